@@ -62,6 +62,24 @@ korva_device_lister_default_init (KorvaDeviceListerInterface *g_iface)
                   G_TYPE_NONE,
                   1,
                   G_TYPE_STRING);
+
+    /**
+     * KorvaDeviceLister::device-changed
+     * @device: The device that changed
+     *
+     * ::device-changed is emitted when the information about an available
+     * device changed
+     */
+    g_signal_new ("device-changed",
+                  G_TYPE_FROM_INTERFACE (g_iface),
+                  G_SIGNAL_RUN_LAST,
+                  G_STRUCT_OFFSET (KorvaDeviceListerInterface, device_changed),
+                  NULL,
+                  NULL,
+                  g_cclosure_marshal_VOID__OBJECT,
+                  G_TYPE_NONE,
+                  1,
+                  KORVA_TYPE_DEVICE);
 }
 
 /**
@@ -122,3 +140,27 @@ korva_device_lister_idle (KorvaDeviceLister *self)
 {
     return KORVA_DEVICE_LISTER_GET_IFACE (self)->idle (self);
 }
+
+/**
+ * korva_device_lister_prioritize:
+ *
+ * Tell the device lister that a client is waiting for the device with @uid,
+ * so it should finish setting it up before other devices.
+ * @self: a #KorvaDeviceLister
+ * @uid: Identifier of the device
+ *
+ * Returns: %TRUE if the device was found and is about to become available,
+ * %FALSE otherwise.
+ */
+gboolean
+korva_device_lister_prioritize (KorvaDeviceLister *self,
+                                const char        *uid)
+{
+    KorvaDeviceListerInterface *iface = KORVA_DEVICE_LISTER_GET_IFACE (self);
+
+    if (iface->prioritize == NULL) {
+        return FALSE;
+    }
+
+    return iface->prioritize (self, uid);
+}
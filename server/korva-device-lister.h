@@ -43,10 +43,12 @@ struct _KorvaDeviceListerInterface {
     KorvaDevice  * (*get_device_info)(KorvaDeviceLister * self, const char *uid);
     gint           (*get_device_count)(KorvaDeviceLister *self);
     gboolean       (*idle)(KorvaDeviceLister *self);
+    gboolean       (*prioritize)(KorvaDeviceLister *self, const char *uid);
 
     /* signals */
     void           (*device_available)(KorvaDevice *device);
     void           (*device_unavailable)(const char *uid);
+    void           (*device_changed)(KorvaDevice *device);
 };
 
 
@@ -62,4 +64,8 @@ korva_device_lister_get_device_count (KorvaDeviceLister *self);
 gboolean
 korva_device_lister_idle (KorvaDeviceLister *self);
 
+gboolean
+korva_device_lister_prioritize (KorvaDeviceLister *self,
+                                const char        *uid);
+
 G_END_DECLS
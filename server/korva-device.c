@@ -27,7 +27,24 @@ G_DEFINE_INTERFACE (KorvaDevice, korva_device, G_TYPE_OBJECT)
 static void
 korva_device_default_init (KorvaDeviceInterface *g_iface)
 {
+    /**
+     * KorvaDevice::changed
+     *
+     * ::changed is emitted when information that is part of the device's
+     * serialization changed after the device became available, e.g. when its
+     * icon was downloaded.
+     */
+    g_signal_new ("changed",
+                  G_TYPE_FROM_INTERFACE (g_iface),
+                  G_SIGNAL_RUN_LAST,
+                  G_STRUCT_OFFSET (KorvaDeviceInterface, changed),
+                  NULL,
+                  NULL,
+                  g_cclosure_marshal_VOID__VOID,
+                  G_TYPE_NONE,
+                  0);
 }
+
 const char *
 korva_device_get_uid (KorvaDevice *self)
 {
@@ -62,9 +79,11 @@ korva_device_get_device_type (KorvaDevice *self)
  * korva_device_serialize:
  *
  * Serialize a device into a #G_VARIANT_TYPE_VARDICT #GVariant for D-Bus use.
+ * Implementations keep the serialized form until the device's data changes
+ * and emit #KorvaDevice::changed then, so repeated calls are cheap.
  * @self: device to serialize
- * Returns: a newly allocated #GVariant containing the meta-data for this
- * device
+ * Returns: (transfer full): a reference to an immutable #GVariant containing
+ * the meta-data for this device
  */
 GVariant *
 korva_device_serialize (KorvaDevice *self)
@@ -72,12 +91,90 @@ korva_device_serialize (KorvaDevice *self)
     return KORVA_DEVICE_GET_IFACE (self)->serialize (self);
 }
 
+/**
+ * korva_device_get_position:
+ *
+ * Get the playback position of the media pushed to the device. Devices keep
+ * track of the position themselves, so calling this is cheap.
+ * @self: device to query
+ * Returns: (transfer full) (allow-none): a #G_VARIANT_TYPE_VARDICT #GVariant
+ * with the position or %NULL if nothing is playing or the device does not
+ * know about positions.
+ */
+GVariant *
+korva_device_get_position (KorvaDevice *self)
+{
+    KorvaDeviceInterface *iface = KORVA_DEVICE_GET_IFACE (self);
+
+    if (iface->get_position == NULL) {
+        return NULL;
+    }
+
+    return iface->get_position (self);
+}
+
+/**
+ * korva_device_get_statistics:
+ *
+ * Get the data about the device that changes with nearly every call to it,
+ * like round-trip times. It is not part of korva_device_serialize(), so it
+ * does not invalidate the serialized form, and is computed on each call.
+ * @self: device to query
+ * Returns: (transfer full) (allow-none): a #G_VARIANT_TYPE_VARDICT #GVariant
+ * with the statistics or %NULL if the device does not keep any.
+ */
+GVariant *
+korva_device_get_statistics (KorvaDevice *self)
+{
+    KorvaDeviceInterface *iface = KORVA_DEVICE_GET_IFACE (self);
+
+    if (iface->get_statistics == NULL) {
+        return NULL;
+    }
+
+    return iface->get_statistics (self);
+}
+
+/**
+ * korva_device_watch:
+ *
+ * Tell the device that a client wants to see its state changes as they
+ * happen. Devices may stop tracking their state while nobody is watching
+ * and nothing is pushed to them.
+ * @self: device to watch
+ */
+void
+korva_device_watch (KorvaDevice *self)
+{
+    KorvaDeviceInterface *iface = KORVA_DEVICE_GET_IFACE (self);
+
+    if (iface->watch != NULL) {
+        iface->watch (self);
+    }
+}
+
+/**
+ * korva_device_unwatch:
+ *
+ * Drop a watch added with korva_device_watch().
+ * @self: device to stop watching
+ */
+void
+korva_device_unwatch (KorvaDevice *self)
+{
+    KorvaDeviceInterface *iface = KORVA_DEVICE_GET_IFACE (self);
+
+    if (iface->unwatch != NULL) {
+        iface->unwatch (self);
+    }
+}
+
 /**
  * korva_device_push_async:
  *
  * Initiate media push to the device.
  * @self: device to push to
- * @source: an "a{sv}" variant, containing at least the mandatory key "URI"
+ * @source: an "a{sv}" variant, containing the mandatory key "URI" or "URIs"
  * @callback: #GAsyncReady call-back to call after the push operation succeeds
  * @user_data: user data
  */
@@ -49,6 +49,10 @@ struct _KorvaDeviceInterface {
     KorvaDeviceType (*get_device_type) (KorvaDevice *self);
 
     GVariant *(*serialize) (KorvaDevice *self);
+    GVariant *(*get_position) (KorvaDevice *self);
+    GVariant *(*get_statistics) (KorvaDevice *self);
+    void (*watch) (KorvaDevice *self);
+    void (*unwatch) (KorvaDevice *self);
     void (*push_async) (KorvaDevice *self,
                         GVariant *source,
                         GCancellable *cancellable,
@@ -61,6 +65,9 @@ struct _KorvaDeviceInterface {
                            GAsyncReadyCallback callback,
                            gpointer user_data);
     gboolean (*unshare_finish) (KorvaDevice *self, GAsyncResult *result, GError **error);
+
+    /* signals */
+    void (*changed) (KorvaDevice *self);
 };
 
 const char *
@@ -81,6 +88,18 @@ korva_device_get_device_type (KorvaDevice *self);
 GVariant *
 korva_device_serialize (KorvaDevice *self);
 
+GVariant *
+korva_device_get_position (KorvaDevice *self);
+
+GVariant *
+korva_device_get_statistics (KorvaDevice *self);
+
+void
+korva_device_watch (KorvaDevice *self);
+
+void
+korva_device_unwatch (KorvaDevice *self);
+
 void
 korva_device_push_async (KorvaDevice *self,
                          GVariant *source,
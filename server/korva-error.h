@@ -37,6 +37,7 @@ enum _KorvaController1Error {
     KORVA_CONTROLLER1_ERROR_NO_SUCH_TRANSFER,
     KORVA_CONTROLLER1_ERROR_NOT_ACCESSIBLE,
     KORVA_CONTROLLER1_ERROR_NO_SERVER,
+    KORVA_CONTROLLER1_ERROR_CANCELLED,
 };
 
 G_END_DECLS
@@ -24,39 +24,542 @@
 #include <gio/gio.h>
 
 #include "korva-icon-cache.h"
+#include "korva-priority.h"
+
+/* Size limit of the icon cache directory if none is given; icons are scaled
+ * to 64x64, so this fits a few hundred devices */
+#define KORVA_ICON_CACHE_DEFAULT_MAX_SIZE (4 * 1024 * 1024)
+
+#define KORVA_ICON_CACHE_ATTRIBUTES \
+    G_FILE_ATTRIBUTE_STANDARD_NAME "," \
+    G_FILE_ATTRIBUTE_STANDARD_TYPE "," \
+    G_FILE_ATTRIBUTE_STANDARD_SIZE "," \
+    G_FILE_ATTRIBUTE_STANDARD_SYMLINK_TARGET "," \
+    G_FILE_ATTRIBUTE_TIME_MODIFIED "," \
+    G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC
+
+/*
+ * Icons are stored once per content, named by the SHA-256 of their data. Each
+ * device has a symbolic link named by its UID pointing at its icon, so many
+ * renderers of the same model share a single file.
+ */
+typedef struct {
+    char   *hash;
+    goffset size;
+    guint   users;
+    GList  *link;
+} KorvaIconCacheBlob;
+
+typedef struct {
+    char    *uid;
+    char    *hash;
+    GBytes  *data;
+    GFile   *dir;
+    gboolean write_blob;
+} KorvaIconCacheStoreData;
 
 static char *cache_path;
 static GFile *default_icon_path;
 static GFile *user_icon_cache;
 
+/*
+ * In-memory index of the cache directory. blobs maps content hashes to
+ * KorvaIconCacheBlob, icons maps device UIDs to the blob they use. Blobs are
+ * kept in least recently used order in lru, the head being the next one to
+ * be evicted once the icons take more than max_cache_size bytes.
+ */
+static GHashTable *blobs;
+static GHashTable *icons;
+static GQueue lru = G_QUEUE_INIT;
+static goffset cache_size;
+static goffset max_cache_size;
+
+static void
+korva_icon_cache_blob_free (KorvaIconCacheBlob *blob)
+{
+    g_free (blob->hash);
+    g_list_free_1 (blob->link);
+    g_free (blob);
+}
+
+static void
+korva_icon_cache_store_data_free (KorvaIconCacheStoreData *data)
+{
+    g_free (data->uid);
+    g_free (data->hash);
+    g_bytes_unref (data->data);
+    g_object_unref (data->dir);
+    g_free (data);
+}
+
+static gboolean
+korva_icon_cache_is_hash (const char *name)
+{
+    int i;
+
+    for (i = 0; name[i] != '\0'; i++) {
+        if (!g_ascii_isxdigit (name[i])) {
+            return FALSE;
+        }
+    }
+
+    return i == 64;
+}
+
+static void
+korva_icon_cache_on_deleted (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    g_autoptr (GError) error = NULL;
+
+    if (!g_file_delete_finish (G_FILE (source), res, &error)) {
+        g_debug ("Failed to remove icon cache file: %s", error->message);
+    }
+}
+
+static void
+korva_icon_cache_delete_file (const char *name)
+{
+    g_autoptr (GFile) file = g_file_get_child (user_icon_cache, name);
+
+    g_file_delete_async (file,
+                         korva_priority_get (KORVA_PRIORITY_CLASS_HOUSEKEEPING),
+                         NULL,
+                         korva_icon_cache_on_deleted,
+                         NULL);
+}
+
+static void
+korva_icon_cache_touch (KorvaIconCacheBlob *blob)
+{
+    g_queue_unlink (&lru, blob->link);
+    g_queue_push_tail_link (&lru, blob->link);
+}
+
+static KorvaIconCacheBlob *
+korva_icon_cache_add_blob (const char *hash, goffset size)
+{
+    KorvaIconCacheBlob *blob;
+
+    blob = g_hash_table_lookup (blobs, hash);
+    if (blob != NULL) {
+        korva_icon_cache_touch (blob);
+
+        return blob;
+    }
+
+    blob = g_new0 (KorvaIconCacheBlob, 1);
+    blob->hash = g_strdup (hash);
+    blob->size = size;
+    blob->link = g_list_alloc ();
+    blob->link->data = blob;
+    g_hash_table_insert (blobs, blob->hash, blob);
+
+    cache_size += size;
+    g_queue_push_tail_link (&lru, blob->link);
+
+    return blob;
+}
+
+static gboolean
+korva_icon_cache_drop_link (gpointer key, gpointer value, gpointer user_data)
+{
+    if (value != user_data) {
+        return FALSE;
+    }
+
+    korva_icon_cache_delete_file ((const char *) key);
+
+    return TRUE;
+}
+
+/* Remove a blob and the links of all devices using it */
+static void
+korva_icon_cache_remove_blob (KorvaIconCacheBlob *blob)
+{
+    g_hash_table_foreach_remove (icons, korva_icon_cache_drop_link, blob);
+    korva_icon_cache_delete_file (blob->hash);
+
+    cache_size -= blob->size;
+    g_queue_unlink (&lru, blob->link);
+    g_hash_table_remove (blobs, blob->hash);
+}
+
+static void
+korva_icon_cache_set_icon (const char *uid, KorvaIconCacheBlob *blob)
+{
+    KorvaIconCacheBlob *old;
+
+    old = g_hash_table_lookup (icons, uid);
+    if (old == blob) {
+        return;
+    }
+
+    blob->users++;
+    g_hash_table_replace (icons, g_strdup (uid), blob);
+
+    if (old != NULL) {
+        old->users--;
+        if (old->users == 0) {
+            korva_icon_cache_remove_blob (old);
+        }
+    }
+}
+
+/*
+ * Remove least recently used icons until the cache fits its size limit again.
+ * @keep is never evicted, so an icon that was just stored is available even
+ * if it is larger than the limit on its own.
+ */
+static void
+korva_icon_cache_evict (KorvaIconCacheBlob *keep)
+{
+    while (cache_size > max_cache_size) {
+        KorvaIconCacheBlob *blob = g_queue_peek_head (&lru);
+
+        if (blob == NULL || blob == keep) {
+            break;
+        }
+
+        g_debug ("Evicting icon %s used by %u devices", blob->hash, blob->users);
+        korva_icon_cache_remove_blob (blob);
+    }
+}
+
+static gint
+korva_icon_cache_compare_mtime (gconstpointer a, gconstpointer b)
+{
+    GFileInfo *info_a = G_FILE_INFO ((gpointer) a);
+    GFileInfo *info_b = G_FILE_INFO ((gpointer) b);
+    guint64 time_a, time_b;
+    guint32 usec_a, usec_b;
+
+    time_a = g_file_info_get_attribute_uint64 (info_a, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+    time_b = g_file_info_get_attribute_uint64 (info_b, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+    if (time_a != time_b) {
+        return time_a < time_b ? -1 : 1;
+    }
+
+    usec_a = g_file_info_get_attribute_uint32 (info_a, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC);
+    usec_b = g_file_info_get_attribute_uint32 (info_b, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC);
+
+    return usec_a < usec_b ? -1 : (usec_a > usec_b ? 1 : 0);
+}
+
+/*
+ * Build the index from the cache directory. The usage information is not
+ * persisted, so the modification time of the blobs serves as the initial LRU
+ * order. Dangling links, unused blobs and icons stored by older versions
+ * are removed.
+ */
+static void
+korva_icon_cache_load_index (void)
+{
+    g_autoptr (GFileEnumerator) enumerator = NULL;
+    g_autoptr (GError) error = NULL;
+    GList *files = NULL, *links = NULL, *it;
+    GFileInfo *info;
+    GHashTableIter iter;
+    KorvaIconCacheBlob *blob;
+
+    enumerator = g_file_enumerate_children (user_icon_cache,
+                                            KORVA_ICON_CACHE_ATTRIBUTES,
+                                            G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                            NULL,
+                                            &error);
+    if (enumerator == NULL) {
+        g_debug ("Failed to read icon cache %s: %s", cache_path, error->message);
+
+        return;
+    }
+
+    while ((info = g_file_enumerator_next_file (enumerator, NULL, &error)) != NULL) {
+        const char *name = g_file_info_get_name (info);
+
+        /* Skip left-overs of interrupted writes */
+        if (g_str_has_prefix (name, ".")) {
+            g_object_unref (info);
+        } else if (g_file_info_get_file_type (info) == G_FILE_TYPE_SYMBOLIC_LINK) {
+            links = g_list_prepend (links, info);
+        } else if (g_file_info_get_file_type (info) == G_FILE_TYPE_REGULAR &&
+                   korva_icon_cache_is_hash (name)) {
+            files = g_list_prepend (files, info);
+        } else {
+            if (g_file_info_get_file_type (info) == G_FILE_TYPE_REGULAR) {
+                korva_icon_cache_delete_file (name);
+            }
+            g_object_unref (info);
+        }
+    }
+
+    if (error != NULL) {
+        g_debug ("Failed to read icon cache %s: %s", cache_path, error->message);
+    }
+
+    files = g_list_sort (files, korva_icon_cache_compare_mtime);
+    for (it = files; it != NULL; it = it->next) {
+        info = G_FILE_INFO (it->data);
+        korva_icon_cache_add_blob (g_file_info_get_name (info), g_file_info_get_size (info));
+    }
+
+    for (it = links; it != NULL; it = it->next) {
+        const char *target;
+
+        info = G_FILE_INFO (it->data);
+        target = g_file_info_get_symlink_target (info);
+        blob = target != NULL ? g_hash_table_lookup (blobs, target) : NULL;
+        if (blob == NULL) {
+            korva_icon_cache_delete_file (g_file_info_get_name (info));
+        } else {
+            korva_icon_cache_set_icon (g_file_info_get_name (info), blob);
+        }
+    }
+
+    g_hash_table_iter_init (&iter, blobs);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &blob)) {
+        if (blob->users == 0) {
+            korva_icon_cache_delete_file (blob->hash);
+            cache_size -= blob->size;
+            g_queue_unlink (&lru, blob->link);
+            g_hash_table_iter_remove (&iter);
+        }
+    }
+
+    g_list_free_full (files, g_object_unref);
+    g_list_free_full (links, g_object_unref);
+}
+
+/**
+ * korva_icon_cache_init:
+ *
+ * Enable the icon cache and index the icons already on disk.
+ *
+ * @path: (allow-none): Directory to store the icons in or %NULL to use the
+ *   default location in the user's cache directory.
+ * @max_size: Maximum number of bytes the icons may take or 0 for the default
+ */
 void
-korva_icon_cache_init (void)
+korva_icon_cache_init (const char *path, goffset max_size)
 {
-    const char *cache_dir = g_get_user_cache_dir ();
+    korva_icon_cache_shutdown ();
+
+    if (path == NULL) {
+        cache_path = g_build_filename (g_get_user_cache_dir (), "korva", "icons", NULL);
+    } else {
+        cache_path = g_strdup (path);
+    }
 
-    cache_path = g_build_filename (cache_dir, "korva", "icons", NULL);
     g_mkdir_with_parents (cache_path, 0700);
     user_icon_cache = g_file_new_for_path (cache_path);
     default_icon_path = g_file_new_for_path (ICON_PATH);
+    max_cache_size = max_size > 0 ? max_size : KORVA_ICON_CACHE_DEFAULT_MAX_SIZE;
+
+    blobs = g_hash_table_new_full (g_str_hash,
+                                   g_str_equal,
+                                   NULL,
+                                   (GDestroyNotify) korva_icon_cache_blob_free);
+    icons = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    korva_icon_cache_load_index ();
+    korva_icon_cache_evict (NULL);
+
+    g_debug ("Using %s as icon cache directory, %u icons for %u devices…",
+             cache_path,
+             g_hash_table_size (blobs),
+             g_hash_table_size (icons));
+}
+
+/**
+ * korva_icon_cache_shutdown:
+ *
+ * Disable the icon cache and release its resources. The icons on disk are
+ * kept.
+ */
+void
+korva_icon_cache_shutdown (void)
+{
+    g_clear_pointer (&icons, g_hash_table_destroy);
 
-    g_debug ("Using %s as icon cache directory…", cache_path);
+    /* The blobs own the links of the LRU queue */
+    g_clear_pointer (&blobs, g_hash_table_destroy);
+    g_queue_init (&lru);
+    cache_size = 0;
+
+    g_clear_pointer (&cache_path, g_free);
+    g_clear_object (&user_icon_cache);
+    g_clear_object (&default_icon_path);
 }
 
+/**
+ * korva_icon_cache_lookup:
+ *
+ * Get the cached icon of a device. This does not touch the disk.
+ *
+ * @uid: Unique identifier of the device
+ *
+ * Returns: (transfer full) (allow-none): The URI of the icon or %NULL if the
+ *   device's icon is not in the cache. Devices with identical icons share the
+ *   URI.
+ */
 char *
 korva_icon_cache_lookup (const char *uid)
 {
-    char *file_path = NULL;
-    GFile *file;
+    KorvaIconCacheBlob *blob;
+    g_autoptr (GFile) file = NULL;
 
-    file = g_file_get_child (user_icon_cache, uid);
+    if (icons == NULL) {
+        return NULL;
+    }
 
-    if (g_file_query_exists (file, NULL)) {
-        file_path = g_file_get_uri (file);
+    blob = g_hash_table_lookup (icons, uid);
+    if (blob == NULL) {
+        return NULL;
     }
 
-    g_object_unref (file);
+    /* Mark as most recently used */
+    korva_icon_cache_touch (blob);
 
-    return file_path;
+    file = g_file_get_child (user_icon_cache, blob->hash);
+
+    return g_file_get_uri (file);
+}
+
+static void
+korva_icon_cache_store_thread (GTask        *task,
+                               gpointer      source_object,
+                               gpointer      task_data,
+                               GCancellable *cancellable)
+{
+    KorvaIconCacheStoreData *data = (KorvaIconCacheStoreData *) task_data;
+    g_autoptr (GFile) blob = NULL;
+    g_autoptr (GFile) link = NULL;
+    GError *error = NULL;
+
+    blob = g_file_get_child (data->dir, data->hash);
+    if (data->write_blob) {
+        gsize size = 0;
+        gconstpointer bytes = g_bytes_get_data (data->data, &size);
+
+        if (!g_file_replace_contents (blob, bytes, size, NULL, FALSE, G_FILE_CREATE_NONE, NULL, cancellable, &error)) {
+            g_task_return_error (task, error);
+
+            return;
+        }
+    }
+
+    link = g_file_get_child (data->dir, data->uid);
+    if (!g_file_delete (link, cancellable, &error)) {
+        if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND)) {
+            g_task_return_error (task, error);
+
+            return;
+        }
+        g_clear_error (&error);
+    }
+
+    if (!g_file_make_symbolic_link (link, data->hash, cancellable, &error)) {
+        g_task_return_error (task, error);
+
+        return;
+    }
+
+    g_task_return_boolean (task, TRUE);
+}
+
+static void
+korva_icon_cache_on_stored (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    GTask *task = G_TASK (user_data);
+    KorvaIconCacheStoreData *data = g_task_get_task_data (G_TASK (res));
+    KorvaIconCacheBlob *blob;
+    g_autoptr (GFile) file = NULL;
+    GError *error = NULL;
+
+    if (!g_task_propagate_boolean (G_TASK (res), &error)) {
+        g_task_return_error (task, error);
+
+        goto out;
+    }
+
+    /* The cache could have been re-initialized in the mean-time */
+    if (user_icon_cache != NULL && g_file_equal (data->dir, user_icon_cache)) {
+        blob = korva_icon_cache_add_blob (data->hash, g_bytes_get_size (data->data));
+        korva_icon_cache_set_icon (data->uid, blob);
+        korva_icon_cache_evict (blob);
+    }
+
+    file = g_file_get_child (data->dir, data->hash);
+    g_task_return_pointer (task, g_file_get_uri (file), g_free);
+
+out:
+    g_object_unref (task);
+}
+
+/**
+ * korva_icon_cache_store_async:
+ *
+ * Store the icon of a device in the cache, replacing an older one, and evict
+ * the least recently used icons if the cache grows too large. The data is
+ * only written if no other device uses the same icon yet.
+ *
+ * @uid: Unique identifier of the device
+ * @data: The icon's image data
+ * @cancellable: (allow-none): A #GCancellable
+ * @callback: Called when the icon was written
+ * @user_data: User data for @callback
+ */
+void
+korva_icon_cache_store_async (const char         *uid,
+                              GBytes             *data,
+                              GCancellable       *cancellable,
+                              GAsyncReadyCallback callback,
+                              gpointer            user_data)
+{
+    GTask *task, *write_task;
+    KorvaIconCacheStoreData *store_data;
+
+    task = g_task_new (NULL, cancellable, callback, user_data);
+    g_task_set_source_tag (task, korva_icon_cache_store_async);
+
+    if (user_icon_cache == NULL) {
+        g_task_return_new_error (task,
+                                 G_IO_ERROR,
+                                 G_IO_ERROR_NOT_INITIALIZED,
+                                 "Icon cache is not initialized");
+        g_object_unref (task);
+
+        return;
+    }
+
+    store_data = g_new0 (KorvaIconCacheStoreData, 1);
+    store_data->uid = g_strdup (uid);
+    store_data->hash = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, data);
+    store_data->data = g_bytes_ref (data);
+    store_data->dir = g_object_ref (user_icon_cache);
+    store_data->write_blob = !g_hash_table_contains (blobs, store_data->hash);
+
+    /* The index is only touched from the main thread, the worker just does
+     * the file system operations */
+    write_task = g_task_new (NULL, cancellable, korva_icon_cache_on_stored, task);
+    g_task_set_task_data (write_task, store_data, (GDestroyNotify) korva_icon_cache_store_data_free);
+    g_task_set_priority (write_task, korva_priority_get (KORVA_PRIORITY_CLASS_HOUSEKEEPING));
+    g_task_run_in_thread (write_task, korva_icon_cache_store_thread);
+    g_object_unref (write_task);
+}
+
+/**
+ * korva_icon_cache_store_finish:
+ *
+ * @result: The #GAsyncResult passed to the callback
+ * @error: Return location for a #GError
+ *
+ * Returns: (transfer full) (allow-none): The URI of the stored icon or %NULL
+ *   on error.
+ */
+char *
+korva_icon_cache_store_finish (GAsyncResult *result, GError **error)
+{
+    g_return_val_if_fail (g_task_is_valid (result, NULL), NULL);
+
+    return g_task_propagate_pointer (G_TASK (result), error);
 }
 
 char *
@@ -81,9 +584,3 @@ korva_icon_cache_get_default (KorvaDeviceType type)
 
     return uri;
 }
-
-char *
-korva_icon_cache_create_path (const char *uid)
-{
-    return g_build_filename (cache_path, uid, NULL);
-}
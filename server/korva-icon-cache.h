@@ -22,19 +22,30 @@
 #define __KORVA_ICON_CACHE_H__
 
 #include <glib.h>
+#include <gio/gio.h>
 
 #include "korva-device.h"
 
 G_BEGIN_DECLS
 
 void
-korva_icon_cache_init ();
+korva_icon_cache_init (const char *path, goffset max_size);
+
+void
+korva_icon_cache_shutdown (void);
 
 char *
 korva_icon_cache_lookup (const char *uid);
 
+void
+korva_icon_cache_store_async (const char         *uid,
+                              GBytes             *data,
+                              GCancellable       *cancellable,
+                              GAsyncReadyCallback callback,
+                              gpointer            user_data);
+
 char *
-korva_icon_cache_create_path (const char *uid);
+korva_icon_cache_store_finish (GAsyncResult *result, GError **error);
 
 char *
 korva_icon_cache_get_default (KorvaDeviceType type);
@@ -0,0 +1,119 @@
+/*
+    This file is part of Korva.
+
+    Copyright (C) 2012 Openismus GmbH.
+    Author: Jens Georg <jensg@openismus.com>
+
+    Korva is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Korva is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Korva.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define G_LOG_DOMAIN "Korva-Priority"
+
+#include "korva-priority.h"
+
+static const char *class_names[KORVA_PRIORITY_CLASS_COUNT] = {
+    "streaming",
+    "control",
+    "discovery",
+    "housekeeping"
+};
+
+static const int default_priorities[KORVA_PRIORITY_CLASS_COUNT] = {
+    G_PRIORITY_HIGH,
+    G_PRIORITY_DEFAULT,
+    G_PRIORITY_DEFAULT_IDLE,
+    G_PRIORITY_LOW
+};
+
+static int priorities[KORVA_PRIORITY_CLASS_COUNT];
+static int configured;
+
+/**
+ * korva_priority_get:
+ * @klass: A #KorvaPriorityClass
+ *
+ * Get the main loop priority for sources and asynchronous operations of
+ * @klass. On first use, the priorities are read from the environment
+ * variable KORVA_PRIORITIES, see korva_priority_configure().
+ *
+ * Returns: A priority suitable for g_source_set_priority() or as I/O
+ *   priority.
+ */
+int
+korva_priority_get (KorvaPriorityClass klass)
+{
+    g_return_val_if_fail (klass < KORVA_PRIORITY_CLASS_COUNT, G_PRIORITY_DEFAULT);
+
+    if (!g_atomic_int_get (&configured)) {
+        korva_priority_configure (g_getenv ("KORVA_PRIORITIES"));
+    }
+
+    return priorities[klass];
+}
+
+/**
+ * korva_priority_configure:
+ * @spec: (allow-none): A comma-separated list of class=priority pairs such as
+ *   "streaming=-100,housekeeping=300" or %NULL
+ *
+ * Reset all classes to their default priority and apply the overrides in
+ * @spec. Unknown classes and malformed priorities are ignored with a warning.
+ */
+void
+korva_priority_configure (const char *spec)
+{
+    g_auto (GStrv) entries = NULL;
+    int i, j;
+
+    for (i = 0; i < KORVA_PRIORITY_CLASS_COUNT; i++) {
+        priorities[i] = default_priorities[i];
+    }
+
+    if (spec != NULL) {
+        entries = g_strsplit (spec, ",", -1);
+    }
+
+    for (i = 0; entries != NULL && entries[i] != NULL; i++) {
+        g_auto (GStrv) pair = g_strsplit (g_strstrip (entries[i]), "=", 2);
+        char *end = NULL;
+        gint64 value;
+
+        if (pair[0] == NULL || *pair[0] == '\0') {
+            continue;
+        }
+
+        for (j = 0; j < KORVA_PRIORITY_CLASS_COUNT; j++) {
+            if (g_ascii_strcasecmp (pair[0], class_names[j]) == 0) {
+                break;
+            }
+        }
+
+        if (j == KORVA_PRIORITY_CLASS_COUNT || pair[1] == NULL) {
+            g_warning ("Ignoring invalid priority setting '%s'", entries[i]);
+
+            continue;
+        }
+
+        value = g_ascii_strtoll (pair[1], &end, 10);
+        if (end == pair[1] || *end != '\0' || value < G_MININT || value > G_MAXINT) {
+            g_warning ("Ignoring invalid priority setting '%s'", entries[i]);
+
+            continue;
+        }
+
+        priorities[j] = (int) value;
+    }
+
+    g_atomic_int_set (&configured, TRUE);
+}
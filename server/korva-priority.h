@@ -0,0 +1,53 @@
+/*
+    This file is part of Korva.
+
+    Copyright (C) 2012 Openismus GmbH.
+    Author: Jens Georg <jensg@openismus.com>
+
+    Korva is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Korva is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Korva.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/**
+ * KorvaPriorityClass:
+ * @KORVA_PRIORITY_CLASS_STREAMING: Refilling chunks of files being served
+ * @KORVA_PRIORITY_CLASS_CONTROL: Handling D-Bus calls and SOAP replies
+ * @KORVA_PRIORITY_CLASS_DISCOVERY: Introspecting devices and fetching icons
+ * @KORVA_PRIORITY_CLASS_HOUSEKEEPING: Idle timeouts and cache maintenance
+ *
+ * The kinds of work korva schedules on its main contexts, from the most to
+ * the least urgent.
+ */
+enum _KorvaPriorityClass
+{
+    KORVA_PRIORITY_CLASS_STREAMING,
+    KORVA_PRIORITY_CLASS_CONTROL,
+    KORVA_PRIORITY_CLASS_DISCOVERY,
+    KORVA_PRIORITY_CLASS_HOUSEKEEPING,
+    KORVA_PRIORITY_CLASS_COUNT
+};
+typedef enum _KorvaPriorityClass KorvaPriorityClass;
+
+int
+korva_priority_get (KorvaPriorityClass klass);
+
+void
+korva_priority_configure (const char *spec);
+
+G_END_DECLS
@@ -0,0 +1,321 @@
+/*
+    This file is part of Korva.
+
+    Copyright (C) 2012 Openismus GmbH.
+    Author: Jens Georg <jensg@openismus.com>
+
+    Korva is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Korva is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Korva.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define G_LOG_DOMAIN "Korva-Push-Trace"
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "korva-push-trace.h"
+
+/* Number of finished traces kept around for GetPushTrace */
+#define KORVA_PUSH_TRACE_HISTORY 64
+
+typedef struct {
+    gint64 start;
+    gint64 end;
+} KorvaPushTraceSpan;
+
+struct _KorvaPushTrace {
+    gatomicrefcount    ref_count;
+    guint              serial;
+    char              *id;
+    char              *tag;
+    char              *uid;
+    gint64             start;
+    KorvaPushTraceSpan spans[KORVA_PUSH_TRACE_PHASE_COUNT];
+};
+
+static const char *phase_names[KORVA_PUSH_TRACE_PHASE_COUNT] = {
+    "MetadataQuery",
+    "DIDLLite",
+    "SetAVTransportURI",
+    "Stop",
+    "Play",
+    "FirstByte"
+};
+
+/* Traces are updated from the file server's thread as well */
+static GMutex trace_lock;
+static guint trace_serial;
+static GHashTable *traces;
+static GQueue history = G_QUEUE_INIT;
+static FILE *trace_file;
+
+static void
+korva_push_trace_write_event (KorvaPushTrace *self, KorvaPushTracePhase phase)
+{
+    static gboolean initialized = FALSE;
+    g_autofree char *uid = NULL;
+    const KorvaPushTraceSpan *span = &self->spans[phase];
+
+    if (!initialized) {
+        const char *path;
+
+        initialized = TRUE;
+        path = g_getenv ("KORVA_TRACE_FILE");
+        if (path == NULL || *path == '\0') {
+            return;
+        }
+
+        trace_file = fopen (path, "a");
+        if (trace_file == NULL) {
+            g_warning ("Could not open trace file %s: %s", path, g_strerror (errno));
+
+            return;
+        }
+
+        /* The trace event format tolerates a missing closing bracket, so
+         * appending to an existing file keeps it loadable */
+        if (ftell (trace_file) == 0) {
+            fputs ("[\n", trace_file);
+        }
+    }
+
+    if (trace_file == NULL) {
+        return;
+    }
+
+    uid = g_strescape (self->uid, NULL);
+    fprintf (trace_file,
+             "{\"name\":\"%s\",\"cat\":\"push\",\"ph\":\"X\","
+             "\"ts\":%" G_GINT64_FORMAT ",\"dur\":%" G_GINT64_FORMAT ","
+             "\"pid\":%d,\"tid\":%u,\"args\":{\"trace\":\"%s\",\"uid\":\"%s\"}},\n",
+             phase_names[phase],
+             span->start,
+             span->end - span->start,
+             (int) getpid (),
+             self->serial,
+             self->id,
+             uid);
+    fflush (trace_file);
+}
+
+static void
+korva_push_trace_free (KorvaPushTrace *self)
+{
+    g_free (self->id);
+    g_free (self->tag);
+    g_free (self->uid);
+    g_free (self);
+}
+
+/**
+ * korva_push_trace_new:
+ * @tag: The tag the push will be known by
+ * @uid: UID of the device the push is targeting
+ *
+ * Create a new trace for a push operation and register it under @tag,
+ * replacing any older trace for the same tag. The most recent traces are
+ * kept after the push is done so they can be queried with
+ * korva_push_trace_lookup().
+ *
+ * Returns: (transfer full): A new #KorvaPushTrace.
+ */
+KorvaPushTrace *
+korva_push_trace_new (const char *tag, const char *uid)
+{
+    KorvaPushTrace *self;
+
+    g_mutex_lock (&trace_lock);
+    if (traces == NULL) {
+        traces = g_hash_table_new_full (g_str_hash,
+                                        g_str_equal,
+                                        NULL,
+                                        (GDestroyNotify) korva_push_trace_unref);
+    }
+
+    self = g_new0 (KorvaPushTrace, 1);
+    g_atomic_ref_count_init (&self->ref_count);
+    self->serial = ++trace_serial;
+    self->id = g_strdup_printf ("%u", self->serial);
+    self->tag = g_strdup (tag);
+    self->uid = g_strdup (uid);
+    self->start = g_get_monotonic_time ();
+
+    if (g_hash_table_contains (traces, tag)) {
+        GList *it = g_queue_find_custom (&history, tag, (GCompareFunc) g_strcmp0);
+
+        g_queue_delete_link (&history, it);
+    } else if (g_queue_get_length (&history) >= KORVA_PUSH_TRACE_HISTORY) {
+        char *oldest = g_queue_pop_head (&history);
+
+        g_hash_table_remove (traces, oldest);
+    }
+
+    /* The key is owned by the trace stored as the value */
+    g_hash_table_replace (traces, self->tag, korva_push_trace_ref (self));
+    g_queue_push_tail (&history, self->tag);
+    g_mutex_unlock (&trace_lock);
+
+    return self;
+}
+
+KorvaPushTrace *
+korva_push_trace_ref (KorvaPushTrace *self)
+{
+    g_return_val_if_fail (self != NULL, NULL);
+
+    g_atomic_ref_count_inc (&self->ref_count);
+
+    return self;
+}
+
+void
+korva_push_trace_unref (KorvaPushTrace *self)
+{
+    g_return_if_fail (self != NULL);
+
+    if (g_atomic_ref_count_dec (&self->ref_count)) {
+        korva_push_trace_free (self);
+    }
+}
+
+const char *
+korva_push_trace_get_id (KorvaPushTrace *self)
+{
+    g_return_val_if_fail (self != NULL, NULL);
+
+    return self->id;
+}
+
+/**
+ * korva_push_trace_begin:
+ * @self: (allow-none): A #KorvaPushTrace
+ * @phase: The phase that is starting
+ *
+ * Mark the start of @phase. Entering a phase that has already ended, e.g.
+ * when SetAVTransportURI is retried after stopping a locked transport, starts
+ * a new span for it.
+ */
+void
+korva_push_trace_begin (KorvaPushTrace *self, KorvaPushTracePhase phase)
+{
+    if (self == NULL) {
+        return;
+    }
+
+    g_return_if_fail (phase < KORVA_PUSH_TRACE_PHASE_COUNT);
+
+    g_mutex_lock (&trace_lock);
+    if (self->spans[phase].start == 0 || self->spans[phase].end != 0) {
+        self->spans[phase].start = g_get_monotonic_time ();
+        self->spans[phase].end = 0;
+    }
+    g_mutex_unlock (&trace_lock);
+}
+
+/**
+ * korva_push_trace_end:
+ * @self: (allow-none): A #KorvaPushTrace
+ * @phase: The phase that is done
+ *
+ * Mark the end of @phase. Ending a phase that is not running is ignored. If
+ * the environment variable KORVA_TRACE_FILE is set, the span is appended to
+ * that file in the Chrome trace event format.
+ */
+void
+korva_push_trace_end (KorvaPushTrace *self, KorvaPushTracePhase phase)
+{
+    if (self == NULL) {
+        return;
+    }
+
+    g_return_if_fail (phase < KORVA_PUSH_TRACE_PHASE_COUNT);
+
+    g_mutex_lock (&trace_lock);
+    if (self->spans[phase].start == 0 || self->spans[phase].end != 0) {
+        g_mutex_unlock (&trace_lock);
+
+        return;
+    }
+
+    self->spans[phase].end = g_get_monotonic_time ();
+    korva_push_trace_write_event (self, phase);
+    g_mutex_unlock (&trace_lock);
+}
+
+/**
+ * korva_push_trace_serialize:
+ * @self: A #KorvaPushTrace
+ *
+ * Serialize the trace for the D-Bus interface. Offsets and durations are in
+ * microseconds relative to the start of the push; phases that are still
+ * running have a duration of -1.
+ *
+ * Returns: (transfer floating): A #GVariant of type a{sv}.
+ */
+GVariant *
+korva_push_trace_serialize (KorvaPushTrace *self)
+{
+    GVariantBuilder builder, phases;
+    gint64 last = self->start;
+    int i;
+
+    g_variant_builder_init (&phases, G_VARIANT_TYPE ("a(sxx)"));
+    g_mutex_lock (&trace_lock);
+    for (i = 0; i < KORVA_PUSH_TRACE_PHASE_COUNT; i++) {
+        const KorvaPushTraceSpan *span = &self->spans[i];
+
+        if (span->start == 0) {
+            continue;
+        }
+
+        g_variant_builder_add (&phases,
+                               "(sxx)",
+                               phase_names[i],
+                               span->start - self->start,
+                               span->end != 0 ? span->end - span->start : -1);
+        last = MAX (last, span->end);
+    }
+    g_mutex_unlock (&trace_lock);
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+    g_variant_builder_add (&builder, "{sv}", "TraceID", g_variant_new_string (self->id));
+    g_variant_builder_add (&builder, "{sv}", "UID", g_variant_new_string (self->uid));
+    g_variant_builder_add (&builder, "{sv}", "Total", g_variant_new_int64 (last - self->start));
+    g_variant_builder_add (&builder, "{sv}", "Phases", g_variant_builder_end (&phases));
+
+    return g_variant_builder_end (&builder);
+}
+
+/**
+ * korva_push_trace_lookup:
+ * @tag: Tag of a push operation
+ *
+ * Returns: (transfer none) (allow-none): The most recent trace for @tag or
+ * %NULL if there is none.
+ */
+KorvaPushTrace *
+korva_push_trace_lookup (const char *tag)
+{
+    KorvaPushTrace *trace = NULL;
+
+    g_mutex_lock (&trace_lock);
+    if (traces != NULL) {
+        trace = g_hash_table_lookup (traces, tag);
+    }
+    g_mutex_unlock (&trace_lock);
+
+    return trace;
+}
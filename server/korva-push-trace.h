@@ -0,0 +1,67 @@
+/*
+    This file is part of Korva.
+
+    Copyright (C) 2012 Openismus GmbH.
+    Author: Jens Georg <jensg@openismus.com>
+
+    Korva is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Korva is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Korva.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+enum _KorvaPushTracePhase
+{
+    KORVA_PUSH_TRACE_PHASE_METADATA_QUERY,
+    KORVA_PUSH_TRACE_PHASE_DIDL_LITE,
+    KORVA_PUSH_TRACE_PHASE_SET_AV_TRANSPORT_URI,
+    KORVA_PUSH_TRACE_PHASE_STOP,
+    KORVA_PUSH_TRACE_PHASE_PLAY,
+    KORVA_PUSH_TRACE_PHASE_FIRST_BYTE,
+    KORVA_PUSH_TRACE_PHASE_COUNT
+};
+typedef enum _KorvaPushTracePhase KorvaPushTracePhase;
+
+typedef struct _KorvaPushTrace KorvaPushTrace;
+
+KorvaPushTrace *
+korva_push_trace_new (const char *tag, const char *uid);
+
+KorvaPushTrace *
+korva_push_trace_ref (KorvaPushTrace *self);
+
+void
+korva_push_trace_unref (KorvaPushTrace *self);
+
+const char *
+korva_push_trace_get_id (KorvaPushTrace *self);
+
+void
+korva_push_trace_begin (KorvaPushTrace *self, KorvaPushTracePhase phase);
+
+void
+korva_push_trace_end (KorvaPushTrace *self, KorvaPushTracePhase phase);
+
+GVariant *
+korva_push_trace_serialize (KorvaPushTrace *self);
+
+KorvaPushTrace *
+korva_push_trace_lookup (const char *tag);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (KorvaPushTrace, korva_push_trace_unref)
+
+G_END_DECLS
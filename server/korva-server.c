@@ -29,12 +29,20 @@
 #include "korva-error.h"
 #include "korva-server.h"
 #include "korva-device-lister.h"
+#include "korva-priority.h"
+#include "korva-push-trace.h"
 #include "korva-dbus-interface.h"
 
 #include "upnp/korva-upnp-device-lister.h"
 
 #define DEFAULT_TIMEOUT 600
 
+/* Number of removed devices remembered for GetDevicesSince */
+#define MAX_REMOVED_DEVICES 128
+
+/* Seconds a push waits for a device that is still being set up */
+#define PUSH_WAIT_TIMEOUT 10
+
 struct _KorvaBackend {
     KorvaDeviceLister *lister;
 };
@@ -47,13 +55,94 @@ korva_backend_free (KorvaBackend *backend)
     g_free (backend);
 }
 
+/*
+ * Entry of the device registry. Removed devices are kept with device set to
+ * %NULL so GetDevicesSince can report them.
+ */
+struct _KorvaRegistryEntry {
+    char        *uid;
+    KorvaDevice *device;
+    guint64      generation;
+};
+typedef struct _KorvaRegistryEntry KorvaRegistryEntry;
+
+static void
+korva_registry_entry_free (KorvaRegistryEntry *entry)
+{
+    g_free (entry->uid);
+    g_clear_object (&entry->device);
+    g_free (entry);
+}
+
+/*
+ * Devices a D-Bus client watches. The watches are dropped when the client
+ * leaves the bus.
+ */
+struct _KorvaWatcher {
+    char       *name;
+    guint       name_watch_id;
+    GHashTable *uids;
+};
+typedef struct _KorvaWatcher KorvaWatcher;
+
+static void
+korva_watcher_free (KorvaWatcher *watcher)
+{
+    if (watcher->name_watch_id != 0) {
+        g_bus_unwatch_name (watcher->name_watch_id);
+    }
+    g_hash_table_destroy (watcher->uids);
+    g_free (watcher->name);
+    g_free (watcher);
+}
+
+/*
+ * A push to a device that was discovered but is not available yet.
+ */
+typedef struct {
+    KorvaServer           *self;
+    GDBusMethodInvocation *invocation;
+    GVariant              *source;
+    char                  *uid;
+    guint                  timeout_id;
+} WaitingPush;
+
+static void
+waiting_push_free (WaitingPush *push)
+{
+    if (push->timeout_id != 0) {
+        g_source_remove (push->timeout_id);
+    }
+    g_variant_unref (push->source);
+    g_free (push->uid);
+    g_free (push);
+}
+
 struct _KorvaServerPrivate {
     GMainLoop        *loop;
     KorvaController1 *dbus_controller;
     GList            *backends;
     guint             bus_id;
+    guint             signal_id;
     GHashTable       *tags;
     guint             timeout_id;
+    GVariant         *devices;
+
+    /* Used instead of the UPnP device lister if set */
+    KorvaDeviceLister *lister;
+
+    /* Devices of all backends by UID */
+    GHashTable       *registry;
+    guint             removed_devices;
+    guint64           generation;
+    /* Oldest generation GetDevicesSince can compute a delta for */
+    guint64           horizon;
+
+    /* Pushes to devices that were found but are not available yet */
+    GList            *waiting_pushes;
+
+    /* KorvaWatcher by unique bus name of the client */
+    GHashTable       *watchers;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE (KorvaServer, korva_server, G_TYPE_OBJECT);
@@ -87,12 +176,24 @@ korva_server_on_handle_get_devices (KorvaController1      *iface,
                                     GDBusMethodInvocation *invocation,
                                     gpointer               user_data);
 
+static gboolean
+korva_server_on_handle_get_devices_since (KorvaController1      *iface,
+                                          GDBusMethodInvocation *invocation,
+                                          guint64                since,
+                                          gpointer               user_data);
+
 static gboolean
 korva_server_on_handle_get_device_info (KorvaController1      *iface,
                                         GDBusMethodInvocation *invocation,
                                         const gchar           *uid,
                                         gpointer               user_data);
 
+static gboolean
+korva_server_on_handle_get_position (KorvaController1      *iface,
+                                     GDBusMethodInvocation *invocation,
+                                     const char            *uid,
+                                     gpointer               user_data);
+
 static gboolean
 korva_server_on_handle_push (KorvaController1      *iface,
                              GDBusMethodInvocation *invocation,
@@ -100,11 +201,35 @@ korva_server_on_handle_push (KorvaController1      *iface,
                              const char            *uid,
                              gpointer               user_data);
 
+static gboolean
+korva_server_on_handle_push_many (KorvaController1      *iface,
+                                  GDBusMethodInvocation *invocation,
+                                  GVariant              *targets,
+                                  gpointer               user_data);
+
 static gboolean
 korva_server_on_handle_unshare (KorvaController1      *iface,
                                 GDBusMethodInvocation *invocation,
                                 const char            *tag,
                                 gpointer               user_data);
+
+static gboolean
+korva_server_on_handle_get_push_trace (KorvaController1      *iface,
+                                       GDBusMethodInvocation *invocation,
+                                       const char            *tag,
+                                       gpointer               user_data);
+
+static gboolean
+korva_server_on_handle_watch_device (KorvaController1      *iface,
+                                     GDBusMethodInvocation *invocation,
+                                     const char            *uid,
+                                     gpointer               user_data);
+
+static gboolean
+korva_server_on_handle_unwatch_device (KorvaController1      *iface,
+                                       GDBusMethodInvocation *invocation,
+                                       const char            *uid,
+                                       gpointer               user_data);
 /* Backend signal handlers */
 static void
 korva_server_on_device_available (KorvaDeviceLister *source,
@@ -116,6 +241,11 @@ korva_server_on_device_unavailable (KorvaDeviceLister *source,
                                     const char        *uid,
                                     gpointer           user_data);
 
+static void
+korva_server_on_device_changed (KorvaDeviceLister *source,
+                                KorvaDevice       *device,
+                                gpointer           user_data);
+
 static gboolean
 korva_server_signal_handler (gpointer user_data)
 {
@@ -138,16 +268,31 @@ korva_server_init (KorvaServer *self)
                                          korva_server_on_bus_aquired,
                                          korva_server_on_name_aquired,
                                          korva_server_on_name_lost,
-                                         g_object_ref (self),
-                                         g_object_unref);
+                                         self,
+                                         NULL);
 
     self->priv->tags = g_hash_table_new_full (g_str_hash,
                                               (GEqualFunc) g_str_equal,
                                               g_free,
                                               g_free);
 
+    self->priv->registry = g_hash_table_new_full (g_str_hash,
+                                                  g_str_equal,
+                                                  NULL,
+                                                  (GDestroyNotify) korva_registry_entry_free);
+
+    self->priv->watchers = g_hash_table_new_full (g_str_hash,
+                                                  g_str_equal,
+                                                  NULL,
+                                                  (GDestroyNotify) korva_watcher_free);
+
+    /* Start from the wall clock so generations handed out by a previous
+     * instance are older than anything we hand out */
+    self->priv->generation = (guint64) g_get_real_time ();
+    self->priv->horizon = self->priv->generation;
+
 #ifdef G_OS_UNIX
-    g_unix_signal_add (SIGINT, korva_server_signal_handler, self);
+    self->priv->signal_id = g_unix_signal_add (SIGINT, korva_server_signal_handler, self);
 #endif
 
     korva_server_reset_timeout (self);
@@ -163,9 +308,46 @@ static void
 korva_server_dispose (GObject *object)
 {
     KorvaServer *self = KORVA_SERVER (object);
+    GList *l;
 
+    if (self->priv->bus_id != 0) {
+        g_bus_unown_name (self->priv->bus_id);
+        self->priv->bus_id = 0;
+    }
+
+    if (self->priv->timeout_id != 0) {
+        g_source_remove (self->priv->timeout_id);
+        self->priv->timeout_id = 0;
+    }
+
+    if (self->priv->signal_id != 0) {
+        g_source_remove (self->priv->signal_id);
+        self->priv->signal_id = 0;
+    }
+
+    while (self->priv->waiting_pushes != NULL) {
+        WaitingPush *push = (WaitingPush *) self->priv->waiting_pushes->data;
+
+        self->priv->waiting_pushes = g_list_delete_link (self->priv->waiting_pushes,
+                                                         self->priv->waiting_pushes);
+        g_dbus_method_invocation_return_error (push->invocation,
+                                               G_IO_ERROR,
+                                               G_IO_ERROR_CANCELLED,
+                                               "Server is shutting down");
+        waiting_push_free (push);
+    }
+    g_clear_pointer (&self->priv->watchers, g_hash_table_destroy);
+
+    /* A lister passed to korva_server_new_for_lister() may outlive us */
+    for (l = self->priv->backends; l != NULL; l = l->next) {
+        g_signal_handlers_disconnect_by_data (((KorvaBackend *) l->data)->lister, self);
+    }
     g_clear_pointer (&self->priv->backends, backend_list_free);
-    g_clear_object (&self->priv->dbus_controller);
+    g_clear_object (&self->priv->lister);
+    if (self->priv->dbus_controller != NULL) {
+        g_dbus_interface_skeleton_unexport (G_DBUS_INTERFACE_SKELETON (self->priv->dbus_controller));
+        g_clear_object (&self->priv->dbus_controller);
+    }
 
     G_OBJECT_CLASS (korva_server_parent_class)->dispose (object);
 }
@@ -176,6 +358,8 @@ korva_server_finalize (GObject *object)
     KorvaServer *self = KORVA_SERVER (object);
 
     g_clear_pointer (&self->priv->tags, g_hash_table_destroy);
+    g_clear_pointer (&self->priv->devices, g_variant_unref);
+    g_clear_pointer (&self->priv->registry, g_hash_table_destroy);
 
     G_OBJECT_CLASS (korva_server_parent_class)->finalize (object);
 }
@@ -201,6 +385,26 @@ korva_server_new (void)
     return self;
 }
 
+/**
+ * korva_server_new_for_lister:
+ * @lister: The #KorvaDeviceLister to get the devices from
+ *
+ * Create a server that offers the devices of @lister instead of looking for
+ * UPnP devices on the network. Mainly useful for tests.
+ *
+ * Returns: (transfer full): A new #KorvaServer.
+ */
+KorvaServer *
+korva_server_new_for_lister (KorvaDeviceLister *lister)
+{
+    KorvaServer *self;
+
+    self = g_object_new (KORVA_TYPE_SERVER, NULL);
+    self->priv->lister = g_object_ref (lister);
+
+    return self;
+}
+
 void
 korva_server_run (KorvaServer *self)
 {
@@ -209,6 +413,7 @@ korva_server_run (KorvaServer *self)
 
     g_main_loop_run (self->priv->loop);
     g_bus_unown_name (self->priv->bus_id);
+    self->priv->bus_id = 0;
 }
 
 
@@ -231,20 +436,47 @@ korva_server_on_bus_aquired  (GDBusConnection *connection,
                       "handle-get-devices",
                       G_CALLBACK (korva_server_on_handle_get_devices),
                       user_data);
+    g_signal_connect (G_OBJECT (controller),
+                      "handle-get-devices-since",
+                      G_CALLBACK (korva_server_on_handle_get_devices_since),
+                      user_data);
     g_signal_connect (G_OBJECT (controller),
                       "handle-get-device-info",
                       G_CALLBACK (korva_server_on_handle_get_device_info),
                       user_data);
+    g_signal_connect (G_OBJECT (controller),
+                      "handle-get-position",
+                      G_CALLBACK (korva_server_on_handle_get_position),
+                      user_data);
     g_signal_connect (G_OBJECT (controller),
                       "handle-push",
                       G_CALLBACK (korva_server_on_handle_push),
                       user_data);
+    g_signal_connect (G_OBJECT (controller),
+                      "handle-push-many",
+                      G_CALLBACK (korva_server_on_handle_push_many),
+                      user_data);
 
     g_signal_connect (G_OBJECT (controller),
                       "handle-unshare",
                       G_CALLBACK (korva_server_on_handle_unshare),
                       user_data);
 
+    g_signal_connect (G_OBJECT (controller),
+                      "handle-get-push-trace",
+                      G_CALLBACK (korva_server_on_handle_get_push_trace),
+                      user_data);
+
+    g_signal_connect (G_OBJECT (controller),
+                      "handle-watch-device",
+                      G_CALLBACK (korva_server_on_handle_watch_device),
+                      user_data);
+
+    g_signal_connect (G_OBJECT (controller),
+                      "handle-unwatch-device",
+                      G_CALLBACK (korva_server_on_handle_unwatch_device),
+                      user_data);
+
     g_dbus_interface_skeleton_export (G_DBUS_INTERFACE_SKELETON (controller),
                                       connection,
                                       "/org/jensge/Korva",
@@ -262,7 +494,11 @@ korva_server_on_bus_aquired  (GDBusConnection *connection,
     }
 
     backend = g_new0 (KorvaBackend, 1);
-    backend->lister = korva_upnp_device_lister_new ();
+    if (self->priv->lister != NULL) {
+        backend->lister = g_object_ref (self->priv->lister);
+    } else {
+        backend->lister = korva_upnp_device_lister_new ();
+    }
     self->priv->backends = g_list_append (self->priv->backends, backend);
     g_signal_connect (backend->lister,
                       "device-available",
@@ -273,6 +509,11 @@ korva_server_on_bus_aquired  (GDBusConnection *connection,
                       "device-unavailable",
                       G_CALLBACK (korva_server_on_device_unavailable),
                       self);
+
+    g_signal_connect (backend->lister,
+                      "device-changed",
+                      G_CALLBACK (korva_server_on_device_changed),
+                      self);
 }
 
 static void
@@ -290,51 +531,99 @@ korva_server_on_name_lost    (GDBusConnection *connection,
 }
 
 
+/* Device registry */
 static void
-serialize_device_list (gpointer data, gpointer user_data)
+korva_server_registry_update (KorvaServer *self, const char *uid, KorvaDevice *device)
+{
+    KorvaRegistryEntry *entry;
+
+    entry = g_hash_table_lookup (self->priv->registry, uid);
+
+    /* Clients never saw this device, or were told it is gone already */
+    if (device == NULL && (entry == NULL || entry->device == NULL)) {
+        return;
+    }
+
+    if (entry == NULL) {
+        entry = g_new0 (KorvaRegistryEntry, 1);
+        entry->uid = g_strdup (uid);
+        g_hash_table_insert (self->priv->registry, entry->uid, entry);
+    } else if (entry->device == NULL) {
+        self->priv->removed_devices--;
+    } else if (device == NULL) {
+        self->priv->removed_devices++;
+    }
+
+    g_clear_object (&entry->device);
+    if (device != NULL) {
+        entry->device = g_object_ref (device);
+    }
+    entry->generation = ++self->priv->generation;
+
+    /* Forget the oldest removal; clients that have not seen it get the full
+     * list on their next query */
+    if (self->priv->removed_devices > MAX_REMOVED_DEVICES) {
+        KorvaRegistryEntry *oldest = NULL, *it;
+        GHashTableIter iter;
+
+        g_hash_table_iter_init (&iter, self->priv->registry);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &it)) {
+            if (it->device == NULL && (oldest == NULL || it->generation < oldest->generation)) {
+                oldest = it;
+            }
+        }
+
+        self->priv->horizon = oldest->generation;
+        self->priv->removed_devices--;
+        g_hash_table_remove (self->priv->registry, oldest->uid);
+    }
+
+    g_clear_pointer (&self->priv->devices, g_variant_unref);
+}
+
+static KorvaDevice *
+korva_server_get_device (KorvaServer *self, const char *uid)
 {
-    GVariantBuilder *builder = (GVariantBuilder *) user_data;
-    KorvaDevice *device = (KorvaDevice *) data;
+    KorvaRegistryEntry *entry;
+
+    entry = g_hash_table_lookup (self->priv->registry, uid);
 
-    g_variant_builder_add_value (builder,
-                                 korva_device_serialize (device));
+    return entry != NULL ? entry->device : NULL;
 }
 
 static void
-serialize_device_list_backend (KorvaBackend    *backend,
-                               GVariantBuilder *builder)
+serialize_registry_entry (GVariantBuilder *builder, KorvaRegistryEntry *entry)
 {
-    GList *devices;
+    GVariant *info;
 
-    devices = korva_device_lister_get_devices (backend->lister);
-    if (devices != NULL) {
-        g_list_foreach (devices, serialize_device_list, builder);
-    }
+    info = korva_device_serialize (entry->device);
+    g_variant_builder_add_value (builder, info);
+    g_variant_unref (info);
 }
 
-/* Controller1 interface callbacks */
-static gboolean
-korva_server_on_handle_get_devices (KorvaController1      *iface,
-                                    GDBusMethodInvocation *invocation,
-                                    gpointer               user_data)
+/*
+ * The device list is kept until a device appears, disappears or changes, so
+ * clients polling GetDevices only cost a reference.
+ */
+static GVariant *
+korva_server_get_device_list (KorvaServer *self)
 {
-    KorvaServer *self = KORVA_SERVER (user_data);
     GVariantBuilder *builder;
-    GVariant *result;
-    GList *it;
+    GHashTableIter iter;
+    KorvaRegistryEntry *entry;
     gboolean devices = FALSE;
 
-    korva_server_reset_timeout (self);
+    if (self->priv->devices != NULL) {
+        return self->priv->devices;
+    }
 
     builder = g_variant_builder_new (G_VARIANT_TYPE_ARRAY);
-    it = self->priv->backends;
-    while (it) {
-        KorvaBackend *backend = (KorvaBackend *) it->data;
-        if (korva_device_lister_get_device_count (backend->lister) > 0) {
+    g_hash_table_iter_init (&iter, self->priv->registry);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &entry)) {
+        if (entry->device != NULL) {
             devices = TRUE;
-            serialize_device_list_backend (backend, builder);
+            serialize_registry_entry (builder, entry);
         }
-        it = it->next;
     }
 
     /* Add empty hash if no devices found */
@@ -342,43 +631,73 @@ korva_server_on_handle_get_devices (KorvaController1      *iface,
         g_variant_builder_add_value (builder, g_variant_new ("a{sv}", NULL));
     }
 
-    result = g_variant_builder_end (builder);
+    self->priv->devices = g_variant_ref_sink (g_variant_builder_end (builder));
+    g_variant_builder_unref (builder);
 
-    korva_controller1_complete_get_devices (iface, invocation, result);
-
-    return TRUE;
+    return self->priv->devices;
 }
 
-typedef struct {
-    const char  *uid;
-    KorvaDevice *device;
-} FindDeviceData;
-
-static void
-find_device_func (gpointer data, gpointer user_data)
+/* Controller1 interface callbacks */
+static gboolean
+korva_server_on_handle_get_devices (KorvaController1      *iface,
+                                    GDBusMethodInvocation *invocation,
+                                    gpointer               user_data)
 {
-    FindDeviceData *device_data = (FindDeviceData *) user_data;
-    KorvaBackend *backend = (KorvaBackend *) data;
+    KorvaServer *self = KORVA_SERVER (user_data);
 
-    if (device_data->device != NULL) {
-        return;
-    }
+    korva_server_reset_timeout (self);
+
+    korva_controller1_complete_get_devices (iface,
+                                            invocation,
+                                            korva_server_get_device_list (self));
 
-    device_data->device = korva_device_lister_get_device_info (backend->lister,
-                                                               device_data->uid);
+    return TRUE;
 }
 
-static KorvaDevice *
-korva_server_get_device (KorvaServer *self, const char *uid)
+static gboolean
+korva_server_on_handle_get_devices_since (KorvaController1      *iface,
+                                          GDBusMethodInvocation *invocation,
+                                          guint64                since,
+                                          gpointer               user_data)
 {
-    FindDeviceData data;
+    KorvaServer *self = KORVA_SERVER (user_data);
+    GVariantBuilder devices;
+    GPtrArray *removed;
+    GHashTableIter iter;
+    KorvaRegistryEntry *entry;
+    gboolean reset;
+
+    korva_server_reset_timeout (self);
 
-    data.uid = uid;
-    data.device = NULL;
+    /* Generations we did not hand out or whose removals were forgotten */
+    reset = since < self->priv->horizon || since > self->priv->generation;
 
-    g_list_foreach (self->priv->backends, find_device_func, &data);
+    g_variant_builder_init (&devices, G_VARIANT_TYPE ("aa{sv}"));
+    removed = g_ptr_array_new ();
 
-    return data.device;
+    g_hash_table_iter_init (&iter, self->priv->registry);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &entry)) {
+        if (!reset && entry->generation <= since) {
+            continue;
+        }
+
+        if (entry->device != NULL) {
+            serialize_registry_entry (&devices, entry);
+        } else if (!reset) {
+            g_ptr_array_add (removed, entry->uid);
+        }
+    }
+    g_ptr_array_add (removed, NULL);
+
+    korva_controller1_complete_get_devices_since (iface,
+                                                  invocation,
+                                                  self->priv->generation,
+                                                  g_variant_builder_end (&devices),
+                                                  (const char *const *) removed->pdata,
+                                                  reset);
+    g_ptr_array_unref (removed);
+
+    return TRUE;
 }
 
 static gboolean
@@ -396,9 +715,36 @@ korva_server_on_handle_get_device_info (KorvaController1      *iface,
 
     if (device != NULL) {
         GVariant *result;
+        GVariant *statistics;
 
         result = korva_device_serialize (device);
+        statistics = korva_device_get_statistics (device);
+        if (statistics != NULL) {
+            GVariantBuilder builder;
+            GVariantIter iter;
+            GVariant *entry;
+
+            /* The statistics are only reported here, see korva_device_get_statistics() */
+            g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+            g_variant_iter_init (&iter, result);
+            while ((entry = g_variant_iter_next_value (&iter)) != NULL) {
+                g_variant_builder_add_value (&builder, entry);
+                g_variant_unref (entry);
+            }
+
+            g_variant_iter_init (&iter, statistics);
+            while ((entry = g_variant_iter_next_value (&iter)) != NULL) {
+                g_variant_builder_add_value (&builder, entry);
+                g_variant_unref (entry);
+            }
+
+            g_variant_unref (result);
+            g_variant_unref (statistics);
+            result = g_variant_ref_sink (g_variant_builder_end (&builder));
+        }
+
         korva_controller1_complete_get_device_info (iface, invocation, result);
+        g_variant_unref (result);
     } else {
         g_dbus_method_invocation_return_error (invocation,
                                                KORVA_CONTROLLER1_ERROR,
@@ -410,6 +756,46 @@ korva_server_on_handle_get_device_info (KorvaController1      *iface,
     return TRUE;
 }
 
+static gboolean
+korva_server_on_handle_get_position (KorvaController1      *iface,
+                                     GDBusMethodInvocation *invocation,
+                                     const char            *uid,
+                                     gpointer               user_data)
+{
+    KorvaServer *self = KORVA_SERVER (user_data);
+    KorvaDevice *device;
+    GVariant *position;
+
+    korva_server_reset_timeout (self);
+
+    device = korva_server_get_device (self, uid);
+    if (device == NULL) {
+        g_dbus_method_invocation_return_error (invocation,
+                                               KORVA_CONTROLLER1_ERROR,
+                                               KORVA_CONTROLLER1_ERROR_NO_SUCH_DEVICE,
+                                               "Device '%s' does not exist",
+                                               uid);
+
+        return TRUE;
+    }
+
+    position = korva_device_get_position (device);
+    if (position == NULL) {
+        g_dbus_method_invocation_return_error (invocation,
+                                               KORVA_CONTROLLER1_ERROR,
+                                               KORVA_CONTROLLER1_ERROR_NO_SUCH_TRANSFER,
+                                               "Nothing is playing on device '%s'",
+                                               uid);
+
+        return TRUE;
+    }
+
+    korva_controller1_complete_get_position (iface, invocation, position);
+    g_variant_unref (position);
+
+    return TRUE;
+}
+
 typedef struct {
     KorvaServer           *self;
     GDBusMethodInvocation *invocation;
@@ -444,6 +830,69 @@ out:
     g_free (data);
 }
 
+/*
+ * Ask the backends to set up the device with @uid first. Returns %TRUE if one
+ * of them is about to make it available.
+ */
+static gboolean
+korva_server_prioritize_device (KorvaServer *self, const char *uid)
+{
+    GList *it;
+
+    for (it = self->priv->backends; it != NULL; it = it->next) {
+        KorvaBackend *backend = (KorvaBackend *) it->data;
+
+        if (korva_device_lister_prioritize (backend->lister, uid)) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static gboolean
+korva_server_on_push_wait_timeout (gpointer user_data)
+{
+    WaitingPush *push = (WaitingPush *) user_data;
+    KorvaServer *self = push->self;
+
+    push->timeout_id = 0;
+    self->priv->waiting_pushes = g_list_remove (self->priv->waiting_pushes, push);
+    g_dbus_method_invocation_return_error (push->invocation,
+                                           KORVA_CONTROLLER1_ERROR,
+                                           KORVA_CONTROLLER1_ERROR_NO_SUCH_DEVICE,
+                                           "Device '%s' did not become available",
+                                           push->uid);
+    waiting_push_free (push);
+
+    return FALSE;
+}
+
+/* Start the pushes that were waiting for @device to become available */
+static void
+korva_server_run_waiting_pushes (KorvaServer *self, KorvaDevice *device)
+{
+    GList *it, *next;
+
+    for (it = self->priv->waiting_pushes; it != NULL; it = next) {
+        WaitingPush *push = (WaitingPush *) it->data;
+        PushAsyncData *data;
+
+        next = it->next;
+        if (g_strcmp0 (push->uid, korva_device_get_uid (device)) != 0) {
+            continue;
+        }
+
+        self->priv->waiting_pushes = g_list_delete_link (self->priv->waiting_pushes, it);
+
+        data = g_new0 (PushAsyncData, 1);
+        data->self = self;
+        data->invocation = push->invocation;
+        korva_device_push_async (device, push->source, NULL, korva_server_on_push_async_ready, data);
+        waiting_push_free (push);
+    }
+}
+
 static gboolean
 korva_server_on_handle_push (KorvaController1      *iface,
                              GDBusMethodInvocation *invocation,
@@ -468,6 +917,27 @@ korva_server_on_handle_push (KorvaController1      *iface,
         return TRUE;
     }
 
+    if (device == NULL && korva_server_prioritize_device (self, uid)) {
+        WaitingPush *push;
+
+        g_debug ("Device %s is still being set up, waiting for it", uid);
+
+        push = g_new0 (WaitingPush, 1);
+        push->self = self;
+        push->invocation = invocation;
+        push->source = g_variant_ref (source);
+        push->uid = g_strdup (uid);
+        push->timeout_id = g_timeout_add_seconds_full (korva_priority_get (KORVA_PRIORITY_CLASS_CONTROL),
+                                                       PUSH_WAIT_TIMEOUT,
+                                                       korva_server_on_push_wait_timeout,
+                                                       push,
+                                                       NULL);
+        /* Pushes start in the order they came in so the latest one wins */
+        self->priv->waiting_pushes = g_list_append (self->priv->waiting_pushes, push);
+
+        return TRUE;
+    }
+
     if (device == NULL) {
         g_dbus_method_invocation_return_error (invocation,
                                                KORVA_CONTROLLER1_ERROR,
@@ -487,6 +957,170 @@ korva_server_on_handle_push (KorvaController1      *iface,
     return TRUE;
 }
 
+typedef struct _PushManyData PushManyData;
+
+typedef struct {
+    PushManyData *batch;
+    guint         index;
+} PushManyTarget;
+
+struct _PushManyData {
+    KorvaServer           *self;
+    GDBusMethodInvocation *invocation;
+    GVariant             **results;
+    PushManyTarget        *targets;
+    guint                  n_targets;
+    guint                  pending;
+};
+
+static GVariant *
+korva_server_push_many_result (const char *uid, const char *tag, const GError *error)
+{
+    GVariantBuilder builder;
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add (&builder, "{sv}", "UID", g_variant_new_string (uid));
+    if (tag != NULL) {
+        g_variant_builder_add (&builder, "{sv}", "Tag", g_variant_new_string (tag));
+    } else {
+        char *name;
+
+        name = g_dbus_error_encode_gerror (error);
+        g_variant_builder_add (&builder, "{sv}", "Error", g_variant_new_string (name));
+        g_variant_builder_add (&builder, "{sv}", "ErrorMessage", g_variant_new_string (error->message));
+        g_free (name);
+    }
+
+    return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+static void
+korva_server_push_many_target_done (PushManyData *data)
+{
+    GVariantBuilder builder;
+    guint i;
+
+    if (--data->pending > 0) {
+        return;
+    }
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE ("aa{sv}"));
+    for (i = 0; i < data->n_targets; i++) {
+        g_variant_builder_add_value (&builder, data->results[i]);
+        g_variant_unref (data->results[i]);
+    }
+
+    korva_controller1_complete_push_many (data->self->priv->dbus_controller,
+                                          data->invocation,
+                                          g_variant_builder_end (&builder));
+
+    g_free (data->results);
+    g_free (data->targets);
+    g_free (data);
+}
+
+static void
+korva_server_on_push_many_async_ready (GObject      *obj,
+                                       GAsyncResult *res,
+                                       gpointer      user_data)
+{
+    KorvaDevice *device = KORVA_DEVICE (obj);
+    PushManyTarget *target = (PushManyTarget *) user_data;
+    PushManyData *data = target->batch;
+    GError *error = NULL;
+    char *tag;
+
+    tag = korva_device_push_finish (device, res, &error);
+    if (tag != NULL) {
+        g_hash_table_insert (data->self->priv->tags,
+                             g_strdup (tag),
+                             g_strdup (korva_device_get_uid (device)));
+    }
+
+    data->results[target->index] = korva_server_push_many_result (korva_device_get_uid (device),
+                                                                  tag,
+                                                                  error);
+    g_clear_error (&error);
+    g_free (tag);
+
+    korva_server_push_many_target_done (data);
+}
+
+/*
+ * Push to several devices at once. All pushes are started before the first
+ * one finishes, so pushes of the same file share its meta-data query and
+ * hosting in the file server, and the requests to the devices run
+ * concurrently. Failures are reported per target instead of failing the
+ * whole call.
+ */
+static gboolean
+korva_server_on_handle_push_many (KorvaController1      *iface,
+                                  GDBusMethodInvocation *invocation,
+                                  GVariant              *targets,
+                                  gpointer               user_data)
+{
+    KorvaServer *self = KORVA_SERVER (user_data);
+    PushManyData *data;
+    GVariantIter iter;
+    GVariant *source;
+    const char *uid;
+    guint i = 0;
+
+    korva_server_reset_timeout (self);
+
+    if (!g_variant_is_of_type (targets, G_VARIANT_TYPE ("a(a{sv}s)"))) {
+        g_dbus_method_invocation_return_error (invocation,
+                                               KORVA_CONTROLLER1_ERROR,
+                                               KORVA_CONTROLLER1_ERROR_INVALID_ARGS,
+                                               "'targets' parameter needs to be 'a(a{sv}s)'");
+
+        return TRUE;
+    }
+
+    data = g_new0 (PushManyData, 1);
+    data->self = self;
+    data->invocation = invocation;
+    data->n_targets = g_variant_n_children (targets);
+    data->results = g_new0 (GVariant *, data->n_targets);
+    data->targets = g_new0 (PushManyTarget, data->n_targets);
+
+    /* Keep the reply from being sent before every push has been started */
+    data->pending = data->n_targets + 1;
+
+    g_variant_iter_init (&iter, targets);
+    while (g_variant_iter_next (&iter, "(@a{sv}&s)", &source, &uid)) {
+        KorvaDevice *device;
+
+        device = korva_server_get_device (self, uid);
+        if (device == NULL) {
+            GError *error;
+
+            error = g_error_new (KORVA_CONTROLLER1_ERROR,
+                                 KORVA_CONTROLLER1_ERROR_NO_SUCH_DEVICE,
+                                 "Device '%s' does not exist",
+                                 uid);
+            data->results[i] = korva_server_push_many_result (uid, NULL, error);
+            g_error_free (error);
+            data->pending--;
+        } else {
+            data->targets[i].batch = data;
+            data->targets[i].index = i;
+            korva_device_push_async (device,
+                                     source,
+                                     NULL,
+                                     korva_server_on_push_many_async_ready,
+                                     &data->targets[i]);
+        }
+
+        g_variant_unref (source);
+        i++;
+    }
+
+    korva_server_push_many_target_done (data);
+
+    return TRUE;
+}
+
 static void
 korva_server_on_unshare_async_ready (GObject      *obj,
                                      GAsyncResult *res,
@@ -555,6 +1189,161 @@ korva_server_on_handle_unshare (KorvaController1      *iface,
     return TRUE;
 }
 
+static gboolean
+korva_server_on_handle_get_push_trace (KorvaController1      *iface,
+                                       GDBusMethodInvocation *invocation,
+                                       const char            *tag,
+                                       gpointer               user_data)
+{
+    KorvaServer *self = KORVA_SERVER (user_data);
+    KorvaPushTrace *trace;
+
+    korva_server_reset_timeout (self);
+
+    trace = korva_push_trace_lookup (tag);
+    if (trace == NULL) {
+        g_dbus_method_invocation_return_error (invocation,
+                                               KORVA_CONTROLLER1_ERROR,
+                                               KORVA_CONTROLLER1_ERROR_NO_SUCH_TRANSFER,
+                                               "No trace for push operation '%s'",
+                                               tag);
+
+        return TRUE;
+    }
+
+    korva_controller1_complete_get_push_trace (iface, invocation, korva_push_trace_serialize (trace));
+
+    return TRUE;
+}
+
+static void
+korva_server_on_watcher_vanished (GDBusConnection *connection,
+                                  const char      *name,
+                                  gpointer         user_data)
+{
+    KorvaServer *self = KORVA_SERVER (user_data);
+    KorvaWatcher *watcher;
+    GHashTableIter iter;
+    const char *uid;
+
+    watcher = g_hash_table_lookup (self->priv->watchers, name);
+    if (watcher == NULL) {
+        return;
+    }
+
+    g_debug ("Client %s left, dropping its watches", name);
+
+    g_hash_table_iter_init (&iter, watcher->uids);
+    while (g_hash_table_iter_next (&iter, (gpointer *) &uid, NULL)) {
+        KorvaDevice *device = korva_server_get_device (self, uid);
+
+        if (device != NULL) {
+            korva_device_unwatch (device);
+        }
+    }
+
+    g_hash_table_remove (self->priv->watchers, name);
+}
+
+static gboolean
+korva_server_on_handle_watch_device (KorvaController1      *iface,
+                                     GDBusMethodInvocation *invocation,
+                                     const char            *uid,
+                                     gpointer               user_data)
+{
+    KorvaServer *self = KORVA_SERVER (user_data);
+    KorvaDevice *device;
+    KorvaWatcher *watcher;
+    const char *sender;
+
+    korva_server_reset_timeout (self);
+
+    device = korva_server_get_device (self, uid);
+    if (device == NULL) {
+        g_dbus_method_invocation_return_error (invocation,
+                                               KORVA_CONTROLLER1_ERROR,
+                                               KORVA_CONTROLLER1_ERROR_NO_SUCH_DEVICE,
+                                               "Device '%s' does not exist",
+                                               uid);
+
+        return TRUE;
+    }
+
+    sender = g_dbus_method_invocation_get_sender (invocation);
+    if (sender == NULL) {
+        sender = "";
+    }
+
+    watcher = g_hash_table_lookup (self->priv->watchers, sender);
+    if (watcher == NULL) {
+        watcher = g_new0 (KorvaWatcher, 1);
+        watcher->name = g_strdup (sender);
+        watcher->uids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+        if (*sender != '\0') {
+            watcher->name_watch_id =
+                g_bus_watch_name_on_connection (g_dbus_method_invocation_get_connection (invocation),
+                                                sender,
+                                                G_BUS_NAME_WATCHER_FLAGS_NONE,
+                                                NULL,
+                                                korva_server_on_watcher_vanished,
+                                                self,
+                                                NULL);
+        }
+        g_hash_table_insert (self->priv->watchers, watcher->name, watcher);
+    }
+
+    /* Watching a device twice is the same as watching it once */
+    if (g_hash_table_add (watcher->uids, g_strdup (uid))) {
+        korva_device_watch (device);
+    }
+
+    korva_controller1_complete_watch_device (iface, invocation);
+
+    return TRUE;
+}
+
+static gboolean
+korva_server_on_handle_unwatch_device (KorvaController1      *iface,
+                                       GDBusMethodInvocation *invocation,
+                                       const char            *uid,
+                                       gpointer               user_data)
+{
+    KorvaServer *self = KORVA_SERVER (user_data);
+    KorvaDevice *device;
+    KorvaWatcher *watcher;
+    const char *sender;
+
+    korva_server_reset_timeout (self);
+
+    sender = g_dbus_method_invocation_get_sender (invocation);
+    if (sender == NULL) {
+        sender = "";
+    }
+
+    watcher = g_hash_table_lookup (self->priv->watchers, sender);
+    if (watcher == NULL || !g_hash_table_remove (watcher->uids, uid)) {
+        g_dbus_method_invocation_return_error (invocation,
+                                               KORVA_CONTROLLER1_ERROR,
+                                               KORVA_CONTROLLER1_ERROR_NO_SUCH_DEVICE,
+                                               "Device '%s' is not watched",
+                                               uid);
+
+        return TRUE;
+    }
+
+    device = korva_server_get_device (self, uid);
+    if (device != NULL) {
+        korva_device_unwatch (device);
+    }
+
+    if (g_hash_table_size (watcher->uids) == 0) {
+        g_hash_table_remove (self->priv->watchers, sender);
+    }
+
+    korva_controller1_complete_unwatch_device (iface, invocation);
+
+    return TRUE;
+}
 
 static void
 korva_server_on_device_available (KorvaDeviceLister *source,
@@ -562,10 +1351,27 @@ korva_server_on_device_available (KorvaDeviceLister *source,
                                   gpointer           user_data)
 {
     KorvaServer *self = KORVA_SERVER (user_data);
+    GVariant *info;
+    GHashTableIter iter;
+    KorvaWatcher *watcher;
+
+    korva_server_registry_update (self, korva_device_get_uid (device), device);
+
+    /* Watches outlive the device going away and coming back */
+    g_hash_table_iter_init (&iter, self->priv->watchers);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &watcher)) {
+        if (g_hash_table_contains (watcher->uids, korva_device_get_uid (device))) {
+            korva_device_watch (device);
+        }
+    }
 
+    info = korva_device_serialize (device);
     g_signal_emit_by_name (self->priv->dbus_controller,
                            "device-available",
-                           korva_device_serialize (device));
+                           info);
+    g_variant_unref (info);
+
+    korva_server_run_waiting_pushes (self, device);
 }
 
 static void
@@ -575,11 +1381,30 @@ korva_server_on_device_unavailable (KorvaDeviceLister *source,
 {
     KorvaServer *self = KORVA_SERVER (user_data);
 
+    korva_server_registry_update (self, uid, NULL);
+
     g_signal_emit_by_name (self->priv->dbus_controller,
                            "device-unavailable",
                            uid);
 }
 
+static void
+korva_server_on_device_changed (KorvaDeviceLister *source,
+                                KorvaDevice       *device,
+                                gpointer           user_data)
+{
+    KorvaServer *self = KORVA_SERVER (user_data);
+    GVariant *info;
+
+    korva_server_registry_update (self, korva_device_get_uid (device), device);
+
+    info = korva_device_serialize (device);
+    g_signal_emit_by_name (self->priv->dbus_controller,
+                           "device-changed",
+                           info);
+    g_variant_unref (info);
+}
+
 static void
 idle_collector (gpointer data, gpointer user_data)
 {
@@ -605,9 +1430,11 @@ korva_server_reset_timeout (KorvaServer *self)
     }
 
     g_debug ("Setting timeout to %d seconds", DEFAULT_TIMEOUT);
-    self->priv->timeout_id = g_timeout_add_seconds (DEFAULT_TIMEOUT,
-                                                    korva_server_on_timeout,
-                                                    self);
+    self->priv->timeout_id = g_timeout_add_seconds_full (korva_priority_get (KORVA_PRIORITY_CLASS_HOUSEKEEPING),
+                                                         DEFAULT_TIMEOUT,
+                                                         korva_server_on_timeout,
+                                                         self,
+                                                         NULL);
 }
 
 static gboolean
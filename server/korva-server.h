@@ -23,6 +23,8 @@
 
 #include <glib-object.h>
 
+#include "korva-device-lister.h"
+
 G_BEGIN_DECLS
 
 GType korva_server_get_type (void);
@@ -57,6 +59,9 @@ struct _KorvaServerClass {
 KorvaServer *
 korva_server_new (void);
 
+KorvaServer *
+korva_server_new_for_lister (KorvaDeviceLister *lister);
+
 void korva_server_run (KorvaServer *self);
 
 G_END_DECLS
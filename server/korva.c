@@ -23,10 +23,13 @@
 #include "korva-server.h"
 #include "korva-icon-cache.h"
 
+#include "upnp/korva-upnp-device-cache.h"
+
 int main (int argc, char *argv[])
 {
     g_debug ("Starting korva...");
-    korva_icon_cache_init ();
+    korva_icon_cache_init (NULL, 0);
+    korva_upnp_device_cache_init (NULL);
 
     KorvaServer *server = korva_server_new ();
 
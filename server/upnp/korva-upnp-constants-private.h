@@ -22,4 +22,9 @@
 
 #define KORVA_UPNP_FILE_SERVER_DEFAULT_TIMEOUT 30
 
+/* Content types of the playlists served for pushes of a directory or a list
+ * of files */
+#define KORVA_UPNP_PLAYLIST_M3U "audio/x-mpegurl"
+#define KORVA_UPNP_PLAYLIST_DIDL_LITE "text/xml"
+
 #endif /* _KORVA_UPNP_CONSTANTS_PRIVATE_H_ */
@@ -0,0 +1,360 @@
+/*
+    This file is part of Korva.
+
+    Copyright (C) 2012 Openismus GmbH.
+    Author: Jens Georg <jensg@openismus.com>
+
+    Korva is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Korva is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Korva.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define G_LOG_DOMAIN "Korva-UPnP-Device-Cache"
+
+#include <stdlib.h>
+
+#include <gio/gio.h>
+
+#include "korva-upnp-device-cache.h"
+#include "korva-priority.h"
+
+#define KEY_LOCATION "Location"
+#define KEY_CONFIG_ID "ConfigId"
+#define KEY_DEVICE_TYPE "DeviceType"
+#define KEY_FRIENDLY_NAME "FriendlyName"
+#define KEY_PROTOCOL_INFO "ProtocolInfo"
+#define KEY_ICON_URI "IconURI"
+#define KEY_LAST_SEEN "LastSeen"
+
+/* Seconds to collect changes for before the cache is written */
+#define SAVE_DELAY 2
+
+/* Entries of renderers that were not seen for this long are dropped */
+#define MAX_AGE (30 * 24 * 60 * 60)
+
+/* The renderers seen most recently are kept if there are more entries */
+#define MAX_ENTRIES 256
+
+/*
+ * Persistent cache of renderer introspection results, one key file group per
+ * UDN. The cache is disabled until korva_upnp_device_cache_init() is called;
+ * lookups will miss and stores are ignored.
+ *
+ * Changes are written to disk in the background, a few seconds after the
+ * first one, so a burst of discovered renderers causes a single write.
+ */
+static GKeyFile *cache;
+static char *cache_file;
+static guint save_id;
+static gboolean dirty;
+static gboolean writing;
+static GCancellable *save_cancellable;
+
+static void
+korva_upnp_device_cache_schedule_save (void);
+
+static void
+korva_upnp_device_cache_on_saved (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    g_autoptr (GError) error = NULL;
+
+    if (!g_file_replace_contents_finish (G_FILE (source), res, NULL, &error)) {
+        /* The cache was shut down and wrote its state itself */
+        if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            return;
+        }
+
+        g_debug ("Failed to write device cache: %s", error->message);
+    }
+
+    writing = FALSE;
+    if (dirty) {
+        korva_upnp_device_cache_schedule_save ();
+    }
+}
+
+static gboolean
+korva_upnp_device_cache_on_save_timeout (gpointer user_data)
+{
+    g_autoptr (GFile) file = NULL;
+    g_autoptr (GBytes) data = NULL;
+    char *contents;
+    gsize length;
+
+    save_id = 0;
+
+    contents = g_key_file_to_data (cache, &length, NULL);
+    data = g_bytes_new_take (contents, length);
+    file = g_file_new_for_path (cache_file);
+
+    dirty = FALSE;
+    writing = TRUE;
+    g_file_replace_contents_bytes_async (file,
+                                         data,
+                                         NULL,
+                                         FALSE,
+                                         G_FILE_CREATE_NONE,
+                                         save_cancellable,
+                                         korva_upnp_device_cache_on_saved,
+                                         NULL);
+
+    return FALSE;
+}
+
+/* Only one write is in flight, so an older state never replaces a newer one */
+static void
+korva_upnp_device_cache_schedule_save (void)
+{
+    dirty = TRUE;
+    if (save_id != 0 || writing) {
+        return;
+    }
+
+    save_id = g_timeout_add_seconds_full (korva_priority_get (KORVA_PRIORITY_CLASS_HOUSEKEEPING),
+                                          SAVE_DELAY,
+                                          korva_upnp_device_cache_on_save_timeout,
+                                          NULL,
+                                          NULL);
+}
+
+static gint
+korva_upnp_device_cache_compare_last_seen (gconstpointer a, gconstpointer b)
+{
+    gint64 seen_a, seen_b;
+
+    seen_a = g_key_file_get_int64 (cache, *(const char **) a, KEY_LAST_SEEN, NULL);
+    seen_b = g_key_file_get_int64 (cache, *(const char **) b, KEY_LAST_SEEN, NULL);
+
+    return seen_a > seen_b ? -1 : (seen_a < seen_b ? 1 : 0);
+}
+
+/*
+ * Drop the entries of renderers that were not seen for a long time, and the
+ * least recently seen ones beyond the maximum number of entries. Entries
+ * written by older versions have no time stamp and are dropped as well.
+ */
+static void
+korva_upnp_device_cache_prune (void)
+{
+    g_auto (GStrv) udns = NULL;
+    gint64 now;
+    gsize length, i;
+
+    udns = g_key_file_get_groups (cache, &length);
+    qsort (udns, length, sizeof (char *), korva_upnp_device_cache_compare_last_seen);
+
+    now = g_get_real_time () / G_USEC_PER_SEC;
+    for (i = 0; i < length; i++) {
+        gint64 last_seen = g_key_file_get_int64 (cache, udns[i], KEY_LAST_SEEN, NULL);
+
+        if (i >= MAX_ENTRIES || now - last_seen > MAX_AGE) {
+            g_debug ("Dropping cached device %s", udns[i]);
+            g_key_file_remove_group (cache, udns[i], NULL);
+            dirty = TRUE;
+        }
+    }
+}
+
+/**
+ * korva_upnp_device_cache_init:
+ *
+ * Enable the device cache and load its contents.
+ *
+ * @path: (allow-none): File to store the cache in or %NULL to use the
+ *   default location in the user's cache directory.
+ */
+void
+korva_upnp_device_cache_init (const char *path)
+{
+    g_autoptr (GError) error = NULL;
+
+    korva_upnp_device_cache_shutdown ();
+
+    if (path == NULL) {
+        g_autofree char *dir = g_build_filename (g_get_user_cache_dir (), "korva", NULL);
+
+        g_mkdir_with_parents (dir, 0700);
+        cache_file = g_build_filename (dir, "devices.ini", NULL);
+    } else {
+        cache_file = g_strdup (path);
+    }
+
+    cache = g_key_file_new ();
+    if (!g_key_file_load_from_file (cache, cache_file, G_KEY_FILE_NONE, &error)) {
+        if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+            g_debug ("Failed to load device cache %s: %s", cache_file, error->message);
+        }
+    }
+
+    save_cancellable = g_cancellable_new ();
+    korva_upnp_device_cache_prune ();
+    if (dirty) {
+        korva_upnp_device_cache_schedule_save ();
+    }
+
+    g_debug ("Using %s as device cache…", cache_file);
+}
+
+/**
+ * korva_upnp_device_cache_shutdown:
+ *
+ * Disable the device cache and release its resources. Changes that were not
+ * written yet are saved, and the on-disk cache is kept.
+ */
+void
+korva_upnp_device_cache_shutdown (void)
+{
+    g_autoptr (GError) error = NULL;
+
+    if (save_id != 0) {
+        g_source_remove (save_id);
+        save_id = 0;
+    }
+
+    if (save_cancellable != NULL) {
+        g_cancellable_cancel (save_cancellable);
+        g_clear_object (&save_cancellable);
+    }
+
+    if (cache != NULL && (dirty || writing) &&
+        !g_key_file_save_to_file (cache, cache_file, &error)) {
+        g_debug ("Failed to write device cache %s: %s", cache_file, error->message);
+    }
+    dirty = FALSE;
+    writing = FALSE;
+
+    g_clear_pointer (&cache, g_key_file_free);
+    g_clear_pointer (&cache_file, g_free);
+}
+
+/**
+ * korva_upnp_device_cache_lookup:
+ *
+ * Get the cached introspection results of a device. It is up to the caller
+ * to check whether the entry still matches the device's description.
+ *
+ * @udn: The UDN of the device
+ *
+ * Returns: (transfer full) (allow-none): A new #KorvaUPnPDeviceCacheEntry or
+ *   %NULL if the device is not cached.
+ */
+KorvaUPnPDeviceCacheEntry *
+korva_upnp_device_cache_lookup (const char *udn)
+{
+    KorvaUPnPDeviceCacheEntry *entry;
+
+    if (cache == NULL || !g_key_file_has_group (cache, udn)) {
+        return NULL;
+    }
+
+    entry = g_slice_new0 (KorvaUPnPDeviceCacheEntry);
+    entry->location = g_key_file_get_string (cache, udn, KEY_LOCATION, NULL);
+    entry->config_id = g_key_file_get_string (cache, udn, KEY_CONFIG_ID, NULL);
+    entry->device_type = g_key_file_get_string (cache, udn, KEY_DEVICE_TYPE, NULL);
+    entry->friendly_name = g_key_file_get_string (cache, udn, KEY_FRIENDLY_NAME, NULL);
+    entry->protocol_info = g_key_file_get_string (cache, udn, KEY_PROTOCOL_INFO, NULL);
+    entry->icon_uri = g_key_file_get_string (cache, udn, KEY_ICON_URI, NULL);
+
+    if (entry->location == NULL || entry->device_type == NULL || entry->protocol_info == NULL) {
+        korva_upnp_device_cache_entry_free (entry);
+
+        return NULL;
+    }
+
+    return entry;
+}
+
+/**
+ * korva_upnp_device_cache_get_udns:
+ *
+ * Get the UDNs of all cached devices, e.g. to look for them on the network
+ * directly instead of waiting for their announcements.
+ *
+ * Returns: (transfer full): A %NULL-terminated array of UDNs.
+ */
+char **
+korva_upnp_device_cache_get_udns (void)
+{
+    if (cache == NULL) {
+        return g_new0 (char *, 1);
+    }
+
+    return g_key_file_get_groups (cache, NULL);
+}
+
+/**
+ * korva_upnp_device_cache_store:
+ *
+ * Store the introspection results of a device, replacing any previous entry,
+ * and remember when the device was seen.
+ *
+ * @udn: The UDN of the device
+ * @entry: The introspection results
+ */
+void
+korva_upnp_device_cache_store (const char *udn, const KorvaUPnPDeviceCacheEntry *entry)
+{
+    gsize length;
+
+    if (cache == NULL) {
+        return;
+    }
+
+    g_key_file_remove_group (cache, udn, NULL);
+    g_key_file_set_string (cache, udn, KEY_LOCATION, entry->location);
+    g_key_file_set_string (cache, udn, KEY_CONFIG_ID, entry->config_id ? entry->config_id : "");
+    g_key_file_set_string (cache, udn, KEY_DEVICE_TYPE, entry->device_type);
+    g_key_file_set_string (cache, udn, KEY_FRIENDLY_NAME, entry->friendly_name ? entry->friendly_name : "");
+    g_key_file_set_string (cache, udn, KEY_PROTOCOL_INFO, entry->protocol_info);
+    if (entry->icon_uri != NULL) {
+        g_key_file_set_string (cache, udn, KEY_ICON_URI, entry->icon_uri);
+    }
+    g_key_file_set_int64 (cache, udn, KEY_LAST_SEEN, g_get_real_time () / G_USEC_PER_SEC);
+
+    g_strfreev (g_key_file_get_groups (cache, &length));
+    if (length > MAX_ENTRIES) {
+        korva_upnp_device_cache_prune ();
+    }
+
+    korva_upnp_device_cache_schedule_save ();
+}
+
+/**
+ * korva_upnp_device_cache_remove:
+ *
+ * Invalidate the cached introspection results of a device.
+ *
+ * @udn: The UDN of the device
+ */
+void
+korva_upnp_device_cache_remove (const char *udn)
+{
+    if (cache == NULL) {
+        return;
+    }
+
+    if (g_key_file_remove_group (cache, udn, NULL)) {
+        korva_upnp_device_cache_schedule_save ();
+    }
+}
+
+void
+korva_upnp_device_cache_entry_free (KorvaUPnPDeviceCacheEntry *entry)
+{
+    g_free (entry->location);
+    g_free (entry->config_id);
+    g_free (entry->device_type);
+    g_free (entry->friendly_name);
+    g_free (entry->protocol_info);
+    g_free (entry->icon_uri);
+    g_slice_free (KorvaUPnPDeviceCacheEntry, entry);
+}
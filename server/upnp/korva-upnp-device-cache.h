@@ -0,0 +1,61 @@
+/*
+    This file is part of Korva.
+
+    Copyright (C) 2012 Openismus GmbH.
+    Author: Jens Georg <jensg@openismus.com>
+
+    Korva is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Korva is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Korva.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _KorvaUPnPDeviceCacheEntry KorvaUPnPDeviceCacheEntry;
+
+struct _KorvaUPnPDeviceCacheEntry {
+    char *location;
+    char *config_id;
+    char *device_type;
+    char *friendly_name;
+    char *protocol_info;
+    char *icon_uri;
+};
+
+void
+korva_upnp_device_cache_init (const char *path);
+
+void
+korva_upnp_device_cache_shutdown (void);
+
+KorvaUPnPDeviceCacheEntry *
+korva_upnp_device_cache_lookup (const char *udn);
+
+char **
+korva_upnp_device_cache_get_udns (void);
+
+void
+korva_upnp_device_cache_store (const char *udn, const KorvaUPnPDeviceCacheEntry *entry);
+
+void
+korva_upnp_device_cache_remove (const char *udn);
+
+void
+korva_upnp_device_cache_entry_free (KorvaUPnPDeviceCacheEntry *entry);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (KorvaUPnPDeviceCacheEntry, korva_upnp_device_cache_entry_free)
+
+G_END_DECLS
@@ -20,22 +20,72 @@
 
 #define G_LOG_DOMAIN "Korva-UPnP-Device-Lister"
 
+#include <string.h>
+
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+
+#include <libsoup/soup.h>
 #include <libgupnp/gupnp.h>
 
 #include "korva-upnp-device-lister.h"
 #include "korva-upnp-device.h"
+#include "korva-upnp-device-cache.h"
+#include "korva-upnp-failure-cache.h"
 #include "korva-upnp-file-server.h"
+#include "korva-upnp-introspection-queue.h"
 
 #include "korva-device-lister.h"
+#include "korva-priority.h"
 
 #define MEDIA_SERVER "urn:schemas-upnp-org:device:MediaServer:1"
 #define MEDIA_RENDERER "urn:schemas-upnp-org:device:MediaRenderer:1"
 
+/* Seconds an unused control connection to a renderer is kept open */
+#define CONTROL_IDLE_TIMEOUT 300
+
+/* MX of the searches sent right after a network became available and
+ * afterwards. The short one makes renderers answer at once; the default
+ * spreads the answers of a crowded network */
+#define DISCOVERY_MX 1
+#define DEFAULT_MX 3
+
+/* Milliseconds after which the first search is repeated for renderers that
+ * missed it, e.g. because their WiFi was dozing, and the MX is reset */
+#define DISCOVERY_RESCAN_DELAY 1000
+
+/* Number of devices introspected at the same time */
+#define MAX_INTROSPECTIONS 8
+
+/* Milliseconds until a device that failed to introspect is tried again. The
+ * delay doubles with every further failure up to the maximum */
+#define RETRY_BASE_DELAY (30 * 1000)
+#define RETRY_MAX_DELAY (60 * 60 * 1000)
+
+/* Milliseconds, see korva_upnp_device_lister_set_retry_delay() */
+static guint retry_base_delay = RETRY_BASE_DELAY;
+static guint retry_max_delay = RETRY_MAX_DELAY;
+
+/* Milliseconds a renderer found through the device cache is kept without
+ * answering any of our searches */
+#define PROBE_CONFIRM_TIMEOUT (30 * 1000)
+
 struct _KorvaUPnPDeviceListerPrivate {
-    GUPnPContextManager *context_manager;
-    GHashTable          *devices;
-    GHashTable          *pending_devices;
-    KorvaUPnPFileServer *server;
+    GUPnPContextManager         *context_manager;
+    GHashTable                  *devices;
+    GHashTable                  *pending_devices;
+    KorvaUPnPFileServer         *server;
+    KorvaUPnPIntrospectionQueue *introspections;
+    KorvaUPnPFailureCache       *failures;
+
+    /* KorvaUPnPRetry by UDN for renderers whose introspection failed and
+     * that are introspected again once they are done backing off */
+    GHashTable                  *retries;
+
+    /* KorvaUPnPProbedDevice by UDN for renderers that were created from
+     * the device cache and did not answer a search yet */
+    GHashTable                  *probes;
+    GCancellable                *probe_cancellable;
 };
 
 typedef struct _KorvaUPnPDeviceListerPrivate KorvaUPnPDeviceListerPrivate;
@@ -49,6 +99,69 @@ struct _KorvaUPnPDeviceLister {
 static void
 korva_upnp_device_lister_iface_init (gpointer, gpointer);
 
+/*
+ * A renderer from the device cache whose description was fetched directly.
+ * No control point knows its proxy, so it is replaced by the one of the
+ * control point once the renderer answers a search, or dropped if it never
+ * does.
+ */
+typedef struct {
+    KorvaUPnPDeviceLister *self;
+    char                  *udn;
+    GUPnPDeviceProxy      *proxy;
+    guint                  timeout_id;
+} KorvaUPnPProbedDevice;
+
+static void
+korva_upnp_probed_device_free (KorvaUPnPProbedDevice *probed)
+{
+    if (probed->timeout_id != 0) {
+        g_source_remove (probed->timeout_id);
+    }
+    g_object_unref (probed->proxy);
+    g_free (probed->udn);
+    g_free (probed);
+}
+
+/*
+ * A renderer whose introspection failed. The control point announces a
+ * proxy only once, so it is kept to try again later.
+ */
+typedef struct {
+    KorvaUPnPDeviceLister *self;
+    GUPnPDeviceProxy      *proxy;
+    guint                  timeout_id;
+} KorvaUPnPRetry;
+
+static void
+korva_upnp_retry_free (KorvaUPnPRetry *retry)
+{
+    if (retry->timeout_id != 0) {
+        g_source_remove (retry->timeout_id);
+    }
+    g_object_unref (retry->proxy);
+    g_free (retry);
+}
+
+/* A running fetch of the description of a cached renderer */
+typedef struct {
+    KorvaUPnPDeviceLister *self;
+    GUPnPControlPoint     *cp;
+    SoupMessage           *message;
+    char                  *udn;
+    char                  *location;
+} KorvaUPnPProbe;
+
+static void
+korva_upnp_probe_free (KorvaUPnPProbe *probe)
+{
+    g_object_unref (probe->cp);
+    g_object_unref (probe->message);
+    g_free (probe->udn);
+    g_free (probe->location);
+    g_free (probe);
+}
+
 G_DEFINE_TYPE_EXTENDED (KorvaUPnPDeviceLister,
                         korva_upnp_device_lister,
                         G_TYPE_OBJECT,
@@ -72,6 +185,9 @@ korva_upnp_device_lister_get_device_count (KorvaDeviceLister *self);
 static gboolean
 korva_upnp_device_lister_idle (KorvaDeviceLister *lister);
 
+static gboolean
+korva_upnp_device_lister_prioritize (KorvaDeviceLister *lister, const char *uid);
+
 /* ContextManager callbacks */
 static void
 korva_upnp_device_lister_on_context_available (GUPnPContextManager *cm,
@@ -99,6 +215,7 @@ korva_upnp_device_lister_iface_init (gpointer g_iface,
     iface->get_device_info = korva_upnp_device_lister_get_device_info;
     iface->get_device_count = korva_upnp_device_lister_get_device_count;
     iface->idle = korva_upnp_device_lister_idle;
+    iface->prioritize = korva_upnp_device_lister_prioritize;
 }
 
 static void
@@ -117,6 +234,17 @@ korva_upnp_device_lister_init (KorvaUPnPDeviceLister *self)
                                                          g_free,
                                                          g_object_unref);
     self->priv->server = korva_upnp_file_server_get_default ();
+    self->priv->introspections = korva_upnp_introspection_queue_new (MAX_INTROSPECTIONS);
+    self->priv->failures = korva_upnp_failure_cache_new (retry_base_delay, retry_max_delay);
+    self->priv->retries = g_hash_table_new_full (g_str_hash,
+                                                 g_str_equal,
+                                                 g_free,
+                                                 (GDestroyNotify) korva_upnp_retry_free);
+    self->priv->probes = g_hash_table_new_full (g_str_hash,
+                                                g_str_equal,
+                                                NULL,
+                                                (GDestroyNotify) korva_upnp_probed_device_free);
+    self->priv->probe_cancellable = g_cancellable_new ();
 
     cm = gupnp_context_manager_create (0);
     self->priv->context_manager = cm;
@@ -131,8 +259,16 @@ korva_upnp_device_lister_dispose (GObject *object)
 {
     KorvaUPnPDeviceLister *self = KORVA_UPNP_DEVICE_LISTER (object);
 
+    if (self->priv->probe_cancellable != NULL) {
+        g_cancellable_cancel (self->priv->probe_cancellable);
+        g_clear_object (&self->priv->probe_cancellable);
+    }
+    g_clear_pointer (&self->priv->probes, g_hash_table_destroy);
+    g_clear_pointer (&self->priv->retries, g_hash_table_destroy);
     g_clear_object (&self->priv->context_manager);
     g_clear_pointer (&self->priv->devices, g_hash_table_destroy);
+    g_clear_pointer (&self->priv->introspections, korva_upnp_introspection_queue_free);
+    g_clear_pointer (&self->priv->failures, korva_upnp_failure_cache_free);
     g_clear_pointer (&self->priv->pending_devices, g_hash_table_destroy);
     g_clear_object (&self->priv->server);
 
@@ -155,6 +291,23 @@ korva_upnp_device_lister_new (void)
                                               NULL));
 }
 
+/**
+ * korva_upnp_device_lister_set_retry_delay:
+ * @base_delay: Milliseconds until a renderer whose introspection failed is
+ * tried again, 0 for the default
+ * @max_delay: Upper limit for the time between two retries in milliseconds,
+ * 0 for the default
+ *
+ * Override how long listers created afterwards back off from renderers that
+ * fail introspection. Mostly useful for tests.
+ */
+void
+korva_upnp_device_lister_set_retry_delay (guint base_delay, guint max_delay)
+{
+    retry_base_delay = base_delay != 0 ? base_delay : RETRY_BASE_DELAY;
+    retry_max_delay = max_delay != 0 ? max_delay : RETRY_MAX_DELAY;
+}
+
 /* KorvaDeviceLister interface implementation */
 static GList *
 korva_upnp_device_lister_get_devices (KorvaDeviceLister *lister)
@@ -203,16 +356,328 @@ korva_upnp_device_lister_idle (KorvaDeviceLister *lister)
     return result;
 }
 
+static gboolean
+korva_upnp_device_lister_prioritize (KorvaDeviceLister *lister, const char *uid)
+{
+    KorvaUPnPDeviceLister *self;
+
+    g_return_val_if_fail (KORVA_IS_UPNP_DEVICE_LISTER (lister), FALSE);
+    self = KORVA_UPNP_DEVICE_LISTER (lister);
+
+    if (!g_hash_table_contains (self->priv->pending_devices, uid)) {
+        return FALSE;
+    }
+
+    /* Already running if it is not waiting anymore */
+    korva_upnp_introspection_queue_prioritize (self->priv->introspections, uid);
+
+    return TRUE;
+}
+
+static gboolean
+korva_upnp_device_lister_on_rescan (gpointer user_data)
+{
+    GSSDPResourceBrowser *browser = GSSDP_RESOURCE_BROWSER (user_data);
+
+    gssdp_resource_browser_rescan (browser);
+    gssdp_resource_browser_set_mx (browser, DEFAULT_MX);
+
+    return FALSE;
+}
+
+/* The first child element of @node called @name */
+static xmlNode *
+korva_upnp_device_lister_get_element (xmlNode *node, const char *name)
+{
+    xmlNode *it;
+
+    for (it = node->children; it != NULL; it = it->next) {
+        if (it->type == XML_ELEMENT_NODE && xmlStrEqual (it->name, (const xmlChar *) name)) {
+            return it;
+        }
+    }
+
+    return NULL;
+}
+
+/* Find the description of the device @udn in the device tree below @node */
+static xmlNode *
+korva_upnp_device_lister_find_device (xmlNode *node, const char *udn)
+{
+    xmlNode *it, *found;
+    xmlChar *content;
+    gboolean match;
+
+    for (it = node->children; it != NULL; it = it->next) {
+        if (it->type != XML_ELEMENT_NODE) {
+            continue;
+        }
+
+        if (xmlStrEqual (it->name, (const xmlChar *) "UDN")) {
+            content = xmlNodeGetContent (it);
+            match = content != NULL && g_strcmp0 (g_strstrip ((char *) content), udn) == 0;
+            xmlFree (content);
+
+            if (match && xmlStrEqual (node->name, (const xmlChar *) "device")) {
+                return node;
+            }
+        } else if (xmlStrEqual (it->name, (const xmlChar *) "device") ||
+                   xmlStrEqual (it->name, (const xmlChar *) "deviceList")) {
+            found = korva_upnp_device_lister_find_device (it, udn);
+            if (found != NULL) {
+                return found;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static gboolean
+korva_upnp_device_lister_on_probe_timeout (gpointer user_data)
+{
+    KorvaUPnPProbedDevice *probed = (KorvaUPnPProbedDevice *) user_data;
+    KorvaUPnPDeviceLister *self = probed->self;
+    g_autofree char *udn = NULL;
+    KorvaUPnPDevice *device;
+
+    /* The introspection will tell whether the renderer is still there */
+    if (g_hash_table_contains (self->priv->pending_devices, probed->udn)) {
+        return TRUE;
+    }
+
+    probed->timeout_id = 0;
+    udn = g_strdup (probed->udn);
+
+    g_debug ("Cached renderer %s did not answer any search, dropping it", udn);
+
+    device = g_hash_table_lookup (self->priv->devices, udn);
+    if (device != NULL && korva_upnp_device_remove_proxy (device, probed->proxy)) {
+        g_hash_table_remove (self->priv->devices, udn);
+        g_signal_emit_by_name (self, "device-unavailable", udn);
+    }
+    g_hash_table_remove (self->priv->probes, udn);
+
+    return FALSE;
+}
+
+/*
+ * Replace the proxy of a renderer that was created from the device cache
+ * with @proxy, which comes from the control point.
+ */
+static void
+korva_upnp_device_lister_confirm_probe (KorvaUPnPDeviceLister *self,
+                                        KorvaUPnPDevice       *device,
+                                        GUPnPDeviceProxy      *proxy)
+{
+    KorvaUPnPProbedDevice *probed;
+    const char *udn;
+
+    udn = gupnp_device_info_get_udn (GUPNP_DEVICE_INFO (proxy));
+    probed = g_hash_table_lookup (self->priv->probes, udn);
+    if (probed == NULL || probed->proxy == proxy) {
+        return;
+    }
+
+    g_debug ("Cached renderer %s answered a search", udn);
+    korva_upnp_device_remove_proxy (device, probed->proxy);
+    g_hash_table_remove (self->priv->probes, udn);
+}
+
+static void
+korva_upnp_device_lister_on_probed (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    KorvaUPnPProbe *probe = (KorvaUPnPProbe *) user_data;
+    KorvaUPnPDeviceLister *self = probe->self;
+    KorvaUPnPProbedDevice *probed;
+    g_autoptr (GBytes) description = NULL;
+    g_autoptr (GError) error = NULL;
+    g_autoptr (GUPnPXMLDoc) doc = NULL;
+    g_autoptr (GUPnPDeviceProxy) proxy = NULL;
+    g_autoptr (GUri) url_base = NULL;
+    GUPnPContext *context;
+    xmlDoc *xml;
+    xmlNode *element, *base;
+    xmlChar *content;
+    const char *data;
+    gsize size;
+
+    description = soup_session_send_and_read_finish (SOUP_SESSION (source), res, &error);
+    if (description == NULL) {
+        /* The lister is gone if the probe was cancelled */
+        if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            g_debug ("Cached renderer %s is not at %s: %s", probe->udn, probe->location, error->message);
+        }
+
+        goto out;
+    }
+
+    if (!SOUP_STATUS_IS_SUCCESSFUL (soup_message_get_status (probe->message))) {
+        g_debug ("Cached renderer %s is not at %s: %u %s",
+                 probe->udn,
+                 probe->location,
+                 soup_message_get_status (probe->message),
+                 soup_message_get_reason_phrase (probe->message));
+
+        goto out;
+    }
+
+    /* It answered our search while we were waiting */
+    if (g_hash_table_contains (self->priv->devices, probe->udn) ||
+        g_hash_table_contains (self->priv->pending_devices, probe->udn)) {
+        goto out;
+    }
+
+    data = g_bytes_get_data (description, &size);
+    xml = xmlReadMemory (data, size, probe->location, NULL, XML_PARSE_NONET);
+    if (xml == NULL) {
+        g_debug ("Description of cached renderer %s is invalid", probe->udn);
+
+        goto out;
+    }
+    doc = gupnp_xml_doc_new (xml);
+
+    element = korva_upnp_device_lister_find_device (xmlDocGetRootElement (xml), probe->udn);
+    if (element == NULL) {
+        g_debug ("%s does not describe cached renderer %s anymore", probe->location, probe->udn);
+
+        goto out;
+    }
+
+    base = korva_upnp_device_lister_get_element (xmlDocGetRootElement (xml), "URLBase");
+    if (base != NULL) {
+        content = xmlNodeGetContent (base);
+        if (content != NULL) {
+            url_base = g_uri_parse (g_strstrip ((char *) content), G_URI_FLAGS_NONE, NULL);
+        }
+        xmlFree (content);
+    }
+
+    if (url_base == NULL) {
+        url_base = g_uri_parse (probe->location, G_URI_FLAGS_NONE, NULL);
+    }
+
+    g_debug ("Found cached renderer %s at %s", probe->udn, probe->location);
+
+    context = gupnp_control_point_get_context (probe->cp);
+    proxy = gupnp_resource_factory_create_device_proxy (gupnp_control_point_get_resource_factory (probe->cp),
+                                                        context,
+                                                        doc,
+                                                        element,
+                                                        probe->udn,
+                                                        probe->location,
+                                                        url_base);
+
+    /* From here on, it is handled like a renderer that answered a search */
+    korva_upnp_device_lister_on_renderer_available (probe->cp, proxy, self);
+    if (!g_hash_table_contains (self->priv->pending_devices, probe->udn)) {
+        goto out;
+    }
+
+    probed = g_new0 (KorvaUPnPProbedDevice, 1);
+    probed->self = self;
+    probed->udn = g_strdup (probe->udn);
+    probed->proxy = g_object_ref (proxy);
+    probed->timeout_id = g_timeout_add_full (korva_priority_get (KORVA_PRIORITY_CLASS_HOUSEKEEPING),
+                                             PROBE_CONFIRM_TIMEOUT,
+                                             korva_upnp_device_lister_on_probe_timeout,
+                                             probed,
+                                             NULL);
+    g_hash_table_insert (self->priv->probes, probed->udn, probed);
+
+out:
+    korva_upnp_probe_free (probe);
+}
+
+/*
+ * Fetch the descriptions of the renderers in the device cache directly from
+ * their last known location instead of waiting for them to answer a search.
+ * A renderer that is still there shows up after one round-trip and goes
+ * through the same introspection as one that answered a search.
+ */
+static void
+korva_upnp_device_lister_probe_cached (KorvaUPnPDeviceLister *self,
+                                       GUPnPControlPoint     *cp)
+{
+    GUPnPContext *context = gupnp_control_point_get_context (cp);
+    g_auto (GStrv) udns = NULL;
+    char **udn;
+
+    udns = korva_upnp_device_cache_get_udns ();
+    for (udn = udns; *udn != NULL; udn++) {
+        g_autoptr (KorvaUPnPDeviceCacheEntry) entry = NULL;
+        g_autoptr (GUri) location = NULL;
+        g_autoptr (GInetAddress) address = NULL;
+        g_autoptr (GSocketAddress) socket_address = NULL;
+        KorvaUPnPProbe *probe;
+        SoupMessage *message;
+
+        if (g_hash_table_contains (self->priv->devices, *udn) ||
+            g_hash_table_contains (self->priv->pending_devices, *udn)) {
+            continue;
+        }
+
+        entry = korva_upnp_device_cache_lookup (*udn);
+        if (entry == NULL || strstr (entry->device_type, ":MediaRenderer:") == NULL) {
+            continue;
+        }
+
+        /* Only ask on the network the renderer was seen on */
+        location = g_uri_parse (entry->location, G_URI_FLAGS_NONE, NULL);
+        if (location == NULL) {
+            continue;
+        }
+
+        address = g_inet_address_new_from_string (g_uri_get_host (location));
+        if (address == NULL) {
+            continue;
+        }
+
+        socket_address = g_inet_socket_address_new (address, MAX (g_uri_get_port (location), 0));
+        if (!gssdp_client_can_reach (GSSDP_CLIENT (context), G_INET_SOCKET_ADDRESS (socket_address))) {
+            continue;
+        }
+
+        message = soup_message_new_from_uri (SOUP_METHOD_GET, location);
+        if (message == NULL) {
+            continue;
+        }
+
+        g_debug ("Probing cached renderer %s at %s", *udn, entry->location);
+
+        probe = g_new0 (KorvaUPnPProbe, 1);
+        probe->self = self;
+        probe->cp = g_object_ref (cp);
+        probe->message = message;
+        probe->udn = g_strdup (*udn);
+        probe->location = g_strdup (entry->location);
+        soup_session_send_and_read_async (gupnp_context_get_session (context),
+                                          message,
+                                          korva_priority_get (KORVA_PRIORITY_CLASS_DISCOVERY),
+                                          self->priv->probe_cancellable,
+                                          korva_upnp_device_lister_on_probed,
+                                          probe);
+    }
+}
+
 static void
 korva_upnp_device_lister_on_context_available (GUPnPContextManager *cm,
                                                GUPnPContext        *context,
                                                gpointer             user_data)
 {
+    KorvaUPnPDeviceLister *self = KORVA_UPNP_DEVICE_LISTER (user_data);
     GUPnPControlPoint *cp;
 
     g_debug ("New network context available: %s",
              gssdp_client_get_host_ip (GSSDP_CLIENT (context)));
 
+    /* All SOAP calls on this network go through the session of the context,
+     * so it is the connection pool for the control traffic. Keep idle
+     * connections for longer than the libsoup default so pushes to a
+     * renderer find one ready */
+    soup_session_set_idle_timeout (gupnp_context_get_session (context),
+                                   CONTROL_IDLE_TIMEOUT);
+
     cp = gupnp_control_point_new (context, MEDIA_RENDERER);
     gupnp_context_manager_manage_control_point (cm, cp);
     g_signal_connect (cp,
@@ -224,11 +689,86 @@ korva_upnp_device_lister_on_context_available (GUPnPContextManager *cm,
                       "device-proxy-unavailable",
                       G_CALLBACK (korva_upnp_device_lister_on_renderer_unavailable),
                       user_data);
+
+    /* Find renderers quickly after D-Bus activation */
+    gssdp_resource_browser_set_mx (GSSDP_RESOURCE_BROWSER (cp), DISCOVERY_MX);
     gssdp_resource_browser_set_active (GSSDP_RESOURCE_BROWSER (cp),
                                        TRUE);
+    g_timeout_add_full (korva_priority_get (KORVA_PRIORITY_CLASS_DISCOVERY),
+                        DISCOVERY_RESCAN_DELAY,
+                        korva_upnp_device_lister_on_rescan,
+                        g_object_ref (cp),
+                        g_object_unref);
+    korva_upnp_device_lister_probe_cached (self, cp);
     g_object_unref (cp);
 }
 
+static void
+korva_upnp_device_lister_on_device_changed (KorvaDevice *device,
+                                            gpointer     user_data)
+{
+    KorvaUPnPDeviceLister *self = KORVA_UPNP_DEVICE_LISTER (user_data);
+
+    /* Late updates of a device that already went away are not interesting */
+    if (g_hash_table_lookup (self->priv->devices, korva_device_get_uid (device)) != device) {
+        return;
+    }
+
+    g_signal_emit_by_name (self, "device-changed", device);
+}
+
+static gboolean
+korva_upnp_device_lister_on_retry (gpointer user_data)
+{
+    KorvaUPnPRetry *retry = (KorvaUPnPRetry *) user_data;
+    KorvaUPnPDeviceLister *self = retry->self;
+    g_autoptr (GUPnPDeviceProxy) proxy = g_object_ref (retry->proxy);
+
+    retry->timeout_id = 0;
+    g_hash_table_remove (self->priv->retries,
+                         gupnp_device_info_get_udn (GUPNP_DEVICE_INFO (proxy)));
+
+    g_debug ("Retrying device %s", gupnp_device_info_get_udn (GUPNP_DEVICE_INFO (proxy)));
+    korva_upnp_device_lister_on_renderer_available (NULL, proxy, self);
+
+    return FALSE;
+}
+
+/*
+ * Introspect a renderer that failed again once it is done backing off.
+ * Renderers that cannot work with us are not retried, and neither are those
+ * from the device cache that never answered a search.
+ */
+static void
+korva_upnp_device_lister_schedule_retry (KorvaUPnPDeviceLister *self,
+                                         KorvaUPnPDevice       *device)
+{
+    const char *uid = korva_device_get_uid (KORVA_DEVICE (device));
+    KorvaUPnPRetry *retry;
+    gint64 retry_after, delay;
+
+    if (g_hash_table_contains (self->priv->probes, uid)) {
+        return;
+    }
+
+    retry_after = korva_upnp_failure_cache_get_retry_after (self->priv->failures, uid);
+    if (retry_after == 0 || retry_after == G_MAXINT64) {
+        return;
+    }
+
+    delay = MAX (retry_after - g_get_monotonic_time (), 0);
+
+    retry = g_new0 (KorvaUPnPRetry, 1);
+    retry->self = self;
+    retry->proxy = g_object_ref (korva_upnp_device_get_proxy (device));
+    retry->timeout_id = g_timeout_add_full (korva_priority_get (KORVA_PRIORITY_CLASS_DISCOVERY),
+                                            (delay + 999) / 1000,
+                                            korva_upnp_device_lister_on_retry,
+                                            retry,
+                                            NULL);
+    g_hash_table_replace (self->priv->retries, g_strdup (uid), retry);
+}
+
 static void
 korva_upnp_device_lister_on_device_ready (GObject      *source,
                                           GAsyncResult *res,
@@ -238,24 +778,34 @@ korva_upnp_device_lister_on_device_ready (GObject      *source,
     gboolean ok;
     KorvaUPnPDevice *device = KORVA_UPNP_DEVICE (source);
     KorvaUPnPDeviceLister *self = KORVA_UPNP_DEVICE_LISTER (user_data);
+    const char *uid = korva_device_get_uid (KORVA_DEVICE (device));
 
     g_object_ref (source);
-    g_hash_table_remove (self->priv->pending_devices,
-                         korva_device_get_uid (KORVA_DEVICE (device)));
+    g_hash_table_remove (self->priv->pending_devices, uid);
 
     ok = g_async_initable_init_finish (G_ASYNC_INITABLE (source),
                                        res,
                                        &error);
     if (ok) {
-        g_debug ("Device %s ready to use, adding",
-                 korva_device_get_uid (KORVA_DEVICE (device)));
-        g_hash_table_insert (self->priv->devices,
-                             g_strdup (korva_device_get_uid (KORVA_DEVICE (device))),
-                             device);
+        g_debug ("Device %s ready to use, adding", uid);
+        korva_upnp_failure_cache_succeed (self->priv->failures, uid);
+        g_hash_table_insert (self->priv->devices, g_strdup (uid), device);
+        g_signal_connect_object (device,
+                                 "changed",
+                                 G_CALLBACK (korva_upnp_device_lister_on_device_changed),
+                                 self,
+                                 0);
         g_signal_emit_by_name (self, "device-available", device);
     } else {
-        g_warning ("Failed to add device: %s", error->message);
+        /* Only complain once about devices that keep failing */
+        if (korva_upnp_failure_cache_fail (self->priv->failures, uid, error) == 1) {
+            g_warning ("Failed to add device: %s", error->message);
+        } else {
+            g_debug ("Failed to add device again: %s", error->message);
+        }
         g_error_free (error);
+        korva_upnp_device_lister_schedule_retry (self, device);
+        g_hash_table_remove (self->priv->probes, uid);
         g_object_unref (device);
     }
 }
@@ -280,19 +830,31 @@ korva_upnp_device_lister_on_renderer_available (GUPnPControlPoint *cp,
     }
 
     if (device == NULL) {
+        g_autofree char *config_id = NULL;
+
+        config_id = korva_upnp_device_info_get_config_id (GUPNP_DEVICE_INFO (proxy));
+        if (!korva_upnp_failure_cache_begin (self->priv->failures,
+                                             uid,
+                                             gupnp_device_info_get_location (GUPNP_DEVICE_INFO (proxy)),
+                                             config_id)) {
+            return;
+        }
+
+        g_hash_table_remove (self->priv->retries, uid);
         device = g_object_new (KORVA_TYPE_UPNP_DEVICE,
                                "proxy", g_object_ref (proxy),
                                NULL);
         g_hash_table_insert (self->priv->pending_devices,
                              g_strdup (uid),
                              device);
-        g_async_initable_init_async (G_ASYNC_INITABLE (device),
-                                     G_PRIORITY_DEFAULT,
-                                     NULL,
-                                     korva_upnp_device_lister_on_device_ready,
-                                     user_data);
+        korva_upnp_introspection_queue_push (self->priv->introspections,
+                                             uid,
+                                             device,
+                                             korva_upnp_device_lister_on_device_ready,
+                                             user_data);
     } else {
         korva_upnp_device_add_proxy (device, proxy);
+        korva_upnp_device_lister_confirm_probe (self, device, proxy);
         g_debug ("Device '%s' already known, ignoring…", uid);
     }
 }
@@ -305,6 +867,7 @@ korva_upnp_device_lister_on_renderer_unavailable (GUPnPControlPoint *cp,
     KorvaUPnPDeviceLister *self = KORVA_UPNP_DEVICE_LISTER (user_data);
     const char *uid;
     KorvaDevice *device;
+    KorvaUPnPRetry *retry;
 
     uid = gupnp_device_info_get_udn (GUPNP_DEVICE_INFO (proxy));
     if (uid == NULL) {
@@ -315,6 +878,11 @@ korva_upnp_device_lister_on_renderer_unavailable (GUPnPControlPoint *cp,
 
     g_debug ("Device %s disappeared", uid);
 
+    retry = g_hash_table_lookup (self->priv->retries, uid);
+    if (retry != NULL && retry->proxy == proxy) {
+        g_hash_table_remove (self->priv->retries, uid);
+    }
+
     device = g_hash_table_lookup (self->priv->devices, uid);
 
     if (device == NULL) {
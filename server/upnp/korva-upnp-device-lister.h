@@ -28,3 +28,6 @@ G_DECLARE_FINAL_TYPE (KorvaUPnPDeviceLister, korva_upnp_device_lister, KORVA, UP
 
 KorvaDeviceLister *
 korva_upnp_device_lister_new (void);
+
+void
+korva_upnp_device_lister_set_retry_delay (guint base_delay, guint max_delay);
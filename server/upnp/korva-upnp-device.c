@@ -20,24 +20,76 @@
 
 #define G_LOG_DOMAIN "Korva-UPnP-Device"
 
+#include <libxml/tree.h>
 #include <libsoup/soup.h>
 #include <libgupnp-av/gupnp-av.h>
 
 #include <korva-device.h>
 #include <korva-error.h>
 #include <korva-icon-cache.h>
+#include <korva-priority.h>
+#include <korva-push-trace.h>
 
 #include "korva-upnp-device.h"
+#include "korva-upnp-device-cache.h"
 #include "korva-upnp-file-server.h"
+#include "korva-upnp-icon-fetcher.h"
+#include "korva-upnp-last-change.h"
+#include "korva-upnp-rtt-stats.h"
+#include "korva-upnp-sink-caps.h"
 
 #define AV_TRANSPORT "urn:schemas-upnp-org:service:AVTransport"
 #define CONNECTION_MANAGER "urn:schemas-upnp-org:service:ConnectionManager"
 
-#define AV_STATE_STOPPED "STOPPED"
-#define AV_STATE_PAUSED_PLAYBACK "PAUSED_PLAYBACK"
-#define AV_STATE_NO_MEDIA_PRESENT "NO_MEDIA_PRESENT"
-#define AV_STATE_PLAYING "PLAYING"
-#define AV_STATE_UNKNOWN "UNKNOWN"
+/* The TransportState values defined by AVTransport; vendor specific states
+ * are reported as UNKNOWN */
+typedef enum {
+    AV_STATE_UNKNOWN,
+    AV_STATE_STOPPED,
+    AV_STATE_PLAYING,
+    AV_STATE_TRANSITIONING,
+    AV_STATE_PAUSED_PLAYBACK,
+    AV_STATE_PAUSED_RECORDING,
+    AV_STATE_RECORDING,
+    AV_STATE_NO_MEDIA_PRESENT,
+    AV_STATE_COUNT
+} KorvaUPnPTransportState;
+
+static const char *transport_state_names[AV_STATE_COUNT] = {
+    "UNKNOWN",
+    "STOPPED",
+    "PLAYING",
+    "TRANSITIONING",
+    "PAUSED_PLAYBACK",
+    "PAUSED_RECORDING",
+    "RECORDING",
+    "NO_MEDIA_PRESENT"
+};
+
+/* Consecutive timeouts after which calls to a device fail immediately */
+#define KORVA_UPNP_DEVICE_BREAKER_THRESHOLD 3
+
+/* Seconds a device that stopped responding is left alone by default */
+#define KORVA_UPNP_DEVICE_BREAKER_TIMEOUT 30
+
+/* Samples needed before an action is timed by its own statistics */
+#define KORVA_UPNP_DEVICE_MIN_ACTION_SAMPLES 4
+
+/* Milliseconds state changes are collected before they are announced */
+#define KORVA_UPNP_DEVICE_CHANGED_DELAY 200
+
+/* Milliseconds between GetPositionInfo calls right after Play or a seek and
+ * once playback is steady */
+#define KORVA_UPNP_DEVICE_POSITION_FAST_INTERVAL 1000
+#define KORVA_UPNP_DEVICE_POSITION_SLOW_INTERVAL 8000
+
+/* Milliseconds the position may be off from the expected one before it is
+ * taken as a seek */
+#define KORVA_UPNP_DEVICE_POSITION_JUMP 2000
+
+/* Seconds the LastChange subscription is kept after the last push ended and
+ * the last watcher left, so a quick follow-up does not subscribe again */
+#define KORVA_UPNP_DEVICE_SUBSCRIPTION_GRACE 60
 
 static void
 korva_upnp_device_async_initable_init (GAsyncInitableIface *iface);
@@ -48,6 +100,24 @@ korva_upnp_device_korva_device_init (KorvaDeviceInterface *iface);
 static GRegex *media_server_regex;
 static GRegex *media_renderer_regex;
 
+/* Milliseconds, see korva_upnp_device_set_timing() */
+static guint call_deadline;
+static guint call_breaker_timeout = KORVA_UPNP_DEVICE_BREAKER_TIMEOUT * 1000;
+
+static KorvaUPnPTransportState
+korva_upnp_device_parse_state (const char *state)
+{
+    int i;
+
+    for (i = 0; i < AV_STATE_COUNT; i++) {
+        if (g_ascii_strcasecmp (state, transport_state_names[i]) == 0) {
+            return i;
+        }
+    }
+
+    return AV_STATE_UNKNOWN;
+}
+
 GQuark
 korva_upnp_device_error_quark ()
 {
@@ -65,17 +135,53 @@ struct _KorvaUPnPDevicePrivate {
     char                      *icon_uri;
     KorvaDeviceType            device_type;
     GTask                     *result;
-    GHashTable                *services;
+    guint                      pending_calls;
+    GError                    *introspection_error;
+    guint                      icon_pending : 1;
+    guint                      ready : 1;
+    guint                      externally_modified : 1;
+    guint                      position_pending : 1;
+    guint                      command_running : 1;
+    guint                      subscribed : 1;
+    KorvaUPnPTransportState    state;
+    GUPnPServiceProxy         *av_transport;
+    GUPnPServiceProxy         *connection_manager;
     GUPnPServiceIntrospection *introspection;
     char                      *protocol_info;
-    SoupSession               *session;
+    KorvaUPnPSinkCaps         *sink_caps;
+    GVariant                  *serialized;
     GList                     *other_proxies;
-    GUPnPLastChangeParser     *last_change_parser;
-    char                      *state;
     char                      *ip_address;
     char                      *current_tag;
     char                      *current_uri;
     GFile                     *current_file;
+    /* Tag of the push or unshare that is running, owned by its task */
+    const char                *running_tag;
+
+    /* Pending emission of KorvaDevice::changed */
+    guint                      changed_id;
+
+    /* GetPositionInfo of the current push; times are in ms, -1 if unknown */
+    guint                      position_id;
+    guint                      position_interval;
+    gint64                     position;
+    gint64                     duration;
+    gint64                     position_updated;
+
+    /* Pushes and unshares waiting for the running one to finish */
+    GQueue                     commands;
+
+    /* LastChange subscription, held while something is pushed to the device
+     * or a client watches it */
+    guint                      watchers;
+    guint                      unsubscribe_id;
+
+    /* Round-trip times of all SOAP calls and by action name; the latter is
+     * only created once the first call went out */
+    KorvaUPnPRttStats         *rtt_stats;
+    GHashTable                *action_stats;
+    guint                      timeouts;
+    gint64                     breaker_until;
 };
 typedef struct _KorvaUPnPDevicePrivate KorvaUPnPDevicePrivate;
 
@@ -97,6 +203,15 @@ G_DEFINE_TYPE_WITH_CODE (KorvaUPnPDevice,
 /* forward declarations */
 
 /* KorvaUPnPDevice */
+static gboolean
+korva_upnp_device_setup_services (KorvaUPnPDevice *self, GError **error);
+
+static gboolean
+korva_upnp_device_load_cached (KorvaUPnPDevice *self);
+
+static void
+korva_upnp_device_on_revalidated (GObject *source, GAsyncResult *res, gpointer user_data);
+
 static void
 korva_upnp_device_introspect_renderer (KorvaUPnPDevice *self);
 
@@ -110,8 +225,8 @@ korva_upnp_device_on_last_change (GUPnPServiceProxy *proxy,
                                   GValue            *value,
                                   gpointer           user_data);
 
-#define korva_upnp_device_introspection_success(self) \
-    korva_upnp_device_introspection_finish ((self), NULL)
+static void
+korva_upnp_device_introspection_call_done (KorvaUPnPDevice *self, GError *error);
 
 static void
 korva_upnp_device_on_get_protocol_info (GObject *source, GAsyncResult *res, gpointer user_data);
@@ -122,6 +237,12 @@ korva_upnp_device_get_icon (KorvaUPnPDevice *self);
 static void
 korva_upnp_device_on_icon_ready (GObject *source, GAsyncResult *res, gpointer user_data);
 
+static void
+korva_upnp_device_ensure_icon (KorvaUPnPDevice *self);
+
+static void
+korva_upnp_device_icon_done (KorvaUPnPDevice *self, char *icon_uri);
+
 static void
 korva_upnp_device_on_set_av_transport_uri (GObject *proxy, GAsyncResult *res, gpointer user_data);
 static void
@@ -138,6 +259,21 @@ korva_upnp_device_on_get_transport_info (GObject *source, GAsyncResult *action,
 static void
 korva_upnp_device_drop_current_file (KorvaUPnPDevice *self);
 
+static void
+korva_upnp_device_preconnect (KorvaUPnPDevice *self);
+
+static void
+korva_upnp_device_run_next_command (KorvaUPnPDevice *self);
+
+static void
+korva_upnp_device_start_position_polling (KorvaUPnPDevice *self);
+
+static void
+korva_upnp_device_stop_position_polling (KorvaUPnPDevice *self);
+
+static void
+korva_upnp_device_update_subscription (KorvaUPnPDevice *self);
+
 /* GAsyncInitable */
 static void
 korva_upnp_device_init_async (GAsyncInitable     *initable,
@@ -170,6 +306,18 @@ korva_upnp_device_get_device_type (KorvaDevice *device);
 static GVariant *
 korva_upnp_device_serialize (KorvaDevice *device);
 
+static GVariant *
+korva_upnp_device_get_position (KorvaDevice *device);
+
+static GVariant *
+korva_upnp_device_get_statistics (KorvaDevice *device);
+
+static void
+korva_upnp_device_watch (KorvaDevice *device);
+
+static void
+korva_upnp_device_unwatch (KorvaDevice *device);
+
 static void
 korva_upnp_device_push_async (KorvaDevice        *self,
                               GVariant           *source,
@@ -203,13 +351,9 @@ static void
 korva_upnp_device_init (KorvaUPnPDevice *self)
 {
     self->priv = korva_upnp_device_get_instance_private (self);
-    self->priv->services = g_hash_table_new_full (g_str_hash,
-                                                  g_str_equal,
-                                                  NULL,
-                                                  g_object_unref);
-    self->priv->session = soup_session_new ();
-    self->priv->last_change_parser = gupnp_last_change_parser_new ();
-    self->priv->state = g_strdup (AV_STATE_UNKNOWN);
+    self->priv->state = AV_STATE_UNKNOWN;
+    g_queue_init (&self->priv->commands);
+    self->priv->rtt_stats = korva_upnp_rtt_stats_new ();
 }
 
 static void proxy_list_free (GList *proxies)
@@ -217,17 +361,43 @@ static void proxy_list_free (GList *proxies)
     g_list_free_full (proxies, g_object_unref);
 }
 
+/* Stop listening to the AVTransport service proxy before letting go of it */
+static void
+korva_upnp_device_clear_av_transport (KorvaUPnPDevice *self)
+{
+    if (self->priv->av_transport == NULL) {
+        return;
+    }
+
+    gupnp_service_proxy_remove_notify (self->priv->av_transport,
+                                       "LastChange",
+                                       korva_upnp_device_on_last_change,
+                                       self);
+    if (self->priv->subscribed) {
+        gupnp_service_proxy_set_subscribed (self->priv->av_transport, FALSE);
+    }
+    g_clear_object (&self->priv->av_transport);
+}
+
 static void
 korva_upnp_device_dispose (GObject *obj)
 {
     KorvaUPnPDevice *self = KORVA_UPNP_DEVICE (obj);
 
     g_clear_object (&self->priv->proxy);
-    g_clear_pointer (&self->priv->services, g_hash_table_destroy);
-    g_clear_object (&self->priv->session);
+    korva_upnp_device_clear_av_transport (self);
+    g_clear_object (&self->priv->connection_manager);
     g_clear_pointer (&self->priv->other_proxies, proxy_list_free);
-    g_clear_object (&self->priv->last_change_parser);
-    g_clear_object (&self->priv->last_change_parser);
+
+    if (self->priv->changed_id != 0) {
+        g_source_remove (self->priv->changed_id);
+        self->priv->changed_id = 0;
+    }
+    if (self->priv->unsubscribe_id != 0) {
+        g_source_remove (self->priv->unsubscribe_id);
+        self->priv->unsubscribe_id = 0;
+    }
+    korva_upnp_device_stop_position_polling (self);
 
     G_OBJECT_CLASS (korva_upnp_device_parent_class)->dispose (obj);
 }
@@ -238,9 +408,13 @@ korva_upnp_device_finalize (GObject *obj)
     KorvaUPnPDevice *self = KORVA_UPNP_DEVICE (obj);
 
     g_clear_pointer (&self->priv->protocol_info, g_free);
+    g_clear_pointer (&self->priv->sink_caps, korva_upnp_sink_caps_free);
+    g_clear_pointer (&self->priv->serialized, g_variant_unref);
     g_clear_pointer (&self->priv->ip_address, g_free);
     g_clear_pointer (&self->priv->current_tag, g_free);
     g_clear_pointer (&self->priv->current_uri, g_free);
+    g_clear_pointer (&self->priv->rtt_stats, korva_upnp_rtt_stats_free);
+    g_clear_pointer (&self->priv->action_stats, g_hash_table_destroy);
 
     G_OBJECT_CLASS (korva_upnp_device_parent_class)->finalize (obj);
 }
@@ -304,6 +478,10 @@ korva_upnp_device_korva_device_init (KorvaDeviceInterface *iface)
     iface->get_protocol = korva_upnp_device_get_protocol;
     iface->get_device_type = korva_upnp_device_get_device_type;
     iface->serialize = korva_upnp_device_serialize;
+    iface->get_position = korva_upnp_device_get_position;
+    iface->get_statistics = korva_upnp_device_get_statistics;
+    iface->watch = korva_upnp_device_watch;
+    iface->unwatch = korva_upnp_device_unwatch;
     iface->push_async = korva_upnp_device_push_async;
     iface->push_finish = korva_upnp_device_push_finish;
     iface->unshare_async = korva_upnp_device_unshare_async;
@@ -354,6 +532,10 @@ korva_upnp_device_serialize (KorvaDevice *device)
     KorvaUPnPDevice *self = KORVA_UPNP_DEVICE (device);
     GVariantBuilder *builder;
 
+    if (self->priv->serialized != NULL) {
+        return g_variant_ref (self->priv->serialized);
+    }
+
     builder = g_variant_builder_new (G_VARIANT_TYPE_ARRAY);
     g_variant_builder_add (builder,
                            "{sv}",
@@ -376,7 +558,102 @@ korva_upnp_device_serialize (KorvaDevice *device)
                            "{sv}",
                            "Type",
                            g_variant_new_uint32 ((int) self->priv->device_type));
-    return g_variant_builder_end (builder);
+    g_variant_builder_add (builder,
+                           "{sv}",
+                           "Responsive",
+                           g_variant_new_boolean (self->priv->timeouts < KORVA_UPNP_DEVICE_BREAKER_THRESHOLD));
+    g_variant_builder_add (builder,
+                           "{sv}",
+                           "TransportState",
+                           g_variant_new_string (transport_state_names[self->priv->state]));
+    g_variant_builder_add (builder,
+                           "{sv}",
+                           "Tag",
+                           g_variant_new_string (self->priv->current_tag ? self->priv->current_tag : ""));
+    g_variant_builder_add (builder,
+                           "{sv}",
+                           "ExternallyModified",
+                           g_variant_new_boolean (self->priv->externally_modified));
+    self->priv->serialized = g_variant_ref_sink (g_variant_builder_end (builder));
+    g_variant_builder_unref (builder);
+
+    return g_variant_ref (self->priv->serialized);
+}
+
+/*
+ * The position is extrapolated from the last GetPositionInfo while the
+ * device is playing, so all clients can share one poll.
+ */
+static GVariant *
+korva_upnp_device_get_position (KorvaDevice *device)
+{
+    KorvaUPnPDevice *self = KORVA_UPNP_DEVICE (device);
+    GVariantBuilder builder;
+    gint64 age, position;
+
+    if (self->priv->current_tag == NULL || self->priv->position_updated == 0) {
+        return NULL;
+    }
+
+    age = (g_get_monotonic_time () - self->priv->position_updated) / 1000;
+    position = self->priv->position;
+    if (position >= 0 && self->priv->state == AV_STATE_PLAYING) {
+        position += age;
+        if (self->priv->duration >= 0) {
+            position = MIN (position, self->priv->duration);
+        }
+    }
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add (&builder, "{sv}", "Tag", g_variant_new_string (self->priv->current_tag));
+    g_variant_builder_add (&builder,
+                           "{sv}",
+                           "TransportState",
+                           g_variant_new_string (transport_state_names[self->priv->state]));
+    g_variant_builder_add (&builder, "{sv}", "Position", g_variant_new_int64 (position));
+    g_variant_builder_add (&builder, "{sv}", "Duration", g_variant_new_int64 (self->priv->duration));
+    g_variant_builder_add (&builder, "{sv}", "Age", g_variant_new_uint32 (MIN (age, G_MAXUINT32)));
+
+    return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+/*
+ * Every answer changes the round-trip times, so they are not kept in the
+ * serialized device.
+ */
+static GVariant *
+korva_upnp_device_get_statistics (KorvaDevice *device)
+{
+    KorvaUPnPDevice *self = KORVA_UPNP_DEVICE (device);
+    GVariantBuilder builder;
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add (&builder,
+                           "{sv}",
+                           "SoapRTT",
+                           korva_upnp_rtt_stats_serialize (self->priv->rtt_stats));
+
+    return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+static void
+korva_upnp_device_watch (KorvaDevice *device)
+{
+    KorvaUPnPDevice *self = KORVA_UPNP_DEVICE (device);
+
+    self->priv->watchers++;
+    korva_upnp_device_update_subscription (self);
+}
+
+static void
+korva_upnp_device_unwatch (KorvaDevice *device)
+{
+    KorvaUPnPDevice *self = KORVA_UPNP_DEVICE (device);
+
+    g_return_if_fail (self->priv->watchers > 0);
+
+    self->priv->watchers--;
+    korva_upnp_device_update_subscription (self);
 }
 
 /* GASyncableInit functions */
@@ -397,6 +674,8 @@ korva_upnp_device_init_async (GAsyncInitable     *initable,
     GTask *result;
     KorvaUPnPDevice *self;
     const char *device_type;
+    GError *error = NULL;
+    gboolean cached;
 
     self = KORVA_UPNP_DEVICE (initable);
 
@@ -412,10 +691,35 @@ korva_upnp_device_init_async (GAsyncInitable     *initable,
         self->priv->device_type = DEVICE_TYPE_SERVER;
     } else if (g_regex_match (media_renderer_regex, device_type, 0, NULL)) {
         self->priv->device_type = DEVICE_TYPE_PLAYER;
+        if (!korva_upnp_device_setup_services (self, &error)) {
+            korva_upnp_device_introspection_finish (self, error);
+
+            return;
+        }
+
+        korva_upnp_device_preconnect (self);
+        cached = korva_upnp_device_load_cached (self);
+
+        /* The icon is not needed to use the device, so it is fetched next to
+         * the introspection calls and announced with KorvaDevice::changed if
+         * it arrives after the device became ready */
+        korva_upnp_device_get_icon (self);
+
+        if (cached) {
+            g_debug ("Using cached introspection data for device %s (%s)",
+                     self->priv->friendly_name,
+                     self->priv->udn);
+            korva_upnp_device_ensure_icon (self);
+            self->priv->ready = TRUE;
+            g_task_return_boolean (result, TRUE);
+            g_object_unref (result);
+
+            /* Keep ourselves alive while revalidating the cached data */
+            self->priv->result = g_task_new (self, NULL, korva_upnp_device_on_revalidated, NULL);
+        }
+
         korva_upnp_device_introspect_renderer (self);
     } else {
-        GError *error;
-
         error = g_error_new (KORVA_UPNP_DEVICE_ERROR,
                              INVALID_DEVICE_TYPE,
                              "Device %s is not the device we are looking for",
@@ -436,55 +740,44 @@ korva_upnp_device_init_finish (GAsyncInitable *initable,
     return g_task_propagate_boolean (G_TASK (res), error);
 }
 
-static void
-korva_upnp_device_introspect_renderer (KorvaUPnPDevice *self)
+static gboolean
+korva_upnp_device_setup_services (KorvaUPnPDevice *self, GError **error)
 {
     GUPnPDeviceInfo *info;
     GUPnPServiceInfo *service;
-    GUPnPServiceProxy *proxy;
 
     info = GUPNP_DEVICE_INFO (self->priv->proxy);
-    g_debug ("Starting introspection of rendering device %s (%s)",
-             self->priv->friendly_name,
-             self->priv->udn);
 
     /* check if we have all the necessary proxys */
     service = gupnp_device_info_get_service (info, AV_TRANSPORT);
     if (service == NULL) {
-        GError *error;
-
-        error = g_error_new (KORVA_UPNP_DEVICE_ERROR,
-                             MISSING_SERVICE,
-                             "Device %s is missing the 'AVTransport' service",
-                             self->priv->udn);
-
-        korva_upnp_device_introspection_finish (self, error);
+        g_set_error (error,
+                     KORVA_UPNP_DEVICE_ERROR,
+                     MISSING_SERVICE,
+                     "Device %s is missing the 'AVTransport' service",
+                     self->priv->udn);
 
-        return;
+        return FALSE;
     }
 
-    g_hash_table_insert (self->priv->services,
-                         (char *) AV_TRANSPORT,
-                         GUPNP_SERVICE_PROXY (service));
+    self->priv->av_transport = GUPNP_SERVICE_PROXY (service);
+    /* The subscription itself is only started when needed, see
+     * korva_upnp_device_update_subscription() */
     gupnp_service_proxy_add_notify (GUPNP_SERVICE_PROXY (service),
                                     "LastChange", G_TYPE_STRING,
                                     korva_upnp_device_on_last_change,
                                     self);
-    gupnp_service_proxy_set_subscribed (GUPNP_SERVICE_PROXY (service), TRUE);
 
 
     service = gupnp_device_info_get_service (info, CONNECTION_MANAGER);
     if (service == NULL) {
-        GError *error;
-
-        error = g_error_new (KORVA_UPNP_DEVICE_ERROR,
-                             MISSING_SERVICE,
-                             "Device %s is missing the 'ConnectionManager' service",
-                             self->priv->udn);
+        g_set_error (error,
+                     KORVA_UPNP_DEVICE_ERROR,
+                     MISSING_SERVICE,
+                     "Device %s is missing the 'ConnectionManager' service",
+                     self->priv->udn);
 
-        korva_upnp_device_introspection_finish (self, error);
-
-        return;
+        return FALSE;
     }
 
     /*
@@ -493,36 +786,476 @@ korva_upnp_device_introspect_renderer (KorvaUPnPDevice *self)
      */
     korva_upnp_device_update_ip_address (self);
 
-    g_hash_table_insert (self->priv->services,
-                         (char *) CONNECTION_MANAGER,
-                         GUPNP_SERVICE_PROXY (service));
+    self->priv->connection_manager = GUPNP_SERVICE_PROXY (service);
+
+    return TRUE;
+}
+
+/**
+ * korva_upnp_device_info_get_config_id:
+ * @info: A #GUPnPDeviceInfo
+ *
+ * Returns: (transfer full) (allow-none): The configId attribute of the
+ * description @info was created from or %NULL if it has none.
+ */
+char *
+korva_upnp_device_info_get_config_id (GUPnPDeviceInfo *info)
+{
+    xmlNode *element;
+    xmlChar *value;
+    char *config_id;
+
+    element = gupnp_device_info_get_element (info);
+    if (element == NULL || element->doc == NULL) {
+        return NULL;
+    }
+
+    value = xmlGetProp (xmlDocGetRootElement (element->doc), (const xmlChar *) "configId");
+    config_id = g_strdup ((const char *) value);
+    xmlFree (value);
+
+    return config_id;
+}
+
+/**
+ * korva_upnp_device_set_timing:
+ * @deadline: Milliseconds a SOAP call may take, 0 to derive it from the
+ * round-trip times of each device again
+ * @breaker_timeout: Milliseconds calls to a device that stopped responding
+ * fail immediately, 0 for the default
+ *
+ * Override the timing of calls to all devices. Mostly useful for tests, which
+ * cannot wait for the deadlines of real renderers.
+ */
+void
+korva_upnp_device_set_timing (guint deadline, guint breaker_timeout)
+{
+    call_deadline = deadline;
+    call_breaker_timeout = breaker_timeout != 0 ? breaker_timeout : KORVA_UPNP_DEVICE_BREAKER_TIMEOUT * 1000;
+}
+
+/*
+ * Fill in the introspection results from the device cache if the cached entry
+ * was created from the same description. The UPnP BOOTID is not available
+ * from GUPnP, so the description URL and the configId of the root device are
+ * used instead.
+ */
+static gboolean
+korva_upnp_device_load_cached (KorvaUPnPDevice *self)
+{
+    g_autoptr (KorvaUPnPDeviceCacheEntry) entry = NULL;
+    g_autofree char *config_id = NULL;
+
+    entry = korva_upnp_device_cache_lookup (self->priv->udn);
+    if (entry == NULL) {
+        return FALSE;
+    }
+
+    config_id = korva_upnp_device_info_get_config_id (self->priv->info);
+    if (g_strcmp0 (entry->location, gupnp_device_info_get_location (self->priv->info)) != 0 ||
+        g_strcmp0 (entry->config_id, config_id ? config_id : "") != 0 ||
+        g_strcmp0 (entry->device_type, gupnp_device_info_get_device_type (self->priv->info)) != 0 ||
+        g_strcmp0 (entry->friendly_name, self->priv->friendly_name) != 0) {
+        g_debug ("Cached data for device %s is stale", self->priv->udn);
+        korva_upnp_device_cache_remove (self->priv->udn);
+
+        return FALSE;
+    }
+
+    self->priv->protocol_info = g_steal_pointer (&entry->protocol_info);
+    self->priv->sink_caps = korva_upnp_sink_caps_new (self->priv->protocol_info);
+
+    /* Downloaded icons are found by the icon cache already. Remember that the
+     * device has none so we do not try to download it again */
+    if (self->priv->icon_uri == NULL) {
+        g_autofree char *default_icon = korva_icon_cache_get_default (self->priv->device_type);
+
+        if (g_strcmp0 (entry->icon_uri, default_icon) == 0) {
+            self->priv->icon_uri = g_steal_pointer (&default_icon);
+        }
+    }
+
+    return TRUE;
+}
+
+static void
+korva_upnp_device_store_cached (KorvaUPnPDevice *self)
+{
+    KorvaUPnPDeviceCacheEntry entry = { 0 };
+    g_autofree char *config_id = NULL;
+
+    config_id = korva_upnp_device_info_get_config_id (self->priv->info);
+
+    entry.location = (char *) gupnp_device_info_get_location (self->priv->info);
+    entry.config_id = config_id;
+    entry.device_type = (char *) gupnp_device_info_get_device_type (self->priv->info);
+    entry.friendly_name = self->priv->friendly_name;
+    entry.protocol_info = self->priv->protocol_info;
+    /* Do not remember the default icon while the real one is still loading */
+    entry.icon_uri = self->priv->icon_pending ? NULL : self->priv->icon_uri;
+
+    korva_upnp_device_cache_store (self->priv->udn, &entry);
+}
+
+static void
+korva_upnp_device_on_revalidated (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    KorvaUPnPDevice *self = KORVA_UPNP_DEVICE (source);
+    g_autoptr (GError) error = NULL;
+
+    if (!g_task_propagate_boolean (G_TASK (res), &error)) {
+        g_debug ("Revalidating cached data of device %s failed: %s", self->priv->udn, error->message);
+        korva_upnp_device_cache_remove (self->priv->udn);
+    }
+}
+
+/* SOAP calls */
+typedef struct {
+    KorvaUPnPDevice    *self;
+    char               *name;
+    gint64              start;
+    GCancellable       *cancellable;
+    guint               timeout_id;
+    gboolean            timed_out;
+    GAsyncReadyCallback callback;
+    gpointer            user_data;
+} ActionCall;
+
+static KorvaUPnPRttStats *
+korva_upnp_device_get_action_stats (KorvaUPnPDevice *self, const char *name)
+{
+    KorvaUPnPRttStats *stats;
+
+    if (self->priv->action_stats == NULL) {
+        /* Action names are a small fixed set, so intern them instead of
+         * keeping a copy per device */
+        self->priv->action_stats = g_hash_table_new_full (g_str_hash,
+                                                          g_str_equal,
+                                                          NULL,
+                                                          (GDestroyNotify) korva_upnp_rtt_stats_free);
+    }
+
+    stats = g_hash_table_lookup (self->priv->action_stats, name);
+    if (stats == NULL) {
+        stats = korva_upnp_rtt_stats_new ();
+        g_hash_table_insert (self->priv->action_stats, (gpointer) g_intern_string (name), stats);
+    }
+
+    return stats;
+}
+
+/*
+ * Renderers often take a lot longer to start playback than to answer
+ * anything else, so an action is timed by its own statistics once there are
+ * enough of them.
+ */
+static guint
+korva_upnp_device_get_deadline (KorvaUPnPDevice *self, const char *name)
+{
+    KorvaUPnPRttStats *stats;
+
+    if (call_deadline != 0) {
+        return call_deadline;
+    }
+
+    stats = korva_upnp_device_get_action_stats (self, name);
+    if (korva_upnp_rtt_stats_get_samples (stats) < KORVA_UPNP_DEVICE_MIN_ACTION_SAMPLES) {
+        stats = self->priv->rtt_stats;
+    }
+
+    return korva_upnp_rtt_stats_get_deadline (stats);
+}
+
+static gboolean
+korva_upnp_device_is_responsive (KorvaUPnPDevice *self)
+{
+    return self->priv->timeouts < KORVA_UPNP_DEVICE_BREAKER_THRESHOLD ||
+           g_get_monotonic_time () >= self->priv->breaker_until;
+}
+
+static void
+korva_upnp_device_record_rtt (KorvaUPnPDevice *self, const char *name, gint64 rtt)
+{
+    gboolean recovered;
+
+    korva_upnp_rtt_stats_add_sample (self->priv->rtt_stats, rtt);
+    korva_upnp_rtt_stats_add_sample (korva_upnp_device_get_action_stats (self, name), rtt);
+
+    recovered = self->priv->timeouts >= KORVA_UPNP_DEVICE_BREAKER_THRESHOLD;
+    self->priv->timeouts = 0;
+
+    /* Only Responsive is part of the serialized device */
+    if (recovered) {
+        g_debug ("Device %s is responding again", self->priv->udn);
+        g_clear_pointer (&self->priv->serialized, g_variant_unref);
+        if (self->priv->ready) {
+            g_signal_emit_by_name (self, "changed");
+        }
+    }
+}
+
+static void
+korva_upnp_device_record_timeout (KorvaUPnPDevice *self, const char *name)
+{
+    korva_upnp_rtt_stats_add_timeout (self->priv->rtt_stats);
+    korva_upnp_rtt_stats_add_timeout (korva_upnp_device_get_action_stats (self, name));
+
+    self->priv->timeouts++;
+    if (self->priv->timeouts < KORVA_UPNP_DEVICE_BREAKER_THRESHOLD) {
+        return;
+    }
+
+    /* Give the renderer some time before the next call; if that one times
+     * out as well, we are back here */
+    self->priv->breaker_until = g_get_monotonic_time () + call_breaker_timeout * (gint64) 1000;
+
+    if (self->priv->timeouts == KORVA_UPNP_DEVICE_BREAKER_THRESHOLD) {
+        g_warning ("Device %s stopped responding, failing calls for %u ms",
+                   self->priv->udn,
+                   call_breaker_timeout);
+        g_clear_pointer (&self->priv->serialized, g_variant_unref);
+        if (self->priv->ready) {
+            g_signal_emit_by_name (self, "changed");
+        }
+    }
+}
+
+static gboolean
+korva_upnp_device_on_action_deadline (gpointer user_data)
+{
+    ActionCall *call = (ActionCall *) user_data;
+
+    g_debug ("%s on device %s ran into its deadline", call->name, call->self->priv->udn);
+
+    call->timeout_id = 0;
+    call->timed_out = TRUE;
+    g_cancellable_cancel (call->cancellable);
+
+    return FALSE;
+}
+
+static void
+korva_upnp_device_on_action_done (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    ActionCall *call = (ActionCall *) user_data;
+
+    if (call->timeout_id != 0) {
+        g_source_remove (call->timeout_id);
+    }
+
+    if (call->timed_out) {
+        korva_upnp_device_record_timeout (call->self, call->name);
+    } else {
+        korva_upnp_device_record_rtt (call->self, call->name, g_get_monotonic_time () - call->start);
+    }
+
+    call->callback (source, res, call->user_data);
+
+    g_object_unref (call->cancellable);
+    g_object_unref (call->self);
+    g_free (call->name);
+    g_free (call);
+}
+
+/*
+ * Call @action with a deadline derived from the round-trip times of the
+ * device. A call that runs into its deadline is cancelled; use
+ * korva_upnp_device_call_action_finish() to turn that into a timeout error.
+ */
+static void
+korva_upnp_device_call_action (KorvaUPnPDevice         *self,
+                               GUPnPServiceProxy       *proxy,
+                               const char              *name,
+                               GUPnPServiceProxyAction *action,
+                               GAsyncReadyCallback      callback,
+                               gpointer                 user_data)
+{
+    ActionCall *call;
+
+    call = g_new0 (ActionCall, 1);
+    call->self = g_object_ref (self);
+    call->name = g_strdup (name);
+    call->cancellable = g_cancellable_new ();
+    call->callback = callback;
+    call->user_data = user_data;
+    call->timeout_id = g_timeout_add_full (korva_priority_get (KORVA_PRIORITY_CLASS_CONTROL),
+                                           korva_upnp_device_get_deadline (self, name),
+                                           korva_upnp_device_on_action_deadline,
+                                           call,
+                                           NULL);
+    call->start = g_get_monotonic_time ();
+
+    gupnp_service_proxy_call_action_async (proxy,
+                                           action,
+                                           call->cancellable,
+                                           korva_upnp_device_on_action_done,
+                                           call);
+}
+
+static void
+korva_upnp_device_on_preconnect (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    g_autoptr (GError) error = NULL;
 
-    proxy = g_hash_table_lookup (self->priv->services, AV_TRANSPORT);
-    g_autoptr (GUPnPServiceProxyAction) action;
+    if (!soup_session_preconnect_finish (SOUP_SESSION (source), res, &error)) {
+        g_debug ("Failed to open control connection: %s", error->message);
+    }
+}
 
+/*
+ * Open a connection to the AVTransport service ahead of the next call.
+ * Embedded renderers can be slow to accept connections; this overlaps the
+ * connection setup with discovery or with hosting the file of a push. SOAP
+ * calls go through the session of the GUPnPContext, which keeps the
+ * connection alive for all devices on that host, so it is only opened if
+ * there is no idle one.
+ */
+static void
+korva_upnp_device_preconnect (KorvaUPnPDevice *self)
+{
+    GUPnPServiceProxy *proxy;
+    GUPnPContext *context;
+    g_autofree char *control_url = NULL;
+    g_autoptr (SoupMessage) message = NULL;
+
+    proxy = self->priv->av_transport;
+    if (proxy == NULL) {
+        return;
+    }
+
+    control_url = gupnp_service_info_get_control_url (GUPNP_SERVICE_INFO (proxy));
+    message = soup_message_new (SOUP_METHOD_POST, control_url);
+    if (message == NULL) {
+        return;
+    }
+
+    context = gupnp_service_info_get_context (GUPNP_SERVICE_INFO (proxy));
+    soup_session_preconnect_async (gupnp_context_get_session (context),
+                                   message,
+                                   korva_priority_get (KORVA_PRIORITY_CLASS_DISCOVERY),
+                                   NULL,
+                                   korva_upnp_device_on_preconnect,
+                                   NULL);
+}
+
+static GUPnPServiceProxyAction *
+korva_upnp_device_call_action_finish (GObject *source, GAsyncResult *res, GError **error)
+{
+    GUPnPServiceProxyAction *action;
+    GError *inner_error = NULL;
+
+    action = gupnp_service_proxy_call_action_finish (GUPNP_SERVICE_PROXY (source), res, &inner_error);
+    if (g_error_matches (inner_error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        g_error_free (inner_error);
+        g_set_error_literal (error,
+                             KORVA_CONTROLLER1_ERROR,
+                             KORVA_CONTROLLER1_ERROR_TIMEOUT,
+                             "The device did not answer in time");
+
+        return NULL;
+    }
+
+    if (inner_error != NULL) {
+        g_propagate_error (error, inner_error);
+    }
+
+    return action;
+}
+
+/*
+ * Turn the failure of an introspection call into an error of the device.
+ * The services are there, so these are worth retrying later; only a
+ * missing service is reported as MISSING_SERVICE. Takes @error.
+ */
+static GError *
+korva_upnp_device_call_error (KorvaUPnPDevice *self, const char *name, GError *error)
+{
+    GError *result;
+
+    result = g_error_new (KORVA_UPNP_DEVICE_ERROR,
+                          g_error_matches (error,
+                                           KORVA_CONTROLLER1_ERROR,
+                                           KORVA_CONTROLLER1_ERROR_TIMEOUT) ? TIMEOUT : INVALID_RESPONSE,
+                          "Call to '%s' on device %s failed: %s",
+                          name,
+                          self->priv->udn,
+                          error->message);
+    g_error_free (error);
+
+    return result;
+}
+
+/*
+ * GetTransportInfo and GetProtocolInfo are independent of each other, so both
+ * are issued at once. The introspection is done once both have replied.
+ */
+static void
+korva_upnp_device_introspect_renderer (KorvaUPnPDevice *self)
+{
+    GUPnPServiceProxy *proxy;
+    GUPnPServiceProxyAction *action;
+
+    g_debug ("Starting introspection of rendering device %s (%s)",
+             self->priv->friendly_name,
+             self->priv->udn);
+
+    self->priv->pending_calls = 2;
+
+    proxy = self->priv->av_transport;
     action = gupnp_service_proxy_action_new ("GetTransportInfo", "InstanceID", G_TYPE_UINT, 0, NULL);
-    gupnp_service_proxy_call_action_async (proxy, action, NULL, korva_upnp_device_on_get_transport_info, self);
+    korva_upnp_device_call_action (self,
+                                   proxy,
+                                   "GetTransportInfo",
+                                   action,
+                                   korva_upnp_device_on_get_transport_info,
+                                   self);
+    gupnp_service_proxy_action_unref (action);
+
+    proxy = self->priv->connection_manager;
+    action = gupnp_service_proxy_action_new ("GetProtocolInfo", NULL);
+    korva_upnp_device_call_action (self,
+                                   proxy,
+                                   "GetProtocolInfo",
+                                   action,
+                                   korva_upnp_device_on_get_protocol_info,
+                                   self);
+    gupnp_service_proxy_action_unref (action);
+}
+
+static void
+korva_upnp_device_introspection_call_done (KorvaUPnPDevice *self, GError *error)
+{
+    if (error != NULL) {
+        if (self->priv->introspection_error == NULL) {
+            self->priv->introspection_error = error;
+        } else {
+            g_debug ("Ignoring additional introspection error: %s", error->message);
+            g_error_free (error);
+        }
+    }
+
+    self->priv->pending_calls--;
+    if (self->priv->pending_calls > 0) {
+        return;
+    }
+
+    korva_upnp_device_introspection_finish (self,
+                                            g_steal_pointer (&self->priv->introspection_error));
 }
 
 static void
 korva_upnp_device_on_get_transport_info (GObject *source, GAsyncResult *res, gpointer user_data)
 {
-    GUPnPServiceProxy *proxy = GUPNP_SERVICE_PROXY (source);
     KorvaUPnPDevice *self = KORVA_UPNP_DEVICE (user_data);
     GError *error = NULL;
+    char *state = NULL;
 
-    GUPnPServiceProxyAction *action = gupnp_service_proxy_call_action_finish (proxy, res, &error);
+    GUPnPServiceProxyAction *action = korva_upnp_device_call_action_finish (source, res, &error);
     if (error != NULL) {
-        GError *inner_error;
-
-        inner_error = g_error_new (KORVA_UPNP_DEVICE_ERROR,
-                                   MISSING_SERVICE,
-                                   "Call to 'GetTransportInfo' on device %s failed: %s",
-                                   self->priv->udn,
-                                   error->message);
-        g_error_free (error);
-
-        korva_upnp_device_introspection_finish (self, inner_error);
+        korva_upnp_device_introspection_call_done (self,
+                                                   korva_upnp_device_call_error (self,
+                                                                                 "GetTransportInfo",
+                                                                                 error));
 
         return;
     }
@@ -531,176 +1264,532 @@ korva_upnp_device_on_get_transport_info (GObject *source, GAsyncResult *res, gpo
                                            &error,
                                            "CurrentTransportState",
                                            G_TYPE_STRING,
-                                           &(self->priv->state),
+                                           &state,
                                            NULL);
 
-    if (error != NULL) {
+    if (error != NULL || state == NULL) {
         GError *inner_error;
 
         inner_error = g_error_new (KORVA_UPNP_DEVICE_ERROR,
                                    INVALID_RESPONSE,
                                    "Getting current stransport state on device %s failed: %s",
                                    self->priv->udn,
-                                   error->message);
+                                   error != NULL ? error->message : "No state");
+        g_clear_error (&error);
+
+        korva_upnp_device_introspection_call_done (self, inner_error);
+
+        return;
+    }
+
+    self->priv->state = korva_upnp_device_parse_state (state);
+    g_free (state);
+    g_clear_pointer (&self->priv->serialized, g_variant_unref);
+
+    g_debug ("Device %s has state %s", self->priv->udn, transport_state_names[self->priv->state]);
+
+    korva_upnp_device_introspection_call_done (self, NULL);
+}
+
+static void
+korva_upnp_device_on_get_protocol_info (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    KorvaUPnPDevice *self = KORVA_UPNP_DEVICE (user_data);
+    GError *error = NULL;
+    const char *variable;
+    char *protocol_info = NULL;
+
+    GUPnPServiceProxyAction *action = korva_upnp_device_call_action_finish (source, res, &error);
+    if (error != NULL) {
+        korva_upnp_device_introspection_call_done (self,
+                                                   korva_upnp_device_call_error (self,
+                                                                                 "GetProtocolInfo",
+                                                                                 error));
+
+        return;
+    }
+
+    variable = self->priv->device_type == DEVICE_TYPE_PLAYER ? "Sink" : "Source";
+
+    gupnp_service_proxy_action_get_result (action, &error, variable, G_TYPE_STRING, &protocol_info, NULL);
+
+    if (protocol_info == NULL || error != NULL) {
+        g_clear_error (&error);
+        error = g_error_new (KORVA_UPNP_DEVICE_ERROR,
+                             INVALID_RESPONSE,
+                             "Device %s did not properly reply to GetProtocolInfo call",
+                             self->priv->udn);
+        korva_upnp_device_introspection_call_done (self, error);
+
+        return;
+    }
+
+    /* When revalidating cached data, the old values are still in use until here */
+    g_free (self->priv->protocol_info);
+    self->priv->protocol_info = protocol_info;
+    g_clear_pointer (&self->priv->sink_caps, korva_upnp_sink_caps_free);
+    self->priv->sink_caps = korva_upnp_sink_caps_new (self->priv->protocol_info);
+
+    korva_upnp_device_introspection_call_done (self, NULL);
+}
+
+static void
+korva_upnp_device_introspection_finish (KorvaUPnPDevice *self,
+                                        GError          *error)
+{
+    GTask *result = g_steal_pointer (&self->priv->result);
+
+    if (error != NULL) {
+        g_task_return_error (result, error);
+    } else {
+        /* Use the default icon until the download is done */
+        korva_upnp_device_ensure_icon (self);
+        self->priv->ready = TRUE;
+        if (self->priv->device_type == DEVICE_TYPE_PLAYER) {
+            korva_upnp_device_store_cached (self);
+        }
+        g_task_return_boolean (result, TRUE);
+    }
+    g_object_unref (result);
+}
+
+static void
+korva_upnp_device_ensure_icon (KorvaUPnPDevice *self)
+{
+    if (self->priv->icon_uri == NULL) {
+        self->priv->icon_uri = korva_icon_cache_get_default (self->priv->device_type);
+        g_clear_pointer (&self->priv->serialized, g_variant_unref);
+    }
+}
+
+/*
+ * Called when the icon download is done. @icon_uri is %NULL if the device
+ * does not have a usable icon.
+ */
+static void
+korva_upnp_device_icon_done (KorvaUPnPDevice *self, char *icon_uri)
+{
+    self->priv->icon_pending = FALSE;
+
+    if (icon_uri == NULL) {
+        g_debug ("Could not find any icon, will use default");
+        icon_uri = korva_icon_cache_get_default (self->priv->device_type);
+    }
+
+    if (g_strcmp0 (icon_uri, self->priv->icon_uri) == 0) {
+        g_free (icon_uri);
+    } else {
+        g_free (self->priv->icon_uri);
+        self->priv->icon_uri = icon_uri;
+        g_clear_pointer (&self->priv->serialized, g_variant_unref);
+
+        if (self->priv->ready) {
+            g_debug ("Icon of device %s arrived late, announcing change", self->priv->udn);
+            g_signal_emit_by_name (self, "changed");
+        }
+    }
+
+    /* While the introspection is still running, it will update the cache */
+    if (self->priv->ready && self->priv->result == NULL) {
+        korva_upnp_device_store_cached (self);
+    }
+}
+
+static void
+korva_upnp_device_on_icon_stored (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    KorvaUPnPDevice *self = KORVA_UPNP_DEVICE (user_data);
+    g_autoptr (GError) error = NULL;
+    char *icon_uri;
+
+    icon_uri = korva_icon_cache_store_finish (res, &error);
+    if (icon_uri == NULL) {
+        g_debug ("Could not store icon of device %s: %s", self->priv->udn, error->message);
+    }
+
+    korva_upnp_device_icon_done (self, icon_uri);
+    g_object_unref (self);
+}
+
+static void
+korva_upnp_device_get_icon (KorvaUPnPDevice *self)
+{
+    g_autofree char *url = NULL;
+
+    /* icon was already in cache */
+    if (self->priv->icon_uri != NULL) {
+        return;
+    }
+
+    url = gupnp_device_info_get_icon_url (self->priv->info, "image/png", -1, 64, 64, TRUE, NULL, NULL, NULL, NULL);
+    if (url == NULL) {
+        url = gupnp_device_info_get_icon_url (self->priv->info, "image/jpeg", -1, 64, 64, TRUE, NULL, NULL, NULL, NULL);
+    }
+
+    if (url == NULL) {
+        korva_upnp_device_icon_done (self, NULL);
+
+        return;
+    }
+
+    self->priv->icon_pending = TRUE;
+    korva_upnp_icon_fetcher_fetch_async (url,
+                                         NULL,
+                                         korva_upnp_device_on_icon_ready,
+                                         g_object_ref (self));
+}
+
+static void
+korva_upnp_device_on_icon_ready (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    KorvaUPnPDevice *self = KORVA_UPNP_DEVICE (user_data);
+    g_autoptr (GError) error = NULL;
+    g_autoptr (GBytes) icon = NULL;
+
+    icon = korva_upnp_icon_fetcher_fetch_finish (res, &error);
+    if (icon == NULL) {
+        g_debug ("Failed to download icon: %s", error->message);
+        korva_upnp_device_icon_done (self, NULL);
+        g_object_unref (self);
+
+        return;
+    }
+
+    korva_icon_cache_store_async (self->priv->udn,
+                                  icon,
+                                  NULL,
+                                  korva_upnp_device_on_icon_stored,
+                                  self);
+}
+
+static gboolean
+korva_upnp_device_on_changed_timeout (gpointer user_data)
+{
+    KorvaUPnPDevice *self = KORVA_UPNP_DEVICE (user_data);
+
+    self->priv->changed_id = 0;
+    g_signal_emit_by_name (self, "changed");
+
+    return FALSE;
+}
+
+/*
+ * Invalidate the serialized device and announce the change. Renderers tend to
+ * go through several transport states in quick succession, e.g. on a push, so
+ * changes are collected for KORVA_UPNP_DEVICE_CHANGED_DELAY ms and announced
+ * once.
+ */
+static void
+korva_upnp_device_schedule_changed (KorvaUPnPDevice *self)
+{
+    g_clear_pointer (&self->priv->serialized, g_variant_unref);
+
+    if (!self->priv->ready || self->priv->changed_id != 0) {
+        return;
+    }
+
+    self->priv->changed_id = g_timeout_add_full (korva_priority_get (KORVA_PRIORITY_CLASS_CONTROL),
+                                                 KORVA_UPNP_DEVICE_CHANGED_DELAY,
+                                                 korva_upnp_device_on_changed_timeout,
+                                                 self,
+                                                 NULL);
+}
+
+/*
+ * Parse a time in the H+:MM:SS[.F+] format of AVTransport into milliseconds.
+ * Returns -1 for NOT_IMPLEMENTED or anything else that is not a time.
+ */
+static gint64
+korva_upnp_device_parse_time (const char *time)
+{
+    guint64 hours, minutes;
+    double seconds;
+    char *end;
+
+    if (time == NULL || !g_ascii_isdigit (*time)) {
+        return -1;
+    }
+
+    hours = g_ascii_strtoull (time, &end, 10);
+    if (*end != ':') {
+        return -1;
+    }
+
+    minutes = g_ascii_strtoull (end + 1, &end, 10);
+    if (*end != ':' || minutes > 59) {
+        return -1;
+    }
+
+    seconds = g_ascii_strtod (end + 1, &end);
+    if (seconds < 0 || seconds >= 60) {
+        return -1;
+    }
+
+    return (hours * 3600 + minutes * 60) * 1000 + (gint64) (seconds * 1000);
+}
+
+static void
+korva_upnp_device_poll_position (KorvaUPnPDevice *self);
+
+static gboolean
+korva_upnp_device_on_position_timeout (gpointer user_data)
+{
+    KorvaUPnPDevice *self = KORVA_UPNP_DEVICE (user_data);
+
+    self->priv->position_id = 0;
+    korva_upnp_device_poll_position (self);
+
+    return FALSE;
+}
+
+static void
+korva_upnp_device_on_get_position_info (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    KorvaUPnPDevice *self = KORVA_UPNP_DEVICE (user_data);
+    g_autofree char *rel_time = NULL;
+    g_autofree char *duration = NULL;
+    GUPnPServiceProxyAction *action;
+    GError *error = NULL;
+    gint64 position, expected;
+
+    self->priv->position_pending = FALSE;
+
+    action = korva_upnp_device_call_action_finish (source, res, &error);
+    if (error == NULL) {
+        gupnp_service_proxy_action_get_result (action,
+                                               &error,
+                                               "RelTime", G_TYPE_STRING, &rel_time,
+                                               "TrackDuration", G_TYPE_STRING, &duration,
+                                               NULL);
+    }
+
+    if (error != NULL) {
+        g_debug ("Failed to get position of device %s: %s", self->priv->udn, error->message);
         g_error_free (error);
+        if (self->priv->position_interval != 0) {
+            self->priv->position_interval = KORVA_UPNP_DEVICE_POSITION_SLOW_INTERVAL;
+        }
+    } else {
+        position = korva_upnp_device_parse_time (rel_time);
+
+        /* A position that is off from where playback should be means the
+         * renderer seeked; look closer for a while */
+        expected = self->priv->position + (g_get_monotonic_time () - self->priv->position_updated) / 1000;
+        if (self->priv->position_interval == 0) {
+            /* Polling was stopped while the call was running */
+        } else if (self->priv->position_updated == 0 ||
+                   position < 0 ||
+                   ABS (position - expected) > KORVA_UPNP_DEVICE_POSITION_JUMP) {
+            self->priv->position_interval = KORVA_UPNP_DEVICE_POSITION_FAST_INTERVAL;
+        } else {
+            self->priv->position_interval = MIN (self->priv->position_interval * 2,
+                                                 KORVA_UPNP_DEVICE_POSITION_SLOW_INTERVAL);
+        }
 
-        korva_upnp_device_introspection_finish (self, inner_error);
+        self->priv->position = position;
+        self->priv->duration = korva_upnp_device_parse_time (duration);
+        self->priv->position_updated = g_get_monotonic_time ();
+    }
 
+    if (self->priv->current_tag == NULL || self->priv->position_interval == 0) {
         return;
     }
 
-    g_debug ("Device %s has state %s", self->priv->udn, self->priv->state);
-
-    GUPnPServiceProxy *cm_proxy = g_hash_table_lookup (self->priv->services, CONNECTION_MANAGER);
-
-    action = gupnp_service_proxy_action_new ("GetProtocolInfo", NULL);
-    gupnp_service_proxy_call_action_async (cm_proxy, action, NULL, korva_upnp_device_on_get_protocol_info, self);
-    gupnp_service_proxy_action_unref (action);
+    self->priv->position_id = g_timeout_add_full (korva_priority_get (KORVA_PRIORITY_CLASS_CONTROL),
+                                                  self->priv->position_interval,
+                                                  korva_upnp_device_on_position_timeout,
+                                                  self,
+                                                  NULL);
 }
 
 static void
-korva_upnp_device_on_get_protocol_info (GObject *source, GAsyncResult *res, gpointer user_data)
+korva_upnp_device_poll_position (KorvaUPnPDevice *self)
 {
-    KorvaUPnPDevice *self = KORVA_UPNP_DEVICE (user_data);
-    GError *error = NULL;
-    const char *variable;
-
-    GUPnPServiceProxyAction *action =
-        gupnp_service_proxy_call_action_finish (GUPNP_SERVICE_PROXY (source), res, &error);
-
-    if (error != NULL) {
-        error = g_error_new (KORVA_UPNP_DEVICE_ERROR,
-                             MISSING_SERVICE,
-                             "Device %s did not properly reply to GetProtocolInfo call",
-                             self->priv->udn);
-        korva_upnp_device_introspection_finish (self, error);
+    GUPnPServiceProxy *proxy;
+    GUPnPServiceProxyAction *action;
 
+    proxy = self->priv->av_transport;
+    if (proxy == NULL) {
         return;
     }
 
-    variable = self->priv->device_type == DEVICE_TYPE_PLAYER ? "Sink" : "Source";
+    self->priv->position_pending = TRUE;
+    action = gupnp_service_proxy_action_new ("GetPositionInfo", "InstanceID", G_TYPE_UINT, 0, NULL);
+    korva_upnp_device_call_action (self,
+                                   proxy,
+                                   "GetPositionInfo",
+                                   action,
+                                   korva_upnp_device_on_get_position_info,
+                                   self);
+    gupnp_service_proxy_action_unref (action);
+}
 
-    gupnp_service_proxy_action_get_result (action, &error, variable, G_TYPE_STRING, &self->priv->protocol_info, NULL);
+/*
+ * Track the position of the current push, starting with short intervals that
+ * grow while playback goes on as expected.
+ */
+static void
+korva_upnp_device_start_position_polling (KorvaUPnPDevice *self)
+{
+    self->priv->position_interval = KORVA_UPNP_DEVICE_POSITION_FAST_INTERVAL;
 
-    if (self->priv->protocol_info == NULL || error != NULL) {
-        g_clear_error (&error);
-        error = g_error_new (KORVA_UPNP_DEVICE_ERROR,
-                             MISSING_SERVICE,
-                             "Device %s did not properly reply to GetProtocolInfo call",
-                             self->priv->udn);
-        korva_upnp_device_introspection_finish (self, error);
+    if (self->priv->position_id != 0) {
+        g_source_remove (self->priv->position_id);
+        self->priv->position_id = 0;
+    }
 
+    /* The reply of a running call schedules the next one */
+    if (self->priv->position_pending) {
         return;
     }
-    korva_upnp_device_get_icon (self);
+
+    self->priv->position_id = g_timeout_add_full (korva_priority_get (KORVA_PRIORITY_CLASS_CONTROL),
+                                                  self->priv->position_interval,
+                                                  korva_upnp_device_on_position_timeout,
+                                                  self,
+                                                  NULL);
 }
 
 static void
-korva_upnp_device_introspection_finish (KorvaUPnPDevice *self,
-                                        GError          *error)
+korva_upnp_device_stop_position_polling (KorvaUPnPDevice *self)
 {
-    if (error != NULL) {
-        g_task_return_error (self->priv->result, error);
-    } else {
-        g_task_return_boolean (self->priv->result, TRUE);
+    self->priv->position_interval = 0;
+
+    if (self->priv->position_id != 0) {
+        g_source_remove (self->priv->position_id);
+        self->priv->position_id = 0;
     }
-    g_object_unref (self->priv->result);
 }
 
-typedef struct {
-    KorvaUPnPDevice *self;
-    int state;
-} GetIconData;
-
+/* Switch to @state and announce it if it is a change */
 static void
-korva_upnp_device_get_icon (KorvaUPnPDevice *self)
+korva_upnp_device_set_state (KorvaUPnPDevice *self, KorvaUPnPTransportState state)
 {
-    /* icon was already in cache */
-    if (self->priv->icon_uri != NULL) {
-        korva_upnp_device_introspection_success (self);
-
+    if (state == self->priv->state) {
         return;
     }
 
-    GetIconData *data = g_new0 (GetIconData, 1);
-    data->self = g_object_ref (self);
-    data->state = 0;
+    self->priv->state = state;
+    g_debug ("Device %s has new state '%s'", self->priv->udn, transport_state_names[state]);
+    korva_upnp_device_schedule_changed (self);
 
-    gupnp_device_info_get_icon_async (self->priv->info,
-                                      "image/png",
-                                      -1,
-                                      64,
-                                      64,
-                                      TRUE,
-                                      NULL,
-                                      korva_upnp_device_on_icon_ready,
-                                      data);
+    if (self->priv->current_tag != NULL) {
+        if (state == AV_STATE_PLAYING || state == AV_STATE_TRANSITIONING) {
+            korva_upnp_device_start_position_polling (self);
+        } else {
+            korva_upnp_device_stop_position_polling (self);
+        }
+    }
 }
 
 static void
-korva_upnp_device_on_icon_ready (GObject *source, GAsyncResult *res, gpointer user_data)
+korva_upnp_device_on_transport_info_refreshed (GObject *source, GAsyncResult *res, gpointer user_data)
 {
-    GetIconData *data = (GetIconData *) user_data;
-    KorvaUPnPDevice *self = data->self;
-    g_autoptr (GError) error = NULL;
-    g_autoptr (GBytes) icon =
-        gupnp_device_info_get_icon_finish (GUPNP_DEVICE_INFO (source), res, NULL, NULL, NULL, NULL, &error);
+    KorvaUPnPDevice *self = KORVA_UPNP_DEVICE (user_data);
+    GUPnPServiceProxyAction *action;
+    GError *error = NULL;
+    char *state = NULL;
 
-    if (icon == NULL) {
-        if (error != NULL) {
-            g_debug ("Failed to download icon: %s", error->message);
-        }
+    action = korva_upnp_device_call_action_finish (source, res, &error);
+    if (error == NULL) {
+        gupnp_service_proxy_action_get_result (action,
+                                               &error,
+                                               "CurrentTransportState",
+                                               G_TYPE_STRING,
+                                               &state,
+                                               NULL);
+    }
 
+    if (error != NULL || state == NULL) {
+        g_debug ("Failed to get transport state of device %s: %s",
+                 self->priv->udn,
+                 error != NULL ? error->message : "No state");
         g_clear_error (&error);
 
-        // We were called with PNG, do a second round with JPEG
-        if (data->state == 0) {
-            data->state = 1;
-            gupnp_device_info_get_icon_async (self->priv->info,
-                                              "image/jpeg",
-                                              -1,
-                                              64,
-                                              64,
-                                              TRUE,
-                                              NULL,
-                                              korva_upnp_device_on_icon_ready,
-                                              data);
-        } else {
-            g_object_unref (data->self);
-            g_free (data);
+        return;
+    }
 
-            g_debug ("Could not find any icon, will use default");
-            self->priv->icon_uri = korva_icon_cache_get_default (self->priv->device_type);
-            korva_upnp_device_introspection_success (self);
-        }
+    korva_upnp_device_set_state (self, korva_upnp_device_parse_state (state));
+    g_free (state);
+}
 
-        return;
+static gboolean
+korva_upnp_device_on_unsubscribe_timeout (gpointer user_data)
+{
+    KorvaUPnPDevice *self = KORVA_UPNP_DEVICE (user_data);
+    GUPnPServiceProxy *proxy;
+
+    self->priv->unsubscribe_id = 0;
+    self->priv->subscribed = FALSE;
+
+    proxy = self->priv->av_transport;
+    if (proxy == NULL) {
+        return FALSE;
     }
 
-    g_autofree char *path = NULL;
-    g_autoptr (GFile) file;
+    g_debug ("Unsubscribing from LastChange of device %s", self->priv->udn);
+    gupnp_service_proxy_set_subscribed (proxy, FALSE);
+
+    return FALSE;
+}
+
+/*
+ * Hold the LastChange subscription only while something is pushed to the
+ * device or a client watches it; renewals and events of all the other
+ * renderers on the network are of no use. The transport state of a device
+ * that is not subscribed gets stale, so it is fetched with GetTransportInfo
+ * when the subscription starts.
+ */
+static void
+korva_upnp_device_update_subscription (KorvaUPnPDevice *self)
+{
+    GUPnPServiceProxy *proxy;
+    GUPnPServiceProxyAction *action;
+    gboolean wanted;
+
+    proxy = self->priv->av_transport;
+    if (proxy == NULL) {
+        return;
+    }
 
-    path = korva_icon_cache_create_path (self->priv->udn);
-    file = g_file_new_for_path (path);
+    wanted = self->priv->watchers > 0 ||
+             self->priv->current_tag != NULL ||
+             self->priv->command_running ||
+             !g_queue_is_empty (&self->priv->commands);
+
+    if (!wanted) {
+        if (self->priv->subscribed && self->priv->unsubscribe_id == 0) {
+            self->priv->unsubscribe_id = g_timeout_add_seconds_full (korva_priority_get (KORVA_PRIORITY_CLASS_HOUSEKEEPING),
+                                                                     KORVA_UPNP_DEVICE_SUBSCRIPTION_GRACE,
+                                                                     korva_upnp_device_on_unsubscribe_timeout,
+                                                                     self,
+                                                                     NULL);
+        }
 
-    gsize size = 0;
-    gconstpointer icon_data = g_bytes_get_data (icon, &size);
+        return;
+    }
 
-    g_file_replace_contents (file, icon_data, size, NULL, FALSE, G_FILE_CREATE_NONE, NULL, NULL, &error);
-    if (error == NULL) {
-        self->priv->icon_uri = g_file_get_uri (file);
-    } else {
-        g_debug ("Could not write icon %s: %s", path, error->message);
+    if (self->priv->unsubscribe_id != 0) {
+        g_source_remove (self->priv->unsubscribe_id);
+        self->priv->unsubscribe_id = 0;
     }
 
-    if (self->priv->icon_uri == NULL) {
-        self->priv->icon_uri = korva_icon_cache_get_default (self->priv->device_type);
+    if (self->priv->subscribed) {
+        return;
     }
 
-    g_object_unref (data->self);
-    g_free (data);
+    g_debug ("Subscribing to LastChange of device %s", self->priv->udn);
+    self->priv->subscribed = TRUE;
+    gupnp_service_proxy_set_subscribed (proxy, TRUE);
 
-    korva_upnp_device_introspection_finish (self, NULL);
+    action = gupnp_service_proxy_action_new ("GetTransportInfo", "InstanceID", G_TYPE_UINT, 0, NULL);
+    korva_upnp_device_call_action (self,
+                                   proxy,
+                                   "GetTransportInfo",
+                                   action,
+                                   korva_upnp_device_on_transport_info_refreshed,
+                                   self);
+    gupnp_service_proxy_action_unref (action);
 }
 
 static void
@@ -710,48 +1799,58 @@ korva_upnp_device_on_last_change (GUPnPServiceProxy *proxy,
                                   gpointer           user_data)
 {
     KorvaUPnPDevice *self = KORVA_UPNP_DEVICE (user_data);
-    char *status = NULL;
-    char *uri = NULL;
-    gboolean result = FALSE;
-    GError *error = NULL;
-
-    result = gupnp_last_change_parser_parse_last_change (self->priv->last_change_parser,
-                                                         0,
-                                                         g_value_get_string (value),
-                                                         &error,
-                                                         "TransportState", G_TYPE_STRING, &status,
-                                                         "AVTransportURI", G_TYPE_STRING, &uri,
-                                                         NULL);
+    KorvaUPnPLastChangeValue values[] = {
+        { "TransportState", NULL, 0 },
+        { "AVTransportURI", NULL, 0 }
+    };
+    const KorvaUPnPLastChangeValue *status = &values[0];
+    const KorvaUPnPLastChangeValue *uri = &values[1];
 
-    if (!result) {
-        g_warning ("Failed to parse LastState: %s", error->message);
-        g_error_free (error);
+    if (!korva_upnp_last_change_scan (g_value_get_string (value),
+                                      0,
+                                      values,
+                                      G_N_ELEMENTS (values))) {
+        g_warning ("Failed to parse LastChange event of device %s", self->priv->udn);
 
         return;
     }
 
-    if (status != NULL) {
-        if (self->priv->state != NULL) {
-            if (g_ascii_strcasecmp (self->priv->state, status) == 0) {
-                g_free (status);
+    if (status->value != NULL) {
+        KorvaUPnPTransportState state = AV_STATE_UNKNOWN;
+        int i;
+
+        for (i = 0; i < AV_STATE_COUNT; i++) {
+            if (korva_upnp_last_change_value_equal (status, transport_state_names[i], TRUE)) {
+                state = i;
 
-                return;
+                break;
             }
-            g_free (self->priv->state);
         }
-        self->priv->state = status;
-        g_debug ("Device %s has new state '%s'", self->priv->udn, self->priv->state);
+
+        korva_upnp_device_set_state (self, state);
     }
 
-    if (uri != NULL &&
+    if (uri->value != NULL &&
         self->priv->current_uri != NULL &&
-        g_strcmp0 (uri, self->priv->current_uri) != 0) {
+        !korva_upnp_last_change_value_equal (uri, self->priv->current_uri, FALSE)) {
 
         g_debug ("Device has been modified externally.");
+        self->priv->externally_modified = TRUE;
         korva_upnp_device_drop_current_file (self);
     }
 }
 
+/**
+ * korva_upnp_device_get_proxy:
+ * @self: A #KorvaUPnPDevice
+ *
+ * Returns: (transfer none): The proxy used to talk to the device.
+ */
+GUPnPDeviceProxy *
+korva_upnp_device_get_proxy (KorvaUPnPDevice *self)
+{
+    return self->priv->proxy;
+}
 
 void
 korva_upnp_device_add_proxy (KorvaUPnPDevice *self, GUPnPDeviceProxy *proxy)
@@ -763,14 +1862,16 @@ korva_upnp_device_add_proxy (KorvaUPnPDevice *self, GUPnPDeviceProxy *proxy)
 gboolean
 korva_upnp_device_remove_proxy (KorvaUPnPDevice *self, GUPnPDeviceProxy *proxy)
 {
-    GList *it, *keys = NULL;
+    GList *it;
     KorvaUPnPFileServer *server;
+    GUPnPServiceProxy *service;
+    g_autofree char *ip_address = NULL;
 
     it = g_list_find (self->priv->other_proxies, proxy);
     if (it != NULL) {
-        self->priv->other_proxies = g_list_remove_link (self->priv->other_proxies,
-                                                        it);
         g_object_unref (G_OBJECT (it->data));
+        self->priv->other_proxies = g_list_delete_link (self->priv->other_proxies,
+                                                        it);
 
         return FALSE;
     }
@@ -781,39 +1882,54 @@ korva_upnp_device_remove_proxy (KorvaUPnPDevice *self, GUPnPDeviceProxy *proxy)
         return FALSE;
     }
 
-    server = korva_upnp_file_server_get_default ();
-    korva_upnp_file_server_unhost_by_peer (server, self->priv->ip_address);
-    g_object_unref (server);
-
     /* That's the only proxy associated with this.
      * We can destroy the device. */
     if (self->priv->other_proxies == NULL) {
+        server = korva_upnp_file_server_get_default ();
+        korva_upnp_file_server_unhost_by_peer (server, self->priv->ip_address);
+        g_object_unref (server);
+
         return TRUE;
     }
 
     /* Just use the first other proxy to communicate with the device */
     g_object_unref (self->priv->proxy);
     self->priv->proxy = GUPNP_DEVICE_PROXY (self->priv->other_proxies->data);
-    self->priv->other_proxies = g_list_remove_link (self->priv->other_proxies,
+    self->priv->other_proxies = g_list_delete_link (self->priv->other_proxies,
                                                     self->priv->other_proxies);
 
+    ip_address = g_strdup (self->priv->ip_address);
     korva_upnp_device_update_ip_address (self);
 
-    /* and update the service proxies */
-    it = keys = g_hash_table_get_keys (self->priv->services);
-    while (it != NULL) {
-        GUPnPServiceInfo *info;
+    /* Files are hosted per address, so they are still of use if the device
+     * is reached at the same one through the other proxy */
+    if (g_strcmp0 (ip_address, self->priv->ip_address) != 0) {
+        server = korva_upnp_file_server_get_default ();
+        korva_upnp_file_server_unhost_by_peer (server, ip_address);
+        g_object_unref (server);
+    }
 
-        info = gupnp_device_info_get_service (self->priv->info,
-                                              (const char *) it->data);
-        g_hash_table_replace (self->priv->services,
-                              it->data,
-                              GUPNP_SERVICE_PROXY (info));
+    /* and update the service proxies */
+    if (self->priv->connection_manager != NULL) {
+        g_object_unref (self->priv->connection_manager);
+        self->priv->connection_manager =
+            GUPNP_SERVICE_PROXY (gupnp_device_info_get_service (self->priv->info, CONNECTION_MANAGER));
+    }
 
-        it = it->next;
+    service = NULL;
+    if (self->priv->av_transport != NULL) {
+        korva_upnp_device_clear_av_transport (self);
+        service = GUPNP_SERVICE_PROXY (gupnp_device_info_get_service (self->priv->info, AV_TRANSPORT));
+        self->priv->av_transport = service;
     }
 
-    g_list_free (keys);
+    if (service != NULL) {
+        gupnp_service_proxy_add_notify (service,
+                                        "LastChange", G_TYPE_STRING,
+                                        korva_upnp_device_on_last_change,
+                                        self);
+        gupnp_service_proxy_set_subscribed (service, self->priv->subscribed);
+    }
 
     return FALSE;
 }
@@ -827,6 +1943,7 @@ typedef struct {
     gboolean         unshare;
     GFile           *file;
     gboolean         transport_locked;
+    KorvaPushTrace  *trace;
 } HostPathData;
 
 static void
@@ -835,10 +1952,66 @@ host_path_data_free (HostPathData *data)
     g_free (data->uri);
     g_free (data->meta_data);
     g_clear_object (&data->file);
+    g_clear_pointer (&data->trace, korva_push_trace_unref);
 
     g_free (data);
 }
 
+/*
+ * Finish the running push or unshare and start the next queued one. The task
+ * must have been returned already.
+ */
+static void
+korva_upnp_device_command_done (HostPathData *data)
+{
+    KorvaUPnPDevice *self = data->device;
+    GTask *result = data->result;
+
+    host_path_data_free (data);
+    self->priv->command_running = FALSE;
+    self->priv->running_tag = NULL;
+    korva_upnp_device_run_next_command (self);
+    korva_upnp_device_update_subscription (self);
+
+    /* The task keeps the device alive until here */
+    g_object_unref (result);
+}
+
+/*
+ * Drop all pushes that did not start yet; a newer push or an unshare
+ * supersedes them. Returns whether one of them was @tag.
+ */
+static gboolean
+korva_upnp_device_cancel_queued_pushes (KorvaUPnPDevice *self, const char *tag)
+{
+    gboolean found = FALSE;
+    GList *it = self->priv->commands.head;
+
+    while (it != NULL) {
+        HostPathData *data = (HostPathData *) it->data;
+        GList *next = it->next;
+
+        if (!data->unshare) {
+            g_queue_delete_link (&self->priv->commands, it);
+            found |= g_strcmp0 (g_task_get_task_data (data->result), tag) == 0;
+
+            g_debug ("Cancelling superseded push %s",
+                     (const char *) g_task_get_task_data (data->result));
+            g_task_return_new_error (data->result,
+                                     KORVA_CONTROLLER1_ERROR,
+                                     KORVA_CONTROLLER1_ERROR_CANCELLED,
+                                     "The push was superseded by a newer request");
+            g_object_unref (data->result);
+            g_hash_table_destroy (data->params);
+            host_path_data_free (data);
+        }
+
+        it = next;
+    }
+
+    return found;
+}
+
 static void
 korva_upnp_device_on_play (GObject *source, GAsyncResult *res, gpointer user_data)
 {
@@ -847,13 +2020,15 @@ korva_upnp_device_on_play (GObject *source, GAsyncResult *res, gpointer user_dat
     GTask *result = data->result;
 
     GUPnPServiceProxyAction *action =
-        gupnp_service_proxy_call_action_finish (GUPNP_SERVICE_PROXY (source), res, &error);
+        korva_upnp_device_call_action_finish (source, res, &error);
 
     // The actual SOAP error is evaluated only in the action get function
     if (error == NULL) {
         gupnp_service_proxy_action_get_result (action, &error, NULL);
     }
 
+    korva_push_trace_end (data->trace, KORVA_PUSH_TRACE_PHASE_PLAY);
+
     if (error != NULL) {
         KorvaUPnPFileServer *server;
 
@@ -865,16 +2040,17 @@ korva_upnp_device_on_play (GObject *source, GAsyncResult *res, gpointer user_dat
 
         g_task_return_error (result, error);
     } else {
-        char *data = g_strdup (g_task_get_task_data (result));
-        g_task_return_pointer (result, data, g_free);
+        data->device->priv->current_tag = g_strdup (g_task_get_task_data (result));
+        data->device->priv->externally_modified = FALSE;
+        korva_upnp_device_schedule_changed (data->device);
+        korva_upnp_device_start_position_polling (data->device);
+        data->device->priv->current_uri = g_strdup (data->uri);
+        data->device->priv->current_file = data->file;
+        data->file = NULL;
+        g_task_return_pointer (result, g_strdup (g_task_get_task_data (result)), g_free);
     }
 
-    data->device->priv->current_uri = g_strdup (data->uri);
-    data->device->priv->current_file = data->file;
-    data->file = NULL;
-
-    host_path_data_free (data);
-    g_object_unref (result);
+    korva_upnp_device_command_done (data);
 }
 
 static void
@@ -886,13 +2062,15 @@ korva_upnp_device_on_stop (GObject *source, GAsyncResult *res, gpointer user_dat
     GTask *result = data->result;
 
     GUPnPServiceProxyAction *action =
-        gupnp_service_proxy_call_action_finish (GUPNP_SERVICE_PROXY (source), res, &error);
+        korva_upnp_device_call_action_finish (source, res, &error);
 
     // The actual SOAP error is evaluated only in the action get function
     if (error == NULL) {
         gupnp_service_proxy_action_get_result (action, &error, NULL);
     }
 
+    korva_push_trace_end (data->trace, KORVA_PUSH_TRACE_PHASE_STOP);
+
     if (error != NULL) {
         KorvaUPnPFileServer *server;
 
@@ -918,17 +2096,18 @@ korva_upnp_device_on_stop (GObject *source, GAsyncResult *res, gpointer user_dat
                                                  data->meta_data,
                                                  NULL);
 
-        gupnp_service_proxy_call_action_async (proxy,
-                                               action,
-                                               NULL,
-                                               korva_upnp_device_on_set_av_transport_uri,
-                                               user_data);
+        korva_push_trace_begin (data->trace, KORVA_PUSH_TRACE_PHASE_SET_AV_TRANSPORT_URI);
+        korva_upnp_device_call_action (data->device,
+                                       proxy,
+                                       "SetAVTransportURI",
+                                       action,
+                                       korva_upnp_device_on_set_av_transport_uri,
+                                       user_data);
 
         return;
     }
 
-    host_path_data_free (data);
-    g_object_unref (result);
+    korva_upnp_device_command_done (data);
 }
 
 static void
@@ -941,13 +2120,15 @@ korva_upnp_device_on_set_av_transport_uri (GObject *source, GAsyncResult *res, g
     GTask *result = data->result;
 
     GUPnPServiceProxyAction *action =
-        gupnp_service_proxy_call_action_finish (GUPNP_SERVICE_PROXY (source), res, &error);
+        korva_upnp_device_call_action_finish (source, res, &error);
 
     // The actual SOAP error is evaluated only in the action get function
     if (error == NULL) {
         gupnp_service_proxy_action_get_result (action, &error, NULL);
     }
 
+    korva_push_trace_end (data->trace, KORVA_PUSH_TRACE_PHASE_SET_AV_TRANSPORT_URI);
+
     if (error != NULL) {
         /* Transport locked and we didn't come from a transport_locked state already */
         if (error->code == 705 && !data->transport_locked) {
@@ -957,7 +2138,8 @@ korva_upnp_device_on_set_av_transport_uri (GObject *source, GAsyncResult *res, g
             g_autoptr (GUPnPServiceProxyAction) action =
                 gupnp_service_proxy_action_new ("Stop", "InstanceID", G_TYPE_STRING, "0", NULL);
 
-            gupnp_service_proxy_call_action_async (proxy, action, NULL, korva_upnp_device_on_stop, user_data);
+            korva_push_trace_begin (data->trace, KORVA_PUSH_TRACE_PHASE_STOP);
+            korva_upnp_device_call_action (self, proxy, "Stop", action, korva_upnp_device_on_stop, user_data);
 
             g_error_free (error);
 
@@ -987,9 +2169,9 @@ korva_upnp_device_on_set_av_transport_uri (GObject *source, GAsyncResult *res, g
         goto out;
     }
 
-    if (g_ascii_strcasecmp (self->priv->state, AV_STATE_STOPPED) == 0 ||
-        g_ascii_strcasecmp (self->priv->state, AV_STATE_NO_MEDIA_PRESENT) == 0 ||
-        g_ascii_strcasecmp (self->priv->state, AV_STATE_PAUSED_PLAYBACK) == 0) {
+    if (self->priv->state == AV_STATE_STOPPED ||
+        self->priv->state == AV_STATE_NO_MEDIA_PRESENT ||
+        self->priv->state == AV_STATE_PAUSED_PLAYBACK) {
         g_autoptr (GUPnPServiceProxyAction) action = gupnp_service_proxy_action_new ("Play",
                                                                                      "InstanceID",
                                                                                      G_TYPE_STRING,
@@ -999,18 +2181,23 @@ korva_upnp_device_on_set_av_transport_uri (GObject *source, GAsyncResult *res, g
                                                                                      1.0f,
                                                                                      NULL);
 
-        gupnp_service_proxy_call_action_async (proxy, action, NULL, korva_upnp_device_on_play, user_data);
+        korva_push_trace_begin (data->trace, KORVA_PUSH_TRACE_PHASE_PLAY);
+        korva_upnp_device_call_action (self, proxy, "Play", action, korva_upnp_device_on_play, user_data);
 
         return;
     }
 
+    data->device->priv->current_tag = g_strdup (g_task_get_task_data (result));
+    data->device->priv->externally_modified = FALSE;
+    korva_upnp_device_schedule_changed (data->device);
+    korva_upnp_device_start_position_polling (data->device);
     data->device->priv->current_uri = g_strdup (data->uri);
     data->device->priv->current_file = data->file;
     data->file = NULL;
+    g_task_return_pointer (result, g_strdup (g_task_get_task_data (result)), g_free);
 
 out:
-    host_path_data_free (data);
-    g_object_unref (result);
+    korva_upnp_device_command_done (data);
 }
 
 static void
@@ -1027,6 +2214,10 @@ korva_upnp_device_drop_current_file (KorvaUPnPDevice *self)
         g_clear_pointer (&self->priv->current_tag, g_free);
         g_clear_pointer (&self->priv->current_uri, g_free);
         g_clear_object (&self->priv->current_file);
+        korva_upnp_device_schedule_changed (self);
+        korva_upnp_device_stop_position_polling (self);
+        self->priv->position_updated = 0;
+        korva_upnp_device_update_subscription (self);
     }
 
     g_object_unref (server);
@@ -1041,13 +2232,8 @@ korva_upnp_device_on_host_file_async (GObject      *source,
     GHashTable *params;
     HostPathData *data = (HostPathData *) user_data;
     GUPnPServiceProxy *proxy;
-    GUPnPDIDLLiteWriter *writer;
-    GUPnPDIDLLiteObject *object;
-    GUPnPDIDLLiteResource *resource, *compat_resource;
-    GUPnPProtocolInfo *protocol_info;
-    const char *title, *content_type, *dlna_profile = NULL;
+    const char *content_type, *dlna_profile = NULL;
     GVariant *value;
-    guint64 size;
     g_autoptr (GUPnPServiceProxyAction) action = NULL;
 
     data->uri = korva_upnp_file_server_host_file_finish (KORVA_UPNP_FILE_SERVER (source),
@@ -1060,41 +2246,14 @@ korva_upnp_device_on_host_file_async (GObject      *source,
         goto out;
     }
 
-    value = g_hash_table_lookup (params, "Title");
-    title = g_variant_get_string (value, NULL);
     value = g_hash_table_lookup (params, "ContentType");
     content_type = g_variant_get_string (value, NULL);
-    value = g_hash_table_lookup (params, "Size");
-    size = g_variant_get_uint64 (value);
     value = g_hash_table_lookup (params, "DLNAProfile");
     if (value != NULL) {
         dlna_profile = g_variant_get_string (value, NULL);
     }
 
-    writer = gupnp_didl_lite_writer_new (NULL);
-    object = GUPNP_DIDL_LITE_OBJECT (gupnp_didl_lite_writer_add_item (writer));
-    gupnp_didl_lite_object_set_title (object, title);
-    gupnp_didl_lite_object_set_id (object, "1");
-    gupnp_didl_lite_object_set_parent_id (object, "-1");
-    gupnp_didl_lite_object_set_restricted (object, TRUE);
-    resource = gupnp_didl_lite_object_add_resource (object);
-    gupnp_didl_lite_resource_set_uri (resource, data->uri);
-    gupnp_didl_lite_resource_set_size64 (resource, size);
-    protocol_info = gupnp_protocol_info_new_from_string ("http-get:*:*:DLNA.ORG_CI=0;DLNA.ORG_OP=01", NULL);
-    gupnp_protocol_info_set_mime_type (protocol_info, content_type);
-    if (dlna_profile != NULL) {
-        gupnp_protocol_info_set_dlna_profile (protocol_info, dlna_profile);
-    }
-    gupnp_didl_lite_resource_set_protocol_info (resource, protocol_info);
-
-    compat_resource = gupnp_didl_lite_object_get_compat_resource (object,
-                                                                  data->device->priv->protocol_info,
-                                                                  FALSE);
-    data->meta_data = gupnp_didl_lite_writer_get_string (writer);
-    g_object_unref (object);
-    g_object_unref (writer);
-
-    if (compat_resource == NULL) {
+    if (!korva_upnp_sink_caps_is_compatible (data->device->priv->sink_caps, content_type, dlna_profile)) {
         g_set_error_literal (&error,
                              KORVA_CONTROLLER1_ERROR,
                              KORVA_CONTROLLER1_ERROR_NOT_COMPATIBLE,
@@ -1107,9 +2266,24 @@ korva_upnp_device_on_host_file_async (GObject      *source,
 
         goto out;
     }
-    g_object_unref (compat_resource);
 
-    proxy = g_hash_table_lookup (data->device->priv->services, AV_TRANSPORT);
+    /* Only built for the first push of the file through this interface */
+    korva_push_trace_begin (data->trace, KORVA_PUSH_TRACE_PHASE_DIDL_LITE);
+    data->meta_data = korva_upnp_file_server_get_didl_lite (KORVA_UPNP_FILE_SERVER (source),
+                                                            data->file,
+                                                            data->uri);
+    korva_push_trace_end (data->trace, KORVA_PUSH_TRACE_PHASE_DIDL_LITE);
+    if (data->meta_data == NULL) {
+        g_set_error_literal (&error,
+                             KORVA_CONTROLLER1_ERROR,
+                             KORVA_CONTROLLER1_ERROR_NOT_ACCESSIBLE,
+                             "The file is no longer shared");
+        g_task_return_error (data->result, error);
+
+        goto out;
+    }
+
+    proxy = data->device->priv->av_transport;
 
     action = gupnp_service_proxy_action_new ("SetAVTransportURI",
                                              "InstanceID",
@@ -1123,12 +2297,101 @@ korva_upnp_device_on_host_file_async (GObject      *source,
                                              data->meta_data,
                                              NULL);
 
-    gupnp_service_proxy_call_action_async (proxy, action, NULL, korva_upnp_device_on_set_av_transport_uri, user_data);
+    korva_push_trace_begin (data->trace, KORVA_PUSH_TRACE_PHASE_SET_AV_TRANSPORT_URI);
+    korva_upnp_device_call_action (data->device,
+                                   proxy,
+                                   "SetAVTransportURI",
+                                   action,
+                                   korva_upnp_device_on_set_av_transport_uri,
+                                   user_data);
 
     return;
 out:
-    g_object_unref (data->result);
-    host_path_data_free (data);
+    korva_upnp_device_command_done (data);
+}
+
+/*
+ * Start the next queued push or unshare unless one is running already. Only
+ * one command talks to the device at a time so the SetAVTransportURI, Stop and
+ * Play chains of different pushes cannot interleave.
+ */
+static void
+korva_upnp_device_run_next_command (KorvaUPnPDevice *self)
+{
+    HostPathData *data;
+    KorvaUPnPFileServer *server;
+    GUPnPContext *context;
+    GUPnPServiceProxy *proxy;
+    const char *tag;
+
+    if (self->priv->command_running) {
+        return;
+    }
+
+    data = g_queue_pop_head (&self->priv->commands);
+    if (data == NULL) {
+        return;
+    }
+
+    self->priv->command_running = TRUE;
+    tag = g_task_get_task_data (data->result);
+    self->priv->running_tag = tag;
+
+    /* Do not keep the caller waiting for a device that is known to hang */
+    if (!korva_upnp_device_is_responsive (self)) {
+        g_task_return_new_error (data->result,
+                                 KORVA_CONTROLLER1_ERROR,
+                                 KORVA_CONTROLLER1_ERROR_TIMEOUT,
+                                 "Device %s is not responding",
+                                 self->priv->udn);
+        if (!data->unshare) {
+            g_hash_table_destroy (data->params);
+        }
+        korva_upnp_device_command_done (data);
+
+        return;
+    }
+
+    if (data->unshare) {
+        if (g_strcmp0 (self->priv->current_tag, tag) != 0) {
+            g_task_return_new_error (data->result,
+                                     KORVA_CONTROLLER1_ERROR,
+                                     KORVA_CONTROLLER1_ERROR_NO_SUCH_TRANSFER,
+                                     "Sharing operation '%s' is not valid",
+                                     tag);
+            korva_upnp_device_command_done (data);
+
+            return;
+        }
+
+        data->file = g_object_ref (self->priv->current_file);
+
+        proxy = self->priv->av_transport;
+        g_autoptr (GUPnPServiceProxyAction) action =
+            gupnp_service_proxy_action_new ("Stop", "InstanceID", G_TYPE_STRING, "0", NULL);
+
+        korva_upnp_device_call_action (self, proxy, "Stop", action, korva_upnp_device_on_stop, data);
+
+        return;
+    }
+
+    /* Have the connection ready by the time the file is hosted */
+    korva_upnp_device_preconnect (self);
+
+    context = gupnp_device_info_get_context (self->priv->info);
+    server = korva_upnp_file_server_get_default ();
+
+    korva_upnp_device_drop_current_file (self);
+    korva_upnp_file_server_host_file_async (server,
+                                            data->file,
+                                            data->params,
+                                            gssdp_client_get_host_ip (GSSDP_CLIENT (context)),
+                                            self->priv->ip_address,
+                                            data->trace,
+                                            g_task_get_cancellable (data->result),
+                                            korva_upnp_device_on_host_file_async,
+                                            data);
+    g_object_unref (server);
 }
 
 static void
@@ -1156,13 +2419,10 @@ korva_upnp_device_push_async (KorvaDevice        *device,
     GVariant *value;
     GHashTable *params;
     GError *error = NULL;
-    KorvaUPnPFileServer *server;
-    GFile *file = NULL;
-    GUPnPContext *context;
-    GVariant *uri;
+    GVariant *uri, *uris, *content_type, *dlna_profile;
     HostPathData *host_path_data;
-    const char *iface;
-    char *raw_tag;
+    g_autofree char *file_uri = NULL;
+    char *raw_tag, *tag;
 
     self = KORVA_UPNP_DEVICE (device);
     result = g_task_new (device, cancellable, callback, user_data);
@@ -1178,8 +2438,31 @@ korva_upnp_device_push_async (KorvaDevice        *device,
     }
 
     uri = g_hash_table_lookup (params, "URI");
-    if (uri == NULL) {
+    uris = g_hash_table_lookup (params, "URIs");
+    if (uris != NULL &&
+        (!g_variant_is_of_type (uris, G_VARIANT_TYPE_STRING_ARRAY) || g_variant_n_children (uris) == 0)) {
+        error = g_error_new (KORVA_CONTROLLER1_ERROR,
+                             KORVA_CONTROLLER1_ERROR_INVALID_ARGS,
+                             "'Push' to device %s needs a non-empty list of strings as URIs",
+                             korva_device_get_uid (device));
+
+        g_task_return_error (result, error);
+        g_object_unref (result);
+
+        goto out;
+    }
+
+    if (uris != NULL) {
+        g_autofree const char **strv = g_variant_get_strv (uris, NULL);
+        g_autofree char *list = g_strjoinv ("\n", (char **) strv);
+        g_autofree char *hash = g_compute_checksum_for_string (G_CHECKSUM_MD5, list, -1);
 
+        /* A list of files is hosted as a playlist that has no file of its
+         * own, so it gets a made-up one that is unique to the list */
+        file_uri = g_strconcat ("korva-playlist:", hash, NULL);
+    } else if (uri != NULL) {
+        file_uri = g_variant_dup_string (uri, NULL);
+    } else {
         error = g_error_new (KORVA_CONTROLLER1_ERROR,
                              KORVA_CONTROLLER1_ERROR_INVALID_ARGS,
                              "'Push' to device %s is missing mandatory URI key",
@@ -1191,38 +2474,47 @@ korva_upnp_device_push_async (KorvaDevice        *device,
         goto out;
     }
 
-    context = gupnp_device_info_get_context (self->priv->info);
-    iface = gssdp_client_get_host_ip (GSSDP_CLIENT (context));
-    server = korva_upnp_file_server_get_default ();
-    file = g_file_new_for_uri (g_variant_get_string (uri, NULL));
-    raw_tag = g_strconcat (g_variant_get_string (uri, NULL), "\t", self->priv->udn, NULL);
+    /* If the client already told us what it is pushing, reject incompatible
+     * files before they are hosted */
+    content_type = g_hash_table_lookup (params, "ContentType");
+    dlna_profile = g_hash_table_lookup (params, "DLNAProfile");
+    if (content_type != NULL &&
+        !korva_upnp_sink_caps_is_compatible (self->priv->sink_caps,
+                                             g_variant_get_string (content_type, NULL),
+                                             dlna_profile ? g_variant_get_string (dlna_profile, NULL) : NULL)) {
+        g_task_return_new_error (result,
+                                 KORVA_CONTROLLER1_ERROR,
+                                 KORVA_CONTROLLER1_ERROR_NOT_COMPATIBLE,
+                                 "The file is not compatible with the selected renderer");
+        g_object_unref (result);
+
+        goto out;
+    }
+
+    raw_tag = g_strconcat (file_uri, "\t", self->priv->udn, NULL);
 
     host_path_data = g_new0 (HostPathData, 1);
     host_path_data->result = result;
     host_path_data->device = self;
     host_path_data->params = params;
-    host_path_data->file = g_object_ref (file);
+    host_path_data->file = g_file_new_for_uri (file_uri);
 
-    g_task_set_task_data (result,
-                          g_compute_checksum_for_string (G_CHECKSUM_MD5, raw_tag, -1),
-                          g_free);
+    tag = g_compute_checksum_for_string (G_CHECKSUM_MD5, raw_tag, -1);
+    g_task_set_task_data (result, tag, g_free);
     g_free (raw_tag);
 
-    korva_upnp_device_drop_current_file (self);
-    korva_upnp_file_server_host_file_async (server,
-                                            file,
-                                            params,
-                                            iface,
-                                            self->priv->ip_address,
-                                            cancellable,
-                                            korva_upnp_device_on_host_file_async,
-                                            host_path_data);
-    g_object_unref (server);
+    host_path_data->trace = korva_push_trace_new (tag, self->priv->udn);
+
+    /* Only the latest push is interesting to the user, skip everything that
+     * is still waiting for the device */
+    korva_upnp_device_cancel_queued_pushes (self, NULL);
+    g_queue_push_tail (&self->priv->commands, host_path_data);
+    korva_upnp_device_update_subscription (self);
+    korva_upnp_device_run_next_command (self);
 
     return;
 out:
     g_hash_table_destroy (params);
-    g_clear_object (&file);
 }
 
 static char *
@@ -1230,20 +2522,9 @@ korva_upnp_device_push_finish (KorvaDevice  *device,
                                GAsyncResult *res,
                                GError      **error)
 {
-    KorvaUPnPDevice *self;
-    char *tag;
-
     g_return_val_if_fail (g_task_is_valid (res, device), NULL);
 
-    tag = g_task_propagate_pointer (G_TASK (res), error);
-    if (tag != NULL) {
-        self = KORVA_UPNP_DEVICE (device);
-        self->priv->current_tag = g_strdup (tag);
-
-        return tag;
-    }
-
-    return NULL;
+    return g_task_propagate_pointer (G_TASK (res), error);
 }
 
 static void
@@ -1256,11 +2537,22 @@ korva_upnp_device_unshare_async (KorvaDevice        *device,
     GTask *result;
     HostPathData *data;
     KorvaUPnPDevice *self = KORVA_UPNP_DEVICE (device);
-    GUPnPServiceProxy *proxy;
+    GList *it;
+    gboolean known;
 
     result = g_task_new (device, cancellable, callback, user_data);
+    g_task_set_task_data (result, g_strdup (tag), g_free);
+
+    /* An unshare for something we never pushed must leave the pushes that
+     * are still waiting alone */
+    known = g_strcmp0 (self->priv->current_tag, tag) == 0 ||
+            g_strcmp0 (self->priv->running_tag, tag) == 0;
+    for (it = self->priv->commands.head; it != NULL && !known; it = it->next) {
+        data = (HostPathData *) it->data;
+        known = !data->unshare && g_strcmp0 (g_task_get_task_data (data->result), tag) == 0;
+    }
 
-    if (g_strcmp0 (self->priv->current_tag, tag) != 0) {
+    if (!known) {
         g_task_return_new_error (result,
                                  KORVA_CONTROLLER1_ERROR,
                                  KORVA_CONTROLLER1_ERROR_NO_SUCH_TRANSFER,
@@ -1271,19 +2563,28 @@ korva_upnp_device_unshare_async (KorvaDevice        *device,
         return;
     }
 
+    /* Nothing that is still waiting is supposed to play after an unshare. If
+     * the push to unshare did not even start, there is nothing to stop. */
+    if (korva_upnp_device_cancel_queued_pushes (self, tag) &&
+        g_strcmp0 (self->priv->current_tag, tag) != 0 &&
+        g_strcmp0 (self->priv->running_tag, tag) != 0) {
+        g_task_return_boolean (result, TRUE);
+        g_object_unref (result);
+        korva_upnp_device_update_subscription (self);
+
+        return;
+    }
+
     data = g_new0 (HostPathData, 1);
     data->result = result;
     data->uri = g_strdup ("");
     data->meta_data = g_strdup ("");
     data->device = self;
     data->unshare = TRUE;
-    data->file = g_object_ref (self->priv->current_file);
-
-    proxy = g_hash_table_lookup (data->device->priv->services, AV_TRANSPORT);
-    g_autoptr (GUPnPServiceProxyAction) action =
-        gupnp_service_proxy_action_new ("Stop", "InstanceID", G_TYPE_STRING, "0", NULL);
 
-    gupnp_service_proxy_call_action_async (proxy, action, NULL, korva_upnp_device_on_stop, data);
+    g_queue_push_tail (&self->priv->commands, data);
+    korva_upnp_device_update_subscription (self);
+    korva_upnp_device_run_next_command (self);
 }
 
 static gboolean
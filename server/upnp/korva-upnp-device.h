@@ -40,10 +40,19 @@ enum _KorvaUPnPDeviceError
     TIMEOUT
 };
 
+GUPnPDeviceProxy *
+korva_upnp_device_get_proxy (KorvaUPnPDevice *self);
+
 void
 korva_upnp_device_add_proxy (KorvaUPnPDevice *self, GUPnPDeviceProxy *proxy);
 
 gboolean
 korva_upnp_device_remove_proxy (KorvaUPnPDevice *self, GUPnPDeviceProxy *proxy);
 
+char *
+korva_upnp_device_info_get_config_id (GUPnPDeviceInfo *info);
+
+void
+korva_upnp_device_set_timing (guint deadline, guint breaker_timeout);
+
 G_END_DECLS
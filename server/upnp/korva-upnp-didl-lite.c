@@ -0,0 +1,378 @@
+/*
+    This file is part of Korva.
+
+    Copyright (C) 2012 Openismus GmbH.
+    Author: Jens Georg <jensg@openismus.com>
+
+    Korva is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Korva is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Korva.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define G_LOG_DOMAIN "Korva-UPnP-DIDL-Lite"
+
+#include <string.h>
+
+#include "korva-upnp-didl-lite.h"
+
+/*
+ * Writer for the DIDL-Lite documents used as CurrentURIMetaData and for
+ * playlists. The documents always have the same shape
+ *
+ *   <DIDL-Lite ...>
+ *     <item id="1" parentID="-1" restricted="1">
+ *       <dc:title>...</dc:title>
+ *       <upnp:albumArtURI>...</upnp:albumArtURI>
+ *       <res size="..." duration="..." ... protocolInfo="...">...</res>
+ *     </item>
+ *     ...
+ *   </DIDL-Lite>
+ *
+ * so instead of building a libxml tree and serializing it, the variable
+ * parts are escaped straight into a fixed template. The length of the
+ * document is computed up front and the result is written into a single
+ * allocation.
+ */
+
+#define DIDL_LITE_HEADER \
+    "<DIDL-Lite xmlns:dc=\"http://purl.org/dc/elements/1.1/\"" \
+    " xmlns:upnp=\"urn:schemas-upnp-org:metadata-1-0/upnp/\"" \
+    " xmlns=\"urn:schemas-upnp-org:metadata-1-0/DIDL-Lite/\">"
+#define DIDL_LITE_ITEM_START "<item id=\""
+#define DIDL_LITE_TITLE_START "\" parentID=\"-1\" restricted=\"1\"><dc:title>"
+#define DIDL_LITE_TITLE_END "</dc:title>"
+#define DIDL_LITE_ALBUM_ART_START "<upnp:albumArtURI>"
+#define DIDL_LITE_ALBUM_ART_END "</upnp:albumArtURI>"
+#define DIDL_LITE_RES_START "<res"
+#define DIDL_LITE_SIZE " size=\""
+#define DIDL_LITE_DURATION " duration=\""
+#define DIDL_LITE_BITRATE " bitrate=\""
+#define DIDL_LITE_RESOLUTION " resolution=\""
+#define DIDL_LITE_PROTOCOL_INFO " protocolInfo=\""
+#define DIDL_LITE_ATTRIBUTE_END "\""
+#define DIDL_LITE_RES_CONTENT "\">"
+#define DIDL_LITE_ITEM_END "</res></item>"
+#define DIDL_LITE_FOOTER "</DIDL-Lite>"
+
+#define LITERAL_LENGTH(s) (sizeof (s) - 1)
+
+/* Characters that need an entity in both text and attribute values.
+ * Whitespace other than the space is escaped so attribute values survive
+ * attribute value normalization */
+#define ESCAPE_CHARS "&<>\"\t\n\r"
+
+/* The numbers of an item, formatted while measuring the document */
+typedef struct {
+    char  id[16];
+    char  size[32];
+    char  duration[32];
+    char  bitrate[16];
+    char  resolution[32];
+    gsize id_length;
+    gsize size_length;
+    gsize duration_length;
+    gsize bitrate_length;
+    gsize resolution_length;
+} FormattedItem;
+
+static const char *
+get_entity (char c)
+{
+    switch (c) {
+    case '&':
+        return "&amp;";
+    case '<':
+        return "&lt;";
+    case '>':
+        return "&gt;";
+    case '"':
+        return "&quot;";
+    case '\t':
+        return "&#9;";
+    case '\n':
+        return "&#10;";
+    case '\r':
+        return "&#13;";
+    default:
+        g_assert_not_reached ();
+    }
+}
+
+/* Escaping works on runs: everything up to the next special character is
+ * copied in one go, which for the usual titles and URIs is the whole
+ * string */
+static gsize
+get_escaped_length (const char *string)
+{
+    gsize length = 0;
+
+    if (string == NULL) {
+        return 0;
+    }
+
+    while (TRUE) {
+        gsize run = strcspn (string, ESCAPE_CHARS);
+
+        length += run;
+        string += run;
+        if (*string == '\0') {
+            break;
+        }
+
+        length += strlen (get_entity (*string));
+        string++;
+    }
+
+    return length;
+}
+
+static char *
+append (char *p, const char *string, gsize length)
+{
+    memcpy (p, string, length);
+
+    return p + length;
+}
+
+#define APPEND_LITERAL(p, s) append ((p), (s), LITERAL_LENGTH (s))
+
+static char *
+append_escaped (char *p, const char *string)
+{
+    if (string == NULL) {
+        return p;
+    }
+
+    while (TRUE) {
+        gsize run = strcspn (string, ESCAPE_CHARS);
+        const char *entity;
+
+        p = append (p, string, run);
+        string += run;
+        if (*string == '\0') {
+            break;
+        }
+
+        entity = get_entity (*string);
+        p = append (p, entity, strlen (entity));
+        string++;
+    }
+
+    return p;
+}
+
+static char *
+append_attribute (char *p, const char *start, gsize start_length, const char *value, gsize length)
+{
+    if (length == 0) {
+        return p;
+    }
+
+    p = append (p, start, start_length);
+    p = append (p, value, length);
+
+    return APPEND_LITERAL (p, DIDL_LITE_ATTRIBUTE_END);
+}
+
+/* Format the numbers of @item and return the length of its <item> element */
+static gsize
+format_item (const KorvaUPnPDIDLLiteItem *item, guint id, FormattedItem *formatted)
+{
+    gsize length;
+
+    memset (formatted, 0, sizeof (FormattedItem));
+
+    formatted->id_length = g_snprintf (formatted->id, sizeof (formatted->id), "%u", id);
+
+    if (item->size >= 0) {
+        formatted->size_length = g_snprintf (formatted->size,
+                                             sizeof (formatted->size),
+                                             "%" G_GINT64_FORMAT,
+                                             item->size);
+    }
+
+    if (item->duration >= 0) {
+        formatted->duration_length = g_snprintf (formatted->duration,
+                                                 sizeof (formatted->duration),
+                                                 "%ld:%.2ld:%.2ld",
+                                                 item->duration / 3600,
+                                                 (item->duration / 60) % 60,
+                                                 item->duration % 60);
+    }
+
+    if (item->bitrate >= 0) {
+        formatted->bitrate_length = g_snprintf (formatted->bitrate,
+                                                sizeof (formatted->bitrate),
+                                                "%d",
+                                                item->bitrate);
+    }
+
+    if (item->width >= 0 && item->height >= 0) {
+        formatted->resolution_length = g_snprintf (formatted->resolution,
+                                                   sizeof (formatted->resolution),
+                                                   "%dx%d",
+                                                   item->width,
+                                                   item->height);
+    }
+
+    length = LITERAL_LENGTH (DIDL_LITE_ITEM_START) +
+             formatted->id_length +
+             LITERAL_LENGTH (DIDL_LITE_TITLE_START) +
+             get_escaped_length (item->title) +
+             LITERAL_LENGTH (DIDL_LITE_TITLE_END) +
+             LITERAL_LENGTH (DIDL_LITE_RES_START) +
+             LITERAL_LENGTH (DIDL_LITE_PROTOCOL_INFO) +
+             get_escaped_length (item->protocol_info) +
+             LITERAL_LENGTH (DIDL_LITE_RES_CONTENT) +
+             get_escaped_length (item->uri) +
+             LITERAL_LENGTH (DIDL_LITE_ITEM_END);
+
+    if (item->album_art_uri != NULL) {
+        length += LITERAL_LENGTH (DIDL_LITE_ALBUM_ART_START) +
+                  get_escaped_length (item->album_art_uri) +
+                  LITERAL_LENGTH (DIDL_LITE_ALBUM_ART_END);
+    }
+
+    if (formatted->size_length > 0) {
+        length += LITERAL_LENGTH (DIDL_LITE_SIZE) + formatted->size_length +
+                  LITERAL_LENGTH (DIDL_LITE_ATTRIBUTE_END);
+    }
+
+    if (formatted->duration_length > 0) {
+        length += LITERAL_LENGTH (DIDL_LITE_DURATION) + formatted->duration_length +
+                  LITERAL_LENGTH (DIDL_LITE_ATTRIBUTE_END);
+    }
+
+    if (formatted->bitrate_length > 0) {
+        length += LITERAL_LENGTH (DIDL_LITE_BITRATE) + formatted->bitrate_length +
+                  LITERAL_LENGTH (DIDL_LITE_ATTRIBUTE_END);
+    }
+
+    if (formatted->resolution_length > 0) {
+        length += LITERAL_LENGTH (DIDL_LITE_RESOLUTION) + formatted->resolution_length +
+                  LITERAL_LENGTH (DIDL_LITE_ATTRIBUTE_END);
+    }
+
+    return length;
+}
+
+static char *
+append_item (char *p, const KorvaUPnPDIDLLiteItem *item, const FormattedItem *formatted)
+{
+    p = APPEND_LITERAL (p, DIDL_LITE_ITEM_START);
+    p = append (p, formatted->id, formatted->id_length);
+    p = APPEND_LITERAL (p, DIDL_LITE_TITLE_START);
+    p = append_escaped (p, item->title);
+    p = APPEND_LITERAL (p, DIDL_LITE_TITLE_END);
+
+    if (item->album_art_uri != NULL) {
+        p = APPEND_LITERAL (p, DIDL_LITE_ALBUM_ART_START);
+        p = append_escaped (p, item->album_art_uri);
+        p = APPEND_LITERAL (p, DIDL_LITE_ALBUM_ART_END);
+    }
+
+    p = APPEND_LITERAL (p, DIDL_LITE_RES_START);
+    p = append_attribute (p,
+                          DIDL_LITE_SIZE,
+                          LITERAL_LENGTH (DIDL_LITE_SIZE),
+                          formatted->size,
+                          formatted->size_length);
+    p = append_attribute (p,
+                          DIDL_LITE_DURATION,
+                          LITERAL_LENGTH (DIDL_LITE_DURATION),
+                          formatted->duration,
+                          formatted->duration_length);
+    p = append_attribute (p,
+                          DIDL_LITE_BITRATE,
+                          LITERAL_LENGTH (DIDL_LITE_BITRATE),
+                          formatted->bitrate,
+                          formatted->bitrate_length);
+    p = append_attribute (p,
+                          DIDL_LITE_RESOLUTION,
+                          LITERAL_LENGTH (DIDL_LITE_RESOLUTION),
+                          formatted->resolution,
+                          formatted->resolution_length);
+
+    p = APPEND_LITERAL (p, DIDL_LITE_PROTOCOL_INFO);
+    p = append_escaped (p, item->protocol_info);
+    p = APPEND_LITERAL (p, DIDL_LITE_RES_CONTENT);
+    p = append_escaped (p, item->uri);
+
+    return APPEND_LITERAL (p, DIDL_LITE_ITEM_END);
+}
+
+/**
+ * korva_upnp_didl_lite_write_list:
+ *
+ * Create a DIDL-Lite document containing @items, numbered from 1 in the
+ * given order. Optional fields that are unset are left out.
+ *
+ * @items: (array length=n_items): The items to describe
+ * @n_items: Number of items in @items
+ *
+ * Returns: (transfer full): A newly allocated DIDL-Lite XML string.
+ */
+char *
+korva_upnp_didl_lite_write_list (const KorvaUPnPDIDLLiteItem *items, guint n_items)
+{
+    FormattedItem single, *formatted;
+    gsize length;
+    char *result, *p;
+    guint i;
+
+    for (i = 0; i < n_items; i++) {
+        g_return_val_if_fail (items[i].uri != NULL, NULL);
+        g_return_val_if_fail (items[i].protocol_info != NULL, NULL);
+    }
+
+    formatted = n_items > 1 ? g_new (FormattedItem, n_items) : &single;
+
+    length = LITERAL_LENGTH (DIDL_LITE_HEADER) + LITERAL_LENGTH (DIDL_LITE_FOOTER);
+    for (i = 0; i < n_items; i++) {
+        length += format_item (&items[i], i + 1, &formatted[i]);
+    }
+
+    result = g_malloc (length + 1);
+
+    p = APPEND_LITERAL (result, DIDL_LITE_HEADER);
+    for (i = 0; i < n_items; i++) {
+        p = append_item (p, &items[i], &formatted[i]);
+    }
+    p = APPEND_LITERAL (p, DIDL_LITE_FOOTER);
+    *p = '\0';
+
+    g_assert ((gsize) (p - result) == length);
+
+    if (formatted != &single) {
+        g_free (formatted);
+    }
+
+    return result;
+}
+
+/**
+ * korva_upnp_didl_lite_write:
+ *
+ * Create the DIDL-Lite document describing @item. Optional fields that are
+ * unset are left out. The result is equivalent to what #GUPnPDIDLLiteWriter
+ * creates for the same item.
+ *
+ * @item: The item to describe
+ *
+ * Returns: (transfer full): A newly allocated DIDL-Lite XML string.
+ */
+char *
+korva_upnp_didl_lite_write (const KorvaUPnPDIDLLiteItem *item)
+{
+    g_return_val_if_fail (item != NULL, NULL);
+
+    return korva_upnp_didl_lite_write_list (item, 1);
+}
@@ -0,0 +1,62 @@
+/*
+    This file is part of Korva.
+
+    Copyright (C) 2012 Openismus GmbH.
+    Author: Jens Georg <jensg@openismus.com>
+
+    Korva is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Korva is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Korva.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/**
+ * KorvaUPnPDIDLLiteItem:
+ * @title: (allow-none): Title of the item
+ * @uri: URI the item is served from
+ * @protocol_info: protocolInfo of the resource
+ * @size: Size of the resource in bytes or -1 if unknown
+ * @duration: Duration of the resource in seconds or -1 if unknown
+ * @bitrate: Bitrate of the resource in bytes per second or -1 if unknown
+ * @width: Width of the resource in pixels or -1 if unknown
+ * @height: Height of the resource in pixels or -1 if unknown
+ * @album_art_uri: (allow-none): URI of a cover image for the item
+ *
+ * Description of an item of a DIDL-Lite document, e.g. the single item
+ * of CurrentURIMetaData or an entry of a playlist. Initialize it with
+ * #KORVA_UPNP_DIDL_LITE_ITEM_INIT so that all optional fields are unset.
+ */
+typedef struct {
+    const char *title;
+    const char *uri;
+    const char *protocol_info;
+    gint64      size;
+    glong       duration;
+    int         bitrate;
+    int         width;
+    int         height;
+    const char *album_art_uri;
+} KorvaUPnPDIDLLiteItem;
+
+#define KORVA_UPNP_DIDL_LITE_ITEM_INIT { NULL, NULL, NULL, -1, -1, -1, -1, -1, NULL }
+
+char *
+korva_upnp_didl_lite_write (const KorvaUPnPDIDLLiteItem *item);
+
+char *
+korva_upnp_didl_lite_write_list (const KorvaUPnPDIDLLiteItem *items, guint n_items);
+
+G_END_DECLS
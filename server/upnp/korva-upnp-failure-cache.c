@@ -0,0 +1,223 @@
+/*
+    This file is part of Korva.
+
+    Copyright (C) 2012 Openismus GmbH.
+    Author: Jens Georg <jensg@openismus.com>
+
+    Korva is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Korva is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Korva.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define G_LOG_DOMAIN "Korva-UPnP-Failure-Cache"
+
+#include "korva-upnp-device.h"
+#include "korva-upnp-failure-cache.h"
+
+/* Doublings after which the delay is not increased anymore, so the shift
+ * cannot overflow */
+#define MAX_DOUBLINGS 16
+
+typedef struct {
+    char  *location;
+    char  *config_id;
+    GQuark domain;
+    int    code;
+    guint  failures;
+    gint64 retry_after;
+} KorvaUPnPFailure;
+
+struct _KorvaUPnPFailureCache {
+    guint       base_delay;
+    guint       max_delay;
+    GHashTable *failures;
+};
+
+static void
+korva_upnp_failure_free (KorvaUPnPFailure *failure)
+{
+    g_free (failure->location);
+    g_free (failure->config_id);
+    g_free (failure);
+}
+
+/**
+ * korva_upnp_failure_cache_new:
+ * @base_delay: Milliseconds to wait before retrying a device that failed once
+ * @max_delay: Upper limit for the time between two retries in milliseconds
+ *
+ * Create a cache that remembers devices whose introspection failed, so they
+ * are not introspected again on every announcement. The time until the next
+ * retry doubles with each consecutive failure. Devices that are not usable
+ * at all, because they have the wrong device type or lack a required
+ * service, are not retried until their description changes.
+ *
+ * Returns: (transfer full): A new #KorvaUPnPFailureCache.
+ */
+KorvaUPnPFailureCache *
+korva_upnp_failure_cache_new (guint base_delay, guint max_delay)
+{
+    KorvaUPnPFailureCache *self = g_new0 (KorvaUPnPFailureCache, 1);
+
+    self->base_delay = base_delay;
+    self->max_delay = MAX (base_delay, max_delay);
+    self->failures = g_hash_table_new_full (g_str_hash,
+                                            g_str_equal,
+                                            g_free,
+                                            (GDestroyNotify) korva_upnp_failure_free);
+
+    return self;
+}
+
+void
+korva_upnp_failure_cache_free (KorvaUPnPFailureCache *self)
+{
+    g_hash_table_destroy (self->failures);
+    g_free (self);
+}
+
+/**
+ * korva_upnp_failure_cache_begin:
+ * @self: A #KorvaUPnPFailureCache
+ * @udn: UDN of the device that is about to be introspected
+ * @location: URL of the device description
+ * @config_id: (allow-none): configId of the device description
+ *
+ * Check whether the device may be introspected now. GUPnP does not expose
+ * the BOOTID and CONFIGID headers, so a change of the description URL or of
+ * the configId attribute of the description is taken as the device having
+ * rebooted or changed its configuration; that forgets earlier failures.
+ *
+ * Returns: %TRUE if the device should be introspected, %FALSE if it is still
+ * backing off.
+ */
+gboolean
+korva_upnp_failure_cache_begin (KorvaUPnPFailureCache *self,
+                                const char            *udn,
+                                const char            *location,
+                                const char            *config_id)
+{
+    KorvaUPnPFailure *failure;
+
+    failure = g_hash_table_lookup (self->failures, udn);
+    if (failure != NULL &&
+        (g_strcmp0 (failure->location, location) != 0 ||
+         g_strcmp0 (failure->config_id, config_id) != 0)) {
+        if (failure->failures > 0) {
+            g_debug ("Description of device %s changed, forgetting %u failures",
+                     udn,
+                     failure->failures);
+        }
+
+        g_hash_table_remove (self->failures, udn);
+        failure = NULL;
+    }
+
+    if (failure == NULL) {
+        failure = g_new0 (KorvaUPnPFailure, 1);
+        failure->location = g_strdup (location);
+        failure->config_id = g_strdup (config_id);
+        g_hash_table_insert (self->failures, g_strdup (udn), failure);
+
+        return TRUE;
+    }
+
+    if (g_get_monotonic_time () < failure->retry_after) {
+        g_debug ("Device %s failed with %s:%d before, not retrying yet",
+                 udn,
+                 g_quark_to_string (failure->domain),
+                 failure->code);
+
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+ * korva_upnp_failure_cache_fail:
+ * @self: A #KorvaUPnPFailureCache
+ * @udn: UDN of the device
+ * @error: The error the introspection failed with
+ *
+ * Record that the introspection started with korva_upnp_failure_cache_begin()
+ * failed.
+ *
+ * Returns: Number of consecutive failures of the device.
+ */
+guint
+korva_upnp_failure_cache_fail (KorvaUPnPFailureCache *self,
+                               const char            *udn,
+                               const GError          *error)
+{
+    KorvaUPnPFailure *failure;
+    gint64 delay;
+
+    failure = g_hash_table_lookup (self->failures, udn);
+    g_return_val_if_fail (failure != NULL, 0);
+
+    failure->failures++;
+    failure->domain = error->domain;
+    failure->code = error->code;
+
+    if (g_error_matches (error, KORVA_UPNP_DEVICE_ERROR, INVALID_DEVICE_TYPE) ||
+        g_error_matches (error, KORVA_UPNP_DEVICE_ERROR, MISSING_SERVICE)) {
+        failure->retry_after = G_MAXINT64;
+        g_debug ("Not retrying device %s until its description changes", udn);
+
+        return failure->failures;
+    }
+
+    delay = (gint64) self->base_delay << MIN (failure->failures - 1, MAX_DOUBLINGS);
+    delay = MIN (delay, self->max_delay);
+    failure->retry_after = g_get_monotonic_time () + delay * 1000;
+    g_debug ("Retrying device %s in %" G_GINT64_FORMAT " ms at the earliest", udn, delay);
+
+    return failure->failures;
+}
+
+/**
+ * korva_upnp_failure_cache_succeed:
+ * @self: A #KorvaUPnPFailureCache
+ * @udn: UDN of the device
+ *
+ * Forget the device after its introspection succeeded.
+ */
+void
+korva_upnp_failure_cache_succeed (KorvaUPnPFailureCache *self,
+                                  const char            *udn)
+{
+    g_hash_table_remove (self->failures, udn);
+}
+
+/**
+ * korva_upnp_failure_cache_get_retry_after:
+ * @self: A #KorvaUPnPFailureCache
+ * @udn: UDN of the device
+ *
+ * Returns: The monotonic time from which the device may be introspected
+ * again, %G_MAXINT64 if it is not retried until its description changes or
+ * 0 if it did not fail.
+ */
+gint64
+korva_upnp_failure_cache_get_retry_after (KorvaUPnPFailureCache *self,
+                                          const char            *udn)
+{
+    KorvaUPnPFailure *failure;
+
+    failure = g_hash_table_lookup (self->failures, udn);
+    if (failure == NULL || failure->failures == 0) {
+        return 0;
+    }
+
+    return failure->retry_after;
+}
@@ -0,0 +1,56 @@
+/*
+    This file is part of Korva.
+
+    Copyright (C) 2012 Openismus GmbH.
+    Author: Jens Georg <jensg@openismus.com>
+
+    Korva is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Korva is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Korva.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _KorvaUPnPFailureCache KorvaUPnPFailureCache;
+
+KorvaUPnPFailureCache *
+korva_upnp_failure_cache_new (guint base_delay, guint max_delay);
+
+void
+korva_upnp_failure_cache_free (KorvaUPnPFailureCache *self);
+
+gboolean
+korva_upnp_failure_cache_begin (KorvaUPnPFailureCache *self,
+                                const char            *udn,
+                                const char            *location,
+                                const char            *config_id);
+
+guint
+korva_upnp_failure_cache_fail (KorvaUPnPFailureCache *self,
+                               const char            *udn,
+                               const GError          *error);
+
+void
+korva_upnp_failure_cache_succeed (KorvaUPnPFailureCache *self,
+                                  const char            *udn);
+
+gint64
+korva_upnp_failure_cache_get_retry_after (KorvaUPnPFailureCache *self,
+                                          const char            *udn);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (KorvaUPnPFailureCache, korva_upnp_failure_cache_free)
+
+G_END_DECLS
@@ -27,20 +27,31 @@
 #include <libgupnp-av/gupnp-av.h>
 
 #include <korva-error.h>
+#include <korva-priority.h>
 
 #include "korva-upnp-file-server.h"
 #include "korva-upnp-metadata-query.h"
 #include "korva-upnp-host-data.h"
 
-/* A valid path consists of /item/md5 and an optional 4 character extension */
-#define KORVA_PATH_REGEX "^/item/([0-9a-fA-F]{32})(\\.[a-zA-Z0-9]{0,4})?$"
+/* A valid path consists of /item/md5, the position of an entry if the item
+ * is a playlist and an optional 4 character extension */
+#define KORVA_PATH_REGEX "^/item/([0-9a-fA-F]{32})(?:/([0-9]{1,9}))?(\\.[a-zA-Z0-9]{0,4})?$"
 
+/* The HTTP server runs on its own thread and main context so discovery and
+ * SOAP traffic on the default main context cannot stall active streams.
+ * host_data and id_map are only modified on the main thread; lock guards
+ * those modifications and the look-ups done by the serving thread. */
 struct _KorvaUPnPFileServerPrivate {
-    SoupServer *http_server;
-    GHashTable *host_data;
-    GHashTable *id_map;
-    guint       port;
-    GRegex     *path_regex;
+    SoupServer   *http_server;
+    GHashTable   *host_data;
+    GHashTable   *id_map;
+    GHashTable   *pending_queries;
+    guint         port;
+    GRegex       *path_regex;
+    GMainContext *context;
+    GMainLoop    *loop;
+    GThread      *thread;
+    GMutex        lock;
 };
 typedef struct _KorvaUPnPFileServerPrivate KorvaUPnPFileServerPrivate;
 
@@ -54,34 +65,139 @@ G_DEFINE_TYPE_WITH_PRIVATE (KorvaUPnPFileServer, korva_upnp_file_server, G_TYPE_
 
 typedef struct _ServeData {
     SoupServer        *server;
+    SoupServerMessage *msg;
     GInputStream      *stream;
+    GCancellable      *cancellable;
     goffset            start;
     goffset            end;
     KorvaUPnPHostData *host_data;
+    /* The playlist an entry is served for, or host_data itself */
+    KorvaUPnPHostData *owner;
+    KorvaPushTrace    *trace;
+    gboolean           first_chunk_queued;
+    gboolean           reading;
+    gboolean           finished;
 } ServeData;
 
 void
 serve_data_free (ServeData *data)
 {
-    if (data->host_data != NULL) {
-        g_object_remove_weak_pointer (G_OBJECT (data->host_data), (gpointer *) &(data->host_data));
+    if (data->stream != NULL) {
+        g_input_stream_close (data->stream, NULL, NULL);
+        g_object_unref (data->stream);
     }
+    g_clear_object (&data->cancellable);
+    g_clear_object (&data->host_data);
+    g_clear_object (&data->owner);
+    g_clear_pointer (&data->trace, korva_push_trace_unref);
     g_slice_free (ServeData, data);
 }
 
+/* A request kept paused while a playlist or one of its entries is set up in
+ * a worker thread */
+typedef struct _PendingRequest {
+    SoupServer        *server;
+    SoupServerMessage *msg;
+    KorvaUPnPHostData *owner;
+    GCancellable      *cancellable;
+    gulong             finished_id;
+} PendingRequest;
+
+static void
+pending_request_on_finished (SoupServerMessage *msg, gpointer user_data)
+{
+    PendingRequest *request = (PendingRequest *) user_data;
+
+    g_cancellable_cancel (request->cancellable);
+}
+
+static PendingRequest *
+pending_request_new (SoupServer        *server,
+                     SoupServerMessage *msg,
+                     KorvaUPnPHostData *owner)
+{
+    PendingRequest *request;
+
+    request = g_slice_new0 (PendingRequest);
+    request->server = server;
+    request->msg = g_object_ref (msg);
+    request->owner = g_object_ref (owner);
+    request->cancellable = g_cancellable_new ();
+
+    /* The peer may close the connection while the worker is busy */
+    request->finished_id = g_signal_connect (msg,
+                                             "finished",
+                                             G_CALLBACK (pending_request_on_finished),
+                                             request);
+
+    return request;
+}
+
+static void
+pending_request_free (PendingRequest *request)
+{
+    g_signal_handler_disconnect (request->msg, request->finished_id);
+    g_object_unref (request->msg);
+    g_object_unref (request->owner);
+    g_object_unref (request->cancellable);
+    g_slice_free (PendingRequest, request);
+}
+
+static void
+korva_upnp_file_server_on_chunk_read (GObject      *source,
+                                      GAsyncResult *res,
+                                      gpointer      user_data)
+{
+    ServeData *data = (ServeData *) user_data;
+    g_autoptr (GError) error = NULL;
+    SoupMessageBody *body;
+    GBytes *bytes;
+
+    data->reading = FALSE;
+    bytes = g_input_stream_read_bytes_finish (G_INPUT_STREAM (source), res, &error);
+
+    /* The message went away while we were reading */
+    if (data->finished) {
+        g_clear_pointer (&bytes, g_bytes_unref);
+        serve_data_free (data);
+
+        return;
+    }
+
+    body = soup_server_message_get_response_body (data->msg);
+    if (bytes == NULL || g_bytes_get_size (bytes) == 0) {
+        g_warning ("Failed to read from file: %s",
+                   error != NULL ? error->message : "Unexpected end of file");
+
+        /* Cut the response short, the peer will notice the missing bytes */
+        soup_message_body_complete (body);
+    } else {
+        data->start += g_bytes_get_size (bytes);
+        soup_message_body_append_bytes (body, bytes);
+    }
+    g_clear_pointer (&bytes, g_bytes_unref);
+
+    soup_server_unpause_message (data->server, data->msg);
+}
+
 static void
 korva_upnp_file_server_on_wrote_chunk (SoupServerMessage *msg,
                                        gpointer     user_data)
 {
     ServeData *data = (ServeData *) user_data;
     int chunk_size;
-    char *file_buffer;
-    GError *error = NULL;
-    gsize bytes_read;
 
     soup_server_pause_message (data->server, msg);
     SoupMessageBody *body = soup_server_message_get_response_body (msg);
 
+    /* Called for "wrote-headers" first, so the second call means that the
+     * first chunk went out to the peer */
+    if (data->first_chunk_queued && data->trace != NULL) {
+        korva_push_trace_end (data->trace, KORVA_PUSH_TRACE_PHASE_FIRST_BYTE);
+        g_clear_pointer (&data->trace, korva_push_trace_unref);
+    }
+    data->first_chunk_queued = TRUE;
+
     chunk_size = MIN (data->end - data->start + 1, G_MAXUINT16 + 1);
 
     if (chunk_size <= 0) {
@@ -91,20 +207,15 @@ korva_upnp_file_server_on_wrote_chunk (SoupServerMessage *msg,
         return;
     }
 
-    file_buffer = g_malloc0 (chunk_size);
-    g_input_stream_read_all (data->stream,
-                             (void *) file_buffer,
-                             chunk_size,
-                             &bytes_read,
-                             NULL,
-                             &error);
-
-    // FIXME: Handle error on file read
-
-    data->start += chunk_size;
-    soup_message_body_append (body, SOUP_MEMORY_TAKE, file_buffer, chunk_size);
-
-    soup_server_unpause_message (data->server, msg);
+    /* Refilling the next chunk of a running stream goes ahead of any other
+     * work on the context */
+    data->reading = TRUE;
+    g_input_stream_read_bytes_async (data->stream,
+                                     chunk_size,
+                                     korva_priority_get (KORVA_PRIORITY_CLASS_STREAMING),
+                                     data->cancellable,
+                                     korva_upnp_file_server_on_chunk_read,
+                                     data);
 }
 
 static void
@@ -117,15 +228,19 @@ korva_upnp_file_server_on_finished (SoupServerMessage *msg,
     uri = g_uri_to_string (soup_server_message_get_uri (msg));
     g_debug ("Handled request for '%s'", uri);
 
-    if (data->host_data != NULL) {
-        korva_upnp_host_data_remove_request (data->host_data);
-        if (!korva_upnp_host_data_has_requests (data->host_data)) {
-            korva_upnp_host_data_start_timeout (data->host_data);
-        }
+    korva_upnp_host_data_remove_request (data->owner);
+    if (!korva_upnp_host_data_has_requests (data->owner)) {
+        korva_upnp_host_data_start_timeout (data->owner);
+    }
+
+    if (data->reading) {
+        /* Free the data once the pending read got cancelled */
+        data->finished = TRUE;
+        g_cancellable_cancel (data->cancellable);
+
+        return;
     }
 
-    g_input_stream_close (data->stream, NULL, NULL);
-    g_object_unref (data->stream);
     serve_data_free (data);
 }
 
@@ -134,79 +249,97 @@ static void print_header (const char *name, const char *value, gpointer user_dat
     g_debug ("    %s: %s", name, value);
 }
 
+/* Playlists are small and generated on request, so they are sent in one
+ * go. The entries point to the address the request came in on. */
 static void
-korva_upnp_file_server_handle_request (SoupServer *server,
-                                       SoupServerMessage *msg,
-                                       const char *path,
-                                       GHashTable *query,
-                                       gpointer user_data)
+korva_upnp_file_server_on_playlist (GObject      *source,
+                                    GAsyncResult *res,
+                                    gpointer      user_data)
 {
-    KorvaUPnPFileServer *self = KORVA_UPNP_FILE_SERVER (user_data);
-    g_autoptr (GMatchInfo) info = NULL;
-    g_autofree char *id = NULL;
-    GFile *file;
-    KorvaUPnPHostData *data;
-    ServeData *serve_data;
-    SoupRange *ranges = NULL;
-    int length;
-    const char *content_features;
-    GError *error = NULL;
-    goffset size;
+    PendingRequest *request = (PendingRequest *) user_data;
+    KorvaUPnPHostData *data = KORVA_UPNP_HOST_DATA (source);
+    SoupServerMessage *msg = request->msg;
+    g_autoptr (GError) error = NULL;
+    g_autoptr (GBytes) playlist = NULL;
 
-    const char *method = soup_server_message_get_method (msg);
-
-    if (method != SOUP_METHOD_HEAD && method != SOUP_METHOD_GET) {
-        soup_server_message_set_status (msg, SOUP_STATUS_METHOD_NOT_ALLOWED, NULL);
+    playlist = korva_upnp_host_data_get_playlist_finish (data, res, &error);
+    if (g_cancellable_is_cancelled (request->cancellable)) {
+        pending_request_free (request);
 
         return;
     }
 
-    g_debug ("Got %s request for uri: %s", method, path);
-    soup_message_headers_foreach (soup_server_message_get_request_headers (msg), print_header, NULL);
-
-    soup_server_pause_message (server, msg);
-    soup_server_message_set_status (msg, SOUP_STATUS_OK, NULL);
-
-    if (!g_regex_match (self->priv->path_regex,
-                        path,
-                        0,
-                        &info)) {
-        soup_server_message_set_status (msg, SOUP_STATUS_NOT_FOUND, NULL);
+    if (playlist == NULL) {
+        g_warning ("Failed to create playlist: %s", error->message);
+        soup_server_message_set_status (msg, SOUP_STATUS_INTERNAL_SERVER_ERROR, NULL);
 
         goto out;
     }
 
-    id = g_match_info_fetch (info, 1);
-
-    file = g_hash_table_lookup (self->priv->id_map, id);
+    /* Give the renderer time to come back for the first entry */
+    korva_upnp_host_data_start_timeout (data);
 
-    if (file == NULL) {
-        soup_server_message_set_status (msg, SOUP_STATUS_NOT_FOUND, NULL);
-
-        goto out;
-    }
-
-    data = g_hash_table_lookup (self->priv->host_data, file);
-    if (data == NULL) {
-        soup_server_message_set_status (msg, SOUP_STATUS_NOT_FOUND, NULL);
+    soup_message_headers_append (soup_server_message_get_response_headers (msg),
+                                 "Connection",
+                                 "close");
+    soup_server_message_set_status (msg, SOUP_STATUS_OK, NULL);
+    soup_server_message_set_response (msg,
+                                      korva_upnp_host_data_get_content_type (data),
+                                      SOUP_MEMORY_COPY,
+                                      g_bytes_get_data (playlist, NULL),
+                                      g_bytes_get_size (playlist));
 
-        goto out;
-    }
+out:
+    soup_server_unpause_message (request->server, msg);
+    pending_request_free (request);
+}
 
-    GUri *peer = soup_server_message_get_uri (msg);
-    if (!korva_upnp_host_data_valid_for_peer (data, g_uri_get_host (peer))) {
-        soup_server_message_set_status (msg, SOUP_STATUS_NOT_FOUND, NULL);
+static void
+korva_upnp_file_server_serve_playlist (SoupServer        *server,
+                                       SoupServerMessage *msg,
+                                       KorvaUPnPHostData *data)
+{
+    g_autofree char *host = NULL;
+    GInetSocketAddress *local;
+    PendingRequest *request;
+
+    local = G_INET_SOCKET_ADDRESS (soup_server_message_get_local_address (msg));
+    host = g_inet_address_to_string (g_inet_socket_address_get_address (local));
+
+    request = pending_request_new (server, msg, data);
+    korva_upnp_host_data_get_playlist_async (data,
+                                             host,
+                                             g_inet_socket_address_get_port (local),
+                                             request->cancellable,
+                                             korva_upnp_file_server_on_playlist,
+                                             request);
+}
 
-        goto out;
-    }
+/* Set up the response for the file of @data. @owner is the playlist @data
+ * is an entry of, or @data itself. The message is left paused. */
+static void
+korva_upnp_file_server_serve_file (SoupServer        *server,
+                                   SoupServerMessage *msg,
+                                   KorvaUPnPHostData *data,
+                                   KorvaUPnPHostData *owner)
+{
+    GUri *uri = soup_server_message_get_uri (msg);
+    const char *method = soup_server_message_get_method (msg);
+    SoupMessageHeaders *request_headers = soup_server_message_get_request_headers (msg);
+    SoupMessageHeaders *response_headers = soup_server_message_get_response_headers (msg);
+    ServeData *serve_data;
+    SoupRange *ranges = NULL;
+    int length;
+    const char *content_features;
+    GError *error = NULL;
+    GFile *file;
+    goffset size;
 
     serve_data = g_slice_new0 (ServeData);
-    serve_data->host_data = data;
-    g_object_add_weak_pointer (G_OBJECT (data), (gpointer *) &(serve_data->host_data));
-    korva_upnp_host_data_add_request (data);
+    serve_data->host_data = g_object_ref (data);
+    serve_data->owner = g_object_ref (owner);
+    korva_upnp_host_data_add_request (owner);
     size = korva_upnp_host_data_get_size (data);
-    SoupMessageHeaders *request_headers = soup_server_message_get_request_headers (msg);
-    SoupMessageHeaders *response_headers = soup_server_message_get_response_headers (msg);
     if (soup_message_headers_get_ranges (request_headers, size, &ranges, &length)) {
         goffset start, end;
         start = ranges[0].start;
@@ -256,7 +389,7 @@ korva_upnp_file_server_handle_request (SoupServer *server,
     soup_message_headers_foreach (response_headers, print_header, NULL);
 
     if (g_ascii_strcasecmp (method, "HEAD") == 0) {
-        g_debug ("Handled HEAD request of %s: %d", path, soup_server_message_get_status (msg));
+        g_debug ("Handled HEAD request of %s: %d", g_uri_get_path (uri), soup_server_message_get_status (msg));
         serve_data_free (serve_data);
 
         goto out;
@@ -265,11 +398,15 @@ korva_upnp_file_server_handle_request (SoupServer *server,
     soup_message_headers_set_encoding (response_headers, SOUP_ENCODING_CONTENT_LENGTH);
     soup_message_body_set_accumulate (soup_server_message_get_response_body (msg), FALSE);
 
+    file = korva_upnp_host_data_get_file (data);
     serve_data->stream = G_INPUT_STREAM (g_file_read (file, NULL, &error));
+    g_object_unref (file);
     serve_data->server = server;
+    serve_data->msg = msg;
+    serve_data->cancellable = g_cancellable_new ();
     if (error != NULL) {
         g_warning ("Failed to MMAP file %s: %s",
-                   path,
+                   g_uri_get_path (uri),
                    error->message);
 
         g_error_free (error);
@@ -282,7 +419,10 @@ korva_upnp_file_server_handle_request (SoupServer *server,
     g_seekable_seek (G_SEEKABLE (serve_data->stream), serve_data->start, G_SEEK_SET, NULL, NULL);
 
     /* Drop timeout until the message is done */
-    korva_upnp_host_data_cancel_timeout (data);
+    korva_upnp_host_data_cancel_timeout (owner);
+
+    serve_data->trace = korva_upnp_host_data_steal_trace (owner, g_uri_get_host (uri));
+    korva_push_trace_begin (serve_data->trace, KORVA_PUSH_TRACE_PHASE_FIRST_BYTE);
 
     g_signal_connect (msg,
                       "wrote-chunk",
@@ -301,16 +441,162 @@ out:
     if (ranges != NULL) {
         soup_message_headers_free_ranges (request_headers, ranges);
     }
+}
+
+static void
+korva_upnp_file_server_on_member (GObject      *source,
+                                  GAsyncResult *res,
+                                  gpointer      user_data)
+{
+    PendingRequest *request = (PendingRequest *) user_data;
+    g_autoptr (GError) error = NULL;
+    g_autoptr (KorvaUPnPHostData) data = NULL;
+
+    data = korva_upnp_host_data_get_member_finish (KORVA_UPNP_HOST_DATA (source), res, &error);
+    if (g_cancellable_is_cancelled (request->cancellable)) {
+        pending_request_free (request);
+
+        return;
+    }
+
+    if (data == NULL) {
+        g_debug ("Failed to get playlist entry %s: %s",
+                 g_uri_get_path (soup_server_message_get_uri (request->msg)),
+                 error->message);
+        soup_server_message_set_status (request->msg, SOUP_STATUS_NOT_FOUND, NULL);
+    } else {
+        korva_upnp_file_server_serve_file (request->server, request->msg, data, request->owner);
+    }
+
+    soup_server_unpause_message (request->server, request->msg);
+    pending_request_free (request);
+}
+
+static void
+korva_upnp_file_server_handle_request (SoupServer *server,
+                                       SoupServerMessage *msg,
+                                       const char *path,
+                                       GHashTable *query,
+                                       gpointer user_data)
+{
+    KorvaUPnPFileServer *self = KORVA_UPNP_FILE_SERVER (user_data);
+    g_autoptr (GMatchInfo) info = NULL;
+    g_autofree char *id = NULL;
+    g_autofree char *entry = NULL;
+    GFile *file;
+    KorvaUPnPHostData *data = NULL;
+    PendingRequest *request;
+
+    const char *method = soup_server_message_get_method (msg);
+
+    if (method != SOUP_METHOD_HEAD && method != SOUP_METHOD_GET) {
+        soup_server_message_set_status (msg, SOUP_STATUS_METHOD_NOT_ALLOWED, NULL);
+
+        return;
+    }
+
+    g_debug ("Got %s request for uri: %s", method, path);
+    soup_message_headers_foreach (soup_server_message_get_request_headers (msg), print_header, NULL);
+
+    soup_server_pause_message (server, msg);
+    soup_server_message_set_status (msg, SOUP_STATUS_OK, NULL);
+
+    if (!g_regex_match (self->priv->path_regex,
+                        path,
+                        0,
+                        &info)) {
+        soup_server_message_set_status (msg, SOUP_STATUS_NOT_FOUND, NULL);
+
+        goto out;
+    }
+
+    id = g_match_info_fetch (info, 1);
+    entry = g_match_info_fetch (info, 2);
+
+    g_mutex_lock (&self->priv->lock);
+    file = g_hash_table_lookup (self->priv->id_map, id);
+    if (file != NULL) {
+        data = g_hash_table_lookup (self->priv->host_data, file);
+    }
+
+    /* Keep the data alive even if the main thread unhosts it meanwhile */
+    if (data != NULL) {
+        g_object_ref (data);
+    }
+    g_mutex_unlock (&self->priv->lock);
+
+    if (data == NULL) {
+        soup_server_message_set_status (msg, SOUP_STATUS_NOT_FOUND, NULL);
+
+        goto out;
+    }
+
+    GUri *peer = soup_server_message_get_uri (msg);
+    if (!korva_upnp_host_data_valid_for_peer (data, g_uri_get_host (peer))) {
+        soup_server_message_set_status (msg, SOUP_STATUS_NOT_FOUND, NULL);
+
+        goto out;
+    }
+
+    /* Entries of a playlist are only set up once the renderer gets to them;
+     * requests, timeout and trace stay with the playlist. Listing the
+     * directory and querying an entry touch the file system, so they run in
+     * a worker thread and the message stays paused until they are done */
+    if (korva_upnp_host_data_is_playlist (data)) {
+        if (entry == NULL || *entry == '\0') {
+            korva_upnp_file_server_serve_playlist (server, msg, data);
+        } else {
+            request = pending_request_new (server, msg, data);
+            korva_upnp_host_data_get_member_async (data,
+                                                   (guint) g_ascii_strtoull (entry, NULL, 10),
+                                                   g_uri_get_host (peer),
+                                                   request->cancellable,
+                                                   korva_upnp_file_server_on_member,
+                                                   request);
+        }
+        g_object_unref (data);
+
+        return;
+    }
+
+    if (entry != NULL && *entry != '\0') {
+        soup_server_message_set_status (msg, SOUP_STATUS_NOT_FOUND, NULL);
+
+        goto out;
+    }
+
+    korva_upnp_file_server_serve_file (server, msg, data, data);
+
+out:
+    g_clear_object (&data);
 
     soup_server_unpause_message (server, msg);
 }
 
+static gpointer
+korva_upnp_file_server_thread (gpointer user_data)
+{
+    KorvaUPnPFileServer *self = KORVA_UPNP_FILE_SERVER (user_data);
+
+    g_main_context_push_thread_default (self->priv->context);
+    g_main_loop_run (self->priv->loop);
+    g_main_context_pop_thread_default (self->priv->context);
+
+    return NULL;
+}
+
 static void
 korva_upnp_file_server_init (KorvaUPnPFileServer *self)
 {
     g_autoptr(GError) error = NULL;
 
     self->priv = korva_upnp_file_server_get_instance_private (self);
+    g_mutex_init (&self->priv->lock);
+    self->priv->context = g_main_context_new ();
+    self->priv->loop = g_main_loop_new (self->priv->context, FALSE);
+
+    /* The listening sockets attach to the thread-default context */
+    g_main_context_push_thread_default (self->priv->context);
     self->priv->http_server = soup_server_new (NULL, NULL);
     soup_server_add_handler (self->priv->http_server,
                              "/item",
@@ -325,6 +611,7 @@ korva_upnp_file_server_init (KorvaUPnPFileServer *self)
     if (error != NULL) {
         g_warning ("Failed to start HTTP server: %s", error->message);
     }
+    g_main_context_pop_thread_default (self->priv->context);
 
     self->priv->host_data = g_hash_table_new_full (g_file_hash,
                                                    (GEqualFunc) g_file_equal,
@@ -334,10 +621,18 @@ korva_upnp_file_server_init (KorvaUPnPFileServer *self)
                                                 (GEqualFunc) g_str_equal,
                                                 g_free,
                                                 g_object_unref);
+    self->priv->pending_queries = g_hash_table_new_full (g_file_hash,
+                                                         (GEqualFunc) g_file_equal,
+                                                         g_object_unref,
+                                                         NULL);
     self->priv->path_regex = g_regex_new (KORVA_PATH_REGEX,
                                           G_REGEX_OPTIMIZE,
                                           G_REGEX_MATCH_NEWLINE_ANY,
                                           NULL);
+
+    self->priv->thread = g_thread_new ("korva-file-server",
+                                       korva_upnp_file_server_thread,
+                                       self);
 }
 
 static void
@@ -345,7 +640,16 @@ korva_upnp_file_server_dispose (GObject *object)
 {
     KorvaUPnPFileServer *self = KORVA_UPNP_FILE_SERVER (object);
 
-    g_clear_object (&self->priv->http_server);
+    if (self->priv->thread != NULL) {
+        g_main_loop_quit (self->priv->loop);
+        g_clear_pointer (&self->priv->thread, g_thread_join);
+    }
+
+    if (self->priv->http_server != NULL) {
+        g_main_context_push_thread_default (self->priv->context);
+        g_clear_object (&self->priv->http_server);
+        g_main_context_pop_thread_default (self->priv->context);
+    }
 
     G_OBJECT_CLASS (korva_upnp_file_server_parent_class)->dispose (object);
 }
@@ -357,7 +661,11 @@ korva_upnp_file_server_finalize (GObject *object)
 
     g_clear_pointer (&self->priv->host_data, g_hash_table_destroy);
     g_clear_pointer (&self->priv->id_map, g_hash_table_destroy);
+    g_clear_pointer (&self->priv->pending_queries, g_hash_table_destroy);
     g_clear_pointer (&self->priv->path_regex, g_regex_unref);
+    g_clear_pointer (&self->priv->loop, g_main_loop_unref);
+    g_clear_pointer (&self->priv->context, g_main_context_unref);
+    g_mutex_clear (&self->priv->lock);
 
     G_OBJECT_CLASS (korva_upnp_file_server_parent_class)->finalize (object);
 }
@@ -404,13 +712,50 @@ typedef struct {
     char       *uri;
 } HostFileResult;
 
+typedef struct {
+    char           *iface;
+    char           *peer;
+    KorvaPushTrace *trace;
+    GTask          *result;
+} HostFileWaiter;
+
 typedef struct {
     KorvaUPnPHostData   *data;
     KorvaUPnPFileServer *self;
-    char                *iface;
-    GTask               *result;
+    GFile               *file;
+    /* Every push of the file that arrived while the query was running */
+    GList               *waiters;
 } QueryMetaData;
 
+static HostFileWaiter *
+host_file_waiter_new (GTask          *result,
+                      const char     *iface,
+                      const char     *peer,
+                      KorvaPushTrace *trace)
+{
+    HostFileWaiter *waiter;
+
+    waiter = g_slice_new0 (HostFileWaiter);
+    waiter->result = result;
+    waiter->iface = g_strdup (iface);
+    waiter->peer = g_strdup (peer);
+    if (trace != NULL) {
+        waiter->trace = korva_push_trace_ref (trace);
+    }
+
+    return waiter;
+}
+
+static void
+host_file_waiter_free (HostFileWaiter *waiter)
+{
+    g_free (waiter->iface);
+    g_free (waiter->peer);
+    g_clear_pointer (&waiter->trace, korva_push_trace_unref);
+    g_object_unref (waiter->result);
+    g_slice_free (HostFileWaiter, waiter);
+}
+
 static void
 korva_upnp_file_server_on_host_data_timeout (KorvaUPnPFileServer *self,
                                              KorvaUPnPHostData   *data)
@@ -421,23 +766,59 @@ korva_upnp_file_server_on_host_data_timeout (KorvaUPnPFileServer *self,
     file = korva_upnp_host_data_get_file (data);
     id = korva_upnp_host_data_get_id (data);
 
+    g_mutex_lock (&self->priv->lock);
     g_hash_table_remove (self->priv->id_map, id);
     g_hash_table_remove (self->priv->host_data, file);
+    g_mutex_unlock (&self->priv->lock);
 
     g_object_unref (file);
     g_free (id);
 }
 
+static void
+korva_upnp_file_server_return_uri (KorvaUPnPFileServer *self,
+                                   KorvaUPnPHostData   *data,
+                                   const char          *iface,
+                                   GTask               *result)
+{
+    HostFileResult *result_data;
+    GSList *uris = NULL;
+
+    uris = soup_server_get_uris (self->priv->http_server);
+    if (uris == NULL) {
+        g_task_return_new_error (result,
+                                 KORVA_CONTROLLER1_ERROR,
+                                 KORVA_CONTROLLER1_ERROR_NO_SERVER,
+                                 "%s",
+                                 "No HTTP server available");
+
+        return;
+    }
+
+    result_data = g_new0 (HostFileResult, 1);
+    result_data->params = korva_upnp_host_data_get_meta_data (data);
+    result_data->uri = korva_upnp_host_data_get_uri (data, iface, g_uri_get_port ((GUri *) uris->data));
+    g_slist_free_full (uris, (GDestroyNotify) g_uri_unref);
+
+    g_task_return_pointer (result, result_data, g_free);
+}
+
 static void
 korva_upnp_file_server_on_metadata_query_run_done (GObject      *sender,
                                                    GAsyncResult *res,
                                                    gpointer      user_data)
 {
     QueryMetaData *data = (QueryMetaData *) user_data;
-    GTask *result = data->result;
-    HostFileResult *result_data;
     GError *error = NULL;
-    GSList *uris = NULL;
+    GList *it;
+
+    g_hash_table_remove (data->self->priv->pending_queries, data->file);
+
+    for (it = data->waiters; it != NULL; it = it->next) {
+        HostFileWaiter *waiter = (HostFileWaiter *) it->data;
+
+        korva_push_trace_end (waiter->trace, KORVA_PUSH_TRACE_PHASE_METADATA_QUERY);
+    }
 
     if (!korva_upnp_metadata_query_run_finish (KORVA_UPNP_METADATA_QUERY (sender),
                                                res,
@@ -459,7 +840,12 @@ korva_upnp_file_server_on_metadata_query_run_done (GObject      *sender,
             }
         }
 
-        g_task_return_error (result, error);
+        for (it = data->waiters; it != NULL; it = it->next) {
+            HostFileWaiter *waiter = (HostFileWaiter *) it->data;
+
+            g_task_return_error (waiter->result, g_error_copy (error));
+        }
+        g_error_free (error);
         g_object_unref (data->data);
 
         goto out;
@@ -470,104 +856,89 @@ korva_upnp_file_server_on_metadata_query_run_done (GObject      *sender,
                               G_CALLBACK (korva_upnp_file_server_on_host_data_timeout),
                               data->self);
 
+    g_mutex_lock (&data->self->priv->lock);
     g_hash_table_insert (data->self->priv->host_data,
                          korva_upnp_host_data_get_file (data->data),
                          data->data);
     g_hash_table_insert (data->self->priv->id_map,
                          korva_upnp_host_data_get_id (data->data),
                          korva_upnp_host_data_get_file (data->data));
+    g_mutex_unlock (&data->self->priv->lock);
 
-    uris = soup_server_get_uris (data->self->priv->http_server);
-    if (uris == NULL) {
-        g_task_return_new_error (result,
-                                 KORVA_CONTROLLER1_ERROR,
-                                 KORVA_CONTROLLER1_ERROR_NO_SERVER,
-                                 "%s",
-                                 "No HTTP server available");
+    for (it = data->waiters; it != NULL; it = it->next) {
+        HostFileWaiter *waiter = (HostFileWaiter *) it->data;
 
-        goto out;
+        korva_upnp_host_data_add_peer (data->data, waiter->peer);
+        korva_upnp_host_data_add_trace (data->data, waiter->peer, waiter->trace);
+        korva_upnp_file_server_return_uri (data->self, data->data, waiter->iface, waiter->result);
     }
 
-    result_data = g_new0 (HostFileResult, 1);
-    result_data->params = korva_upnp_host_data_get_meta_data (data->data);
-
-    result_data->uri = korva_upnp_host_data_get_uri (data->data, data->iface, g_uri_get_port ((GUri *) uris->data));
-    g_slist_free_full (uris, (GDestroyNotify) g_uri_unref);
-
-    g_task_return_pointer (result, result_data, g_free);
-
-    data->result = NULL;
-
 out:
-    g_free (data->iface);
-    data->iface = NULL;
-
-    g_object_unref (result);
+    g_list_free_full (data->waiters, (GDestroyNotify) host_file_waiter_free);
+    g_object_unref (data->file);
     g_object_unref (sender);
     g_slice_free (QueryMetaData, data);
 }
 
+/**
+ * korva_upnp_file_server_host_file_async:
+ *
+ * Make @file available to @peer. The meta-data of a file is only queried
+ * once; pushes of a file that is already being queried, e.g. from a PushMany
+ * call, wait for that query and share its result.
+ */
 void
 korva_upnp_file_server_host_file_async (KorvaUPnPFileServer *self,
                                         GFile               *file,
                                         GHashTable          *params,
                                         const char          *iface,
                                         const char          *peer,
+                                        KorvaPushTrace      *trace,
                                         GCancellable        *cancellable,
                                         GAsyncReadyCallback  callback,
                                         gpointer             user_data)
 {
     KorvaUPnPHostData *data;
     GTask *result;
-    HostFileResult *result_data;
     KorvaUPnPMetadataQuery *query;
-    GSList *uris = NULL;
+    QueryMetaData *query_data;
 
     result = g_task_new (G_OBJECT (self), cancellable, callback, user_data);
 
+    korva_push_trace_begin (trace, KORVA_PUSH_TRACE_PHASE_METADATA_QUERY);
     data = g_hash_table_lookup (self->priv->host_data, file);
-    if (data == NULL) {
-        QueryMetaData *query_data;
-
-        query_data = g_slice_new0 (QueryMetaData);
-
-        data = korva_upnp_host_data_new (file, params, peer);
-        query_data->data = data;
-        query_data->self = self;
-        query_data->result = result;
-        query_data->iface = g_strdup (iface);
+    if (data != NULL) {
+        korva_upnp_host_data_add_peer (data, peer);
+        korva_upnp_host_data_add_trace (data, peer, trace);
+        korva_push_trace_end (trace, KORVA_PUSH_TRACE_PHASE_METADATA_QUERY);
 
-        query = korva_upnp_metadata_query_new (file, params);
-        korva_upnp_metadata_query_run_async (query,
-                                             korva_upnp_file_server_on_metadata_query_run_done,
-                                             NULL,
-                                             query_data);
+        korva_upnp_file_server_return_uri (self, data, iface, result);
+        g_object_unref (result);
 
         return;
     }
 
-    uris = soup_server_get_uris (self->priv->http_server);
-    if (uris == NULL) {
-        g_task_return_new_error (result,
-                                 KORVA_CONTROLLER1_ERROR,
-                                 KORVA_CONTROLLER1_ERROR_NO_SERVER,
-                                 "%s",
-                                 "No HTTP server available");
-
-        g_object_unref (result);
+    query_data = g_hash_table_lookup (self->priv->pending_queries, file);
+    if (query_data != NULL) {
+        query_data->waiters = g_list_append (query_data->waiters,
+                                             host_file_waiter_new (result, iface, peer, trace));
 
         return;
     }
 
-    korva_upnp_host_data_add_peer (data, peer);
-
-    result_data = g_new0 (HostFileResult, 1);
-    result_data->params = korva_upnp_host_data_get_meta_data (data);
-    result_data->uri = korva_upnp_host_data_get_uri (data, iface, g_uri_get_port ((GUri *) uris->data));
-    g_slist_free_full (uris, (GDestroyNotify) g_uri_unref);
-
-    g_task_return_pointer (result, result_data, g_free);
-    g_object_unref (result);
+    query_data = g_slice_new0 (QueryMetaData);
+    query_data->data = korva_upnp_host_data_new (file, params, peer);
+    query_data->self = self;
+    query_data->file = g_object_ref (file);
+    query_data->waiters = g_list_append (NULL,
+                                         host_file_waiter_new (result, iface, peer, trace));
+    g_hash_table_insert (self->priv->pending_queries, g_object_ref (file), query_data);
+
+    query = korva_upnp_metadata_query_new (file, params);
+    korva_upnp_metadata_query_run_async (query,
+                                         korva_upnp_file_server_on_metadata_query_run_done,
+                                         NULL,
+                                         query_data);
 }
 
 char *
@@ -593,6 +964,30 @@ korva_upnp_file_server_host_file_finish (KorvaUPnPFileServer *self,
     return NULL;
 }
 
+/**
+ * korva_upnp_file_server_get_didl_lite:
+ *
+ * Get the CurrentURIMetaData for a push of @file that is served at @uri.
+ * Pushes of a file through the same interface share the document.
+ *
+ * Returns: (transfer full) (allow-none): A DIDL-Lite XML string or %NULL if
+ *   @file is not hosted.
+ */
+char *
+korva_upnp_file_server_get_didl_lite (KorvaUPnPFileServer *self,
+                                      GFile               *file,
+                                      const char          *uri)
+{
+    KorvaUPnPHostData *data;
+
+    data = g_hash_table_lookup (self->priv->host_data, file);
+    if (data == NULL) {
+        return NULL;
+    }
+
+    return g_strdup (korva_upnp_host_data_get_didl_lite (data, uri));
+}
+
 gboolean
 korva_upnp_file_server_idle (KorvaUPnPFileServer *self)
 {
@@ -607,6 +1002,7 @@ korva_upnp_file_server_unhost_by_peer (KorvaUPnPFileServer *self,
     KorvaUPnPHostData *value;
     char *key;
 
+    g_mutex_lock (&self->priv->lock);
     g_hash_table_iter_init (&iter, self->priv->host_data);
     while (g_hash_table_iter_next (&iter, (gpointer) & key, (gpointer) & value)) {
         korva_upnp_host_data_remove_peer (value, peer);
@@ -628,6 +1024,7 @@ korva_upnp_file_server_unhost_by_peer (KorvaUPnPFileServer *self,
             g_hash_table_iter_remove (&iter);
         }
     }
+    g_mutex_unlock (&self->priv->lock);
 }
 
 void
@@ -647,16 +1044,18 @@ korva_upnp_file_server_unhost_file_for_peer (KorvaUPnPFileServer *self,
         char *id, *uri;
 
         id = korva_upnp_host_data_get_id (data);
-        g_hash_table_remove (self->priv->id_map, id);
-        g_free (id);
-
         file = korva_upnp_host_data_get_file (data);
         uri = g_file_get_uri (file);
         g_debug ("File '%s' no longer shared to any peer, removing…",
                  uri);
         g_free (uri);
-        g_object_unref (file);
 
+        g_mutex_lock (&self->priv->lock);
+        g_hash_table_remove (self->priv->id_map, id);
         g_hash_table_remove (self->priv->host_data, file);
+        g_mutex_unlock (&self->priv->lock);
+
+        g_free (id);
+        g_object_unref (file);
     }
 }
@@ -23,6 +23,8 @@
 #include <glib-object.h>
 #include <gio/gio.h>
 
+#include <korva-push-trace.h>
+
 G_BEGIN_DECLS
 
 #define KORVA_TYPE_UPNP_FILE_SERVER             (korva_upnp_file_server_get_type ())
@@ -38,6 +40,7 @@ korva_upnp_file_server_host_file_async (KorvaUPnPFileServer *self,
                                         GHashTable          *params,
                                         const char          *iface,
                                         const char          *peer,
+                                        KorvaPushTrace      *trace,
                                         GCancellable        *cancellable,
                                         GAsyncReadyCallback  callback,
                                         gpointer             user_data);
@@ -48,6 +51,11 @@ korva_upnp_file_server_host_file_finish (KorvaUPnPFileServer *self,
                                          GHashTable         **params,
                                          GError             **error);
 
+char *
+korva_upnp_file_server_get_didl_lite (KorvaUPnPFileServer *self,
+                                      GFile               *file,
+                                      const char          *uri);
+
 gboolean
 korva_upnp_file_server_idle (KorvaUPnPFileServer *self);
 
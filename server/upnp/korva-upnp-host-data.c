@@ -24,9 +24,44 @@
 
 #include <libgupnp-av/gupnp-av.h>
 
+#include <korva-priority.h>
+#include <korva-push-trace.h>
+
 #include "korva-upnp-constants-private.h"
+#include "korva-upnp-didl-lite.h"
 #include "korva-upnp-host-data.h"
-
+#include "korva-upnp-metadata-query.h"
+
+/* Attributes needed to pick the members of a pushed directory */
+#define KORVA_UPNP_HOST_DATA_MEMBER_ATTRIBUTES \
+    G_FILE_ATTRIBUTE_STANDARD_TYPE "," \
+    G_FILE_ATTRIBUTE_STANDARD_IS_HIDDEN "," \
+    G_FILE_ATTRIBUTE_STANDARD_NAME "," \
+    G_FILE_ATTRIBUTE_STANDARD_DISPLAY_NAME "," \
+    G_FILE_ATTRIBUTE_STANDARD_FAST_CONTENT_TYPE
+
+/* An entry of a playlist. Its host data is only created once the renderer
+ * requests the entry */
+typedef struct {
+    GFile             *file;
+    char              *title;
+    char              *content_type;
+    char              *collate_key;
+    KorvaUPnPHostData *data;
+} KorvaUPnPPlaylistMember;
+
+/* Arguments of a playlist or entry request handed to the worker thread */
+typedef struct {
+    char  *host;
+    guint  port;
+    guint  index;
+    char  *peer;
+} KorvaUPnPPlaylistRequest;
+
+/* The file server looks at peers, requests and traces from its serving
+ * thread; lock guards those, the lazily created protocol info and the
+ * members of a playlist. The list of members is not modified anymore once
+ * it is set, only the host data of each member */
 struct _KorvaUPnPHostDataPrivate {
     GFile      *file;
     GHashTable *meta_data;
@@ -35,6 +70,10 @@ struct _KorvaUPnPHostDataPrivate {
     uint        timeout_id;
     char       *extension;
     uint        request_count;
+    GHashTable *traces;
+    GHashTable *didl_lite;
+    GPtrArray  *members;
+    GMutex      lock;
 };
 typedef struct _KorvaUPnPHostDataPrivate KorvaUPnPHostDataPrivate;
 
@@ -181,6 +220,7 @@ korva_upnp_host_data_init (KorvaUPnPHostData *self)
 {
 
     self->priv = korva_upnp_host_data_get_instance_private (self);
+    g_mutex_init (&self->priv->lock);
 }
 
 static void
@@ -197,6 +237,10 @@ korva_upnp_host_data_finalize (GObject *object)
     g_clear_pointer (&self->priv->peers, peer_list_free);
     g_clear_pointer (&self->priv->protocol_info, g_free);
     g_clear_pointer (&self->priv->extension, g_free);
+    g_clear_pointer (&self->priv->traces, g_hash_table_destroy);
+    g_clear_pointer (&self->priv->didl_lite, g_hash_table_destroy);
+    g_clear_pointer (&self->priv->members, g_ptr_array_unref);
+    g_mutex_clear (&self->priv->lock);
 
     G_OBJECT_CLASS (korva_upnp_host_data_parent_class)->finalize (object);
 }
@@ -259,7 +303,17 @@ korva_upnp_host_data_on_timeout (gpointer user_data)
 
     KorvaUPnPHostData *self = KORVA_UPNP_HOST_DATA (user_data);
 
+    /* A request that arrived on the serving thread while the main loop was
+     * about to dispatch us may have cancelled or restarted the timeout */
+    g_mutex_lock (&self->priv->lock);
+    if (self->priv->timeout_id != g_source_get_id (g_main_current_source ())) {
+        g_mutex_unlock (&self->priv->lock);
+
+        return FALSE;
+    }
     self->priv->timeout_id = 0;
+    g_mutex_unlock (&self->priv->lock);
+
     uri = g_file_get_uri (self->priv->file);
     g_debug ("File '%s' was not accessed for %d seconds; removing.",
              uri,
@@ -309,12 +363,12 @@ korva_upnp_host_data_add_peer (KorvaUPnPHostData *self, const char *peer)
 {
     GList *it;
 
+    g_mutex_lock (&self->priv->lock);
     it = g_list_find_custom (self->priv->peers, peer, (GCompareFunc) g_strcmp0);
-    if (it != NULL) {
-        return;
+    if (it == NULL) {
+        self->priv->peers = g_list_prepend (self->priv->peers, g_strdup (peer));
     }
-
-    self->priv->peers = g_list_prepend (self->priv->peers, g_strdup (peer));
+    g_mutex_unlock (&self->priv->lock);
 }
 
 /**
@@ -331,12 +385,14 @@ korva_upnp_host_data_remove_peer (KorvaUPnPHostData *self, const char *peer)
 {
     GList *it;
 
+    g_mutex_lock (&self->priv->lock);
     it = g_list_find_custom (self->priv->peers, peer, (GCompareFunc) g_strcmp0);
     if (it != NULL) {
         g_free (it->data);
 
         self->priv->peers = g_list_remove_link (self->priv->peers, it);
     }
+    g_mutex_unlock (&self->priv->lock);
 }
 
 /**
@@ -410,6 +466,7 @@ korva_upnp_host_data_get_uri (KorvaUPnPHostData *self, const char *iface, guint
 const char *
 korva_upnp_host_data_get_protocol_info (KorvaUPnPHostData *self)
 {
+    g_mutex_lock (&self->priv->lock);
     if (self->priv->protocol_info == NULL) {
         GVariant *value;
         const char *dlna_profile;
@@ -428,10 +485,86 @@ korva_upnp_host_data_get_protocol_info (KorvaUPnPHostData *self)
         self->priv->protocol_info = gupnp_protocol_info_to_string (info);
         g_object_unref (info);
     }
+    g_mutex_unlock (&self->priv->lock);
 
     return self->priv->protocol_info;
 }
 
+/* Optional numeric meta-data is only used if it has the documented type */
+static int
+korva_upnp_host_data_lookup_uint (KorvaUPnPHostData *self, const char *key)
+{
+    GVariant *value;
+
+    value = g_hash_table_lookup (self->priv->meta_data, key);
+    if (value == NULL || !g_variant_is_of_type (value, G_VARIANT_TYPE_UINT32)) {
+        return -1;
+    }
+
+    return (int) MIN (g_variant_get_uint32 (value), G_MAXINT);
+}
+
+/**
+ * korva_upnp_host_data_get_didl_lite:
+ *
+ * Get the DIDL-Lite document describing the :file as it is served from @uri,
+ * to be used as CurrentURIMetaData. The document only depends on the file's
+ * :meta-data and @uri, so it is created once per URI and shared by all
+ * renderers the file is pushed to through the same interface.
+ *
+ * @self: An instance of #KorvaUPnPHostData
+ * @uri: The URI the file is served from, see korva_upnp_host_data_get_uri()
+ *
+ * Returns: (transfer none): A DIDL-Lite XML string.
+ */
+const char *
+korva_upnp_host_data_get_didl_lite (KorvaUPnPHostData *self, const char *uri)
+{
+    KorvaUPnPDIDLLiteItem item = KORVA_UPNP_DIDL_LITE_ITEM_INIT;
+    GVariant *value;
+    char *didl_lite;
+
+    g_mutex_lock (&self->priv->lock);
+    if (self->priv->didl_lite == NULL) {
+        self->priv->didl_lite = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    }
+
+    didl_lite = g_hash_table_lookup (self->priv->didl_lite, uri);
+    g_mutex_unlock (&self->priv->lock);
+
+    if (didl_lite != NULL) {
+        return didl_lite;
+    }
+
+    value = g_hash_table_lookup (self->priv->meta_data, "Title");
+    if (value != NULL) {
+        item.title = g_variant_get_string (value, NULL);
+    }
+
+    item.uri = uri;
+    if (g_hash_table_contains (self->priv->meta_data, "Size")) {
+        item.size = korva_upnp_host_data_get_size (self);
+    }
+    item.protocol_info = korva_upnp_host_data_get_protocol_info (self);
+    item.duration = korva_upnp_host_data_lookup_uint (self, "Duration");
+    item.bitrate = korva_upnp_host_data_lookup_uint (self, "Bitrate");
+    item.width = korva_upnp_host_data_lookup_uint (self, "Width");
+    item.height = korva_upnp_host_data_lookup_uint (self, "Height");
+
+    value = g_hash_table_lookup (self->priv->meta_data, "AlbumArtURI");
+    if (value != NULL && g_variant_is_of_type (value, G_VARIANT_TYPE_STRING)) {
+        item.album_art_uri = g_variant_get_string (value, NULL);
+    }
+
+    didl_lite = korva_upnp_didl_lite_write (&item);
+
+    g_mutex_lock (&self->priv->lock);
+    g_hash_table_replace (self->priv->didl_lite, g_strdup (uri), didl_lite);
+    g_mutex_unlock (&self->priv->lock);
+
+    return didl_lite;
+}
+
 /**
  * korva_upnp_host_data_valid_for_peer:
  *
@@ -446,7 +579,9 @@ korva_upnp_host_data_valid_for_peer (KorvaUPnPHostData *self, const char *peer)
 {
     GList *it;
 
+    g_mutex_lock (&self->priv->lock);
     it = g_list_find_custom (self->priv->peers, peer, (GCompareFunc) g_strcmp0);
+    g_mutex_unlock (&self->priv->lock);
 
     return it != NULL;
 }
@@ -461,11 +596,19 @@ korva_upnp_host_data_valid_for_peer (KorvaUPnPHostData *self, const char *peer)
 void
 korva_upnp_host_data_start_timeout (KorvaUPnPHostData *self)
 {
-    korva_upnp_host_data_cancel_timeout (self);
+    g_mutex_lock (&self->priv->lock);
+    if (self->priv->timeout_id != 0) {
+        g_source_remove (self->priv->timeout_id);
+    }
 
-    self->priv->timeout_id = g_timeout_add_seconds (KORVA_UPNP_FILE_SERVER_DEFAULT_TIMEOUT,
-                                                    korva_upnp_host_data_on_timeout,
-                                                    self);
+    /* Always attached to the default main context, even when called from
+     * the file server's thread */
+    self->priv->timeout_id = g_timeout_add_seconds_full (korva_priority_get (KORVA_PRIORITY_CLASS_HOUSEKEEPING),
+                                                         KORVA_UPNP_FILE_SERVER_DEFAULT_TIMEOUT,
+                                                         korva_upnp_host_data_on_timeout,
+                                                         self,
+                                                         NULL);
+    g_mutex_unlock (&self->priv->lock);
 }
 
 /**
@@ -478,10 +621,12 @@ korva_upnp_host_data_start_timeout (KorvaUPnPHostData *self)
 void
 korva_upnp_host_data_cancel_timeout (KorvaUPnPHostData *self)
 {
+    g_mutex_lock (&self->priv->lock);
     if (self->priv->timeout_id != 0) {
         g_source_remove (self->priv->timeout_id);
         self->priv->timeout_id = 0;
     }
+    g_mutex_unlock (&self->priv->lock);
 }
 
 /**
@@ -581,25 +726,624 @@ korva_upnp_host_data_get_content_type (KorvaUPnPHostData *self)
 gboolean
 korva_upnp_host_data_has_peers (KorvaUPnPHostData *self)
 {
-    return self->priv->peers != NULL;
+    gboolean result;
+
+    g_mutex_lock (&self->priv->lock);
+    result = self->priv->peers != NULL;
+    g_mutex_unlock (&self->priv->lock);
+
+    return result;
 }
 
 void
 korva_upnp_host_data_add_request (KorvaUPnPHostData *self)
 {
+    g_mutex_lock (&self->priv->lock);
     self->priv->request_count++;
+    g_mutex_unlock (&self->priv->lock);
 }
 
 void
 korva_upnp_host_data_remove_request (KorvaUPnPHostData *self)
 {
+    g_mutex_lock (&self->priv->lock);
     self->priv->request_count--;
+    g_mutex_unlock (&self->priv->lock);
 }
 
 gboolean
 korva_upnp_host_data_has_requests (KorvaUPnPHostData *self)
 {
-    return self->priv->request_count != 0;
+    gboolean result;
+
+    g_mutex_lock (&self->priv->lock);
+    result = self->priv->request_count != 0;
+    g_mutex_unlock (&self->priv->lock);
+
+    return result;
+}
+
+/**
+ * korva_upnp_host_data_add_trace:
+ *
+ * Attach the trace of a push operation to the file so the first request of
+ * @peer can record when the first byte was served.
+ *
+ * @self: An instance of #KorvaUPnPHostData
+ * @peer: IP address of the remote device the file was pushed to
+ * @trace: (allow-none): A #KorvaPushTrace
+ */
+void
+korva_upnp_host_data_add_trace (KorvaUPnPHostData *self,
+                                const char        *peer,
+                                KorvaPushTrace    *trace)
+{
+    if (trace == NULL) {
+        return;
+    }
+
+    g_mutex_lock (&self->priv->lock);
+    if (self->priv->traces == NULL) {
+        self->priv->traces = g_hash_table_new_full (g_str_hash,
+                                                    g_str_equal,
+                                                    g_free,
+                                                    (GDestroyNotify) korva_push_trace_unref);
+    }
+
+    g_hash_table_replace (self->priv->traces, g_strdup (peer), korva_push_trace_ref (trace));
+    g_mutex_unlock (&self->priv->lock);
+}
+
+/**
+ * korva_upnp_host_data_steal_trace:
+ *
+ * Remove the pending push trace for @peer from the file.
+ *
+ * @self: An instance of #KorvaUPnPHostData
+ * @peer: IP address of the remote device that is requesting the file
+ *
+ * Returns: (transfer full) (allow-none): The #KorvaPushTrace or %NULL if there
+ *   is no pending trace for @peer.
+ */
+KorvaPushTrace *
+korva_upnp_host_data_steal_trace (KorvaUPnPHostData *self, const char *peer)
+{
+    KorvaPushTrace *trace = NULL;
+    char *key = NULL;
+
+    g_mutex_lock (&self->priv->lock);
+    if (self->priv->traces != NULL &&
+        g_hash_table_steal_extended (self->priv->traces, peer, (gpointer *) &key, (gpointer *) &trace)) {
+        g_free (key);
+    }
+    g_mutex_unlock (&self->priv->lock);
+
+    return trace;
+}
+
+static KorvaUPnPPlaylistMember *
+korva_upnp_playlist_member_new (GFile *file, const char *title, const char *content_type)
+{
+    KorvaUPnPPlaylistMember *member;
+
+    member = g_slice_new0 (KorvaUPnPPlaylistMember);
+    member->file = file;
+    member->title = g_strdup (title);
+    if (content_type != NULL) {
+        member->content_type = g_content_type_get_mime_type (content_type);
+    }
+
+    if (member->content_type == NULL) {
+        member->content_type = g_strdup ("application/octet-stream");
+    }
+
+    return member;
+}
+
+static void
+korva_upnp_playlist_member_free (KorvaUPnPPlaylistMember *member)
+{
+    g_object_unref (member->file);
+    g_free (member->title);
+    g_free (member->content_type);
+    g_free (member->collate_key);
+    g_clear_object (&member->data);
+    g_slice_free (KorvaUPnPPlaylistMember, member);
+}
+
+static gboolean
+korva_upnp_playlist_member_is_media (KorvaUPnPPlaylistMember *member)
+{
+    return g_str_has_prefix (member->content_type, "audio/") ||
+           g_str_has_prefix (member->content_type, "video/") ||
+           g_str_has_prefix (member->content_type, "image/");
+}
+
+static int
+korva_upnp_playlist_member_compare (gconstpointer a, gconstpointer b)
+{
+    const KorvaUPnPPlaylistMember *member_a = *(KorvaUPnPPlaylistMember **) a;
+    const KorvaUPnPPlaylistMember *member_b = *(KorvaUPnPPlaylistMember **) b;
+
+    return strcmp (member_a->collate_key, member_b->collate_key);
+}
+
+/* Build the list of entries of the playlist. Only names are needed for
+ * this; the entries' meta-data is queried when they are requested. This
+ * runs in a worker thread and lists the directory without holding the lock,
+ * so neither the file server's thread nor other requests wait for slow file
+ * systems; if two requests race, the first list to be done wins. Returns a
+ * new reference to the list. */
+static GPtrArray *
+korva_upnp_host_data_ensure_members (KorvaUPnPHostData *self,
+                                     GCancellable      *cancellable,
+                                     GError           **error)
+{
+    g_autoptr (GFileEnumerator) enumerator = NULL;
+    GPtrArray *members;
+    GVariant *value;
+
+    g_mutex_lock (&self->priv->lock);
+    members = self->priv->members;
+    if (members != NULL) {
+        g_ptr_array_ref (members);
+    }
+    g_mutex_unlock (&self->priv->lock);
+
+    if (members != NULL) {
+        return members;
+    }
+
+    members = g_ptr_array_new_with_free_func ((GDestroyNotify) korva_upnp_playlist_member_free);
+
+    value = g_hash_table_lookup (self->priv->meta_data, "URIs");
+    if (value != NULL) {
+        GVariantIter iter;
+        const char *uri;
+
+        g_variant_iter_init (&iter, value);
+        while (g_variant_iter_next (&iter, "&s", &uri)) {
+            GFile *file = g_file_new_for_uri (uri);
+            g_autofree char *basename = g_file_get_basename (file);
+            g_autofree char *content_type = g_content_type_guess (basename, NULL, 0, NULL);
+
+            g_ptr_array_add (members, korva_upnp_playlist_member_new (file, basename, content_type));
+        }
+
+        goto out;
+    }
+
+    enumerator = g_file_enumerate_children (self->priv->file,
+                                            KORVA_UPNP_HOST_DATA_MEMBER_ATTRIBUTES,
+                                            G_FILE_QUERY_INFO_NONE,
+                                            cancellable,
+                                            error);
+    if (enumerator == NULL) {
+        g_ptr_array_unref (members);
+
+        return NULL;
+    }
+
+    while (TRUE) {
+        KorvaUPnPPlaylistMember *member;
+        GFileInfo *info;
+        const char *content_type;
+
+        if (!g_file_enumerator_iterate (enumerator, &info, NULL, cancellable, error)) {
+            g_ptr_array_unref (members);
+
+            return NULL;
+        }
+
+        if (info == NULL) {
+            break;
+        }
+
+        if (g_file_info_get_file_type (info) != G_FILE_TYPE_REGULAR ||
+            g_file_info_get_is_hidden (info)) {
+            continue;
+        }
+
+        content_type = g_file_info_get_attribute_string (info, G_FILE_ATTRIBUTE_STANDARD_FAST_CONTENT_TYPE);
+        member = korva_upnp_playlist_member_new (g_file_enumerator_get_child (enumerator, info),
+                                                 g_file_info_get_display_name (info),
+                                                 content_type);
+
+        /* Anything else in the directory is of no use to a renderer */
+        if (!korva_upnp_playlist_member_is_media (member)) {
+            korva_upnp_playlist_member_free (member);
+
+            continue;
+        }
+
+        member->collate_key = g_utf8_collate_key_for_filename (member->title, -1);
+        g_ptr_array_add (members, member);
+    }
+
+    g_ptr_array_sort (members, korva_upnp_playlist_member_compare);
+
+out:
+    g_mutex_lock (&self->priv->lock);
+    if (self->priv->members == NULL) {
+        self->priv->members = g_ptr_array_ref (members);
+    } else {
+        g_ptr_array_unref (members);
+        members = g_ptr_array_ref (self->priv->members);
+    }
+    g_mutex_unlock (&self->priv->lock);
+
+    return members;
+}
+
+static char *
+korva_upnp_host_data_get_member_uri (const char *base, KorvaUPnPPlaylistMember *member, guint index)
+{
+    g_autofree char *basename = g_file_get_basename (member->file);
+    const char *ext = NULL;
+    gsize i;
+
+    if (basename != NULL) {
+        ext = strrchr (basename, '.');
+    }
+
+    if (ext != NULL) {
+        ext++;
+        for (i = 0; ext[i] != '\0'; i++) {
+            if (i == 4 || !g_ascii_isalnum (ext[i])) {
+                ext = NULL;
+
+                break;
+            }
+        }
+    }
+
+    if (ext == NULL || *ext == '\0') {
+        ext = "dat";
+    }
+
+    return g_strdup_printf ("%s/%u.%s", base, index, ext);
+}
+
+/**
+ * korva_upnp_host_data_is_playlist:
+ *
+ * Check whether the host data stands for a pushed directory or list of
+ * URIs, which is served as a playlist.
+ *
+ * @self: An instance of #KorvaUPnPHostData
+ *
+ * Returns: %TRUE for a playlist, %FALSE for a single file.
+ */
+gboolean
+korva_upnp_host_data_is_playlist (KorvaUPnPHostData *self)
+{
+    return g_hash_table_contains (self->priv->meta_data, "Playlist");
+}
+
+/* Generate the playlist document in a worker thread, see
+ * korva_upnp_host_data_get_playlist_async() */
+static GBytes *
+korva_upnp_host_data_create_playlist (KorvaUPnPHostData *self,
+                                      const char        *host,
+                                      guint              port,
+                                      GCancellable      *cancellable,
+                                      GError           **error)
+{
+    g_autofree char *id = NULL;
+    g_autofree char *path = NULL;
+    g_autofree char *base = NULL;
+    g_autoptr (GPtrArray) members = NULL;
+    GBytes *result = NULL;
+    guint i;
+
+    members = korva_upnp_host_data_ensure_members (self, cancellable, error);
+    if (members == NULL) {
+        return NULL;
+    }
+
+    id = korva_upnp_host_data_get_id (self);
+    path = g_strdup_printf ("/item/%s", id);
+    base = g_uri_join (G_URI_FLAGS_NONE, "http", NULL, host, port, path, NULL, NULL);
+
+    if (g_strcmp0 (korva_upnp_host_data_get_content_type (self), KORVA_UPNP_PLAYLIST_DIDL_LITE) == 0) {
+        KorvaUPnPDIDLLiteItem *items;
+        GPtrArray *strings;
+        char *didl_lite;
+
+        items = g_new (KorvaUPnPDIDLLiteItem, members->len);
+        strings = g_ptr_array_new_with_free_func (g_free);
+        for (i = 0; i < members->len; i++) {
+            KorvaUPnPPlaylistMember *member = g_ptr_array_index (members, i);
+            char *uri, *protocol_info;
+
+            uri = korva_upnp_host_data_get_member_uri (base, member, i);
+            protocol_info = g_strdup_printf ("http-get:*:%s:*", member->content_type);
+            g_ptr_array_add (strings, uri);
+            g_ptr_array_add (strings, protocol_info);
+
+            items[i] = (KorvaUPnPDIDLLiteItem) KORVA_UPNP_DIDL_LITE_ITEM_INIT;
+            items[i].title = member->title;
+            items[i].uri = uri;
+            items[i].protocol_info = protocol_info;
+        }
+
+        didl_lite = korva_upnp_didl_lite_write_list (items, members->len);
+        result = g_bytes_new_take (didl_lite, strlen (didl_lite));
+
+        g_ptr_array_unref (strings);
+        g_free (items);
+    } else {
+        GString *playlist = g_string_new ("#EXTM3U\n");
+
+        for (i = 0; i < members->len; i++) {
+            KorvaUPnPPlaylistMember *member = g_ptr_array_index (members, i);
+            g_autofree char *uri = korva_upnp_host_data_get_member_uri (base, member, i);
+            g_autofree char *title = g_strdelimit (g_strdup (member->title), "\r\n", ' ');
+
+            g_string_append_printf (playlist, "#EXTINF:-1,%s\n%s\n", title, uri);
+        }
+
+        result = g_string_free_to_bytes (playlist);
+    }
+
+    return result;
+}
+
+/* Look up or create the host data of an entry in a worker thread, see
+ * korva_upnp_host_data_get_member_async() */
+static KorvaUPnPHostData *
+korva_upnp_host_data_create_member (KorvaUPnPHostData *self,
+                                    guint              index,
+                                    const char        *peer,
+                                    GCancellable      *cancellable,
+                                    GError           **error)
+{
+    g_autoptr (GPtrArray) members = NULL;
+    g_autoptr (GHashTable) params = NULL;
+    g_autoptr (KorvaUPnPMetadataQuery) query = NULL;
+    g_autofree char *uri = NULL;
+    KorvaUPnPPlaylistMember *member;
+    KorvaUPnPHostData *data = NULL;
+
+    members = korva_upnp_host_data_ensure_members (self, cancellable, error);
+    if (members == NULL) {
+        return NULL;
+    }
+
+    if (index >= members->len) {
+        g_set_error (error,
+                     G_IO_ERROR,
+                     G_IO_ERROR_NOT_FOUND,
+                     "Playlist has no entry %u",
+                     index);
+
+        return NULL;
+    }
+
+    member = g_ptr_array_index (members, index);
+    g_mutex_lock (&self->priv->lock);
+    if (member->data != NULL) {
+        data = g_object_ref (member->data);
+    }
+    g_mutex_unlock (&self->priv->lock);
+
+    if (data != NULL) {
+        return data;
+    }
+
+    /* The query reads the file, so it runs without the lock */
+    uri = g_file_get_uri (member->file);
+    params = g_hash_table_new_full (g_str_hash,
+                                    g_str_equal,
+                                    g_free,
+                                    (GDestroyNotify) g_variant_unref);
+    g_hash_table_insert (params, g_strdup ("URI"), g_variant_new_string (uri));
+
+    query = korva_upnp_metadata_query_new (member->file, params);
+    if (!korva_upnp_metadata_query_run_sync (query, cancellable, error)) {
+        return NULL;
+    }
+
+    if (g_hash_table_contains (params, "Playlist")) {
+        g_set_error (error,
+                     G_IO_ERROR,
+                     G_IO_ERROR_NOT_FOUND,
+                     "Entry %u of the playlist is a directory",
+                     index);
+
+        return NULL;
+    }
+
+    data = korva_upnp_host_data_new (member->file, params, peer);
+    korva_upnp_host_data_cancel_timeout (data);
+
+    /* Another request for the same entry may have been faster */
+    g_mutex_lock (&self->priv->lock);
+    if (member->data == NULL) {
+        member->data = g_object_ref (data);
+    } else {
+        g_object_unref (data);
+        data = g_object_ref (member->data);
+    }
+    g_mutex_unlock (&self->priv->lock);
+
+    return data;
+}
+
+static void
+korva_upnp_host_data_playlist_request_free (KorvaUPnPPlaylistRequest *request)
+{
+    g_free (request->host);
+    g_free (request->peer);
+    g_slice_free (KorvaUPnPPlaylistRequest, request);
+}
+
+static void
+korva_upnp_host_data_playlist_thread (GTask        *task,
+                                      gpointer      source_object,
+                                      gpointer      task_data,
+                                      GCancellable *cancellable)
+{
+    KorvaUPnPPlaylistRequest *request = (KorvaUPnPPlaylistRequest *) task_data;
+    GBytes *playlist;
+    GError *error = NULL;
+
+    playlist = korva_upnp_host_data_create_playlist (KORVA_UPNP_HOST_DATA (source_object),
+                                                     request->host,
+                                                     request->port,
+                                                     cancellable,
+                                                     &error);
+    if (playlist == NULL) {
+        g_task_return_error (task, error);
+
+        return;
+    }
+
+    g_task_return_pointer (task, playlist, (GDestroyNotify) g_bytes_unref);
+}
+
+static void
+korva_upnp_host_data_member_thread (GTask        *task,
+                                    gpointer      source_object,
+                                    gpointer      task_data,
+                                    GCancellable *cancellable)
+{
+    KorvaUPnPPlaylistRequest *request = (KorvaUPnPPlaylistRequest *) task_data;
+    KorvaUPnPHostData *data;
+    GError *error = NULL;
+
+    data = korva_upnp_host_data_create_member (KORVA_UPNP_HOST_DATA (source_object),
+                                               request->index,
+                                               request->peer,
+                                               cancellable,
+                                               &error);
+    if (data == NULL) {
+        g_task_return_error (task, error);
+
+        return;
+    }
+
+    g_task_return_pointer (task, data, g_object_unref);
+}
+
+/**
+ * korva_upnp_host_data_get_playlist_async:
+ *
+ * Generate the playlist document, pointing to the entries as served from
+ * @host and @port. It is a DIDL-Lite document if the content type in
+ * :meta-data is #KORVA_UPNP_PLAYLIST_DIDL_LITE and an M3U playlist
+ * otherwise. A pushed directory is listed in a worker thread when the
+ * playlist is generated for the first time; @callback is called in the
+ * thread-default main context of the caller.
+ *
+ * @self: An instance of #KorvaUPnPHostData
+ * @host: Host name the HTTP server was contacted on
+ * @port: TCP port the HTTP server is listening on
+ * @cancellable: (allow-none): A #GCancellable
+ * @callback: Called when the playlist is ready
+ * @user_data: User data for @callback
+ */
+void
+korva_upnp_host_data_get_playlist_async (KorvaUPnPHostData  *self,
+                                         const char         *host,
+                                         guint               port,
+                                         GCancellable       *cancellable,
+                                         GAsyncReadyCallback callback,
+                                         gpointer            user_data)
+{
+    GTask *task;
+    KorvaUPnPPlaylistRequest *request;
+
+    request = g_slice_new0 (KorvaUPnPPlaylistRequest);
+    request->host = g_strdup (host);
+    request->port = port;
+
+    task = g_task_new (self, cancellable, callback, user_data);
+    g_task_set_source_tag (task, korva_upnp_host_data_get_playlist_async);
+    g_task_set_task_data (task, request, (GDestroyNotify) korva_upnp_host_data_playlist_request_free);
+
+    /* A renderer is waiting for the answer */
+    g_task_set_priority (task, korva_priority_get (KORVA_PRIORITY_CLASS_STREAMING));
+    g_task_run_in_thread (task, korva_upnp_host_data_playlist_thread);
+    g_object_unref (task);
+}
+
+/**
+ * korva_upnp_host_data_get_playlist_finish:
+ *
+ * @self: An instance of #KorvaUPnPHostData
+ * @res: The #GAsyncResult passed to the callback
+ * @error: Return location for a #GError
+ *
+ * Returns: (transfer full) (allow-none): The playlist or %NULL on error.
+ */
+GBytes *
+korva_upnp_host_data_get_playlist_finish (KorvaUPnPHostData *self,
+                                          GAsyncResult      *res,
+                                          GError           **error)
+{
+    g_return_val_if_fail (g_task_is_valid (res, self), NULL);
+
+    return g_task_propagate_pointer (G_TASK (res), error);
+}
+
+/**
+ * korva_upnp_host_data_get_member_async:
+ *
+ * Get the host data of the @index-th entry of the playlist. It is created
+ * and its meta-data queried in a worker thread when the entry is requested
+ * for the first time; @callback is called in the thread-default main
+ * context of the caller. Entries have no timeout of their own, they are
+ * dropped together with the playlist.
+ *
+ * @self: An instance of #KorvaUPnPHostData
+ * @index: Position of the entry in the playlist
+ * @peer: IP address of the remote device requesting the entry
+ * @cancellable: (allow-none): A #GCancellable
+ * @callback: Called when the entry is ready
+ * @user_data: User data for @callback
+ */
+void
+korva_upnp_host_data_get_member_async (KorvaUPnPHostData  *self,
+                                       guint               index,
+                                       const char         *peer,
+                                       GCancellable       *cancellable,
+                                       GAsyncReadyCallback callback,
+                                       gpointer            user_data)
+{
+    GTask *task;
+    KorvaUPnPPlaylistRequest *request;
+
+    request = g_slice_new0 (KorvaUPnPPlaylistRequest);
+    request->index = index;
+    request->peer = g_strdup (peer);
+
+    task = g_task_new (self, cancellable, callback, user_data);
+    g_task_set_source_tag (task, korva_upnp_host_data_get_member_async);
+    g_task_set_task_data (task, request, (GDestroyNotify) korva_upnp_host_data_playlist_request_free);
+    g_task_set_priority (task, korva_priority_get (KORVA_PRIORITY_CLASS_STREAMING));
+    g_task_run_in_thread (task, korva_upnp_host_data_member_thread);
+    g_object_unref (task);
+}
+
+/**
+ * korva_upnp_host_data_get_member_finish:
+ *
+ * @self: An instance of #KorvaUPnPHostData
+ * @res: The #GAsyncResult passed to the callback
+ * @error: Return location for a #GError
+ *
+ * Returns: (transfer full) (allow-none): The #KorvaUPnPHostData of the entry
+ *   or %NULL on error.
+ */
+KorvaUPnPHostData *
+korva_upnp_host_data_get_member_finish (KorvaUPnPHostData *self,
+                                        GAsyncResult      *res,
+                                        GError           **error)
+{
+    g_return_val_if_fail (g_task_is_valid (res, self), NULL);
+
+    return g_task_propagate_pointer (G_TASK (res), error);
 }
 
 /**
@@ -621,6 +1365,18 @@ korva_upnp_host_data_get_extension (KorvaUPnPHostData *self)
         goto out;
     }
 
+    /* The file of a list of URIs is not a local file */
+    if (korva_upnp_host_data_is_playlist (self)) {
+        if (g_strcmp0 (korva_upnp_host_data_get_content_type (self),
+                       KORVA_UPNP_PLAYLIST_DIDL_LITE) == 0) {
+            self->priv->extension = g_strdup ("xml");
+        } else {
+            self->priv->extension = g_strdup ("m3u");
+        }
+
+        goto out;
+    }
+
     path = g_file_get_path (self->priv->file);
     ext = g_strrstr (path, ".");
     if (!(ext == NULL || *ext == '\0' || strlen (++ext) > 4)) {
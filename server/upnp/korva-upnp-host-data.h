@@ -23,6 +23,8 @@
 #include <glib-object.h>
 #include <gio/gio.h>
 
+#include <korva-push-trace.h>
+
 G_BEGIN_DECLS
 
 #define KORVA_TYPE_UPNP_HOST_DATA \
@@ -48,6 +50,9 @@ korva_upnp_host_data_get_uri (KorvaUPnPHostData *self, const char *iface, guint
 const char *
 korva_upnp_host_data_get_protocol_info (KorvaUPnPHostData *self);
 
+const char *
+korva_upnp_host_data_get_didl_lite (KorvaUPnPHostData *self, const char *uri);
+
 gboolean
 korva_upnp_host_data_valid_for_peer (KorvaUPnPHostData *self, const char *peer);
 
@@ -84,4 +89,41 @@ korva_upnp_host_data_remove_request (KorvaUPnPHostData *self);
 gboolean
 korva_upnp_host_data_has_requests (KorvaUPnPHostData *self);
 
+void
+korva_upnp_host_data_add_trace (KorvaUPnPHostData *self,
+                                const char        *peer,
+                                KorvaPushTrace    *trace);
+
+KorvaPushTrace *
+korva_upnp_host_data_steal_trace (KorvaUPnPHostData *self, const char *peer);
+
+gboolean
+korva_upnp_host_data_is_playlist (KorvaUPnPHostData *self);
+
+void
+korva_upnp_host_data_get_playlist_async (KorvaUPnPHostData  *self,
+                                         const char         *host,
+                                         guint               port,
+                                         GCancellable       *cancellable,
+                                         GAsyncReadyCallback callback,
+                                         gpointer            user_data);
+
+GBytes *
+korva_upnp_host_data_get_playlist_finish (KorvaUPnPHostData *self,
+                                          GAsyncResult      *res,
+                                          GError           **error);
+
+void
+korva_upnp_host_data_get_member_async (KorvaUPnPHostData  *self,
+                                       guint               index,
+                                       const char         *peer,
+                                       GCancellable       *cancellable,
+                                       GAsyncReadyCallback callback,
+                                       gpointer            user_data);
+
+KorvaUPnPHostData *
+korva_upnp_host_data_get_member_finish (KorvaUPnPHostData *self,
+                                        GAsyncResult      *res,
+                                        GError           **error);
+
 G_END_DECLS
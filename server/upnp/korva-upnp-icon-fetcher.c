@@ -0,0 +1,216 @@
+/*
+    This file is part of Korva.
+
+    Copyright (C) 2012 Openismus GmbH.
+    Author: Jens Georg <jensg@openismus.com>
+
+    Korva is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Korva is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Korva.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define G_LOG_DOMAIN "Korva-UPnP-Icon-Fetcher"
+
+#include <libsoup/soup.h>
+
+#include <korva-priority.h>
+
+#include "korva-upnp-icon-fetcher.h"
+
+/* Icons are tiny, anything bigger is not an icon we want to keep */
+#define KORVA_UPNP_ICON_FETCHER_MAX_SIZE (512 * 1024)
+
+/*
+ * Icon downloads shared by all devices. Requests for a URL that is already
+ * being downloaded join the running download instead of starting another
+ * one, and at most KORVA_UPNP_ICON_FETCHER_MAX_ACTIVE downloads run at the
+ * same time so a burst of new devices does not open a connection per device.
+ */
+typedef struct {
+    char        *url;
+    SoupMessage *message;
+    GList       *waiters;
+} KorvaUPnPIconFetch;
+
+static SoupSession *session;
+static GHashTable *fetches;
+static GQueue queue = G_QUEUE_INIT;
+static guint active;
+
+static void
+korva_upnp_icon_fetcher_start (KorvaUPnPIconFetch *fetch);
+
+static void
+korva_upnp_icon_fetch_free (KorvaUPnPIconFetch *fetch)
+{
+    g_free (fetch->url);
+    g_clear_object (&fetch->message);
+    g_list_free (fetch->waiters);
+    g_free (fetch);
+}
+
+static void
+korva_upnp_icon_fetcher_complete (KorvaUPnPIconFetch *fetch, GBytes *icon, GError *error)
+{
+    GList *it;
+
+    g_hash_table_remove (fetches, fetch->url);
+
+    for (it = fetch->waiters; it != NULL; it = it->next) {
+        GTask *task = G_TASK (it->data);
+
+        if (icon != NULL) {
+            g_task_return_pointer (task, g_bytes_ref (icon), (GDestroyNotify) g_bytes_unref);
+        } else {
+            g_task_return_error (task, g_error_copy (error));
+        }
+        g_object_unref (task);
+    }
+
+    korva_upnp_icon_fetch_free (fetch);
+}
+
+static void
+korva_upnp_icon_fetcher_start_queued (void)
+{
+    while (active < KORVA_UPNP_ICON_FETCHER_MAX_ACTIVE && !g_queue_is_empty (&queue)) {
+        korva_upnp_icon_fetcher_start (g_queue_pop_head (&queue));
+    }
+}
+
+static void
+korva_upnp_icon_fetcher_on_fetched (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    KorvaUPnPIconFetch *fetch = (KorvaUPnPIconFetch *) user_data;
+    g_autoptr (GBytes) icon = NULL;
+    g_autoptr (GError) error = NULL;
+    guint status;
+
+    active--;
+
+    icon = soup_session_send_and_read_finish (SOUP_SESSION (source), res, &error);
+    if (icon != NULL) {
+        status = soup_message_get_status (fetch->message);
+        if (!SOUP_STATUS_IS_SUCCESSFUL (status)) {
+            error = g_error_new (G_IO_ERROR,
+                                 G_IO_ERROR_FAILED,
+                                 "Downloading icon %s failed: %u %s",
+                                 fetch->url,
+                                 status,
+                                 soup_message_get_reason_phrase (fetch->message));
+            g_clear_pointer (&icon, g_bytes_unref);
+        } else if (g_bytes_get_size (icon) == 0 ||
+                   g_bytes_get_size (icon) > KORVA_UPNP_ICON_FETCHER_MAX_SIZE) {
+            error = g_error_new (G_IO_ERROR,
+                                 G_IO_ERROR_INVALID_DATA,
+                                 "Icon %s has an invalid size of %" G_GSIZE_FORMAT " bytes",
+                                 fetch->url,
+                                 g_bytes_get_size (icon));
+            g_clear_pointer (&icon, g_bytes_unref);
+        }
+    }
+
+    korva_upnp_icon_fetcher_complete (fetch, icon, error);
+    korva_upnp_icon_fetcher_start_queued ();
+}
+
+static void
+korva_upnp_icon_fetcher_start (KorvaUPnPIconFetch *fetch)
+{
+    fetch->message = soup_message_new (SOUP_METHOD_GET, fetch->url);
+    if (fetch->message == NULL) {
+        g_autoptr (GError) error = NULL;
+
+        error = g_error_new (G_IO_ERROR,
+                             G_IO_ERROR_INVALID_ARGUMENT,
+                             "Invalid icon URL %s",
+                             fetch->url);
+        korva_upnp_icon_fetcher_complete (fetch, NULL, error);
+
+        return;
+    }
+
+    g_debug ("Downloading icon %s", fetch->url);
+
+    active++;
+    soup_session_send_and_read_async (session,
+                                      fetch->message,
+                                      korva_priority_get (KORVA_PRIORITY_CLASS_DISCOVERY),
+                                      NULL,
+                                      korva_upnp_icon_fetcher_on_fetched,
+                                      fetch);
+}
+
+/**
+ * korva_upnp_icon_fetcher_fetch_async:
+ *
+ * Download an icon.
+ *
+ * @url: The URL of the icon
+ * @cancellable: (allow-none): A #GCancellable. Cancelling only stops waiting
+ *   for the result, the download itself is shared and continues.
+ * @callback: Called when the icon was downloaded
+ * @user_data: User data for @callback
+ */
+void
+korva_upnp_icon_fetcher_fetch_async (const char         *url,
+                                     GCancellable       *cancellable,
+                                     GAsyncReadyCallback callback,
+                                     gpointer            user_data)
+{
+    GTask *task;
+    KorvaUPnPIconFetch *fetch;
+
+    task = g_task_new (NULL, cancellable, callback, user_data);
+    g_task_set_source_tag (task, korva_upnp_icon_fetcher_fetch_async);
+
+    if (fetches == NULL) {
+        fetches = g_hash_table_new (g_str_hash, g_str_equal);
+        session = soup_session_new ();
+    }
+
+    fetch = g_hash_table_lookup (fetches, url);
+    if (fetch != NULL) {
+        g_debug ("Icon %s is already being downloaded, waiting for it", url);
+        fetch->waiters = g_list_append (fetch->waiters, task);
+
+        return;
+    }
+
+    fetch = g_new0 (KorvaUPnPIconFetch, 1);
+    fetch->url = g_strdup (url);
+    fetch->waiters = g_list_append (NULL, task);
+    g_hash_table_insert (fetches, fetch->url, fetch);
+
+    if (active < KORVA_UPNP_ICON_FETCHER_MAX_ACTIVE) {
+        korva_upnp_icon_fetcher_start (fetch);
+    } else {
+        g_debug ("Too many icon downloads running, queueing %s", url);
+        g_queue_push_tail (&queue, fetch);
+    }
+}
+
+/**
+ * korva_upnp_icon_fetcher_fetch_finish:
+ *
+ * @result: The #GAsyncResult passed to the callback
+ * @error: Return location for a #GError
+ *
+ * Returns: (transfer full) (allow-none): The icon data or %NULL on error.
+ */
+GBytes *
+korva_upnp_icon_fetcher_fetch_finish (GAsyncResult *result, GError **error)
+{
+    g_return_val_if_fail (g_task_is_valid (result, NULL), NULL);
+
+    return g_task_propagate_pointer (G_TASK (result), error);
+}
@@ -0,0 +1,212 @@
+/*
+    This file is part of Korva.
+
+    Copyright (C) 2012 Openismus GmbH.
+    Author: Jens Georg <jensg@openismus.com>
+
+    Korva is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Korva is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Korva.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define G_LOG_DOMAIN "Korva-UPnP-Introspection-Queue"
+
+#include <korva-priority.h>
+
+#include "korva-upnp-introspection-queue.h"
+
+/**
+ * KorvaUPnPIntrospectionQueue:
+ *
+ * Runs the introspection of newly discovered devices with bounded
+ * concurrency. When a rack of renderers powers up or a network context
+ * comes back, all of them are announced at once; introspecting them one
+ * batch at a time keeps the main loop responsive and does not hammer the
+ * renderers with SOAP calls and icon downloads.
+ */
+struct _KorvaUPnPIntrospectionQueue {
+    guint  max_running;
+    GQueue running;
+    GQueue waiting;
+};
+
+typedef struct {
+    KorvaUPnPIntrospectionQueue *queue;
+    char                        *uid;
+    KorvaUPnPDevice             *device;
+    GAsyncReadyCallback          callback;
+    gpointer                     user_data;
+} Introspection;
+
+static void
+korva_upnp_introspection_queue_run (KorvaUPnPIntrospectionQueue *self);
+
+static void
+introspection_free (Introspection *introspection)
+{
+    g_object_unref (introspection->device);
+    g_free (introspection->uid);
+    g_free (introspection);
+}
+
+KorvaUPnPIntrospectionQueue *
+korva_upnp_introspection_queue_new (guint max_running)
+{
+    KorvaUPnPIntrospectionQueue *self;
+
+    g_return_val_if_fail (max_running > 0, NULL);
+
+    self = g_new0 (KorvaUPnPIntrospectionQueue, 1);
+    self->max_running = max_running;
+    g_queue_init (&self->running);
+    g_queue_init (&self->waiting);
+
+    return self;
+}
+
+/**
+ * korva_upnp_introspection_queue_free:
+ * @self: A #KorvaUPnPIntrospectionQueue
+ *
+ * Free the queue. Introspections that did not start yet are dropped without
+ * calling their callbacks; running ones finish normally.
+ */
+void
+korva_upnp_introspection_queue_free (KorvaUPnPIntrospectionQueue *self)
+{
+    GList *it;
+
+    for (it = self->waiting.head; it != NULL; it = it->next) {
+        introspection_free (it->data);
+    }
+    g_queue_clear (&self->waiting);
+
+    for (it = self->running.head; it != NULL; it = it->next) {
+        ((Introspection *) it->data)->queue = NULL;
+    }
+    g_queue_clear (&self->running);
+
+    g_free (self);
+}
+
+static void
+korva_upnp_introspection_queue_on_done (GObject      *source,
+                                        GAsyncResult *res,
+                                        gpointer      user_data)
+{
+    Introspection *introspection = (Introspection *) user_data;
+    KorvaUPnPIntrospectionQueue *self;
+
+    introspection->callback (source, res, introspection->user_data);
+
+    /* The callback might have freed the queue */
+    self = introspection->queue;
+    if (self != NULL) {
+        g_queue_remove (&self->running, introspection);
+    }
+    introspection_free (introspection);
+
+    if (self != NULL) {
+        korva_upnp_introspection_queue_run (self);
+    }
+}
+
+static void
+korva_upnp_introspection_queue_run (KorvaUPnPIntrospectionQueue *self)
+{
+    while (g_queue_get_length (&self->running) < self->max_running &&
+           !g_queue_is_empty (&self->waiting)) {
+        Introspection *introspection = g_queue_pop_head (&self->waiting);
+
+        g_queue_push_tail (&self->running, introspection);
+        g_async_initable_init_async (G_ASYNC_INITABLE (introspection->device),
+                                     korva_priority_get (KORVA_PRIORITY_CLASS_DISCOVERY),
+                                     NULL,
+                                     korva_upnp_introspection_queue_on_done,
+                                     introspection);
+    }
+}
+
+/**
+ * korva_upnp_introspection_queue_push:
+ * @self: A #KorvaUPnPIntrospectionQueue
+ * @uid: UID to find the introspection by in
+ * korva_upnp_introspection_queue_prioritize()
+ * @device: A device that was not initialized yet
+ * @callback: Called with @device as source once g_async_initable_init_async()
+ * is done
+ * @user_data: User data for @callback
+ *
+ * Queue the introspection of @device. It is started right away if fewer than
+ * the maximum number of introspections are running.
+ */
+void
+korva_upnp_introspection_queue_push (KorvaUPnPIntrospectionQueue *self,
+                                     const char                  *uid,
+                                     KorvaUPnPDevice             *device,
+                                     GAsyncReadyCallback          callback,
+                                     gpointer                     user_data)
+{
+    Introspection *introspection;
+
+    introspection = g_new0 (Introspection, 1);
+    introspection->queue = self;
+    introspection->uid = g_strdup (uid);
+    introspection->device = g_object_ref (device);
+    introspection->callback = callback;
+    introspection->user_data = user_data;
+
+    g_queue_push_tail (&self->waiting, introspection);
+    korva_upnp_introspection_queue_run (self);
+}
+
+/**
+ * korva_upnp_introspection_queue_prioritize:
+ * @self: A #KorvaUPnPIntrospectionQueue
+ * @uid: UID of a device
+ *
+ * Move the introspection of the device with @uid to the front of the queue,
+ * e.g. because a client wants to push to it.
+ *
+ * Returns: %TRUE if the device is waiting for its introspection.
+ */
+gboolean
+korva_upnp_introspection_queue_prioritize (KorvaUPnPIntrospectionQueue *self,
+                                           const char                  *uid)
+{
+    GList *it;
+
+    for (it = self->waiting.head; it != NULL; it = it->next) {
+        Introspection *introspection = (Introspection *) it->data;
+
+        if (g_strcmp0 (introspection->uid, uid) == 0) {
+            g_queue_unlink (&self->waiting, it);
+            g_queue_push_head_link (&self->waiting, it);
+
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+guint
+korva_upnp_introspection_queue_get_running (KorvaUPnPIntrospectionQueue *self)
+{
+    return g_queue_get_length (&self->running);
+}
+
+guint
+korva_upnp_introspection_queue_get_waiting (KorvaUPnPIntrospectionQueue *self)
+{
+    return g_queue_get_length (&self->waiting);
+}
@@ -0,0 +1,56 @@
+/*
+    This file is part of Korva.
+
+    Copyright (C) 2012 Openismus GmbH.
+    Author: Jens Georg <jensg@openismus.com>
+
+    Korva is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Korva is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Korva.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+#include "korva-upnp-device.h"
+
+G_BEGIN_DECLS
+
+typedef struct _KorvaUPnPIntrospectionQueue KorvaUPnPIntrospectionQueue;
+
+KorvaUPnPIntrospectionQueue *
+korva_upnp_introspection_queue_new (guint max_running);
+
+void
+korva_upnp_introspection_queue_free (KorvaUPnPIntrospectionQueue *self);
+
+void
+korva_upnp_introspection_queue_push (KorvaUPnPIntrospectionQueue *self,
+                                     const char                  *uid,
+                                     KorvaUPnPDevice             *device,
+                                     GAsyncReadyCallback          callback,
+                                     gpointer                     user_data);
+
+gboolean
+korva_upnp_introspection_queue_prioritize (KorvaUPnPIntrospectionQueue *self,
+                                           const char                  *uid);
+
+guint
+korva_upnp_introspection_queue_get_running (KorvaUPnPIntrospectionQueue *self);
+
+guint
+korva_upnp_introspection_queue_get_waiting (KorvaUPnPIntrospectionQueue *self);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (KorvaUPnPIntrospectionQueue, korva_upnp_introspection_queue_free)
+
+G_END_DECLS
@@ -0,0 +1,388 @@
+/*
+    This file is part of Korva.
+
+    Copyright (C) 2012 Openismus GmbH.
+    Author: Jens Georg <jensg@openismus.com>
+
+    Korva is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Korva is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Korva.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define G_LOG_DOMAIN "Korva-UPnP-Last-Change"
+
+#include <string.h>
+
+#include "korva-upnp-last-change.h"
+
+/*
+ * Scanner for the LastChange events of the AVTransport service. An event
+ * looks like
+ *
+ *   <Event xmlns="urn:schemas-upnp-org:metadata-1-0/AVT/">
+ *     <InstanceID val="0">
+ *       <TransportState val="PLAYING"/>
+ *       <AVTransportURI val="http://..."/>
+ *     </InstanceID>
+ *   </Event>
+ *
+ * Renderers send them several times a second during playback, and usually
+ * with the complete track meta-data, so the event is walked in place: tags
+ * and attributes are only delimited, values are handed out as pointers into
+ * the event and unescaped only when a caller needs a copy.
+ */
+
+static gboolean
+is_space (char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static const char *
+skip_space (const char *p)
+{
+    while (is_space (*p)) {
+        p++;
+    }
+
+    return p;
+}
+
+/* Compare a possibly prefixed tag name of @length bytes to @name */
+static gboolean
+name_equal (const char *tag, gsize length, const char *name)
+{
+    const char *colon;
+
+    colon = memchr (tag, ':', length);
+    if (colon != NULL) {
+        length -= colon + 1 - tag;
+        tag = colon + 1;
+    }
+
+    return strlen (name) == length && strncmp (tag, name, length) == 0;
+}
+
+/*
+ * Parse the tag starting after the '<' at @p. On success, @p points behind
+ * the tag and the name and the value of its "val" attribute are set; @name
+ * is %NULL for comments and processing instructions. Returns %FALSE if the
+ * tag is malformed.
+ */
+static gboolean
+scan_tag (const char **p,
+          const char **name,
+          gsize       *name_length,
+          const char **val,
+          gsize       *val_length,
+          gboolean    *closing)
+{
+    const char *it = *p;
+
+    *val = NULL;
+    *val_length = 0;
+
+    /* Processing instructions, comments and declarations */
+    if (*it == '?' || *it == '!') {
+        const char *end = strstr (it, *it == '!' && it[1] == '-' ? "-->" : ">");
+
+        if (end == NULL) {
+            return FALSE;
+        }
+
+        *name = NULL;
+        *name_length = 0;
+        *closing = FALSE;
+        *p = end + (end[0] == '-' ? 3 : 1);
+
+        return TRUE;
+    }
+
+    *closing = *it == '/';
+    if (*closing) {
+        it++;
+    }
+
+    *name = it;
+    while (*it != '\0' && !is_space (*it) && *it != '/' && *it != '>') {
+        it++;
+    }
+    *name_length = it - *name;
+    if (*name_length == 0) {
+        return FALSE;
+    }
+
+    for (;;) {
+        const char *attr;
+        gsize attr_length;
+        char quote;
+
+        it = skip_space (it);
+        if (*it == '>') {
+            *p = it + 1;
+            break;
+        }
+
+        if (it[0] == '/' && it[1] == '>') {
+            *p = it + 2;
+            break;
+        }
+
+        attr = it;
+        while (*it != '\0' && *it != '=' && !is_space (*it) && *it != '>' && *it != '/') {
+            it++;
+        }
+        attr_length = it - attr;
+        it = skip_space (it);
+        if (attr_length == 0 || *it != '=') {
+            return FALSE;
+        }
+
+        it = skip_space (it + 1);
+        quote = *it;
+        if (quote != '"' && quote != '\'') {
+            return FALSE;
+        }
+
+        it++;
+        attr = name_equal (attr, attr_length, "val") ? it : NULL;
+        it = strchr (it, quote);
+        if (it == NULL) {
+            return FALSE;
+        }
+
+        if (attr != NULL) {
+            *val = attr;
+            *val_length = it - attr;
+        }
+        it++;
+    }
+
+    return TRUE;
+}
+
+/**
+ * korva_upnp_last_change_scan:
+ * @last_change: The value of a LastChange event
+ * @instance_id: The instance to look at
+ * @values: (array length=n_values): The variables to look for
+ * @n_values: Number of entries in @values
+ *
+ * Find the values of the variables named in @values for @instance_id in
+ * @last_change. Nothing is allocated; the values point into @last_change and
+ * are still escaped. Use korva_upnp_last_change_value_equal() and
+ * korva_upnp_last_change_value_dup() to look at them.
+ *
+ * Returns: %FALSE if @last_change is not well-formed enough to be scanned.
+ */
+gboolean
+korva_upnp_last_change_scan (const char               *last_change,
+                             guint                     instance_id,
+                             KorvaUPnPLastChangeValue *values,
+                             guint                     n_values)
+{
+    const char *p = last_change;
+    gboolean in_instance = FALSE;
+    guint i;
+
+    g_return_val_if_fail (last_change != NULL, FALSE);
+
+    for (i = 0; i < n_values; i++) {
+        values[i].value = NULL;
+        values[i].length = 0;
+    }
+
+    while ((p = strchr (p, '<')) != NULL) {
+        const char *name, *val;
+        gsize name_length, val_length;
+        gboolean closing;
+
+        p++;
+        if (!scan_tag (&p, &name, &name_length, &val, &val_length, &closing)) {
+            return FALSE;
+        }
+
+        if (name == NULL) {
+            continue;
+        }
+
+        if (name_equal (name, name_length, "InstanceID")) {
+            if (closing) {
+                in_instance = FALSE;
+            } else if (val != NULL && val_length < 11) {
+                char buffer[11] = { 0 };
+
+                memcpy (buffer, val, val_length);
+                in_instance = g_ascii_strtoull (buffer, NULL, 10) == instance_id;
+            } else {
+                in_instance = FALSE;
+            }
+
+            continue;
+        }
+
+        if (!in_instance || closing || val == NULL) {
+            continue;
+        }
+
+        for (i = 0; i < n_values; i++) {
+            if (name_equal (name, name_length, values[i].name)) {
+                values[i].value = val;
+                values[i].length = val_length;
+
+                break;
+            }
+        }
+    }
+
+    return TRUE;
+}
+
+static const struct {
+    const char *entity;
+    char        c;
+} entities[] = {
+    { "amp;", '&' },
+    { "lt;", '<' },
+    { "gt;", '>' },
+    { "quot;", '"' },
+    { "apos;", '\'' }
+};
+
+/*
+ * Unescape the character at @p, which is before @end, into @out. Returns the
+ * number of bytes written and advances @p.
+ */
+static guint
+next_char (const char **p, const char *end, char out[6])
+{
+    const char *it = *p;
+    guint i;
+
+    if (*it != '&') {
+        out[0] = *it;
+        *p = it + 1;
+
+        return 1;
+    }
+
+    it++;
+    if (it < end && *it == '#') {
+        gunichar c;
+        char *number_end;
+        char buffer[12] = { 0 };
+        const char *semicolon;
+
+        semicolon = memchr (it, ';', end - it);
+        if (semicolon != NULL && semicolon - it < (gssize) sizeof (buffer)) {
+            memcpy (buffer, it + 1, semicolon - it - 1);
+            if (buffer[0] == 'x' || buffer[0] == 'X') {
+                c = g_ascii_strtoull (buffer + 1, &number_end, 16);
+            } else {
+                c = g_ascii_strtoull (buffer, &number_end, 10);
+            }
+
+            if (*number_end == '\0' && number_end != buffer && g_unichar_validate (c)) {
+                *p = semicolon + 1;
+
+                return g_unichar_to_utf8 (c, out);
+            }
+        }
+    } else {
+        for (i = 0; i < G_N_ELEMENTS (entities); i++) {
+            gsize length = strlen (entities[i].entity);
+
+            if ((gsize) (end - it) >= length && strncmp (it, entities[i].entity, length) == 0) {
+                out[0] = entities[i].c;
+                *p = it + length;
+
+                return 1;
+            }
+        }
+    }
+
+    /* Not an entity we know, take the ampersand literally */
+    out[0] = '&';
+    *p = it;
+
+    return 1;
+}
+
+/**
+ * korva_upnp_last_change_value_equal:
+ * @value: A value found by korva_upnp_last_change_scan()
+ * @string: The string to compare to
+ * @ignore_case: Whether to compare ASCII letters case-insensitively
+ *
+ * Returns: %TRUE if the unescaped @value is equal to @string.
+ */
+gboolean
+korva_upnp_last_change_value_equal (const KorvaUPnPLastChangeValue *value,
+                                    const char                     *string,
+                                    gboolean                        ignore_case)
+{
+    const char *p, *end;
+
+    if (value->value == NULL) {
+        return FALSE;
+    }
+
+    p = value->value;
+    end = p + value->length;
+    while (p < end) {
+        char buffer[6];
+        guint length, i;
+
+        length = next_char (&p, end, buffer);
+        for (i = 0; i < length; i++, string++) {
+            if (*string == '\0') {
+                return FALSE;
+            }
+
+            if (ignore_case ? g_ascii_tolower (*string) != g_ascii_tolower (buffer[i])
+                            : *string != buffer[i]) {
+                return FALSE;
+            }
+        }
+    }
+
+    return *string == '\0';
+}
+
+/**
+ * korva_upnp_last_change_value_dup:
+ * @value: A value found by korva_upnp_last_change_scan()
+ *
+ * Returns: (transfer full) (allow-none): A copy of the unescaped value or
+ * %NULL if the variable was not found.
+ */
+char *
+korva_upnp_last_change_value_dup (const KorvaUPnPLastChangeValue *value)
+{
+    const char *p, *end;
+    char *result, *out;
+
+    if (value->value == NULL) {
+        return NULL;
+    }
+
+    /* Unescaping never makes a value longer */
+    result = out = g_malloc (value->length + 1);
+    p = value->value;
+    end = p + value->length;
+    while (p < end) {
+        out += next_char (&p, end, out);
+    }
+    *out = '\0';
+
+    return result;
+}
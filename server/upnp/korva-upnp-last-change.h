@@ -0,0 +1,54 @@
+/*
+    This file is part of Korva.
+
+    Copyright (C) 2012 Openismus GmbH.
+    Author: Jens Georg <jensg@openismus.com>
+
+    Korva is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Korva is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Korva.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/**
+ * KorvaUPnPLastChangeValue:
+ * @name: Name of the state variable to look for
+ * @value: (allow-none): Start of the still escaped value inside the scanned
+ * event or %NULL if the variable was not part of it
+ * @length: Length of @value in bytes
+ */
+typedef struct {
+    const char *name;
+    const char *value;
+    gsize       length;
+} KorvaUPnPLastChangeValue;
+
+gboolean
+korva_upnp_last_change_scan (const char               *last_change,
+                             guint                     instance_id,
+                             KorvaUPnPLastChangeValue *values,
+                             guint                     n_values);
+
+gboolean
+korva_upnp_last_change_value_equal (const KorvaUPnPLastChangeValue *value,
+                                    const char                     *string,
+                                    gboolean                        ignore_case);
+
+char *
+korva_upnp_last_change_value_dup (const KorvaUPnPLastChangeValue *value);
+
+G_END_DECLS
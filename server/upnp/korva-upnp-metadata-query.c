@@ -19,9 +19,18 @@
  */
 
 #include <korva-error.h>
+#include <korva-priority.h>
 
+#include "korva-upnp-constants-private.h"
 #include "korva-upnp-metadata-query.h"
 
+#define KORVA_UPNP_METADATA_QUERY_ATTRIBUTES \
+    G_FILE_ATTRIBUTE_STANDARD_TYPE "," \
+    G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE "," \
+    G_FILE_ATTRIBUTE_STANDARD_SIZE "," \
+    G_FILE_ATTRIBUTE_STANDARD_DISPLAY_NAME "," \
+    G_FILE_ATTRIBUTE_ACCESS_CAN_READ
+
 enum {
     PROP_0,
     PROP_FILE,
@@ -130,23 +139,132 @@ korva_upnp_metadata_query_new (GFile *file, GHashTable *params)
                                                     NULL));
 }
 
+/* A pushed directory or list of URIs is served as a playlist. Its size is
+ * only known once the playlist is generated, so it is left out */
+static void
+korva_upnp_metadata_query_set_playlist (KorvaUPnPMetadataQuery *self, const char *title)
+{
+    g_hash_table_replace (self->priv->params,
+                          g_strdup ("Playlist"),
+                          g_variant_new_boolean (TRUE));
+    g_hash_table_remove (self->priv->params, "Size");
+
+    if (!g_hash_table_contains (self->priv->params, "ContentType")) {
+        g_hash_table_insert (self->priv->params,
+                             g_strdup ("ContentType"),
+                             g_variant_new_string (KORVA_UPNP_PLAYLIST_M3U));
+    }
+
+    if (!g_hash_table_contains (self->priv->params, "Title")) {
+        g_hash_table_insert (self->priv->params,
+                             g_strdup ("Title"),
+                             g_variant_new_string (title));
+    }
+}
+
+static gboolean
+korva_upnp_metadata_query_update_params (KorvaUPnPMetadataQuery *self,
+                                         GFileInfo              *info,
+                                         GError                **error)
+{
+    GVariant *value;
+    gboolean can_read;
+    goffset size;
+
+    can_read = g_file_info_get_attribute_boolean (info, G_FILE_ATTRIBUTE_ACCESS_CAN_READ);
+    if (!can_read) {
+        g_set_error_literal (error,
+                             KORVA_CONTROLLER1_ERROR,
+                             KORVA_CONTROLLER1_ERROR_NOT_ACCESSIBLE,
+                             "Can not read file");
+
+        return FALSE;
+    }
+
+    if (g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY) {
+        korva_upnp_metadata_query_set_playlist (self, g_file_info_get_display_name (info));
+
+        return TRUE;
+    }
+
+    size = g_file_info_get_size (info);
+    g_hash_table_replace (self->priv->params,
+                          g_strdup ("Size"),
+                          g_variant_new_uint64 (size));
+
+    value = g_hash_table_lookup (self->priv->params, "ContentType");
+    if (value == NULL) {
+        const char *content_type = g_file_info_get_content_type (info);
+        g_hash_table_insert (self->priv->params,
+                             g_strdup ("ContentType"),
+                             g_variant_new_string (content_type));
+    }
+
+    value = g_hash_table_lookup (self->priv->params, "Title");
+    if (value == NULL) {
+        g_hash_table_insert (self->priv->params,
+                             g_strdup ("Title"),
+                             g_variant_new_string (g_file_info_get_display_name (info)));
+    }
+
+    return TRUE;
+}
+
 void
 korva_upnp_metadata_query_run_async (KorvaUPnPMetadataQuery *self, GAsyncReadyCallback callback, GCancellable *cancellable, gpointer user_data)
 {
     self->priv->result = g_task_new (self, cancellable, callback, user_data);
 
+    /* The members of a list are only looked at when the renderer asks for
+     * them */
+    if (g_hash_table_contains (self->priv->params, "URIs")) {
+        korva_upnp_metadata_query_set_playlist (self, "Playlist");
+        g_task_return_boolean (self->priv->result, TRUE);
+        g_clear_object (&self->priv->result);
+
+        return;
+    }
+
     g_file_query_info_async (self->priv->file,
-                             G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE ","
-                             G_FILE_ATTRIBUTE_STANDARD_SIZE ","
-                             G_FILE_ATTRIBUTE_STANDARD_DISPLAY_NAME ","
-                             G_FILE_ATTRIBUTE_ACCESS_CAN_READ,
+                             KORVA_UPNP_METADATA_QUERY_ATTRIBUTES,
                              G_FILE_QUERY_INFO_NONE,
-                             G_PRIORITY_DEFAULT_IDLE,
+                             korva_priority_get (KORVA_PRIORITY_CLASS_CONTROL),
                              g_task_get_cancellable (self->priv->result),
                              korva_upnp_metadata_query_on_file_query_info_async,
                              self);
 }
 
+/**
+ * korva_upnp_metadata_query_run_sync:
+ *
+ * Blocking version of korva_upnp_metadata_query_run_async(), for callers
+ * that are not running on the main thread.
+ *
+ * @self: A #KorvaUPnPMetadataQuery
+ * @cancellable: (allow-none): A #GCancellable
+ * @error: Return location for a #GError
+ *
+ * Returns: %TRUE if the meta-data was filled in, %FALSE on error.
+ */
+gboolean
+korva_upnp_metadata_query_run_sync (KorvaUPnPMetadataQuery *self,
+                                    GCancellable           *cancellable,
+                                    GError                **error)
+{
+    g_autoptr (GFileInfo) info = NULL;
+
+    info = g_file_query_info (self->priv->file,
+                              KORVA_UPNP_METADATA_QUERY_ATTRIBUTES,
+                              G_FILE_QUERY_INFO_NONE,
+                              cancellable,
+                              error);
+    if (info == NULL) {
+        return FALSE;
+    }
+
+    return korva_upnp_metadata_query_update_params (self, info, error);
+}
+
 gboolean
 korva_upnp_metadata_query_run_finish (KorvaUPnPMetadataQuery *self, GAsyncResult *res, GError **error)
 {
@@ -164,10 +282,7 @@ korva_upnp_metadata_query_on_file_query_info_async (GObject      *source,
 {
     KorvaUPnPMetadataQuery *self = KORVA_UPNP_METADATA_QUERY (user_data);
     GError *error = NULL;
-    GVariant *value;
     GFileInfo *info;
-    gboolean can_read;
-    goffset size;
 
     info = g_file_query_info_finish (self->priv->file, res, &error);
     if (info == NULL) {
@@ -176,39 +291,12 @@ korva_upnp_metadata_query_on_file_query_info_async (GObject      *source,
         goto out;
     }
 
-    can_read = g_file_info_get_attribute_boolean (info, G_FILE_ATTRIBUTE_ACCESS_CAN_READ);
-    if (!can_read) {
-        g_task_return_new_error (self->priv->result,
-                                 KORVA_CONTROLLER1_ERROR,
-                                 KORVA_CONTROLLER1_ERROR_NOT_ACCESSIBLE,
-                                 "%s",
-                                 "Can not read file");
+    if (!korva_upnp_metadata_query_update_params (self, info, &error)) {
+        g_task_return_error (self->priv->result, error);
 
         goto out;
     }
 
-    value = g_hash_table_lookup (self->priv->params, "Size");
-
-    size = g_file_info_get_size (info);
-    g_hash_table_replace (self->priv->params,
-                          g_strdup ("Size"),
-                          g_variant_new_uint64 (size));
-
-    value = g_hash_table_lookup (self->priv->params, "ContentType");
-    if (value == NULL) {
-        const char *content_type = g_file_info_get_content_type (info);
-        g_hash_table_insert (self->priv->params,
-                             g_strdup ("ContentType"),
-                             g_variant_new_string (content_type));
-    }
-
-    value = g_hash_table_lookup (self->priv->params, "Title");
-    if (value == NULL) {
-        g_hash_table_insert (self->priv->params,
-                             g_strdup ("Title"),
-                             g_variant_new_string (g_file_info_get_display_name (info)));
-    }
-
     g_task_return_boolean (self->priv->result, TRUE);
 out:
     g_clear_object (&info);
@@ -37,6 +37,11 @@ korva_upnp_metadata_query_run_async (KorvaUPnPMetadataQuery *query,
                                      GCancellable           *cancellable,
                                      gpointer                user_data);
 
+gboolean
+korva_upnp_metadata_query_run_sync (KorvaUPnPMetadataQuery *query,
+                                    GCancellable           *cancellable,
+                                    GError                **error);
+
 gboolean
 korva_upnp_metadata_query_run_finish (KorvaUPnPMetadataQuery *query,
                                       GAsyncResult           *res,
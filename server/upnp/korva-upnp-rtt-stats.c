@@ -0,0 +1,199 @@
+/*
+    This file is part of Korva.
+
+    Copyright (C) 2012 Openismus GmbH.
+    Author: Jens Georg <jensg@openismus.com>
+
+    Korva is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Korva is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Korva.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define G_LOG_DOMAIN "Korva-UPnP-Rtt-Stats"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "korva-upnp-rtt-stats.h"
+
+/* Number of recent samples kept for the percentiles */
+#define KORVA_UPNP_RTT_STATS_WINDOW 64
+
+/* Deadlines in milliseconds */
+#define KORVA_UPNP_RTT_STATS_DEFAULT_DEADLINE 10000
+#define KORVA_UPNP_RTT_STATS_MIN_DEADLINE 2000
+#define KORVA_UPNP_RTT_STATS_MAX_DEADLINE 30000
+
+/* Upper limit of the deadline doubling after timeouts */
+#define KORVA_UPNP_RTT_STATS_MAX_BACKOFF 3
+
+/**
+ * KorvaUPnPRttStats:
+ *
+ * Round-trip times of the SOAP calls to a renderer, in microseconds. The
+ * smoothed RTT and its mean deviation are kept as exponentially weighted
+ * moving averages the way TCP does (RFC 6298); percentiles are computed over
+ * the most recent samples.
+ */
+struct _KorvaUPnPRttStats {
+    gint64 srtt;
+    gint64 rttvar;
+    gint64 window[KORVA_UPNP_RTT_STATS_WINDOW];
+    guint  samples;
+    guint  timeouts;
+    guint  backoff;
+};
+
+KorvaUPnPRttStats *
+korva_upnp_rtt_stats_new (void)
+{
+    return g_slice_new0 (KorvaUPnPRttStats);
+}
+
+void
+korva_upnp_rtt_stats_free (KorvaUPnPRttStats *self)
+{
+    g_slice_free (KorvaUPnPRttStats, self);
+}
+
+void
+korva_upnp_rtt_stats_add_sample (KorvaUPnPRttStats *self, gint64 rtt)
+{
+    if (self->samples == 0) {
+        self->srtt = rtt;
+        self->rttvar = rtt / 2;
+    } else {
+        self->rttvar += (ABS (self->srtt - rtt) - self->rttvar) / 4;
+        self->srtt += (rtt - self->srtt) / 8;
+    }
+
+    self->window[self->samples % KORVA_UPNP_RTT_STATS_WINDOW] = rtt;
+    self->samples++;
+    self->backoff = 0;
+}
+
+/*
+ * A call ran into its deadline. There is no RTT to learn from, so the next
+ * deadlines are doubled until a call answers again.
+ */
+void
+korva_upnp_rtt_stats_add_timeout (KorvaUPnPRttStats *self)
+{
+    self->timeouts++;
+    self->backoff = MIN (self->backoff + 1, KORVA_UPNP_RTT_STATS_MAX_BACKOFF);
+}
+
+guint
+korva_upnp_rtt_stats_get_samples (KorvaUPnPRttStats *self)
+{
+    return self->samples;
+}
+
+static int
+compare_rtt (gconstpointer a, gconstpointer b)
+{
+    gint64 rtt_a = *(const gint64 *) a;
+    gint64 rtt_b = *(const gint64 *) b;
+
+    return rtt_a < rtt_b ? -1 : rtt_a > rtt_b;
+}
+
+/**
+ * korva_upnp_rtt_stats_get_percentile:
+ * @self: A #KorvaUPnPRttStats
+ * @percentile: The percentile to compute, between 0 and 100
+ *
+ * Returns: The @percentile of the recent RTTs in microseconds or 0 if there
+ * are no samples.
+ */
+gint64
+korva_upnp_rtt_stats_get_percentile (KorvaUPnPRttStats *self, guint percentile)
+{
+    gint64 sorted[KORVA_UPNP_RTT_STATS_WINDOW];
+    guint n;
+
+    n = MIN (self->samples, KORVA_UPNP_RTT_STATS_WINDOW);
+    if (n == 0) {
+        return 0;
+    }
+
+    memcpy (sorted, self->window, n * sizeof (gint64));
+    qsort (sorted, n, sizeof (gint64), compare_rtt);
+
+    return sorted[MIN (n - 1, (n * MIN (percentile, 100)) / 100)];
+}
+
+/**
+ * korva_upnp_rtt_stats_get_deadline:
+ * @self: A #KorvaUPnPRttStats
+ *
+ * Get the time a call may take before it is considered lost: the RFC 6298
+ * retransmission timeout or twice the 99th percentile, whichever is larger,
+ * doubled for every recent timeout and clamped to sane bounds.
+ *
+ * Returns: The deadline in milliseconds.
+ */
+guint
+korva_upnp_rtt_stats_get_deadline (KorvaUPnPRttStats *self)
+{
+    gint64 deadline;
+
+    if (self->samples == 0) {
+        deadline = KORVA_UPNP_RTT_STATS_DEFAULT_DEADLINE;
+    } else {
+        deadline = MAX (self->srtt + 4 * self->rttvar,
+                        2 * korva_upnp_rtt_stats_get_percentile (self, 99)) / 1000;
+    }
+
+    deadline <<= self->backoff;
+
+    return CLAMP (deadline,
+                  KORVA_UPNP_RTT_STATS_MIN_DEADLINE,
+                  KORVA_UPNP_RTT_STATS_MAX_DEADLINE);
+}
+
+/**
+ * korva_upnp_rtt_stats_serialize:
+ * @self: A #KorvaUPnPRttStats
+ *
+ * Returns: (transfer floating): A #GVariant of type a{sv} with the statistics
+ * in milliseconds.
+ */
+GVariant *
+korva_upnp_rtt_stats_serialize (KorvaUPnPRttStats *self)
+{
+    GVariantBuilder builder;
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add (&builder, "{sv}", "Samples", g_variant_new_uint32 (self->samples));
+    g_variant_builder_add (&builder, "{sv}", "Timeouts", g_variant_new_uint32 (self->timeouts));
+    g_variant_builder_add (&builder, "{sv}", "Mean", g_variant_new_double (self->srtt / 1000.0));
+    g_variant_builder_add (&builder, "{sv}", "Deviation", g_variant_new_double (self->rttvar / 1000.0));
+    g_variant_builder_add (&builder,
+                           "{sv}",
+                           "P50",
+                           g_variant_new_double (korva_upnp_rtt_stats_get_percentile (self, 50) / 1000.0));
+    g_variant_builder_add (&builder,
+                           "{sv}",
+                           "P95",
+                           g_variant_new_double (korva_upnp_rtt_stats_get_percentile (self, 95) / 1000.0));
+    g_variant_builder_add (&builder,
+                           "{sv}",
+                           "P99",
+                           g_variant_new_double (korva_upnp_rtt_stats_get_percentile (self, 99) / 1000.0));
+    g_variant_builder_add (&builder,
+                           "{sv}",
+                           "Deadline",
+                           g_variant_new_uint32 (korva_upnp_rtt_stats_get_deadline (self)));
+
+    return g_variant_builder_end (&builder);
+}
@@ -0,0 +1,55 @@
+/*
+    This file is part of Korva.
+
+    Copyright (C) 2012 Openismus GmbH.
+    Author: Jens Georg <jensg@openismus.com>
+
+    Korva is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Korva is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Korva.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _KorvaUPnPRttStats KorvaUPnPRttStats;
+
+KorvaUPnPRttStats *
+korva_upnp_rtt_stats_new (void);
+
+void
+korva_upnp_rtt_stats_free (KorvaUPnPRttStats *self);
+
+void
+korva_upnp_rtt_stats_add_sample (KorvaUPnPRttStats *self, gint64 rtt);
+
+void
+korva_upnp_rtt_stats_add_timeout (KorvaUPnPRttStats *self);
+
+guint
+korva_upnp_rtt_stats_get_samples (KorvaUPnPRttStats *self);
+
+gint64
+korva_upnp_rtt_stats_get_percentile (KorvaUPnPRttStats *self, guint percentile);
+
+guint
+korva_upnp_rtt_stats_get_deadline (KorvaUPnPRttStats *self);
+
+GVariant *
+korva_upnp_rtt_stats_serialize (KorvaUPnPRttStats *self);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (KorvaUPnPRttStats, korva_upnp_rtt_stats_free)
+
+G_END_DECLS
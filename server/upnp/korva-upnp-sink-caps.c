@@ -0,0 +1,261 @@
+/*
+    This file is part of Korva.
+
+    Copyright (C) 2012 Openismus GmbH.
+    Author: Jens Georg <jensg@openismus.com>
+
+    Korva is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Korva is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Korva.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define G_LOG_DOMAIN "Korva-UPnP-Sink-Caps"
+
+#include <string.h>
+
+#include <libgupnp-av/gupnp-av.h>
+
+#include "korva-upnp-sink-caps.h"
+
+/**
+ * KorvaUPnPSinkCaps:
+ *
+ * Index over the Sink protocol info of a renderer. The protocol info is parsed
+ * once and stored in a table keyed by MIME type; each entry holds the set of
+ * DLNA profiles the renderer accepts for that type. Wildcard entries ("*" and
+ * "major/*") are stored under their literal key and probed last. MIME type
+ * parameters are dropped, so "audio/L16;rate=44100;channels=2" is indexed and
+ * probed as "audio/L16".
+ *
+ * Only entries usable with our HTTP server ("http-get" or "*" transport) are
+ * indexed.
+ */
+struct _KorvaUPnPSinkCaps {
+    GHashTable *mime_types;
+};
+
+typedef struct {
+    gboolean    any_profile;
+    GHashTable *profiles;
+} KorvaUPnPSinkCapsEntry;
+
+static void
+korva_upnp_sink_caps_entry_free (KorvaUPnPSinkCapsEntry *entry)
+{
+    g_clear_pointer (&entry->profiles, g_hash_table_destroy);
+    g_slice_free (KorvaUPnPSinkCapsEntry, entry);
+}
+
+static guint
+ascii_str_case_hash (gconstpointer key)
+{
+    const char *p;
+    guint hash = 5381;
+
+    for (p = key; *p != '\0'; p++) {
+        hash = (hash << 5) + hash + g_ascii_tolower (*p);
+    }
+
+    return hash;
+}
+
+static gboolean
+ascii_str_case_equal (gconstpointer a, gconstpointer b)
+{
+    return g_ascii_strcasecmp (a, b) == 0;
+}
+
+/* The MIME type without its parameters */
+static char *
+korva_upnp_sink_caps_get_key (const char *mime_type)
+{
+    const char *end;
+
+    /* Renderers announce raw PCM with any set of parameters, or even without
+     * the separator before them */
+    if (g_ascii_strncasecmp (mime_type, "audio/L16", strlen ("audio/L16")) == 0) {
+        return g_strdup ("audio/L16");
+    }
+
+    end = strchr (mime_type, ';');
+    if (end == NULL) {
+        return g_strdup (mime_type);
+    }
+
+    return g_strchomp (g_strndup (mime_type, end - mime_type));
+}
+
+static void
+korva_upnp_sink_caps_add (KorvaUPnPSinkCaps *self, GUPnPProtocolInfo *info)
+{
+    KorvaUPnPSinkCapsEntry *entry;
+    const char *protocol, *mime_type, *profile;
+    char *key;
+
+    protocol = gupnp_protocol_info_get_protocol (info);
+    if (g_strcmp0 (protocol, "*") != 0 && g_ascii_strcasecmp (protocol, "http-get") != 0) {
+        return;
+    }
+
+    mime_type = gupnp_protocol_info_get_mime_type (info);
+    if (mime_type == NULL) {
+        return;
+    }
+
+    key = korva_upnp_sink_caps_get_key (mime_type);
+    entry = g_hash_table_lookup (self->mime_types, key);
+    if (entry == NULL) {
+        entry = g_slice_new0 (KorvaUPnPSinkCapsEntry);
+        g_hash_table_insert (self->mime_types, key, entry);
+    } else {
+        g_free (key);
+    }
+
+    if (entry->any_profile) {
+        return;
+    }
+
+    profile = gupnp_protocol_info_get_dlna_profile (info);
+    if (profile == NULL || g_strcmp0 (profile, "*") == 0) {
+        entry->any_profile = TRUE;
+        g_clear_pointer (&entry->profiles, g_hash_table_destroy);
+
+        return;
+    }
+
+    if (entry->profiles == NULL) {
+        entry->profiles = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    }
+
+    g_hash_table_add (entry->profiles, g_strdup (profile));
+}
+
+/**
+ * korva_upnp_sink_caps_new:
+ *
+ * Parse the Sink value of a ConnectionManager's GetProtocolInfo reply.
+ * Malformed entries are skipped.
+ *
+ * @protocol_info: (allow-none): Comma-separated list of protocol info strings
+ *
+ * Returns: (transfer full): A new #KorvaUPnPSinkCaps. Use
+ *   korva_upnp_sink_caps_free() after use.
+ */
+KorvaUPnPSinkCaps *
+korva_upnp_sink_caps_new (const char *protocol_info)
+{
+    KorvaUPnPSinkCaps *self;
+    char **entries, **it;
+
+    self = g_slice_new0 (KorvaUPnPSinkCaps);
+    self->mime_types = g_hash_table_new_full (ascii_str_case_hash,
+                                              ascii_str_case_equal,
+                                              g_free,
+                                              (GDestroyNotify) korva_upnp_sink_caps_entry_free);
+
+    if (protocol_info == NULL) {
+        return self;
+    }
+
+    entries = g_strsplit (protocol_info, ",", -1);
+    for (it = entries; *it != NULL; it++) {
+        GUPnPProtocolInfo *info;
+        GError *error = NULL;
+        char *entry = g_strstrip (*it);
+
+        if (*entry == '\0') {
+            continue;
+        }
+
+        info = gupnp_protocol_info_new_from_string (entry, &error);
+        if (info == NULL) {
+            g_debug ("Ignoring invalid protocol info '%s': %s", entry, error->message);
+            g_error_free (error);
+
+            continue;
+        }
+
+        korva_upnp_sink_caps_add (self, info);
+        g_object_unref (info);
+    }
+    g_strfreev (entries);
+
+    return self;
+}
+
+void
+korva_upnp_sink_caps_free (KorvaUPnPSinkCaps *self)
+{
+    g_clear_pointer (&self->mime_types, g_hash_table_destroy);
+    g_slice_free (KorvaUPnPSinkCaps, self);
+}
+
+static gboolean
+korva_upnp_sink_caps_entry_matches (KorvaUPnPSinkCapsEntry *entry, const char *dlna_profile)
+{
+    if (entry == NULL) {
+        return FALSE;
+    }
+
+    if (entry->any_profile || dlna_profile == NULL) {
+        return TRUE;
+    }
+
+    return g_hash_table_contains (entry->profiles, dlna_profile);
+}
+
+/**
+ * korva_upnp_sink_caps_is_compatible:
+ *
+ * Check whether the renderer accepts a resource served via HTTP with the
+ * given content type and DLNA profile. A resource without a DLNA profile
+ * matches any entry for its content type. Parameters of @content_type are
+ * ignored.
+ *
+ * @self: A #KorvaUPnPSinkCaps
+ * @content_type: MIME type of the resource
+ * @dlna_profile: (allow-none): DLNA profile of the resource
+ *
+ * Returns: %TRUE if the resource can be played, %FALSE otherwise.
+ */
+gboolean
+korva_upnp_sink_caps_is_compatible (KorvaUPnPSinkCaps *self,
+                                    const char        *content_type,
+                                    const char        *dlna_profile)
+{
+    g_autofree char *key = NULL;
+    const char *slash;
+
+    if (content_type == NULL) {
+        return FALSE;
+    }
+
+    key = korva_upnp_sink_caps_get_key (content_type);
+    if (korva_upnp_sink_caps_entry_matches (g_hash_table_lookup (self->mime_types, key),
+                                            dlna_profile)) {
+        return TRUE;
+    }
+
+    slash = strchr (key, '/');
+    if (slash != NULL) {
+        g_autofree char *major = g_strndup (key, slash - key + 2);
+
+        major[slash - key + 1] = '*';
+        if (korva_upnp_sink_caps_entry_matches (g_hash_table_lookup (self->mime_types, major),
+                                                dlna_profile)) {
+            return TRUE;
+        }
+    }
+
+    return korva_upnp_sink_caps_entry_matches (g_hash_table_lookup (self->mime_types, "*"),
+                                               dlna_profile);
+}
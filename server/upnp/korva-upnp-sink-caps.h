@@ -0,0 +1,42 @@
+/*
+    This file is part of Korva.
+
+    Copyright (C) 2012 Openismus GmbH.
+    Author: Jens Georg <jensg@openismus.com>
+
+    Korva is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Korva is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Korva.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _KorvaUPnPSinkCaps KorvaUPnPSinkCaps;
+
+KorvaUPnPSinkCaps *
+korva_upnp_sink_caps_new (const char *protocol_info);
+
+void
+korva_upnp_sink_caps_free (KorvaUPnPSinkCaps *self);
+
+gboolean
+korva_upnp_sink_caps_is_compatible (KorvaUPnPSinkCaps *self,
+                                    const char        *content_type,
+                                    const char        *dlna_profile);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (KorvaUPnPSinkCaps, korva_upnp_sink_caps_free)
+
+G_END_DECLS
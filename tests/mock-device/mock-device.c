@@ -0,0 +1,333 @@
+/*
+    This file is part of Korva.
+
+    Copyright (C) 2012 Openismus GmbH.
+    Author: Jens Georg <jensg@openismus.com>
+
+    Korva is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Korva is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Korva.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mock-device.h"
+
+struct _MockDevice {
+    GObject   parent;
+
+    char     *uid;
+    char     *display_name;
+    GVariant *serialized;
+    GError   *push_error;
+    guint     push_count;
+};
+
+static void
+mock_device_korva_device_init (KorvaDeviceInterface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (MockDevice, mock_device, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (KORVA_TYPE_DEVICE,
+                                                mock_device_korva_device_init))
+
+static void
+mock_device_finalize (GObject *object)
+{
+    MockDevice *self = MOCK_DEVICE (object);
+
+    g_free (self->uid);
+    g_free (self->display_name);
+    g_clear_pointer (&self->serialized, g_variant_unref);
+    g_clear_error (&self->push_error);
+
+    G_OBJECT_CLASS (mock_device_parent_class)->finalize (object);
+}
+
+static void
+mock_device_class_init (MockDeviceClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    object_class->finalize = mock_device_finalize;
+}
+
+static void
+mock_device_init (MockDevice *self)
+{
+}
+
+MockDevice *
+mock_device_new (const char *uid)
+{
+    MockDevice *self;
+
+    self = g_object_new (TYPE_MOCK_DEVICE, NULL);
+    self->uid = g_strdup (uid);
+    self->display_name = g_strdup (uid);
+
+    return self;
+}
+
+void
+mock_device_set_push_error (MockDevice *self, const GError *error)
+{
+    g_clear_error (&self->push_error);
+    if (error != NULL) {
+        self->push_error = g_error_copy (error);
+    }
+}
+
+void
+mock_device_set_display_name (MockDevice *self, const char *name)
+{
+    g_free (self->display_name);
+    self->display_name = g_strdup (name);
+    g_clear_pointer (&self->serialized, g_variant_unref);
+
+    g_signal_emit_by_name (self, "changed");
+}
+
+guint
+mock_device_get_push_count (MockDevice *self)
+{
+    return self->push_count;
+}
+
+static const char *
+mock_device_get_uid (KorvaDevice *device)
+{
+    return MOCK_DEVICE (device)->uid;
+}
+
+static const char *
+mock_device_get_display_name (KorvaDevice *device)
+{
+    return MOCK_DEVICE (device)->display_name;
+}
+
+static const char *
+mock_device_get_icon_uri (KorvaDevice *device)
+{
+    return "";
+}
+
+static KorvaDeviceProtocol
+mock_device_get_protocol (KorvaDevice *device)
+{
+    return DEVICE_PROTOCOL_UPNP;
+}
+
+static KorvaDeviceType
+mock_device_get_device_type (KorvaDevice *device)
+{
+    return DEVICE_TYPE_PLAYER;
+}
+
+/* Kept until the device changes, like the real devices do */
+static GVariant *
+mock_device_serialize (KorvaDevice *device)
+{
+    MockDevice *self = MOCK_DEVICE (device);
+    GVariantBuilder builder;
+
+    if (self->serialized == NULL) {
+        g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+        g_variant_builder_add (&builder, "{sv}", "UID", g_variant_new_string (self->uid));
+        g_variant_builder_add (&builder, "{sv}", "DisplayName", g_variant_new_string (self->display_name));
+        g_variant_builder_add (&builder, "{sv}", "IconURI", g_variant_new_string (""));
+        g_variant_builder_add (&builder, "{sv}", "Protocol", g_variant_new_string ("UPnP"));
+        g_variant_builder_add (&builder, "{sv}", "Type", g_variant_new_uint32 (DEVICE_TYPE_PLAYER));
+        self->serialized = g_variant_ref_sink (g_variant_builder_end (&builder));
+    }
+
+    return g_variant_ref (self->serialized);
+}
+
+static void
+mock_device_push_async (KorvaDevice        *device,
+                        GVariant           *source,
+                        GCancellable       *cancellable,
+                        GAsyncReadyCallback callback,
+                        gpointer            user_data)
+{
+    MockDevice *self = MOCK_DEVICE (device);
+    GTask *task;
+
+    self->push_count++;
+    task = g_task_new (device, cancellable, callback, user_data);
+    if (self->push_error != NULL) {
+        g_task_return_error (task, g_error_copy (self->push_error));
+    } else {
+        g_task_return_pointer (task,
+                               g_strdup_printf ("%s-%u", self->uid, self->push_count),
+                               g_free);
+    }
+    g_object_unref (task);
+}
+
+static char *
+mock_device_push_finish (KorvaDevice *device, GAsyncResult *result, GError **error)
+{
+    return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static void
+mock_device_unshare_async (KorvaDevice        *device,
+                           const char         *tag,
+                           GCancellable       *cancellable,
+                           GAsyncReadyCallback callback,
+                           gpointer            user_data)
+{
+    GTask *task;
+
+    task = g_task_new (device, cancellable, callback, user_data);
+    g_task_return_boolean (task, TRUE);
+    g_object_unref (task);
+}
+
+static gboolean
+mock_device_unshare_finish (KorvaDevice *device, GAsyncResult *result, GError **error)
+{
+    return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+static void
+mock_device_korva_device_init (KorvaDeviceInterface *iface)
+{
+    iface->get_uid = mock_device_get_uid;
+    iface->get_display_name = mock_device_get_display_name;
+    iface->get_icon_uri = mock_device_get_icon_uri;
+    iface->get_protocol = mock_device_get_protocol;
+    iface->get_device_type = mock_device_get_device_type;
+    iface->serialize = mock_device_serialize;
+    iface->push_async = mock_device_push_async;
+    iface->push_finish = mock_device_push_finish;
+    iface->unshare_async = mock_device_unshare_async;
+    iface->unshare_finish = mock_device_unshare_finish;
+}
+
+struct _MockDeviceLister {
+    GObject     parent;
+
+    GHashTable *devices;
+};
+
+static void
+mock_device_lister_korva_device_lister_init (KorvaDeviceListerInterface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (MockDeviceLister, mock_device_lister, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (KORVA_TYPE_DEVICE_LISTER,
+                                                mock_device_lister_korva_device_lister_init))
+
+static void
+mock_device_lister_dispose (GObject *object)
+{
+    MockDeviceLister *self = MOCK_DEVICE_LISTER (object);
+
+    g_clear_pointer (&self->devices, g_hash_table_destroy);
+
+    G_OBJECT_CLASS (mock_device_lister_parent_class)->dispose (object);
+}
+
+static void
+mock_device_lister_class_init (MockDeviceListerClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+    object_class->dispose = mock_device_lister_dispose;
+}
+
+static void
+mock_device_lister_init (MockDeviceLister *self)
+{
+    self->devices = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+}
+
+MockDeviceLister *
+mock_device_lister_new (void)
+{
+    return g_object_new (TYPE_MOCK_DEVICE_LISTER, NULL);
+}
+
+static void
+mock_device_lister_on_device_changed (KorvaDevice *device, gpointer user_data)
+{
+    g_signal_emit_by_name (user_data, "device-changed", device);
+}
+
+void
+mock_device_lister_add (MockDeviceLister *self, KorvaDevice *device)
+{
+    g_hash_table_insert (self->devices,
+                         g_strdup (korva_device_get_uid (device)),
+                         g_object_ref (device));
+    g_signal_connect_object (device,
+                             "changed",
+                             G_CALLBACK (mock_device_lister_on_device_changed),
+                             self,
+                             0);
+
+    g_signal_emit_by_name (self, "device-available", device);
+}
+
+void
+mock_device_lister_remove (MockDeviceLister *self, const char *uid)
+{
+    KorvaDevice *device;
+    g_autofree char *key = NULL;
+
+    if (!g_hash_table_steal_extended (self->devices, uid, (gpointer *) &key, (gpointer *) &device)) {
+        return;
+    }
+
+    g_signal_handlers_disconnect_by_data (device, self);
+    g_signal_emit_by_name (self, "device-unavailable", key);
+    g_object_unref (device);
+}
+
+static GList *
+mock_device_lister_get_devices (KorvaDeviceLister *lister)
+{
+    return g_hash_table_get_values (MOCK_DEVICE_LISTER (lister)->devices);
+}
+
+static KorvaDevice *
+mock_device_lister_get_device_info (KorvaDeviceLister *lister, const char *uid)
+{
+    return g_hash_table_lookup (MOCK_DEVICE_LISTER (lister)->devices, uid);
+}
+
+static gint
+mock_device_lister_get_device_count (KorvaDeviceLister *lister)
+{
+    return g_hash_table_size (MOCK_DEVICE_LISTER (lister)->devices);
+}
+
+static gboolean
+mock_device_lister_idle (KorvaDeviceLister *lister)
+{
+    return TRUE;
+}
+
+static gboolean
+mock_device_lister_prioritize (KorvaDeviceLister *lister, const char *uid)
+{
+    return FALSE;
+}
+
+static void
+mock_device_lister_korva_device_lister_init (KorvaDeviceListerInterface *iface)
+{
+    iface->get_devices = mock_device_lister_get_devices;
+    iface->get_device_info = mock_device_lister_get_device_info;
+    iface->get_device_count = mock_device_lister_get_device_count;
+    iface->idle = mock_device_lister_idle;
+    iface->prioritize = mock_device_lister_prioritize;
+}
@@ -0,0 +1,63 @@
+/*
+    This file is part of Korva.
+
+    Copyright (C) 2012 Openismus GmbH.
+    Author: Jens Georg <jensg@openismus.com>
+
+    Korva is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Korva is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with Korva.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+#include <korva-device.h>
+#include <korva-device-lister.h>
+
+G_BEGIN_DECLS
+
+#define TYPE_MOCK_DEVICE (mock_device_get_type ())
+G_DECLARE_FINAL_TYPE (MockDevice, mock_device, MOCK, DEVICE, GObject)
+
+MockDevice *
+mock_device_new (const char *uid);
+
+/* Let pushes fail with a copy of @error, or succeed again if it is %NULL */
+void
+mock_device_set_push_error (MockDevice *self, const GError *error);
+
+/* Change the display name as a renderer that was renamed would, emitting
+ * KorvaDevice::changed */
+void
+mock_device_set_display_name (MockDevice *self, const char *name);
+
+/* Number of pushes to the device */
+guint
+mock_device_get_push_count (MockDevice *self);
+
+#define TYPE_MOCK_DEVICE_LISTER (mock_device_lister_get_type ())
+G_DECLARE_FINAL_TYPE (MockDeviceLister, mock_device_lister, MOCK, DEVICE_LISTER, GObject)
+
+MockDeviceLister *
+mock_device_lister_new (void);
+
+/* Make @device available, passing on its changes */
+void
+mock_device_lister_add (MockDeviceLister *self, KorvaDevice *device);
+
+/* Let the device with @uid disappear */
+void
+mock_device_lister_remove (MockDeviceLister *self, const char *uid);
+
+G_END_DECLS
@@ -33,6 +33,12 @@ struct _MockDMRPrivate {
     MockDMRFault      fault;
     gboolean          unlocked;
     char             *state;
+    guint             latency;
+    char             *current_meta_data;
+    guint             play_count;
+    guint             position_count;
+    GHashTable       *connections;
+    int               subscriptions;
 };
 
 static GInitableIface *ginitable_parent_iface = NULL;
@@ -151,6 +157,26 @@ mock_dmr_get_property (GObject    *obj,
     }
 }
 
+static gboolean
+mock_dmr_on_return_delayed (gpointer user_data)
+{
+    gupnp_service_action_return_success ((GUPnPServiceAction *) user_data);
+
+    return FALSE;
+}
+
+/* Answer an action successfully, simulating a slow device if requested */
+static void
+mock_dmr_return_success (MockDMR *self, GUPnPServiceAction *action)
+{
+    if (self->priv->latency == 0) {
+        gupnp_service_action_return_success (action);
+
+        return;
+    }
+
+    g_timeout_add (self->priv->latency, mock_dmr_on_return_delayed, action);
+}
 
 static void
 on_get_protocol_info (GUPnPService       *service,
@@ -166,7 +192,7 @@ on_get_protocol_info (GUPnPService       *service,
     } else if (self->priv->fault == MOCK_DMR_FAULT_EMPTY_PROTOCOL_INFO) {
         gupnp_service_action_set (action, "Source", G_TYPE_STRING, "", NULL);
         gupnp_service_action_set (action, "Sink", G_TYPE_STRING, "", NULL);
-        gupnp_service_action_return_success (action);
+        mock_dmr_return_success (self, action);
 
         return;
     }
@@ -183,7 +209,7 @@ on_get_protocol_info (GUPnPService       *service,
                                   G_TYPE_STRING, self->priv->sink_protocol_info,
                                   NULL);
     }
-    gupnp_service_action_return_success (action);
+    mock_dmr_return_success (self, action);
 }
 
 static void
@@ -194,6 +220,7 @@ on_play (GUPnPService       *service,
     if (self->priv->fault == MOCK_DMR_FAULT_PLAY_FAIL) {
         gupnp_service_action_return_error (action, 721, "Deliberately fail");
     } else {
+        self->priv->play_count++;
         gupnp_service_action_return_success (action);
     }
 }
@@ -226,7 +253,11 @@ on_get_transport_info (GUPnPService       *service,
     GValue instance_id;
 
 
-    if (self->priv->fault == MOCK_DMR_FAULT_GET_TRANSPORT_INFO_FAIL) {
+    if (self->priv->fault == MOCK_DMR_FAULT_GET_TRANSPORT_INFO_FAIL ||
+        self->priv->fault == MOCK_DMR_FAULT_GET_TRANSPORT_INFO_FAIL_ONCE) {
+        if (self->priv->fault == MOCK_DMR_FAULT_GET_TRANSPORT_INFO_FAIL_ONCE) {
+            self->priv->fault = MOCK_DMR_FAULT_NONE;
+        }
         gupnp_service_action_return_error (action, 701, "Deliberately fail");
 
         return;
@@ -246,6 +277,26 @@ on_get_transport_info (GUPnPService       *service,
                               "CurrentSpeed", G_TYPE_STRING, "1",
                               NULL);
 
+    mock_dmr_return_success (self, action);
+}
+
+static void
+on_get_position_info (GUPnPService       *service,
+                      GUPnPServiceAction *action,
+                      MockDMR            *self)
+{
+    self->priv->position_count++;
+
+    gupnp_service_action_set (action,
+                              "Track", G_TYPE_UINT, 1,
+                              "TrackDuration", G_TYPE_STRING, "0:01:30.500",
+                              "TrackMetaData", G_TYPE_STRING, self->priv->current_meta_data ? self->priv->current_meta_data : "",
+                              "TrackURI", G_TYPE_STRING, "",
+                              "RelTime", G_TYPE_STRING, "0:00:05",
+                              "AbsTime", G_TYPE_STRING, "NOT_IMPLEMENTED",
+                              "RelCount", G_TYPE_INT, 2147483647,
+                              "AbsCount", G_TYPE_INT, 2147483647,
+                              NULL);
     gupnp_service_action_return_success (action);
 }
 
@@ -284,6 +335,9 @@ on_set_av_transport_uri (GUPnPService       *service,
     g_assert (g_value_get_string (&meta_data) != NULL);
     g_assert_cmpint (g_value_get_int (&instance_id), ==, 0);
 
+    g_free (self->priv->current_meta_data);
+    self->priv->current_meta_data = g_value_dup_string (&meta_data);
+
     last_change_str = g_string_new ("<Event xmlns=\"urn:schemas-upnp-org:metadata-1-0/AVT/\">");
     g_string_append (last_change_str, "<InstanceID val=\"0\">");
     g_string_append_printf (last_change_str, "<CurrentURI val=\"%s\" />", g_value_get_string (&uri));
@@ -295,7 +349,37 @@ on_set_av_transport_uri (GUPnPService       *service,
     gupnp_service_notify_value (GUPNP_SERVICE (self->priv->av_transport), "LastChange", &last_change);
     g_string_free (last_change_str, FALSE);
 
-    gupnp_service_action_return_success (action);
+    mock_dmr_return_success (self, action);
+}
+
+static void
+on_request_started (SoupServer        *server,
+                    SoupServerMessage *message,
+                    MockDMR           *self)
+{
+    GSocket *socket;
+
+    socket = soup_server_message_get_socket (message);
+    if (socket != NULL && !g_hash_table_contains (self->priv->connections, socket)) {
+        g_hash_table_add (self->priv->connections, g_object_ref (socket));
+    }
+}
+
+/* Count GENA subscriptions; renewals carry the SID of the subscription */
+static void
+on_request_read (SoupServer        *server,
+                 SoupServerMessage *message,
+                 MockDMR           *self)
+{
+    const char *method = soup_server_message_get_method (message);
+    SoupMessageHeaders *headers = soup_server_message_get_request_headers (message);
+
+    if (g_strcmp0 (method, "SUBSCRIBE") == 0 &&
+        soup_message_headers_get_one (headers, "SID") == NULL) {
+        self->priv->subscriptions++;
+    } else if (g_strcmp0 (method, "UNSUBSCRIBE") == 0) {
+        self->priv->subscriptions--;
+    }
 }
 
 static void
@@ -328,6 +412,18 @@ mock_dmr_ginitable_init (GInitable *object, GCancellable *cancellable, GError **
 
     context = gupnp_device_info_get_context (GUPNP_DEVICE_INFO (self));
 
+    self->priv->connections = g_hash_table_new_full (g_direct_hash, g_direct_equal, g_object_unref, NULL);
+    g_signal_connect_object (gupnp_context_get_server (context),
+                             "request-started",
+                             G_CALLBACK (on_request_started),
+                             self,
+                             0);
+    g_signal_connect_object (gupnp_context_get_server (context),
+                             "request-read",
+                             G_CALLBACK (on_request_read),
+                             self,
+                             0);
+
     gupnp_context_host_path (context,
                              "MediaRenderer2.xml",
                              TEST_DATA_DIR "/mock-dmr/MediaRenderer2.xml");
@@ -376,6 +472,11 @@ mock_dmr_ginitable_init (GInitable *object, GCancellable *cancellable, GError **
                           G_CALLBACK (on_get_transport_info),
                           self);
 
+        g_signal_connect (self->priv->av_transport,
+                          "action-invoked::GetPositionInfo",
+                          G_CALLBACK (on_get_position_info),
+                          self);
+
         g_signal_connect (self->priv->av_transport,
                           "action-invoked::SetAVTransportURI",
                           G_CALLBACK (on_set_av_transport_uri),
@@ -407,6 +508,8 @@ mock_dmr_finalize (GObject *object)
     g_clear_object (&(self->priv->av_transport));
 
     mock_dmr_set_protocol_info (self, NULL, NULL);
+    g_free (self->priv->current_meta_data);
+    g_clear_pointer (&self->priv->connections, g_hash_table_destroy);
 
     parent_class = G_OBJECT_CLASS (mock_dmr_parent_class);
     parent_class->finalize (object);
@@ -500,3 +603,64 @@ mock_dmr_set_fault (MockDMR *self, MockDMRFault fault)
     self->priv->fault = fault;
     self->priv->unlocked = FALSE;
 }
+
+void
+mock_dmr_set_latency (MockDMR *self, guint latency)
+{
+    self->priv->latency = latency;
+}
+
+guint
+mock_dmr_get_play_count (MockDMR *self)
+{
+    return self->priv->play_count;
+}
+
+const char *
+mock_dmr_get_current_meta_data (MockDMR *self)
+{
+    return self->priv->current_meta_data;
+}
+
+guint
+mock_dmr_get_position_count (MockDMR *self)
+{
+    return self->priv->position_count;
+}
+
+guint
+mock_dmr_get_connection_count (MockDMR *self)
+{
+    return g_hash_table_size (self->priv->connections);
+}
+
+int
+mock_dmr_get_subscription_count (MockDMR *self)
+{
+    return self->priv->subscriptions;
+}
+
+void
+mock_dmr_set_transport_state (MockDMR *self, const char *state, const char *uri)
+{
+    GValue last_change;
+    GString *last_change_str;
+
+    g_free (self->priv->state);
+    self->priv->state = g_strdup (state);
+
+    last_change_str = g_string_new ("<Event xmlns=\"urn:schemas-upnp-org:metadata-1-0/AVT/\">");
+    g_string_append (last_change_str, "<InstanceID val=\"0\">");
+    g_string_append_printf (last_change_str, "<TransportState val=\"%s\" />", state);
+    if (uri != NULL) {
+        g_string_append_printf (last_change_str, "<AVTransportURI val=\"%s\" />", uri);
+    }
+    g_string_append (last_change_str, "</InstanceID></Event>");
+
+    memset (&last_change, 0, sizeof (GValue));
+    g_value_init (&last_change, G_TYPE_STRING);
+    g_value_take_string (&last_change, g_string_free (last_change_str, FALSE));
+
+    gupnp_service_notify_value (GUPNP_SERVICE (self->priv->av_transport), "LastChange", &last_change);
+    g_value_unset (&last_change);
+}
@@ -69,6 +69,7 @@ typedef enum {
     MOCK_DMR_FAULT_STOP_FAIL,
     MOCK_DMR_FAULT_GET_TRANSPORT_INFO_FAIL,
     MOCK_DMR_FAULT_EMPTY_PROTOCOL_INFO,
+    MOCK_DMR_FAULT_GET_TRANSPORT_INFO_FAIL_ONCE,
     MOCK_DMR_FAULT_COUNT
 } MockDMRFault;
 
@@ -80,6 +81,36 @@ mock_dmr_set_protocol_info (MockDMR *self, const char *source, const char *sink)
 
 void
 mock_dmr_set_fault (MockDMR *self, MockDMRFault fault);
+
+/* Delay successful replies to the introspection calls and to
+ * SetAVTransportURI by @latency ms */
+void
+mock_dmr_set_latency (MockDMR *self, guint latency);
+
+/* Number of successful Play calls */
+guint
+mock_dmr_get_play_count (MockDMR *self);
+
+/* CurrentURIMetaData of the last SetAVTransportURI call */
+const char *
+mock_dmr_get_current_meta_data (MockDMR *self);
+
+/* Number of GetPositionInfo calls */
+guint
+mock_dmr_get_position_count (MockDMR *self);
+
+/* Number of distinct TCP connections the device received requests on */
+guint
+mock_dmr_get_connection_count (MockDMR *self);
+
+/* Number of GENA subscriptions currently held on the device */
+int
+mock_dmr_get_subscription_count (MockDMR *self);
+
+/* Change the transport state as another control point would, announcing it
+ * with LastChange. If @uri is not %NULL, the device now plays @uri */
+void
+mock_dmr_set_transport_state (MockDMR *self, const char *state, const char *uri);
 G_END_DECLS
 
 #endif /* __MOCK_DMR_H__ */
@@ -22,16 +22,36 @@
 
 #include <glib/gstdio.h>
 
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+
 #include <libsoup/soup.h>
+#include <libgupnp-av/gupnp-av.h>
 
 #include <korva-error.h>
 #include <korva-device.h>
 #include <korva-icon-cache.h>
+#include <korva-priority.h>
+#include <korva-push-trace.h>
+#include <korva-server.h>
 
 #include "korva-upnp-device.h"
+#include "korva-upnp-device-cache.h"
+#include "korva-upnp-device-lister.h"
+#include "korva-upnp-didl-lite.h"
+#include "korva-upnp-failure-cache.h"
 #include "korva-upnp-file-server.h"
+#include "korva-upnp-host-data.h"
+#include "korva-upnp-icon-fetcher.h"
+#include "korva-upnp-introspection-queue.h"
+#include "korva-upnp-last-change.h"
+#include "korva-upnp-rtt-stats.h"
+#include "korva-upnp-sink-caps.h"
 #include "korva-upnp-constants-private.h"
 
+#include "korva-dbus-interface.h"
+
+#include "mock-device/mock-device.h"
 #include "mock-dmr/mock-dmr.h"
 
 static gboolean
@@ -42,6 +62,259 @@ quit_main_loop_source_func (gpointer user_data)
     return FALSE;
 }
 
+/*
+ * CurrentURIMetaData is built once per URI a file is served from and shared
+ * by all pushes through that URI.
+ */
+static void
+test_upnp_host_data_didl_lite (void)
+{
+    g_autoptr (GFile) file = g_file_new_for_path ("/tmp/korva-didl-test.mp3");
+    g_autoptr (GHashTable) params = NULL;
+    g_autoptr (KorvaUPnPHostData) data = NULL;
+    const char *didl_lite, *other;
+
+    params = g_hash_table_new_full (g_str_hash,
+                                    (GEqualFunc) g_str_equal,
+                                    g_free,
+                                    (GDestroyNotify) g_variant_unref);
+    g_hash_table_insert (params, g_strdup ("Title"), g_variant_new_string ("Some <Song>"));
+    g_hash_table_insert (params, g_strdup ("ContentType"), g_variant_new_string ("audio/mpeg"));
+    g_hash_table_insert (params, g_strdup ("DLNAProfile"), g_variant_new_string ("MP3"));
+    g_hash_table_insert (params, g_strdup ("Size"), g_variant_new_uint64 (4711));
+
+    data = korva_upnp_host_data_new (file, params, "127.0.0.1");
+
+    didl_lite = korva_upnp_host_data_get_didl_lite (data, "http://127.0.0.1:1234/item/a.mp3");
+    g_assert (strstr (didl_lite, "http://127.0.0.1:1234/item/a.mp3") != NULL);
+    g_assert (strstr (didl_lite, "Some &lt;Song&gt;") != NULL);
+    g_assert (strstr (didl_lite, "size=\"4711\"") != NULL);
+    g_assert (strstr (didl_lite, "http-get:*:audio/mpeg:DLNA.ORG_PN=MP3") != NULL);
+
+    g_assert (korva_upnp_host_data_get_didl_lite (data, "http://127.0.0.1:1234/item/a.mp3") == didl_lite);
+
+    other = korva_upnp_host_data_get_didl_lite (data, "http://192.168.1.2:1234/item/a.mp3");
+    g_assert (other != didl_lite);
+    g_assert (strstr (other, "http://192.168.1.2:1234/item/a.mp3") != NULL);
+    g_assert (strstr (other, "127.0.0.1") == NULL);
+}
+
+/* What the host data used to build CurrentURIMetaData with */
+static char *
+write_gupnp_didl_lite (const KorvaUPnPDIDLLiteItem *item)
+{
+    g_autoptr (GUPnPDIDLLiteWriter) writer = gupnp_didl_lite_writer_new (NULL);
+    g_autoptr (GUPnPDIDLLiteObject) object = NULL;
+    g_autoptr (GUPnPDIDLLiteResource) resource = NULL;
+    g_autoptr (GUPnPProtocolInfo) protocol_info = NULL;
+
+    object = GUPNP_DIDL_LITE_OBJECT (gupnp_didl_lite_writer_add_item (writer));
+    gupnp_didl_lite_object_set_title (object, item->title);
+    gupnp_didl_lite_object_set_id (object, "1");
+    gupnp_didl_lite_object_set_parent_id (object, "-1");
+    gupnp_didl_lite_object_set_restricted (object, TRUE);
+    if (item->album_art_uri != NULL) {
+        gupnp_didl_lite_object_set_album_art (object, item->album_art_uri);
+    }
+
+    resource = gupnp_didl_lite_object_add_resource (object);
+    gupnp_didl_lite_resource_set_uri (resource, item->uri);
+    if (item->size >= 0) {
+        gupnp_didl_lite_resource_set_size64 (resource, item->size);
+    }
+
+    if (item->duration >= 0) {
+        gupnp_didl_lite_resource_set_duration (resource, item->duration);
+    }
+
+    if (item->bitrate >= 0) {
+        gupnp_didl_lite_resource_set_bitrate (resource, item->bitrate);
+    }
+
+    if (item->width >= 0 && item->height >= 0) {
+        gupnp_didl_lite_resource_set_width (resource, item->width);
+        gupnp_didl_lite_resource_set_height (resource, item->height);
+    }
+
+    protocol_info = gupnp_protocol_info_new_from_string (item->protocol_info, NULL);
+    gupnp_didl_lite_resource_set_protocol_info (resource, protocol_info);
+
+    return gupnp_didl_lite_writer_get_string (writer);
+}
+
+static xmlNode *
+find_child (xmlNode *parent, const char *name)
+{
+    xmlNode *it;
+
+    for (it = parent->children; it != NULL; it = it->next) {
+        if (it->type == XML_ELEMENT_NODE && g_strcmp0 ((const char *) it->name, name) == 0) {
+            return it;
+        }
+    }
+
+    return NULL;
+}
+
+static void
+assert_equal_content (xmlNode *a, xmlNode *b)
+{
+    g_autofree xmlChar *content_a = NULL;
+    g_autofree xmlChar *content_b = NULL;
+
+    g_assert ((a == NULL) == (b == NULL));
+    if (a == NULL) {
+        return;
+    }
+
+    content_a = xmlNodeGetContent (a);
+    content_b = xmlNodeGetContent (b);
+    g_assert_cmpstr ((const char *) content_a, ==, (const char *) content_b);
+}
+
+/* H:MM:SS with optional fraction, which the writers are free to add */
+static glong
+parse_duration (const char *duration)
+{
+    guint hours, minutes, seconds;
+
+    g_assert (sscanf (duration, "%u:%u:%u", &hours, &minutes, &seconds) == 3);
+
+    return hours * 3600 + minutes * 60 + seconds;
+}
+
+static void
+assert_equal_attributes (xmlNode *a, xmlNode *b)
+{
+    xmlAttr *attribute;
+    guint count_a = 0, count_b = 0;
+
+    for (attribute = b->properties; attribute != NULL; attribute = attribute->next) {
+        count_b++;
+    }
+
+    for (attribute = a->properties; attribute != NULL; attribute = attribute->next) {
+        g_autofree xmlChar *value_a = xmlGetProp (a, attribute->name);
+        g_autofree xmlChar *value_b = xmlGetProp (b, attribute->name);
+
+        count_a++;
+        g_assert (value_b != NULL);
+        if (g_strcmp0 ((const char *) attribute->name, "duration") == 0) {
+            g_assert_cmpint (parse_duration ((const char *) value_a), ==, parse_duration ((const char *) value_b));
+        } else {
+            g_assert_cmpstr ((const char *) value_a, ==, (const char *) value_b);
+        }
+    }
+
+    g_assert_cmpuint (count_a, ==, count_b);
+}
+
+static void
+assert_equivalent_didl_lite (const char *didl_lite, const char *reference)
+{
+    xmlDoc *doc, *reference_doc;
+    xmlNode *item, *reference_item;
+
+    doc = xmlReadMemory (didl_lite, strlen (didl_lite), NULL, NULL, XML_PARSE_NONET);
+    reference_doc = xmlReadMemory (reference, strlen (reference), NULL, NULL, XML_PARSE_NONET);
+    g_assert (doc != NULL);
+    g_assert (reference_doc != NULL);
+
+    g_assert_cmpstr ((const char *) xmlDocGetRootElement (doc)->name, ==, "DIDL-Lite");
+    g_assert_cmpstr ((const char *) xmlDocGetRootElement (doc)->ns->href,
+                     ==,
+                     (const char *) xmlDocGetRootElement (reference_doc)->ns->href);
+
+    item = find_child (xmlDocGetRootElement (doc), "item");
+    reference_item = find_child (xmlDocGetRootElement (reference_doc), "item");
+    g_assert (item != NULL);
+    g_assert (reference_item != NULL);
+    assert_equal_attributes (item, reference_item);
+
+    assert_equal_content (find_child (item, "title"), find_child (reference_item, "title"));
+    assert_equal_content (find_child (item, "albumArtURI"), find_child (reference_item, "albumArtURI"));
+    assert_equal_content (find_child (item, "res"), find_child (reference_item, "res"));
+    assert_equal_attributes (find_child (item, "res"), find_child (reference_item, "res"));
+
+    xmlFreeDoc (doc);
+    xmlFreeDoc (reference_doc);
+}
+
+static KorvaUPnPDIDLLiteItem didl_lite_items[] = {
+    { "Some Song", "http://127.0.0.1:1234/item/a.mp3", "http-get:*:audio/mpeg:DLNA.ORG_PN=MP3;DLNA.ORG_CI=0;DLNA.ORG_OP=01",
+      4711, -1, -1, -1, -1, NULL },
+    { "Tom & Jerry <\"Live\">\tat\r\nthe 'Hall'", "http://127.0.0.1:1234/item/b.mkv?x=1&y=2",
+      "http-get:*:video/x-matroska:DLNA.ORG_CI=0;DLNA.ORG_OP=01",
+      G_GINT64_CONSTANT (5368709120), 5025, 625000, 1920, 1080, "http://127.0.0.1:1234/art/b.jpg?size=<160>" },
+    { "Ümläut – ünïcödé ☃", "http://[fe80::1]:1234/item/c.jpg", "http-get:*:image/jpeg:DLNA.ORG_PN=JPEG_LRG;DLNA.ORG_CI=0;DLNA.ORG_OP=01",
+      0, 1, 1, 640, 480, "" },
+    { "", "http://127.0.0.1:1234/item/d", "http-get:*:application/octet-stream:DLNA.ORG_CI=0;DLNA.ORG_OP=01",
+      -1, -1, -1, -1, -1, NULL }
+};
+
+/*
+ * The template writer has to create documents that parse into the same item
+ * as the ones the gupnp-av writer creates. The host data passes protocol
+ * info that went through GUPnPProtocolInfo, so the items do as well.
+ */
+static void
+test_upnp_didl_lite (void)
+{
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS (didl_lite_items); i++) {
+        KorvaUPnPDIDLLiteItem item = didl_lite_items[i];
+        g_autoptr (GUPnPProtocolInfo) info = NULL;
+        g_autofree char *protocol_info = NULL;
+        g_autofree char *didl_lite = NULL;
+        g_autofree char *reference = NULL;
+
+        info = gupnp_protocol_info_new_from_string (item.protocol_info, NULL);
+        protocol_info = gupnp_protocol_info_to_string (info);
+        item.protocol_info = protocol_info;
+
+        didl_lite = korva_upnp_didl_lite_write (&item);
+        reference = write_gupnp_didl_lite (&item);
+
+        g_test_message ("Item %u: %s", i, didl_lite);
+        assert_equivalent_didl_lite (didl_lite, reference);
+    }
+}
+
+static void
+test_upnp_didl_lite_benchmark (void)
+{
+    const guint iterations = 10000;
+    double gupnp_time, template_time;
+    guint i;
+
+    if (!g_test_perf ()) {
+        g_test_skip ("Only run in performance mode");
+
+        return;
+    }
+
+    g_test_timer_start ();
+    for (i = 0; i < iterations; i++) {
+        g_autofree char *didl_lite = write_gupnp_didl_lite (&didl_lite_items[1]);
+    }
+    gupnp_time = g_test_timer_elapsed ();
+
+    g_test_timer_start ();
+    for (i = 0; i < iterations; i++) {
+        g_autofree char *didl_lite = korva_upnp_didl_lite_write (&didl_lite_items[1]);
+    }
+    template_time = g_test_timer_elapsed ();
+
+    g_test_message ("%u documents: GUPnPDIDLLiteWriter %.3f s, template %.3f s",
+                    iterations,
+                    gupnp_time,
+                    template_time);
+    g_test_minimized_result (template_time * G_USEC_PER_SEC / iterations,
+                             "Writing a DIDL-Lite document took %.2f µs",
+                             template_time * G_USEC_PER_SEC / iterations);
+}
+
 static void
 test_upnp_fileserver_single_instance (void)
 {
@@ -55,6 +328,336 @@ test_upnp_fileserver_single_instance (void)
     g_object_unref (server2);
 }
 
+static void
+test_upnp_sink_caps (void)
+{
+    g_autoptr (KorvaUPnPSinkCaps) caps = NULL;
+
+    caps = korva_upnp_sink_caps_new ("http-get:*:image/jpeg:DLNA.ORG_PN=JPEG_SM,"
+                                     "http-get:*:image/jpeg:DLNA.ORG_PN=JPEG_LRG,"
+                                     "rtsp-rtp-udp:*:video/mp4:*,"
+                                     "http-get:*:audio/*:*,"
+                                     " http-get:*:VIDEO/MPEG:* ,"
+                                     "invalid");
+
+    /* Profile set */
+    g_assert (korva_upnp_sink_caps_is_compatible (caps, "image/jpeg", "JPEG_SM"));
+    g_assert (korva_upnp_sink_caps_is_compatible (caps, "image/jpeg", "JPEG_LRG"));
+    g_assert (!korva_upnp_sink_caps_is_compatible (caps, "image/jpeg", "JPEG_MED"));
+    g_assert (korva_upnp_sink_caps_is_compatible (caps, "image/jpeg", NULL));
+
+    /* Transports we cannot serve are not indexed */
+    g_assert (!korva_upnp_sink_caps_is_compatible (caps, "video/mp4", NULL));
+
+    /* Major type wildcard and case-insensitive MIME types */
+    g_assert (korva_upnp_sink_caps_is_compatible (caps, "audio/mpeg", "MP3"));
+    g_assert (korva_upnp_sink_caps_is_compatible (caps, "video/mpeg", NULL));
+    g_assert (!korva_upnp_sink_caps_is_compatible (caps, "image/png", NULL));
+    g_assert (!korva_upnp_sink_caps_is_compatible (caps, NULL, NULL));
+    korva_upnp_sink_caps_free (g_steal_pointer (&caps));
+
+    caps = korva_upnp_sink_caps_new ("*:*:*:*");
+    g_assert (korva_upnp_sink_caps_is_compatible (caps, "image/png", "PNG_LRG"));
+    korva_upnp_sink_caps_free (g_steal_pointer (&caps));
+
+    caps = korva_upnp_sink_caps_new ("");
+    g_assert (!korva_upnp_sink_caps_is_compatible (caps, "image/jpeg", NULL));
+    korva_upnp_sink_caps_free (g_steal_pointer (&caps));
+
+    /* MIME type parameters are ignored on both sides */
+    caps = korva_upnp_sink_caps_new ("http-get:*:audio/L16;rate=44100;channels=2:DLNA.ORG_PN=LPCM,"
+                                     "http-get:*:audio/L16;rate=48000;channels=2:*,"
+                                     "http-get:*:audio/mpeg; charset=binary:*");
+    g_assert (korva_upnp_sink_caps_is_compatible (caps, "audio/L16", NULL));
+    g_assert (korva_upnp_sink_caps_is_compatible (caps, "audio/L16;rate=44100;channels=2", "LPCM"));
+    g_assert (korva_upnp_sink_caps_is_compatible (caps, "audio/l16;rate=22050", "LPCM_low"));
+    g_assert (korva_upnp_sink_caps_is_compatible (caps, "audio/mpeg", "MP3"));
+    g_assert (korva_upnp_sink_caps_is_compatible (caps, "audio/mpeg;charset=binary", NULL));
+    g_assert (!korva_upnp_sink_caps_is_compatible (caps, "audio/mp4;codecs=mp4a", NULL));
+}
+
+typedef struct {
+    GMainLoop *loop;
+    char      *uri;
+    GError    *error;
+} StoreIconData;
+
+static void
+on_icon_cache_store (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    StoreIconData *data = (StoreIconData *) user_data;
+
+    data->uri = korva_icon_cache_store_finish (res, &data->error);
+    g_main_loop_quit (data->loop);
+}
+
+#define TEST_ICON_SIZE 1024
+
+/* Store an icon of TEST_ICON_SIZE bytes filled with @fill */
+static char *
+store_icon_and_wait (StoreIconData *data, const char *uid, guint8 fill)
+{
+    g_autoptr (GBytes) icon = NULL;
+    guint8 *buffer;
+
+    buffer = g_malloc (TEST_ICON_SIZE);
+    memset (buffer, fill, TEST_ICON_SIZE);
+    icon = g_bytes_new_take (buffer, TEST_ICON_SIZE);
+
+    korva_icon_cache_store_async (uid, icon, NULL, on_icon_cache_store, data);
+    g_main_loop_run (data->loop);
+
+    g_assert_no_error (data->error);
+    g_assert (data->uri != NULL);
+
+    return g_steal_pointer (&data->uri);
+}
+
+static gboolean
+icon_cache_has (const char *uid)
+{
+    g_autofree char *uri = korva_icon_cache_lookup (uid);
+
+    return uri != NULL;
+}
+
+/* Wait for the device's link to its icon to be removed */
+static void
+wait_for_file_removal (const char *dir, const char *uid)
+{
+    g_autofree char *path = g_build_filename (dir, uid, NULL);
+
+    while (g_file_test (path, G_FILE_TEST_IS_SYMLINK)) {
+        g_main_context_iteration (NULL, TRUE);
+    }
+}
+
+static void
+remove_icon_cache_dir (const char *dir)
+{
+    GDir *d;
+    const char *name;
+
+    d = g_dir_open (dir, 0, NULL);
+    g_assert (d != NULL);
+    while ((name = g_dir_read_name (d)) != NULL) {
+        g_autofree char *path = g_build_filename (dir, name, NULL);
+
+        g_remove (path);
+    }
+    g_dir_close (d);
+    g_rmdir (dir);
+}
+
+static void
+test_icon_cache_eviction (void)
+{
+    StoreIconData data = { NULL, NULL, NULL };
+    g_autofree char *dir = NULL;
+
+    dir = g_dir_make_tmp ("korva-icons-XXXXXX", NULL);
+    g_assert (dir != NULL);
+
+    data.loop = g_main_loop_new (NULL, FALSE);
+    korva_icon_cache_init (dir, 3 * TEST_ICON_SIZE);
+
+    g_free (store_icon_and_wait (&data, "uuid:a", 'a'));
+    g_free (store_icon_and_wait (&data, "uuid:b", 'b'));
+    g_free (store_icon_and_wait (&data, "uuid:c", 'c'));
+    g_assert (icon_cache_has ("uuid:a"));
+    g_assert (icon_cache_has ("uuid:b"));
+    g_assert (icon_cache_has ("uuid:c"));
+
+    /* Use a again, so b is the least recently used icon */
+    g_assert (icon_cache_has ("uuid:a"));
+    g_free (store_icon_and_wait (&data, "uuid:d", 'd'));
+    g_assert (!icon_cache_has ("uuid:b"));
+    g_assert (icon_cache_has ("uuid:a"));
+    g_assert (icon_cache_has ("uuid:c"));
+    g_assert (icon_cache_has ("uuid:d"));
+    wait_for_file_removal (dir, "uuid:b");
+
+    /* The index is rebuilt from the directory */
+    korva_icon_cache_init (dir, 3 * TEST_ICON_SIZE);
+    g_assert (icon_cache_has ("uuid:a"));
+    g_assert (!icon_cache_has ("uuid:b"));
+    g_assert (icon_cache_has ("uuid:c"));
+    g_assert (icon_cache_has ("uuid:d"));
+
+    /* A lower limit evicts the oldest icons on start-up */
+    korva_icon_cache_init (dir, TEST_ICON_SIZE);
+    g_assert (!icon_cache_has ("uuid:a"));
+    g_assert (!icon_cache_has ("uuid:c"));
+    g_assert (icon_cache_has ("uuid:d"));
+    wait_for_file_removal (dir, "uuid:a");
+    wait_for_file_removal (dir, "uuid:c");
+
+    korva_icon_cache_shutdown ();
+    g_assert (!icon_cache_has ("uuid:d"));
+
+    remove_icon_cache_dir (dir);
+    g_main_loop_unref (data.loop);
+
+    korva_icon_cache_init (NULL, 0);
+}
+
+static guint
+count_regular_files (const char *dir)
+{
+    GDir *d;
+    const char *name;
+    guint count = 0;
+
+    d = g_dir_open (dir, 0, NULL);
+    g_assert (d != NULL);
+    while ((name = g_dir_read_name (d)) != NULL) {
+        g_autofree char *path = g_build_filename (dir, name, NULL);
+
+        if (!g_file_test (path, G_FILE_TEST_IS_SYMLINK)) {
+            count++;
+        }
+    }
+    g_dir_close (d);
+
+    return count;
+}
+
+static void
+test_icon_cache_dedup (void)
+{
+    StoreIconData data = { NULL, NULL, NULL };
+    g_autofree char *dir = NULL;
+    g_autofree char *uri_a = NULL;
+    g_autofree char *uri_b = NULL;
+    g_autofree char *uri_c = NULL;
+    g_autofree char *lookup = NULL;
+
+    dir = g_dir_make_tmp ("korva-icons-XXXXXX", NULL);
+    g_assert (dir != NULL);
+
+    data.loop = g_main_loop_new (NULL, FALSE);
+    korva_icon_cache_init (dir, 0);
+
+    /* Devices with the same icon share the file */
+    uri_a = store_icon_and_wait (&data, "uuid:a", 'x');
+    uri_b = store_icon_and_wait (&data, "uuid:b", 'x');
+    g_assert_cmpstr (uri_a, ==, uri_b);
+    g_assert_cmpuint (count_regular_files (dir), ==, 1);
+
+    lookup = korva_icon_cache_lookup ("uuid:b");
+    g_assert_cmpstr (lookup, ==, uri_a);
+    g_clear_pointer (&lookup, g_free);
+
+    /* A new icon for one of them does not affect the other */
+    uri_c = store_icon_and_wait (&data, "uuid:b", 'y');
+    g_assert_cmpstr (uri_c, !=, uri_a);
+    g_assert_cmpuint (count_regular_files (dir), ==, 2);
+    lookup = korva_icon_cache_lookup ("uuid:a");
+    g_assert_cmpstr (lookup, ==, uri_a);
+    g_clear_pointer (&lookup, g_free);
+
+    /* The links survive a restart */
+    korva_icon_cache_init (dir, 0);
+    lookup = korva_icon_cache_lookup ("uuid:a");
+    g_assert_cmpstr (lookup, ==, uri_a);
+    g_clear_pointer (&lookup, g_free);
+    lookup = korva_icon_cache_lookup ("uuid:b");
+    g_assert_cmpstr (lookup, ==, uri_c);
+    g_clear_pointer (&lookup, g_free);
+
+    korva_icon_cache_shutdown ();
+    remove_icon_cache_dir (dir);
+    g_main_loop_unref (data.loop);
+
+    korva_icon_cache_init (NULL, 0);
+}
+
+typedef struct {
+    GMainLoop *loop;
+    guint      requests;
+    guint      pending;
+    GPtrArray *icons;
+    GError    *error;
+} FetchIconData;
+
+static void
+on_icon_server_request (SoupServer        *server,
+                        SoupServerMessage *msg,
+                        const char        *path,
+                        GHashTable        *query,
+                        gpointer           user_data)
+{
+    FetchIconData *data = (FetchIconData *) user_data;
+
+    data->requests++;
+    soup_server_message_set_status (msg, SOUP_STATUS_OK, NULL);
+    soup_server_message_set_response (msg, "image/png", SOUP_MEMORY_STATIC, "PNG", 3);
+}
+
+static void
+on_icon_fetched (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    FetchIconData *data = (FetchIconData *) user_data;
+    GBytes *icon;
+
+    icon = korva_upnp_icon_fetcher_fetch_finish (res, &data->error);
+    if (icon != NULL) {
+        g_ptr_array_add (data->icons, icon);
+    }
+
+    data->pending--;
+    if (data->pending == 0) {
+        g_main_loop_quit (data->loop);
+    }
+}
+
+static void
+test_upnp_icon_fetcher (void)
+{
+    FetchIconData data = { NULL, 0, 0, NULL, NULL };
+    g_autoptr (SoupServer) server = NULL;
+    g_autoptr (GError) error = NULL;
+    g_autofree char *url = NULL;
+    GSList *uris;
+    guint i;
+
+    data.loop = g_main_loop_new (NULL, FALSE);
+    data.icons = g_ptr_array_new_with_free_func ((GDestroyNotify) g_bytes_unref);
+
+    server = soup_server_new (NULL, NULL);
+    soup_server_add_handler (server, "/icon.png", on_icon_server_request, &data, NULL);
+    soup_server_listen_local (server, 0, SOUP_SERVER_LISTEN_IPV4_ONLY, &error);
+    g_assert_no_error (error);
+
+    uris = soup_server_get_uris (server);
+    url = g_strdup_printf ("http://127.0.0.1:%d/icon.png", g_uri_get_port ((GUri *) uris->data));
+    g_slist_free_full (uris, (GDestroyNotify) g_uri_unref);
+
+    /* Concurrent requests for the same icon share one download */
+    data.pending = 3;
+    for (i = 0; i < 3; i++) {
+        korva_upnp_icon_fetcher_fetch_async (url, NULL, on_icon_fetched, &data);
+    }
+    g_main_loop_run (data.loop);
+
+    g_assert_no_error (data.error);
+    g_assert_cmpuint (data.requests, ==, 1);
+    g_assert_cmpuint (data.icons->len, ==, 3);
+    for (i = 0; i < data.icons->len; i++) {
+        g_assert_cmpuint (g_bytes_get_size (g_ptr_array_index (data.icons, i)), ==, 3);
+    }
+
+    /* Finished downloads are not cached */
+    data.pending = 1;
+    korva_upnp_icon_fetcher_fetch_async (url, NULL, on_icon_fetched, &data);
+    g_main_loop_run (data.loop);
+    g_assert_no_error (data.error);
+    g_assert_cmpuint (data.requests, ==, 2);
+
+    g_ptr_array_unref (data.icons);
+    g_main_loop_unref (data.loop);
+}
+
 typedef struct {
     GMainLoop           *loop;
     char                *result_uri;
@@ -64,6 +667,7 @@ typedef struct {
     GHashTable          *in_params;
     GHashTable          *result_params;
     GError              *result_error;
+    guint                pending;
 } HostFileTestData;
 
 typedef struct {
@@ -162,6 +766,7 @@ test_upnp_fileserver_host_file (HostFileTestData *data, gconstpointer user_data)
                                             "127.0.0.1",
                                             "127.0.0.1",
                                             NULL,
+                                            NULL,
                                             test_upnp_fileserver_host_file_on_host_file,
                                             data);
 
@@ -195,6 +800,7 @@ test_upnp_fileserver_host_file (HostFileTestData *data, gconstpointer user_data)
                                             "127.0.0.1",
                                             "192.168.4.5",
                                             NULL,
+                                            NULL,
                                             test_upnp_fileserver_host_file_on_host_file,
                                             data);
 
@@ -212,6 +818,323 @@ test_upnp_fileserver_host_file (HostFileTestData *data, gconstpointer user_data)
     g_assert (korva_upnp_file_server_idle (data->server));
 }
 
+static void
+test_upnp_rtt_stats (void)
+{
+    g_autoptr (KorvaUPnPRttStats) stats = korva_upnp_rtt_stats_new ();
+    g_autoptr (GVariant) info = NULL;
+    guint i, deadline, timeouts;
+
+    /* Without samples, the default deadline is used */
+    g_assert_cmpint (korva_upnp_rtt_stats_get_percentile (stats, 50), ==, 0);
+    g_assert_cmpuint (korva_upnp_rtt_stats_get_deadline (stats), ==, 10000);
+
+    /* 1 ms to 100 ms; the window only holds the last 64 of them */
+    for (i = 1; i <= 100; i++) {
+        korva_upnp_rtt_stats_add_sample (stats, i * 1000);
+    }
+
+    g_assert_cmpuint (korva_upnp_rtt_stats_get_samples (stats), ==, 100);
+    g_assert_cmpint (korva_upnp_rtt_stats_get_percentile (stats, 0), ==, 37000);
+    g_assert_cmpint (korva_upnp_rtt_stats_get_percentile (stats, 50), ==, 69000);
+    g_assert_cmpint (korva_upnp_rtt_stats_get_percentile (stats, 100), ==, 100000);
+
+    /* Fast devices still get the minimum deadline */
+    g_assert_cmpuint (korva_upnp_rtt_stats_get_deadline (stats), ==, 2000);
+
+    /* Slow devices get more time */
+    for (i = 0; i < 64; i++) {
+        korva_upnp_rtt_stats_add_sample (stats, 3 * G_USEC_PER_SEC);
+    }
+    deadline = korva_upnp_rtt_stats_get_deadline (stats);
+    g_assert_cmpuint (deadline, >=, 6000);
+
+    /* Timeouts back off up to the maximum */
+    korva_upnp_rtt_stats_add_timeout (stats);
+    g_assert_cmpuint (korva_upnp_rtt_stats_get_deadline (stats), ==, MIN (2 * deadline, 30000));
+    for (i = 0; i < 10; i++) {
+        korva_upnp_rtt_stats_add_timeout (stats);
+    }
+    g_assert_cmpuint (korva_upnp_rtt_stats_get_deadline (stats), ==, 30000);
+
+    /* An answer ends the back-off */
+    korva_upnp_rtt_stats_add_sample (stats, 3 * G_USEC_PER_SEC);
+    g_assert_cmpuint (korva_upnp_rtt_stats_get_deadline (stats), <, 30000);
+
+    info = g_variant_ref_sink (korva_upnp_rtt_stats_serialize (stats));
+    g_assert (g_variant_lookup (info, "Timeouts", "u", &timeouts));
+    g_assert_cmpuint (timeouts, ==, 11);
+}
+
+static void
+test_upnp_failure_cache (void)
+{
+    g_autoptr (KorvaUPnPFailureCache) cache = korva_upnp_failure_cache_new (50, 120);
+    g_autoptr (GError) timeout = NULL;
+    g_autoptr (GError) missing = NULL;
+    g_autoptr (GError) invalid = NULL;
+    const char *location = "http://127.0.0.1:4711/description.xml";
+
+    timeout = g_error_new_literal (KORVA_UPNP_DEVICE_ERROR, TIMEOUT, "Timeout");
+    missing = g_error_new_literal (KORVA_UPNP_DEVICE_ERROR, MISSING_SERVICE, "Missing");
+    invalid = g_error_new_literal (KORVA_UPNP_DEVICE_ERROR, INVALID_RESPONSE, "Invalid");
+
+    /* Transient failures back off exponentially */
+    g_assert (korva_upnp_failure_cache_begin (cache, "uuid:a", location, NULL));
+    g_assert_cmpuint (korva_upnp_failure_cache_fail (cache, "uuid:a", timeout), ==, 1);
+    g_assert (!korva_upnp_failure_cache_begin (cache, "uuid:a", location, NULL));
+    g_usleep (60 * 1000);
+    g_assert (korva_upnp_failure_cache_begin (cache, "uuid:a", location, NULL));
+    g_assert_cmpuint (korva_upnp_failure_cache_fail (cache, "uuid:a", timeout), ==, 2);
+    g_usleep (60 * 1000);
+    g_assert (!korva_upnp_failure_cache_begin (cache, "uuid:a", location, NULL));
+    g_usleep (60 * 1000);
+    g_assert (korva_upnp_failure_cache_begin (cache, "uuid:a", location, NULL));
+
+    /* So are failed calls to a device that has all services */
+    g_assert (korva_upnp_failure_cache_begin (cache, "uuid:c", location, NULL));
+    g_assert_cmpuint (korva_upnp_failure_cache_fail (cache, "uuid:c", invalid), ==, 1);
+    g_usleep (60 * 1000);
+    g_assert (korva_upnp_failure_cache_begin (cache, "uuid:c", location, NULL));
+
+    /* A success forgets the failures */
+    korva_upnp_failure_cache_succeed (cache, "uuid:a");
+    g_assert (korva_upnp_failure_cache_begin (cache, "uuid:a", location, NULL));
+    g_assert_cmpuint (korva_upnp_failure_cache_fail (cache, "uuid:a", timeout), ==, 1);
+
+    /* Permanent failures are not retried until the description changes */
+    g_assert (korva_upnp_failure_cache_begin (cache, "uuid:b", location, "1"));
+    g_assert_cmpuint (korva_upnp_failure_cache_fail (cache, "uuid:b", missing), ==, 1);
+    g_usleep (150 * 1000);
+    g_assert (!korva_upnp_failure_cache_begin (cache, "uuid:b", location, "1"));
+    g_assert (korva_upnp_failure_cache_begin (cache, "uuid:b", location, "2"));
+    g_assert_cmpuint (korva_upnp_failure_cache_fail (cache, "uuid:b", missing), ==, 1);
+    g_assert (!korva_upnp_failure_cache_begin (cache, "uuid:b", location, "2"));
+    g_assert (korva_upnp_failure_cache_begin (cache,
+                                              "uuid:b",
+                                              "http://127.0.0.1:4712/description.xml",
+                                              "2"));
+}
+
+/* Events as sent by renderers, with the track meta-data trimmed */
+static const char *last_change_events[] = {
+    "<Event xmlns=\"urn:schemas-upnp-org:metadata-1-0/AVT/\">"
+    "<InstanceID val=\"0\">"
+    "<TransportState val=\"PLAYING\"/>"
+    "<AVTransportURI val=\"http://127.0.0.1:4711/item?id=1&amp;res=0\"/>"
+    "<CurrentTrackMetaData val=\"&lt;DIDL-Lite xmlns=&quot;urn:schemas-upnp-org:metadata-1-0/DIDL-Lite/&quot;&gt;"
+    "&lt;item id=&quot;1&quot; parentID=&quot;0&quot; restricted=&quot;1&quot;&gt;"
+    "&lt;dc:title&gt;Rock &amp;amp; Roll&lt;/dc:title&gt;&lt;/item&gt;&lt;/DIDL-Lite&gt;\"/>"
+    "<CurrentTransportActions val=\"Pause,Stop,Seek\"/>"
+    "</InstanceID>"
+    "</Event>",
+
+    "<?xml version=\"1.0\"?>\n"
+    "<!-- generated -->\n"
+    "<avt:Event xmlns:avt='urn:schemas-upnp-org:metadata-1-0/AVT/'>\n"
+    "  <avt:InstanceID val='0'>\n"
+    "    <avt:TransportStatus val='OK'/>\n"
+    "    <avt:TransportState channel='Master' val='PAUSED_PLAYBACK'/>\n"
+    "  </avt:InstanceID>\n"
+    "</avt:Event>",
+
+    "<Event xmlns=\"urn:schemas-upnp-org:metadata-1-0/AVT/\">"
+    "<InstanceID val=\"1\">"
+    "<TransportState val=\"STOPPED\"/>"
+    "<AVTransportURI val=\"http://example.com/other\"/>"
+    "</InstanceID>"
+    "<InstanceID val=\"0\">"
+    "<AVTransportURI val=\"http://example.com/&#x41;&#66;\"/>"
+    "</InstanceID>"
+    "</Event>"
+};
+
+static void
+test_upnp_last_change (void)
+{
+    g_autoptr (GUPnPLastChangeParser) parser = gupnp_last_change_parser_new ();
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS (last_change_events); i++) {
+        KorvaUPnPLastChangeValue values[] = {
+            { "TransportState", NULL, 0 },
+            { "AVTransportURI", NULL, 0 },
+            { "CurrentTrackMetaData", NULL, 0 }
+        };
+        g_autofree char *state = NULL;
+        g_autofree char *uri = NULL;
+        g_autofree char *meta_data = NULL;
+        g_autofree char *scanned_state = NULL;
+        g_autofree char *scanned_uri = NULL;
+        g_autofree char *scanned_meta_data = NULL;
+        GError *error = NULL;
+
+        g_assert (gupnp_last_change_parser_parse_last_change (parser,
+                                                              0,
+                                                              last_change_events[i],
+                                                              &error,
+                                                              "TransportState", G_TYPE_STRING, &state,
+                                                              "AVTransportURI", G_TYPE_STRING, &uri,
+                                                              "CurrentTrackMetaData", G_TYPE_STRING, &meta_data,
+                                                              NULL));
+        g_assert_no_error (error);
+
+        g_assert (korva_upnp_last_change_scan (last_change_events[i], 0, values, G_N_ELEMENTS (values)));
+        scanned_state = korva_upnp_last_change_value_dup (&values[0]);
+        scanned_uri = korva_upnp_last_change_value_dup (&values[1]);
+        scanned_meta_data = korva_upnp_last_change_value_dup (&values[2]);
+
+        g_assert_cmpstr (scanned_state, ==, state);
+        g_assert_cmpstr (scanned_uri, ==, uri);
+        g_assert_cmpstr (scanned_meta_data, ==, meta_data);
+
+        if (uri != NULL) {
+            g_assert (korva_upnp_last_change_value_equal (&values[1], uri, FALSE));
+        }
+    }
+
+    {
+        KorvaUPnPLastChangeValue values[] = {
+            { "TransportState", NULL, 0 },
+            { "AVTransportURI", NULL, 0 }
+        };
+
+        /* Instance 1 of the last event */
+        g_assert (korva_upnp_last_change_scan (last_change_events[2], 1, values, 2));
+        g_assert (korva_upnp_last_change_value_equal (&values[0], "stopped", TRUE));
+        g_assert (!korva_upnp_last_change_value_equal (&values[0], "stopped", FALSE));
+        g_assert (!korva_upnp_last_change_value_equal (&values[0], "STOP", FALSE));
+        g_assert (korva_upnp_last_change_value_equal (&values[1], "http://example.com/other", FALSE));
+
+        /* No instance 2 at all */
+        g_assert (korva_upnp_last_change_scan (last_change_events[2], 2, values, 2));
+        g_assert (values[0].value == NULL);
+        g_assert (!korva_upnp_last_change_value_equal (&values[0], "", FALSE));
+        g_assert (korva_upnp_last_change_value_dup (&values[1]) == NULL);
+
+        g_assert (!korva_upnp_last_change_scan ("<Event><InstanceID val=\"0", 0, values, 2));
+        g_assert (!korva_upnp_last_change_scan ("<Event><InstanceID val=0/>", 0, values, 2));
+    }
+}
+
+static void
+test_upnp_last_change_benchmark (void)
+{
+    g_autoptr (GUPnPLastChangeParser) parser = gupnp_last_change_parser_new ();
+    const guint iterations = 10000;
+    double gupnp_time, scan_time;
+    guint i;
+
+    if (!g_test_perf ()) {
+        g_test_skip ("Only run in performance mode");
+
+        return;
+    }
+
+    g_test_timer_start ();
+    for (i = 0; i < iterations; i++) {
+        g_autofree char *state = NULL;
+        g_autofree char *uri = NULL;
+
+        gupnp_last_change_parser_parse_last_change (parser,
+                                                    0,
+                                                    last_change_events[0],
+                                                    NULL,
+                                                    "TransportState", G_TYPE_STRING, &state,
+                                                    "AVTransportURI", G_TYPE_STRING, &uri,
+                                                    NULL);
+    }
+    gupnp_time = g_test_timer_elapsed ();
+
+    g_test_timer_start ();
+    for (i = 0; i < iterations; i++) {
+        KorvaUPnPLastChangeValue values[] = {
+            { "TransportState", NULL, 0 },
+            { "AVTransportURI", NULL, 0 }
+        };
+
+        korva_upnp_last_change_scan (last_change_events[0], 0, values, 2);
+        g_assert (korva_upnp_last_change_value_equal (&values[0], "PLAYING", TRUE));
+    }
+    scan_time = g_test_timer_elapsed ();
+
+    g_test_message ("%u events: GUPnPLastChangeParser %.3f s, scanner %.3f s",
+                    iterations,
+                    gupnp_time,
+                    scan_time);
+    g_test_minimized_result (scan_time * G_USEC_PER_SEC / iterations,
+                             "Scanning a LastChange event took %.2f µs",
+                             scan_time * G_USEC_PER_SEC / iterations);
+}
+
+typedef struct {
+    HostFileTestData *data;
+    char             *uri;
+    GError           *error;
+} ConcurrentHostFileData;
+
+static void
+test_upnp_fileserver_host_file_concurrent_on_host_file (GObject      *source,
+                                                        GAsyncResult *res,
+                                                        gpointer      user_data)
+{
+    ConcurrentHostFileData *result = (ConcurrentHostFileData *) user_data;
+    GHashTable *params;
+
+    result->uri = korva_upnp_file_server_host_file_finish (KORVA_UPNP_FILE_SERVER (source),
+                                                           res,
+                                                           &params,
+                                                           &result->error);
+
+    if (--result->data->pending == 0) {
+        g_main_loop_quit (result->data->loop);
+    }
+}
+
+static void
+test_upnp_fileserver_host_file_concurrent (HostFileTestData *data, gconstpointer user_data)
+{
+    ConcurrentHostFileData results[2];
+    const char *peers[2] = { "127.0.0.1", "192.168.4.5" };
+    guint i;
+
+    memset (results, 0, sizeof (results));
+
+    /* Host the same file for two peers before the meta-data of the first one
+     * is known; both have to get the same resource */
+    data->pending = G_N_ELEMENTS (results);
+    for (i = 0; i < G_N_ELEMENTS (results); i++) {
+        results[i].data = data;
+        korva_upnp_file_server_host_file_async (data->server,
+                                                data->in_file,
+                                                data->in_params,
+                                                "127.0.0.1",
+                                                peers[i],
+                                                NULL,
+                                                NULL,
+                                                test_upnp_fileserver_host_file_concurrent_on_host_file,
+                                                &results[i]);
+    }
+
+    g_main_loop_run (data->loop);
+
+    for (i = 0; i < G_N_ELEMENTS (results); i++) {
+        g_assert_no_error (results[i].error);
+        g_assert (results[i].uri != NULL);
+    }
+    g_assert_cmpstr (results[0].uri, ==, results[1].uri);
+
+    korva_upnp_file_server_unhost_file_for_peer (data->server, data->in_file, peers[1]);
+    g_assert (!korva_upnp_file_server_idle (data->server));
+
+    korva_upnp_file_server_unhost_file_for_peer (data->server, data->in_file, peers[0]);
+    g_assert (korva_upnp_file_server_idle (data->server));
+
+    for (i = 0; i < G_N_ELEMENTS (results); i++) {
+        g_free (results[i].uri);
+    }
+}
+
 static void
 test_upnp_fileserver_host_file_dont_override_data (HostFileTestData *data, gconstpointer user_data)
 {
@@ -229,6 +1152,7 @@ test_upnp_fileserver_host_file_dont_override_data (HostFileTestData *data, gcons
                                             "127.0.0.1",
                                             "127.0.0.1",
                                             NULL,
+                                            NULL,
                                             test_upnp_fileserver_host_file_on_host_file,
                                             data);
 
@@ -270,6 +1194,7 @@ test_upnp_fileserver_host_file_error (HostFileTestData *data, gconstpointer user
                                             "127.0.0.1",
                                             "127.0.0.1",
                                             NULL,
+                                            NULL,
                                             test_upnp_fileserver_host_file_on_host_file,
                                             data);
 
@@ -304,6 +1229,7 @@ test_upnp_file_server_host_file_no_access (HostFileTestData *data, gconstpointer
                                             "127.0.0.1",
                                             "127.0.0.1",
                                             NULL,
+                                            NULL,
                                             test_upnp_fileserver_host_file_on_host_file,
                                             data);
 
@@ -331,6 +1257,7 @@ test_upnp_fileserver_host_file_timeout (HostFileTestData *data, gconstpointer us
                                             "127.0.0.1",
                                             "127.0.0.1",
                                             NULL,
+                                            NULL,
                                             test_upnp_fileserver_host_file_on_host_file,
                                             data);
 
@@ -403,6 +1330,7 @@ test_upnp_fileserver_http_server_setup (HostFileTestData *data, gconstpointer us
                                             "127.0.0.1",
                                             "127.0.0.1",
                                             NULL,
+                                            NULL,
                                             test_upnp_fileserver_host_file_on_host_file,
                                             data);
 
@@ -468,6 +1396,7 @@ test_upnp_fileserver_http_server (HostFileTestData *data, gconstpointer user_dat
                                             "127.0.0.1",
                                             "192.168.4.5",
                                             NULL,
+                                            NULL,
                                             test_upnp_fileserver_host_file_on_host_file,
                                             data);
     g_main_loop_run (data->loop);
@@ -622,21 +1551,588 @@ test_upnp_fileserver_http_server_content_features (HostFileTestData *data, gcons
     g_object_unref (message);
 }
 
-typedef struct {
-    GMainLoop         *loop;
-    MockDMR           *dmr;
-    GUPnPDeviceProxy  *proxy;
-    KorvaUPnPDevice   *device;
-    GUPnPControlPoint *cp;
-    gboolean           init_result;
-    GError            *init_error;
-    GError            *result_error;
-    char              *result_tag;
-} UPnPDeviceData;
-
+/* Host @file with @params and wait for the URI it is served from */
 static void
-device_setup_on_device_init (GObject      *object,
-                             GAsyncResult *result,
+test_upnp_fileserver_host_playlist (HostFileTestData *data, GFile *file, GHashTable *params)
+{
+    g_clear_pointer (&data->result_uri, g_free);
+    korva_upnp_file_server_host_file_async (data->server,
+                                            file,
+                                            params,
+                                            "127.0.0.1",
+                                            "127.0.0.1",
+                                            NULL,
+                                            NULL,
+                                            test_upnp_fileserver_host_file_on_host_file,
+                                            data);
+    g_main_loop_run (data->loop);
+
+    g_assert_no_error (data->result_error);
+    g_assert (data->result_uri != NULL);
+    g_assert (g_hash_table_contains (params, "Playlist"));
+    g_assert (!g_hash_table_contains (params, "Size"));
+}
+
+/*
+ * A directory or a list of files is served as one playlist; its entries are
+ * only looked at when they are requested.
+ */
+static void
+test_upnp_fileserver_playlist (HostFileTestData *data, gconstpointer user_data)
+{
+    g_autoptr (SoupSession) session = soup_session_new ();
+    g_autoptr (GError) error = NULL;
+    g_autoptr (GFile) directory = NULL;
+    g_autoptr (GFile) list = NULL;
+    g_autoptr (GHashTable) params = NULL;
+    g_autofree char *path = NULL;
+    g_autofree char *image = NULL;
+    g_autofree char *song = NULL;
+    g_autofree char *text = NULL;
+    g_autofree char *hidden = NULL;
+    g_autofree char *image_uri = NULL;
+    g_autofree char *song_uri = NULL;
+    g_autofree char *missing = NULL;
+    g_autofree char *playlist = NULL;
+    g_auto (GStrv) lines = NULL;
+    const char *uris[3];
+    const char *content = "Not really an MP3 file";
+    SoupMessage *message;
+    xmlDoc *doc;
+    xmlNode *item, *res;
+    xmlChar *entry;
+    g_auto (WaitForMessageData) wfm = WAIT_FOR_MESSAGE_DATA_INIT (data->loop);
+
+    path = g_dir_make_tmp ("korva-playlist-XXXXXX", &error);
+    g_assert_no_error (error);
+
+    image = g_build_filename (path, "a.jpg", NULL);
+    song = g_build_filename (path, "b.mp3", NULL);
+    text = g_build_filename (path, "notes.txt", NULL);
+    hidden = g_build_filename (path, ".hidden.mp3", NULL);
+    g_assert (g_file_set_contents (image, "JPEG", -1, NULL));
+    g_assert (g_file_set_contents (song, content, -1, NULL));
+    g_assert (g_file_set_contents (text, "Notes", -1, NULL));
+    g_assert (g_file_set_contents (hidden, "Hidden", -1, NULL));
+
+    /* A directory is an M3U playlist of its media files, in name order */
+    directory = g_file_new_for_path (path);
+    params = g_hash_table_new_full (g_str_hash,
+                                    (GEqualFunc) g_str_equal,
+                                    g_free,
+                                    (GDestroyNotify) g_variant_unref);
+    g_hash_table_insert (params, g_strdup ("URI"), g_variant_new_take_string (g_file_get_uri (directory)));
+    test_upnp_fileserver_host_playlist (data, directory, params);
+    g_assert (g_str_has_suffix (data->result_uri, ".m3u"));
+
+    message = soup_message_new (SOUP_METHOD_GET, data->result_uri);
+    schedule_request_and_wait (session, message, &wfm);
+    g_assert_no_error (wfm.error);
+    g_assert_cmpint (soup_message_get_status (message), ==, SOUP_STATUS_OK);
+    g_assert_cmpstr (soup_message_headers_get_content_type (soup_message_get_response_headers (message), NULL),
+                     ==,
+                     "audio/x-mpegurl");
+    g_object_unref (message);
+
+    playlist = g_strndup (g_bytes_get_data (wfm.data, NULL), g_bytes_get_size (wfm.data));
+    lines = g_strsplit (playlist, "\n", -1);
+    g_assert_cmpuint (g_strv_length (lines), ==, 6);
+    g_assert_cmpstr (lines[0], ==, "#EXTM3U");
+    g_assert_cmpstr (lines[1], ==, "#EXTINF:-1,a.jpg");
+    g_assert (g_str_has_suffix (lines[2], "/0.jpg"));
+    g_assert_cmpstr (lines[3], ==, "#EXTINF:-1,b.mp3");
+    g_assert (g_str_has_suffix (lines[4], "/1.mp3"));
+    g_assert_cmpstr (lines[5], ==, "");
+    wait_for_message_data_reset (&wfm);
+
+    message = soup_message_new (SOUP_METHOD_GET, lines[4]);
+    schedule_request_and_wait (session, message, &wfm);
+    g_assert_no_error (wfm.error);
+    g_assert_cmpint (soup_message_get_status (message), ==, SOUP_STATUS_OK);
+    g_assert_cmpstr (soup_message_headers_get_content_type (soup_message_get_response_headers (message), NULL),
+                     ==,
+                     "audio/mpeg");
+    g_assert_cmpmem (g_bytes_get_data (wfm.data, NULL), g_bytes_get_size (wfm.data), content, strlen (content));
+    g_object_unref (message);
+    wait_for_message_data_reset (&wfm);
+
+    /* Entries beyond the end of the playlist do not exist */
+    missing = g_strdup (lines[2]);
+    strcpy (missing + strlen (missing) - strlen ("0.jpg"), "7.jpg");
+    message = soup_message_new (SOUP_METHOD_GET, missing);
+    schedule_request_and_wait (session, message, &wfm);
+    g_assert_cmpint (soup_message_get_status (message), ==, SOUP_STATUS_NOT_FOUND);
+    g_object_unref (message);
+    wait_for_message_data_reset (&wfm);
+
+    /* A list of files is a DIDL-Lite playlist if asked for */
+    image_uri = g_filename_to_uri (image, NULL, NULL);
+    song_uri = g_filename_to_uri (song, NULL, NULL);
+    uris[0] = song_uri;
+    uris[1] = image_uri;
+    uris[2] = NULL;
+
+    list = g_file_new_for_uri ("korva-playlist:test");
+    g_hash_table_remove_all (params);
+    g_hash_table_insert (params, g_strdup ("URIs"), g_variant_new_strv (uris, -1));
+    g_hash_table_insert (params, g_strdup ("ContentType"), g_variant_new_string ("text/xml"));
+    test_upnp_fileserver_host_playlist (data, list, params);
+    g_assert (g_str_has_suffix (data->result_uri, ".xml"));
+
+    message = soup_message_new (SOUP_METHOD_GET, data->result_uri);
+    schedule_request_and_wait (session, message, &wfm);
+    g_assert_no_error (wfm.error);
+    g_assert_cmpint (soup_message_get_status (message), ==, SOUP_STATUS_OK);
+    g_object_unref (message);
+
+    doc = xmlReadMemory (g_bytes_get_data (wfm.data, NULL),
+                         g_bytes_get_size (wfm.data),
+                         NULL,
+                         NULL,
+                         XML_PARSE_NONET);
+    g_assert (doc != NULL);
+    item = find_child (xmlDocGetRootElement (doc), "item");
+    g_assert (item != NULL);
+    g_assert (item->next != NULL);
+    g_assert (item->next->next == NULL);
+    res = find_child (item, "res");
+    g_assert (res != NULL);
+    entry = xmlNodeGetContent (res);
+    g_assert (g_str_has_suffix ((const char *) entry, "/0.mp3"));
+    wait_for_message_data_reset (&wfm);
+
+    message = soup_message_new (SOUP_METHOD_GET, (const char *) entry);
+    schedule_request_and_wait (session, message, &wfm);
+    g_assert_no_error (wfm.error);
+    g_assert_cmpint (soup_message_get_status (message), ==, SOUP_STATUS_OK);
+    g_assert_cmpmem (g_bytes_get_data (wfm.data, NULL), g_bytes_get_size (wfm.data), content, strlen (content));
+    g_object_unref (message);
+
+    xmlFree (entry);
+    xmlFreeDoc (doc);
+
+    g_remove (image);
+    g_remove (song);
+    g_remove (text);
+    g_remove (hidden);
+    g_rmdir (path);
+}
+
+/* Length of a simulated burst of discovery or SOAP work on the main context */
+#define JITTER_BURST_MS 30
+#define JITTER_FILE_SIZE (64 * 1024 * 1024)
+
+typedef struct {
+    GMainLoop *loop;
+    char      *uri;
+    gint64     max_gap;
+    gsize      received;
+    GError    *error;
+    GMutex     lock;
+    GCond      cond;
+    gboolean   done;
+} JitterData;
+
+static gboolean
+jitter_on_burst (gpointer user_data)
+{
+    g_usleep (JITTER_BURST_MS * 1000);
+
+    return TRUE;
+}
+
+static gpointer
+jitter_read_stream (gpointer user_data)
+{
+    JitterData *jitter = user_data;
+    GMainContext *ctx = g_main_context_new ();
+    SoupSession *session;
+    SoupMessage *message;
+    GInputStream *stream;
+    char *buffer;
+    gssize bytes_read;
+    gint64 last;
+
+    g_main_context_push_thread_default (ctx);
+
+    session = soup_session_new ();
+    message = soup_message_new (SOUP_METHOD_GET, jitter->uri);
+    buffer = g_malloc (G_MAXUINT16 + 1);
+
+    stream = soup_session_send (session, message, NULL, &jitter->error);
+    if (stream != NULL) {
+        last = g_get_monotonic_time ();
+        while ((bytes_read = g_input_stream_read (stream,
+                                                  buffer,
+                                                  G_MAXUINT16 + 1,
+                                                  NULL,
+                                                  &jitter->error)) > 0) {
+            gint64 now = g_get_monotonic_time ();
+
+            jitter->max_gap = MAX (jitter->max_gap, now - last);
+            jitter->received += bytes_read;
+            last = now;
+        }
+        g_input_stream_close (stream, NULL, NULL);
+        g_object_unref (stream);
+    }
+
+    g_free (buffer);
+    g_object_unref (message);
+    g_object_unref (session);
+    g_main_context_pop_thread_default (ctx);
+    g_main_context_unref (ctx);
+
+    g_mutex_lock (&jitter->lock);
+    jitter->done = TRUE;
+    g_cond_signal (&jitter->cond);
+    g_mutex_unlock (&jitter->lock);
+
+    g_main_loop_quit (jitter->loop);
+
+    return NULL;
+}
+
+/* Stream the whole file without ever iterating the main context */
+static void
+jitter_read_blocked (JitterData *jitter)
+{
+    g_autoptr (GThread) thread = NULL;
+    gint64 deadline;
+
+    g_mutex_init (&jitter->lock);
+    g_cond_init (&jitter->cond);
+
+    deadline = g_get_monotonic_time () + 30 * G_TIME_SPAN_SECOND;
+    thread = g_thread_new ("jitter client", jitter_read_stream, jitter);
+
+    g_mutex_lock (&jitter->lock);
+    while (!jitter->done) {
+        if (!g_cond_wait_until (&jitter->cond, &jitter->lock, deadline)) {
+            break;
+        }
+    }
+    g_mutex_unlock (&jitter->lock);
+
+    g_assert (jitter->done);
+    g_thread_join (g_steal_pointer (&thread));
+
+    g_cond_clear (&jitter->cond);
+    g_mutex_clear (&jitter->lock);
+}
+
+/* Host a file that takes a while to stream instead of the test image */
+static char *
+test_upnp_fileserver_host_big_file (HostFileTestData *data)
+{
+    g_autoptr (GError) error = NULL;
+    g_autofree char *contents = NULL;
+    char *path = NULL;
+    int fd;
+
+    fd = g_file_open_tmp ("korva-jitter-XXXXXX.dat", &path, &error);
+    g_assert_no_error (error);
+    g_close (fd, NULL);
+
+    contents = g_malloc0 (JITTER_FILE_SIZE);
+    g_file_set_contents (path, contents, JITTER_FILE_SIZE, &error);
+    g_assert_no_error (error);
+
+    g_clear_object (&data->in_file);
+    g_free (data->in_uri);
+    data->in_file = g_file_new_for_path (path);
+    data->in_uri = g_file_get_uri (data->in_file);
+    g_hash_table_insert (data->in_params, g_strdup ("URI"), g_variant_new_string (data->in_uri));
+    g_hash_table_insert (data->in_params,
+                         g_strdup ("ContentType"),
+                         g_variant_new_string ("video/mpeg"));
+
+    korva_upnp_file_server_host_file_async (data->server,
+                                            data->in_file,
+                                            data->in_params,
+                                            "127.0.0.1",
+                                            "127.0.0.1",
+                                            NULL,
+                                            NULL,
+                                            test_upnp_fileserver_host_file_on_host_file,
+                                            data);
+    g_main_loop_run (data->loop);
+    g_assert_no_error (data->result_error);
+    g_assert (data->result_uri != NULL);
+
+    return path;
+}
+
+static void
+test_upnp_fileserver_http_server_jitter (HostFileTestData *data, gconstpointer user_data)
+{
+    g_autoptr (GThread) thread = NULL;
+    g_autofree char *path = NULL;
+    JitterData jitter = { 0 };
+    JitterData blocked = { 0 };
+    guint burst_id;
+
+    path = test_upnp_fileserver_host_big_file (data);
+
+    /* The file server has its own context, so a stream does not stall even
+     * if the main one is never dispatched */
+    blocked.loop = data->loop;
+    blocked.uri = data->result_uri;
+    jitter_read_blocked (&blocked);
+    g_assert_no_error (blocked.error);
+    g_assert_cmpuint (blocked.received, ==, JITTER_FILE_SIZE);
+
+    /* Stream the file from another thread while the main context is kept
+     * busy, like it is during a burst of discovery traffic */
+    jitter.loop = data->loop;
+    jitter.uri = data->result_uri;
+    g_mutex_init (&jitter.lock);
+    g_cond_init (&jitter.cond);
+    burst_id = g_timeout_add (JITTER_BURST_MS + 20, jitter_on_burst, NULL);
+    thread = g_thread_new ("jitter client", jitter_read_stream, &jitter);
+    g_main_loop_run (data->loop);
+    g_source_remove (burst_id);
+    g_thread_join (g_steal_pointer (&thread));
+    g_cond_clear (&jitter.cond);
+    g_mutex_clear (&jitter.lock);
+
+    g_assert_no_error (jitter.error);
+    g_assert_cmpuint (jitter.received, ==, JITTER_FILE_SIZE);
+
+    g_test_message ("Largest gap between chunks with %d ms bursts on the main context: %.2f ms",
+                    JITTER_BURST_MS,
+                    jitter.max_gap / 1000.0);
+    g_test_minimized_result (jitter.max_gap / 1000.0,
+                             "Largest gap between chunks was %.2f ms",
+                             jitter.max_gap / 1000.0);
+
+    /* Scheduling noise makes this too flaky for the normal test run */
+    if (g_test_perf ()) {
+        g_assert_cmpint (jitter.max_gap, <, JITTER_BURST_MS * 1000);
+    }
+
+    korva_upnp_file_server_unhost_by_peer (data->server, "127.0.0.1");
+    g_unlink (path);
+}
+
+/* Work done by one dispatch of the synthetic discovery storm */
+#define STORM_ITEM_US 500
+
+typedef struct {
+    GMainLoop    *loop;
+    GInputStream *stream;
+    gint64        requested;
+    gint64        max_latency;
+    gint64        total_latency;
+    guint         chunks;
+    gsize         received;
+    guint         storm_items;
+    gint          control_rank;
+    gboolean      housekeeping_ran;
+    GError       *error;
+} ChunkLatencyData;
+
+static gboolean
+chunk_latency_on_storm (gpointer user_data)
+{
+    ChunkLatencyData *latency = user_data;
+
+    /* Stand-in for parsing a description document or an SSDP burst */
+    g_usleep (STORM_ITEM_US);
+    latency->storm_items++;
+
+    return TRUE;
+}
+
+static gboolean
+chunk_latency_on_control (gpointer user_data)
+{
+    ChunkLatencyData *latency = user_data;
+
+    latency->control_rank = latency->storm_items;
+
+    return FALSE;
+}
+
+static gboolean
+chunk_latency_on_housekeeping (gpointer user_data)
+{
+    ChunkLatencyData *latency = user_data;
+
+    latency->housekeeping_ran = TRUE;
+
+    return FALSE;
+}
+
+static void
+chunk_latency_read_next (ChunkLatencyData *latency);
+
+static void
+chunk_latency_on_read (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    ChunkLatencyData *latency = user_data;
+    g_autoptr (GBytes) bytes = NULL;
+    gint64 elapsed;
+
+    bytes = g_input_stream_read_bytes_finish (G_INPUT_STREAM (source), res, &latency->error);
+    if (bytes == NULL || g_bytes_get_size (bytes) == 0) {
+        g_main_loop_quit (latency->loop);
+
+        return;
+    }
+
+    elapsed = g_get_monotonic_time () - latency->requested;
+    latency->max_latency = MAX (latency->max_latency, elapsed);
+    latency->total_latency += elapsed;
+    latency->chunks++;
+    latency->received += g_bytes_get_size (bytes);
+
+    chunk_latency_read_next (latency);
+}
+
+static void
+chunk_latency_read_next (ChunkLatencyData *latency)
+{
+    latency->requested = g_get_monotonic_time ();
+    g_input_stream_read_bytes_async (latency->stream,
+                                     G_MAXUINT16 + 1,
+                                     korva_priority_get (KORVA_PRIORITY_CLASS_STREAMING),
+                                     NULL,
+                                     chunk_latency_on_read,
+                                     latency);
+}
+
+static void
+chunk_latency_on_send (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    ChunkLatencyData *latency = user_data;
+
+    latency->stream = soup_session_send_finish (SOUP_SESSION (source), res, &latency->error);
+    if (latency->stream == NULL) {
+        g_main_loop_quit (latency->loop);
+
+        return;
+    }
+
+    chunk_latency_read_next (latency);
+}
+
+static void
+test_upnp_fileserver_http_server_storm (HostFileTestData *data, gconstpointer user_data)
+{
+    g_autoptr (SoupSession) session = NULL;
+    g_autoptr (SoupMessage) message = NULL;
+    g_autofree char *path = NULL;
+    ChunkLatencyData latency = { 0 };
+    guint i, storm_ids[8], housekeeping_id;
+
+    path = test_upnp_fileserver_host_big_file (data);
+
+    /* Keep the main context saturated with discovery work while a stream is
+     * consumed on it */
+    for (i = 0; i < G_N_ELEMENTS (storm_ids); i++) {
+        storm_ids[i] = g_idle_add_full (korva_priority_get (KORVA_PRIORITY_CLASS_DISCOVERY),
+                                        chunk_latency_on_storm,
+                                        &latency,
+                                        NULL);
+    }
+
+    /* Queued after the storm, but a reply goes ahead of it while cache
+     * maintenance waits until it is over */
+    latency.control_rank = -1;
+    g_idle_add_full (korva_priority_get (KORVA_PRIORITY_CLASS_CONTROL),
+                     chunk_latency_on_control,
+                     &latency,
+                     NULL);
+    housekeeping_id = g_idle_add_full (korva_priority_get (KORVA_PRIORITY_CLASS_HOUSEKEEPING),
+                                       chunk_latency_on_housekeeping,
+                                       &latency,
+                                       NULL);
+
+    latency.loop = data->loop;
+    session = soup_session_new ();
+    message = soup_message_new (SOUP_METHOD_GET, data->result_uri);
+    soup_session_send_async (session,
+                             message,
+                             korva_priority_get (KORVA_PRIORITY_CLASS_STREAMING),
+                             NULL,
+                             chunk_latency_on_send,
+                             &latency);
+    g_main_loop_run (data->loop);
+
+    for (i = 0; i < G_N_ELEMENTS (storm_ids); i++) {
+        g_source_remove (storm_ids[i]);
+    }
+
+    g_assert_cmpint (latency.control_rank, ==, 0);
+    g_assert (!latency.housekeeping_ran);
+    g_source_remove (housekeeping_id);
+
+    g_assert_no_error (latency.error);
+    g_input_stream_close (latency.stream, NULL, NULL);
+    g_clear_object (&latency.stream);
+    g_assert_cmpuint (latency.received, ==, JITTER_FILE_SIZE);
+    g_assert_cmpuint (latency.chunks, >, 0);
+    g_assert_cmpuint (latency.storm_items, >, 0);
+
+    g_test_message ("%u chunks during %u storm items: mean latency %.2f ms, max %.2f ms",
+                    latency.chunks,
+                    latency.storm_items,
+                    latency.total_latency / 1000.0 / latency.chunks,
+                    latency.max_latency / 1000.0);
+    g_test_minimized_result (latency.max_latency / 1000.0,
+                             "Largest chunk delivery latency was %.2f ms",
+                             latency.max_latency / 1000.0);
+
+    /* A chunk should at most wait for the storm item that was running when
+     * it became ready */
+    if (g_test_perf ()) {
+        g_assert_cmpint (latency.max_latency, <, 10 * STORM_ITEM_US);
+    }
+
+    korva_upnp_file_server_unhost_by_peer (data->server, "127.0.0.1");
+    g_unlink (path);
+}
+
+static void
+test_priority (void)
+{
+    g_assert_cmpint (korva_priority_get (KORVA_PRIORITY_CLASS_STREAMING), <,
+                     korva_priority_get (KORVA_PRIORITY_CLASS_CONTROL));
+    g_assert_cmpint (korva_priority_get (KORVA_PRIORITY_CLASS_CONTROL), <,
+                     korva_priority_get (KORVA_PRIORITY_CLASS_DISCOVERY));
+    g_assert_cmpint (korva_priority_get (KORVA_PRIORITY_CLASS_DISCOVERY), <,
+                     korva_priority_get (KORVA_PRIORITY_CLASS_HOUSEKEEPING));
+
+    g_test_expect_message ("Korva-Priority", G_LOG_LEVEL_WARNING, "*bogus=1*");
+    g_test_expect_message ("Korva-Priority", G_LOG_LEVEL_WARNING, "*control=high*");
+    korva_priority_configure ("streaming=-200, discovery=250,bogus=1,control=high");
+    g_test_assert_expected_messages ();
+
+    g_assert_cmpint (korva_priority_get (KORVA_PRIORITY_CLASS_STREAMING), ==, -200);
+    g_assert_cmpint (korva_priority_get (KORVA_PRIORITY_CLASS_CONTROL), ==, G_PRIORITY_DEFAULT);
+    g_assert_cmpint (korva_priority_get (KORVA_PRIORITY_CLASS_DISCOVERY), ==, 250);
+    g_assert_cmpint (korva_priority_get (KORVA_PRIORITY_CLASS_HOUSEKEEPING), ==, G_PRIORITY_LOW);
+
+    korva_priority_configure (NULL);
+    g_assert_cmpint (korva_priority_get (KORVA_PRIORITY_CLASS_STREAMING), ==, G_PRIORITY_HIGH);
+}
+
+typedef struct {
+    GMainLoop         *loop;
+    MockDMR           *dmr;
+    GUPnPDeviceProxy  *proxy;
+    KorvaUPnPDevice   *device;
+    GUPnPControlPoint *cp;
+    gboolean           init_result;
+    GError            *init_error;
+    GError            *result_error;
+    char              *result_tag;
+} UPnPDeviceData;
+
+static void
+device_setup_on_device_init (GObject      *object,
+                             GAsyncResult *result,
                              gpointer      user_data)
 {
     UPnPDeviceData *data = (UPnPDeviceData *) user_data;
@@ -734,19 +2230,21 @@ test_upnp_device (UPnPDeviceData *data, gconstpointer user_data)
         g_main_loop_run (data->loop);
     }
 
-    if (fault == MOCK_DMR_FAULT_PROTOCOL_INFO_CALL_INVALID || fault == MOCK_DMR_FAULT_NO_AV_TRANSPORT ||
-        fault == MOCK_DMR_FAULT_NO_CONNECTION_MANAGER || fault == MOCK_DMR_FAULT_PROTOCOL_INFO_CALL_ERROR) {
+    if (fault == MOCK_DMR_FAULT_NO_AV_TRANSPORT || fault == MOCK_DMR_FAULT_NO_CONNECTION_MANAGER) {
         g_assert (!data->init_result);
         g_assert (data->init_error != NULL);
         g_assert (data->init_error->domain == KORVA_UPNP_DEVICE_ERROR);
         g_assert_cmpint (data->init_error->code, ==, MISSING_SERVICE);
 
         return;
-    } else if (fault == MOCK_DMR_FAULT_GET_TRANSPORT_INFO_FAIL) {
+    } else if (fault == MOCK_DMR_FAULT_PROTOCOL_INFO_CALL_INVALID ||
+               fault == MOCK_DMR_FAULT_PROTOCOL_INFO_CALL_ERROR ||
+               fault == MOCK_DMR_FAULT_GET_TRANSPORT_INFO_FAIL) {
+        /* The services are there, so the device is tried again later */
         g_assert (!data->init_result);
         g_assert (data->init_error != NULL);
         g_assert (data->init_error->domain == KORVA_UPNP_DEVICE_ERROR);
-        g_assert_cmpint (data->init_error->code, ==, MISSING_SERVICE);
+        g_assert_cmpint (data->init_error->code, ==, INVALID_RESPONSE);
 
         return;
     }
@@ -791,55 +2289,394 @@ test_upnp_device (UPnPDeviceData *data, gconstpointer user_data)
                      korva_icon_cache_get_default (DEVICE_TYPE_PLAYER));
 
     g_assert_cmpint (found_keys & KEY_ALL, ==, KEY_ALL);
+
+    /* The serialization is kept until the device changes */
+    value = korva_device_serialize (KORVA_DEVICE (data->device));
+    g_assert (value == info);
+    g_variant_unref (value);
+    g_variant_unref (info);
 }
 
+#define TEST_DEVICE_CACHE "korva-test-devices.ini"
+
 static void
-test_upnp_device_multiple_proxies (UPnPDeviceData *data, gconstpointer user_data)
+test_upnp_device_cache_setup (UPnPDeviceData *data, gconstpointer user_data)
 {
-    g_assert (data->proxy != NULL);
-    korva_upnp_device_add_proxy (data->device, data->proxy);
-    g_assert (!korva_upnp_device_remove_proxy (data->device, data->proxy));
-    g_assert (korva_upnp_device_remove_proxy (data->device, data->proxy));
+    g_autofree char *path = g_build_filename (g_get_tmp_dir (), TEST_DEVICE_CACHE, NULL);
+
+    g_remove (path);
+    korva_upnp_device_cache_init (path);
+    test_upnp_device_setup (data, user_data);
 }
 
 static void
-on_test_upnp_device_share_push_async (GObject      *source,
-                                      GAsyncResult *res,
-                                      gpointer      user_data)
+test_upnp_device_cache_teardown (UPnPDeviceData *data, gconstpointer user_data)
 {
-    UPnPDeviceData *data = (UPnPDeviceData *) user_data;
+    g_autofree char *path = g_build_filename (g_get_tmp_dir (), TEST_DEVICE_CACHE, NULL);
 
-    data->result_tag = korva_device_push_finish (KORVA_DEVICE (source),
-                                                 res,
-                                                 &(data->result_error));
-    g_main_loop_quit (data->loop);
+    test_upnp_device_teardown (data, user_data);
+    korva_upnp_device_cache_shutdown ();
+    g_remove (path);
 }
 
-static void
-on_test_upnp_device_share_unshare_async (GObject      *source,
-                                         GAsyncResult *res,
-                                         gpointer      user_data)
+static gboolean
+device_cache_has_mock_dmr (void)
 {
-    UPnPDeviceData *data = (UPnPDeviceData *) user_data;
-
-    korva_device_unshare_finish (KORVA_DEVICE (source),
-                                 res,
-                                 &(data->result_error));
+    g_autoptr (KorvaUPnPDeviceCacheEntry) entry = korva_upnp_device_cache_lookup (MOCK_DMR_UDN);
 
-    g_main_loop_quit (data->loop);
+    return entry != NULL;
 }
 
 static void
-test_upnp_device_share (UPnPDeviceData *data, gconstpointer user_data)
+test_upnp_device_cache (UPnPDeviceData *data, gconstpointer user_data)
 {
-    GVariantBuilder *source;
-    GFile *file;
-    char *uri;
-    KorvaUPnPFileServer *server;
-
-    /* create server instance here to make sure the device uses the same server */
-    server = korva_upnp_file_server_get_default ();
-    g_assert (korva_upnp_file_server_idle (server));
+    g_autoptr (KorvaUPnPDeviceCacheEntry) entry = NULL;
+    g_autoptr (KorvaUPnPDevice) device = NULL;
+    g_auto (GStrv) udns = NULL;
+
+    g_assert (data->init_result);
+    g_assert_no_error (data->init_error);
+
+    entry = korva_upnp_device_cache_lookup (MOCK_DMR_UDN);
+    g_assert (entry != NULL);
+    g_assert_cmpstr (entry->location, ==, gupnp_device_info_get_location (GUPNP_DEVICE_INFO (data->proxy)));
+    g_assert_cmpstr (entry->protocol_info, ==, "*:*:*:*,http-get:*:image/jpeg:*");
+    udns = korva_upnp_device_cache_get_udns ();
+    g_assert (g_strv_contains ((const char *const *) udns, MOCK_DMR_UDN));
+
+    /* Full introspection would fail now, but a second instance is initialized
+     * from the cache */
+    mock_dmr_set_fault (data->dmr, MOCK_DMR_FAULT_GET_TRANSPORT_INFO_FAIL);
+    device = g_object_new (KORVA_TYPE_UPNP_DEVICE,
+                           "proxy", g_object_ref (data->proxy),
+                           NULL);
+    data->init_result = FALSE;
+    g_async_initable_init_async (G_ASYNC_INITABLE (device),
+                                 G_PRIORITY_DEFAULT,
+                                 NULL,
+                                 device_setup_on_device_init,
+                                 data);
+    g_main_loop_run (data->loop);
+
+    g_assert (data->init_result);
+    g_assert_no_error (data->init_error);
+    g_assert_cmpstr (korva_device_get_icon_uri (KORVA_DEVICE (device)), ==,
+                     korva_device_get_icon_uri (KORVA_DEVICE (data->device)));
+
+    /* The background revalidation fails and invalidates the entry */
+    while (device_cache_has_mock_dmr ()) {
+        g_main_context_iteration (NULL, TRUE);
+    }
+    g_clear_object (&device);
+
+    device = g_object_new (KORVA_TYPE_UPNP_DEVICE,
+                           "proxy", g_object_ref (data->proxy),
+                           NULL);
+    g_async_initable_init_async (G_ASYNC_INITABLE (device),
+                                 G_PRIORITY_DEFAULT,
+                                 NULL,
+                                 device_setup_on_device_init,
+                                 data);
+    g_main_loop_run (data->loop);
+
+    g_assert (!data->init_result);
+    g_assert_error (data->init_error, KORVA_UPNP_DEVICE_ERROR, INVALID_RESPONSE);
+    g_clear_error (&data->init_error);
+}
+
+static void
+test_upnp_device_cache_add_group (GKeyFile *key_file, const char *udn, gint64 last_seen)
+{
+    g_key_file_set_string (key_file, udn, "Location", "http://127.0.0.1:4711/description.xml");
+    g_key_file_set_string (key_file, udn, "DeviceType", "urn:schemas-upnp-org:device:MediaRenderer:1");
+    g_key_file_set_string (key_file, udn, "ProtocolInfo", "*:*:*:*");
+    if (last_seen != 0) {
+        g_key_file_set_int64 (key_file, udn, "LastSeen", last_seen);
+    }
+}
+
+/*
+ * Renderers that were not seen for a month are dropped when the cache is
+ * loaded, and changes reach the disk later, in one write.
+ */
+static void
+test_upnp_device_cache_expiry (void)
+{
+    g_autofree char *path = g_build_filename (g_get_tmp_dir (), TEST_DEVICE_CACHE, NULL);
+    g_autoptr (GKeyFile) key_file = g_key_file_new ();
+    g_autoptr (GError) error = NULL;
+    g_autoptr (KorvaUPnPDeviceCacheEntry) entry = NULL;
+    KorvaUPnPDeviceCacheEntry new_entry = { 0 };
+    g_auto (GStrv) udns = NULL;
+    gint64 now = g_get_real_time () / G_USEC_PER_SEC;
+
+    test_upnp_device_cache_add_group (key_file, "uuid:fresh", now - 60);
+    test_upnp_device_cache_add_group (key_file, "uuid:stale", now - 31 * 24 * 60 * 60);
+    test_upnp_device_cache_add_group (key_file, "uuid:legacy", 0);
+    g_key_file_save_to_file (key_file, path, &error);
+    g_assert_no_error (error);
+
+    korva_upnp_device_cache_init (path);
+    udns = korva_upnp_device_cache_get_udns ();
+    g_assert_cmpuint (g_strv_length (udns), ==, 1);
+    g_assert_cmpstr (udns[0], ==, "uuid:fresh");
+    entry = korva_upnp_device_cache_lookup ("uuid:fresh");
+    g_assert (entry != NULL);
+
+    new_entry.location = "http://127.0.0.1:4712/description.xml";
+    new_entry.device_type = "urn:schemas-upnp-org:device:MediaRenderer:1";
+    new_entry.protocol_info = "http-get:*:image/jpeg:*";
+    korva_upnp_device_cache_store ("uuid:new", &new_entry);
+
+    /* Nothing is written without the main loop running */
+    g_key_file_load_from_file (key_file, path, G_KEY_FILE_NONE, &error);
+    g_assert_no_error (error);
+    g_assert (g_key_file_has_group (key_file, "uuid:stale"));
+    g_assert (!g_key_file_has_group (key_file, "uuid:new"));
+
+    /* Pending changes are saved on shutdown */
+    korva_upnp_device_cache_shutdown ();
+    g_key_file_load_from_file (key_file, path, G_KEY_FILE_NONE, &error);
+    g_assert_no_error (error);
+    g_assert (g_key_file_has_group (key_file, "uuid:fresh"));
+    g_assert (g_key_file_has_group (key_file, "uuid:new"));
+    g_assert (g_key_file_has_key (key_file, "uuid:new", "LastSeen", NULL));
+    g_assert (!g_key_file_has_group (key_file, "uuid:stale"));
+    g_assert (!g_key_file_has_group (key_file, "uuid:legacy"));
+
+    g_remove (path);
+}
+
+static void
+on_test_upnp_device_lister_available (KorvaDeviceLister *lister,
+                                      KorvaDevice       *device,
+                                      gpointer           user_data)
+{
+    UPnPDeviceData *data = (UPnPDeviceData *) user_data;
+
+    if (g_strcmp0 (korva_device_get_uid (device), MOCK_DMR_UDN) == 0) {
+        data->init_result = TRUE;
+        g_main_loop_quit (data->loop);
+    }
+}
+
+/*
+ * A renderer from the device cache shows up at startup even if it does not
+ * answer any search, since its description is fetched directly.
+ */
+static void
+test_upnp_device_lister_probe_cached (UPnPDeviceData *data, gconstpointer user_data)
+{
+    g_autoptr (KorvaDeviceLister) lister = NULL;
+    KorvaDevice *device;
+    guint timeout_id;
+
+    g_assert (data->init_result);
+    g_assert (device_cache_has_mock_dmr ());
+
+    /* The renderer keeps serving its description but stops answering
+     * searches */
+    gupnp_root_device_set_available (GUPNP_ROOT_DEVICE (data->dmr), FALSE);
+
+    data->init_result = FALSE;
+    lister = korva_upnp_device_lister_new ();
+    g_signal_connect (lister,
+                      "device-available",
+                      G_CALLBACK (on_test_upnp_device_lister_available),
+                      data);
+    timeout_id = g_timeout_add_seconds (5, quit_main_loop_source_func, data->loop);
+    g_main_loop_run (data->loop);
+
+    g_assert (data->init_result);
+    g_source_remove (timeout_id);
+
+    device = korva_device_lister_get_device_info (lister, MOCK_DMR_UDN);
+    g_assert (device != NULL);
+    g_assert_cmpstr (korva_device_get_display_name (device), ==,
+                     korva_device_get_display_name (KORVA_DEVICE (data->device)));
+}
+
+#define TEST_RETRY_DELAY 200
+
+/*
+ * A renderer whose introspection failed is introspected again once the
+ * lister is done backing off, without announcing itself again.
+ */
+static void
+test_upnp_device_lister_retry (UPnPDeviceData *data, gconstpointer user_data)
+{
+    g_autoptr (KorvaDeviceLister) lister = NULL;
+    guint timeout_id;
+    gint64 start;
+
+    g_assert (data->init_result);
+
+    korva_upnp_device_lister_set_retry_delay (TEST_RETRY_DELAY, TEST_RETRY_DELAY);
+    mock_dmr_set_fault (data->dmr, MOCK_DMR_FAULT_GET_TRANSPORT_INFO_FAIL_ONCE);
+    g_test_expect_message ("Korva-UPnP-Device-Lister", G_LOG_LEVEL_WARNING, "Failed to add device*");
+
+    data->init_result = FALSE;
+    start = g_get_monotonic_time ();
+    lister = korva_upnp_device_lister_new ();
+    g_signal_connect (lister,
+                      "device-available",
+                      G_CALLBACK (on_test_upnp_device_lister_available),
+                      data);
+    timeout_id = g_timeout_add_seconds (5, quit_main_loop_source_func, data->loop);
+    g_main_loop_run (data->loop);
+    korva_upnp_device_lister_set_retry_delay (0, 0);
+
+    g_assert (data->init_result);
+    g_source_remove (timeout_id);
+    g_test_assert_expected_messages ();
+
+    g_assert_cmpint (g_get_monotonic_time () - start, >=, TEST_RETRY_DELAY * 1000);
+    g_assert (korva_device_lister_get_device_info (lister, MOCK_DMR_UDN) != NULL);
+}
+
+#define TEST_LATENCY 250
+
+static void
+test_upnp_device_concurrent_introspection (UPnPDeviceData *data, gconstpointer user_data)
+{
+    g_autoptr (KorvaUPnPDevice) device = NULL;
+    g_autofree char *default_icon = NULL;
+    gint64 start, elapsed;
+
+    g_assert (data->init_result);
+    g_assert_no_error (data->init_error);
+
+    /* Each introspection call takes TEST_LATENCY ms to be answered; issued
+     * one after the other they would take at least twice as long */
+    mock_dmr_set_latency (data->dmr, TEST_LATENCY);
+    device = g_object_new (KORVA_TYPE_UPNP_DEVICE,
+                           "proxy", g_object_ref (data->proxy),
+                           NULL);
+    data->init_result = FALSE;
+    start = g_get_monotonic_time ();
+    g_async_initable_init_async (G_ASYNC_INITABLE (device),
+                                 G_PRIORITY_DEFAULT,
+                                 NULL,
+                                 device_setup_on_device_init,
+                                 data);
+    g_main_loop_run (data->loop);
+    elapsed = (g_get_monotonic_time () - start) / 1000;
+
+    g_assert (data->init_result);
+    g_assert_no_error (data->init_error);
+    g_assert_cmpint (elapsed, >=, TEST_LATENCY);
+    g_assert_cmpint (elapsed, <, 2 * TEST_LATENCY);
+
+    default_icon = korva_icon_cache_get_default (DEVICE_TYPE_PLAYER);
+    g_assert_cmpstr (korva_device_get_icon_uri (KORVA_DEVICE (device)), ==, default_icon);
+}
+
+static void
+test_upnp_device_multiple_proxies (UPnPDeviceData *data, gconstpointer user_data)
+{
+    g_assert (data->proxy != NULL);
+    korva_upnp_device_add_proxy (data->device, data->proxy);
+    g_assert (!korva_upnp_device_remove_proxy (data->device, data->proxy));
+    g_assert (korva_upnp_device_remove_proxy (data->device, data->proxy));
+}
+
+#define TEST_DEADLINE 100
+
+static void
+test_upnp_device_introspection_timeout (UPnPDeviceData *data, gconstpointer user_data)
+{
+    g_autoptr (KorvaUPnPFailureCache) failures = NULL;
+    g_autoptr (KorvaUPnPDevice) device = NULL;
+    g_autofree char *config_id = NULL;
+    const char *location;
+
+    g_assert (data->init_result);
+    g_assert_no_error (data->init_error);
+
+    failures = korva_upnp_failure_cache_new (TEST_DEADLINE, TEST_DEADLINE);
+    location = gupnp_device_info_get_location (GUPNP_DEVICE_INFO (data->proxy));
+    config_id = korva_upnp_device_info_get_config_id (GUPNP_DEVICE_INFO (data->proxy));
+
+    /* A renderer that answers too late fails with a transient error */
+    korva_upnp_device_set_timing (TEST_DEADLINE, 0);
+    mock_dmr_set_latency (data->dmr, 3 * TEST_DEADLINE);
+    g_assert (korva_upnp_failure_cache_begin (failures, MOCK_DMR_UDN, location, config_id));
+    device = g_object_new (KORVA_TYPE_UPNP_DEVICE,
+                           "proxy", g_object_ref (data->proxy),
+                           NULL);
+    data->init_result = FALSE;
+    g_async_initable_init_async (G_ASYNC_INITABLE (device),
+                                 G_PRIORITY_DEFAULT,
+                                 NULL,
+                                 device_setup_on_device_init,
+                                 data);
+    g_main_loop_run (data->loop);
+
+    g_assert (!data->init_result);
+    g_assert_error (data->init_error, KORVA_UPNP_DEVICE_ERROR, TIMEOUT);
+    g_assert_cmpuint (korva_upnp_failure_cache_fail (failures, MOCK_DMR_UDN, data->init_error), ==, 1);
+    g_clear_error (&data->init_error);
+    g_clear_object (&device);
+    g_assert (!korva_upnp_failure_cache_begin (failures, MOCK_DMR_UDN, location, config_id));
+
+    /* It is probed again once the back-off is over */
+    g_usleep (2 * TEST_DEADLINE * 1000);
+    mock_dmr_set_latency (data->dmr, 0);
+    g_assert (korva_upnp_failure_cache_begin (failures, MOCK_DMR_UDN, location, config_id));
+    device = g_object_new (KORVA_TYPE_UPNP_DEVICE,
+                           "proxy", g_object_ref (data->proxy),
+                           NULL);
+    g_async_initable_init_async (G_ASYNC_INITABLE (device),
+                                 G_PRIORITY_DEFAULT,
+                                 NULL,
+                                 device_setup_on_device_init,
+                                 data);
+    g_main_loop_run (data->loop);
+
+    g_assert (data->init_result);
+    g_assert_no_error (data->init_error);
+
+    korva_upnp_device_set_timing (0, 0);
+}
+
+static void
+on_test_upnp_device_share_push_async (GObject      *source,
+                                      GAsyncResult *res,
+                                      gpointer      user_data)
+{
+    UPnPDeviceData *data = (UPnPDeviceData *) user_data;
+
+    data->result_tag = korva_device_push_finish (KORVA_DEVICE (source),
+                                                 res,
+                                                 &(data->result_error));
+    g_main_loop_quit (data->loop);
+}
+
+static void
+on_test_upnp_device_share_unshare_async (GObject      *source,
+                                         GAsyncResult *res,
+                                         gpointer      user_data)
+{
+    UPnPDeviceData *data = (UPnPDeviceData *) user_data;
+
+    korva_device_unshare_finish (KORVA_DEVICE (source),
+                                 res,
+                                 &(data->result_error));
+
+    g_main_loop_quit (data->loop);
+}
+
+static void
+test_upnp_device_share (UPnPDeviceData *data, gconstpointer user_data)
+{
+    GVariantBuilder *source;
+    GFile *file;
+    char *uri;
+    KorvaUPnPFileServer *server;
+
+    /* create server instance here to make sure the device uses the same server */
+    server = korva_upnp_file_server_get_default ();
+    g_assert (korva_upnp_file_server_idle (server));
 
     file = g_file_new_for_commandline_arg (TEST_DATA_DIR "/test-upnp-image.jpg");
     uri = g_file_get_uri (file);
@@ -914,133 +2751,1575 @@ test_upnp_device_share_transport_locked (UPnPDeviceData *data, gconstpointer use
     g_assert (data->result_tag != NULL);
     g_assert (!korva_upnp_file_server_idle (server));
 
-    korva_device_unshare_async (KORVA_DEVICE (data->device),
-                                data->result_tag,
-                                NULL,
-                                on_test_upnp_device_share_unshare_async,
-                                data);
+    korva_device_unshare_async (KORVA_DEVICE (data->device),
+                                data->result_tag,
+                                NULL,
+                                on_test_upnp_device_share_unshare_async,
+                                data);
+
+    g_main_loop_run (data->loop);
+
+    g_assert (data->result_error == NULL);
+    g_assert (korva_upnp_file_server_idle (server));
+
+    /* Check that we don't get stuck in an endless loop when the transport
+     * doesn't get unlocked
+     */
+    mock_dmr_set_fault (data->dmr, MOCK_DMR_FAULT_TRANSPORT_LOCKED);
+
+    source = g_variant_builder_new (G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add (source, "{sv}", "URI", g_variant_new_string (uri));
+    korva_device_push_async (KORVA_DEVICE (data->device),
+                             g_variant_builder_end (source),
+                             NULL,
+                             on_test_upnp_device_share_push_async,
+                             data);
+
+    g_main_loop_run (data->loop);
+
+    g_assert (data->result_error != NULL);
+    g_print ("%s\n", data->result_error->message);
+    g_assert (data->result_tag == NULL);
+    g_object_unref (server);
+}
+
+static void
+test_upnp_device_share_ops_fail (UPnPDeviceData *data, gconstpointer user_data)
+{
+    GVariantBuilder *source;
+    GFile *file;
+    char *uri;
+    KorvaUPnPFileServer *server;
+    int fault = GPOINTER_TO_INT (user_data);
+
+    /* create server instance here to make sure the device uses the same server */
+    server = korva_upnp_file_server_get_default ();
+    g_assert (korva_upnp_file_server_idle (server));
+
+    file = g_file_new_for_commandline_arg (TEST_DATA_DIR "/test-upnp-image.jpg");
+    uri = g_file_get_uri (file);
+
+    source = g_variant_builder_new (G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add (source, "{sv}", "URI", g_variant_new_string (uri));
+    korva_device_push_async (KORVA_DEVICE (data->device),
+                             g_variant_builder_end (source),
+                             NULL,
+                             on_test_upnp_device_share_push_async,
+                             data);
+
+    g_main_loop_run (data->loop);
+
+    if (fault == MOCK_DMR_FAULT_PLAY_FAIL) {
+        g_assert (korva_upnp_file_server_idle (server));
+        g_assert (data->result_error != NULL);
+        g_assert (data->result_tag == NULL);
+    } else {
+        g_assert (!korva_upnp_file_server_idle (server));
+        g_assert (data->result_error == NULL);
+        g_assert (data->result_tag != NULL);
+    }
+
+    if (fault == MOCK_DMR_FAULT_STOP_FAIL) {
+        korva_device_unshare_async (KORVA_DEVICE (data->device),
+                                    data->result_tag,
+                                    NULL,
+                                    on_test_upnp_device_share_unshare_async,
+                                    data);
+
+        g_main_loop_run (data->loop);
+
+        g_assert (korva_upnp_file_server_idle (server));
+        g_assert (data->result_error != NULL);
+    }
+
+    g_object_unref (server);
+}
+
+static void
+test_upnp_device_share_not_compatible (UPnPDeviceData *data, gconstpointer user_data)
+{
+    GVariantBuilder *source;
+    GFile *file;
+    char *uri;
+    KorvaUPnPFileServer *server;
+
+    /* create server instance here to make sure the device uses the same server */
+    mock_dmr_set_protocol_info (data->dmr, "", "");
+    server = korva_upnp_file_server_get_default ();
+    g_assert (korva_upnp_file_server_idle (server));
+
+    file = g_file_new_for_commandline_arg (TEST_DATA_DIR "/test-upnp-image.jpg");
+    uri = g_file_get_uri (file);
+
+    source = g_variant_builder_new (G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add (source, "{sv}", "URI", g_variant_new_string (uri));
+    korva_device_push_async (KORVA_DEVICE (data->device),
+                             g_variant_builder_end (source),
+                             NULL,
+                             on_test_upnp_device_share_push_async,
+                             data);
+
+    g_main_loop_run (data->loop);
+
+    g_assert (data->result_error != NULL);
+    g_assert (data->result_tag == NULL);
+    g_assert_cmpint (data->result_error->domain, ==, KORVA_CONTROLLER1_ERROR);
+    g_assert_cmpint (data->result_error->code, ==, KORVA_CONTROLLER1_ERROR_NOT_COMPATIBLE);
+    g_assert (korva_upnp_file_server_idle (server));
+
+    g_object_unref (server);
+}
+
+typedef struct {
+    GMainLoop *loop;
+    char      *uri;
+} TraceHostFileData;
+
+static void
+on_test_upnp_device_share_trace_host_file (GObject      *source,
+                                           GAsyncResult *res,
+                                           gpointer      user_data)
+{
+    TraceHostFileData *data = (TraceHostFileData *) user_data;
+    GHashTable *params;
+
+    data->uri = korva_upnp_file_server_host_file_finish (KORVA_UPNP_FILE_SERVER (source), res, &params, NULL);
+    g_main_loop_quit (data->loop);
+}
+
+/*
+ * SetAVTransportURI and Play go to the same renderer right after each other;
+ * they have to share a connection instead of opening one each.
+ */
+static void
+test_upnp_device_share_connections (UPnPDeviceData *data, gconstpointer user_data)
+{
+    GVariantBuilder *source;
+    g_autoptr (GFile) file = NULL;
+    g_autofree char *uri = NULL;
+    g_autoptr (KorvaUPnPFileServer) server = NULL;
+    guint connections;
+
+    server = korva_upnp_file_server_get_default ();
+    g_assert (korva_upnp_file_server_idle (server));
+
+    file = g_file_new_for_commandline_arg (TEST_DATA_DIR "/test-upnp-image.jpg");
+    uri = g_file_get_uri (file);
+
+    connections = mock_dmr_get_connection_count (data->dmr);
+
+    source = g_variant_builder_new (G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add (source, "{sv}", "URI", g_variant_new_string (uri));
+    korva_device_push_async (KORVA_DEVICE (data->device),
+                             g_variant_builder_end (source),
+                             NULL,
+                             on_test_upnp_device_share_push_async,
+                             data);
+    g_variant_builder_unref (source);
+
+    g_main_loop_run (data->loop);
+
+    g_assert_no_error (data->result_error);
+    g_assert (data->result_tag != NULL);
+    g_assert_cmpuint (mock_dmr_get_play_count (data->dmr), ==, 1);
+    g_assert_cmpuint (mock_dmr_get_connection_count (data->dmr) - connections, <=, 1);
+
+    korva_device_unshare_async (KORVA_DEVICE (data->device),
+                                data->result_tag,
+                                NULL,
+                                on_test_upnp_device_share_unshare_async,
+                                data);
+    g_main_loop_run (data->loop);
+
+    g_assert_no_error (data->result_error);
+    g_assert (korva_upnp_file_server_idle (server));
+}
+
+typedef struct {
+    UPnPDeviceData *data;
+    guint           changes;
+} DeviceChangedData;
+
+static void
+on_test_upnp_device_share_state_changed (KorvaDevice *device, gpointer user_data)
+{
+    DeviceChangedData *changed = (DeviceChangedData *) user_data;
+
+    changed->changes++;
+    g_main_loop_quit (changed->data->loop);
+}
+
+/*
+ * Transport state, tag and external modifications are part of the device
+ * information and announced with a single "changed" per burst.
+ */
+static void
+test_upnp_device_share_state (UPnPDeviceData *data, gconstpointer user_data)
+{
+    GVariantBuilder *source;
+    g_autoptr (GFile) file = NULL;
+    g_autofree char *uri = NULL;
+    g_autoptr (KorvaUPnPFileServer) server = NULL;
+    g_autoptr (GVariant) info = NULL;
+    DeviceChangedData changed = { data, 0 };
+    const char *value;
+    gboolean modified;
+
+    server = korva_upnp_file_server_get_default ();
+    file = g_file_new_for_commandline_arg (TEST_DATA_DIR "/test-upnp-image.jpg");
+    uri = g_file_get_uri (file);
+
+    source = g_variant_builder_new (G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add (source, "{sv}", "URI", g_variant_new_string (uri));
+    korva_device_push_async (KORVA_DEVICE (data->device),
+                             g_variant_builder_end (source),
+                             NULL,
+                             on_test_upnp_device_share_push_async,
+                             data);
+    g_variant_builder_unref (source);
+
+    g_main_loop_run (data->loop);
+    g_assert_no_error (data->result_error);
+    g_assert (data->result_tag != NULL);
+
+    g_signal_connect (data->device,
+                      "changed",
+                      G_CALLBACK (on_test_upnp_device_share_state_changed),
+                      &changed);
+
+    /* The new tag */
+    g_main_loop_run (data->loop);
+    g_assert_cmpuint (changed.changes, ==, 1);
+
+    info = korva_device_serialize (KORVA_DEVICE (data->device));
+    g_assert (g_variant_lookup (info, "Tag", "&s", &value));
+    g_assert_cmpstr (value, ==, data->result_tag);
+    g_assert (g_variant_lookup (info, "ExternallyModified", "b", &modified));
+    g_assert (!modified);
+    g_clear_pointer (&info, g_variant_unref);
+
+    /* Two state changes in a row are announced once */
+    mock_dmr_set_transport_state (data->dmr, "TRANSITIONING", NULL);
+    mock_dmr_set_transport_state (data->dmr, "PLAYING", NULL);
+    g_main_loop_run (data->loop);
+    g_assert_cmpuint (changed.changes, ==, 2);
+
+    info = korva_device_serialize (KORVA_DEVICE (data->device));
+    g_assert (g_variant_lookup (info, "TransportState", "&s", &value));
+    g_assert_cmpstr (value, ==, "PLAYING");
+    g_clear_pointer (&info, g_variant_unref);
+
+    /* Another control point takes over */
+    mock_dmr_set_transport_state (data->dmr, "PLAYING", "http://127.0.0.1/other.jpg");
+    g_main_loop_run (data->loop);
+    g_assert_cmpuint (changed.changes, ==, 3);
+
+    info = korva_device_serialize (KORVA_DEVICE (data->device));
+    g_assert (g_variant_lookup (info, "Tag", "&s", &value));
+    g_assert_cmpstr (value, ==, "");
+    g_assert (g_variant_lookup (info, "ExternallyModified", "b", &modified));
+    g_assert (modified);
+    g_assert (korva_upnp_file_server_idle (server));
+
+    g_signal_handlers_disconnect_by_data (data->device, &changed);
+}
+
+static gboolean
+on_test_upnp_device_share_position_timeout (gpointer user_data)
+{
+    g_main_loop_quit ((GMainLoop *) user_data);
+
+    return FALSE;
+}
+
+/*
+ * A renderer is only subscribed to while it is watched or pushed to. Watching
+ * it fetches the state it missed in the meantime.
+ */
+static void
+test_upnp_device_watch (UPnPDeviceData *data, gconstpointer user_data)
+{
+    g_autoptr (GVariant) info = NULL;
+    DeviceChangedData changed = { data, 0 };
+    const char *value;
+
+    g_assert_cmpint (mock_dmr_get_subscription_count (data->dmr), ==, 0);
+
+    g_signal_connect (data->device,
+                      "changed",
+                      G_CALLBACK (on_test_upnp_device_share_state_changed),
+                      &changed);
+
+    /* Nobody listens */
+    mock_dmr_set_transport_state (data->dmr, "PLAYING", NULL);
+    g_timeout_add (500, on_test_upnp_device_share_position_timeout, data->loop);
+    g_main_loop_run (data->loop);
+    g_assert_cmpuint (changed.changes, ==, 0);
+
+    korva_device_watch (KORVA_DEVICE (data->device));
+    g_main_loop_run (data->loop);
+    g_assert_cmpuint (changed.changes, ==, 1);
+    g_assert_cmpint (mock_dmr_get_subscription_count (data->dmr), ==, 1);
+
+    info = korva_device_serialize (KORVA_DEVICE (data->device));
+    g_assert (g_variant_lookup (info, "TransportState", "&s", &value));
+    g_assert_cmpstr (value, ==, "PLAYING");
+    g_clear_pointer (&info, g_variant_unref);
+
+    mock_dmr_set_transport_state (data->dmr, "PAUSED_PLAYBACK", NULL);
+    g_main_loop_run (data->loop);
+    g_assert_cmpuint (changed.changes, ==, 2);
+
+    info = korva_device_serialize (KORVA_DEVICE (data->device));
+    g_assert (g_variant_lookup (info, "TransportState", "&s", &value));
+    g_assert_cmpstr (value, ==, "PAUSED_PLAYBACK");
+
+    /* A second watcher does not subscribe again and the subscription
+     * outlives the last watch for a while */
+    korva_device_watch (KORVA_DEVICE (data->device));
+    korva_device_unwatch (KORVA_DEVICE (data->device));
+    korva_device_unwatch (KORVA_DEVICE (data->device));
+    g_timeout_add (200, on_test_upnp_device_share_position_timeout, data->loop);
+    g_main_loop_run (data->loop);
+    g_assert_cmpint (mock_dmr_get_subscription_count (data->dmr), ==, 1);
+
+    g_signal_handlers_disconnect_by_data (data->device, &changed);
+}
+
+/*
+ * The position is polled once for all callers and polling stops when the
+ * renderer pauses.
+ */
+static void
+test_upnp_device_share_position (UPnPDeviceData *data, gconstpointer user_data)
+{
+    GVariantBuilder *source;
+    g_autoptr (GFile) file = NULL;
+    g_autofree char *uri = NULL;
+    g_autoptr (GVariant) position = NULL;
+    const char *tag;
+    gint64 value;
+    guint polls, i;
+
+    file = g_file_new_for_commandline_arg (TEST_DATA_DIR "/test-upnp-image.jpg");
+    uri = g_file_get_uri (file);
+
+    g_assert (korva_device_get_position (KORVA_DEVICE (data->device)) == NULL);
+
+    source = g_variant_builder_new (G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add (source, "{sv}", "URI", g_variant_new_string (uri));
+    korva_device_push_async (KORVA_DEVICE (data->device),
+                             g_variant_builder_end (source),
+                             NULL,
+                             on_test_upnp_device_share_push_async,
+                             data);
+    g_variant_builder_unref (source);
+
+    g_main_loop_run (data->loop);
+    g_assert_no_error (data->result_error);
+
+    g_timeout_add (1500, on_test_upnp_device_share_position_timeout, data->loop);
+    g_main_loop_run (data->loop);
+
+    polls = mock_dmr_get_position_count (data->dmr);
+    g_assert_cmpuint (polls, ==, 1);
+
+    for (i = 0; i < 10; i++) {
+        g_clear_pointer (&position, g_variant_unref);
+        position = korva_device_get_position (KORVA_DEVICE (data->device));
+        g_assert (position != NULL);
+    }
+    g_assert_cmpuint (mock_dmr_get_position_count (data->dmr), ==, polls);
+
+    g_assert (g_variant_lookup (position, "Tag", "&s", &tag));
+    g_assert_cmpstr (tag, ==, data->result_tag);
+    g_assert (g_variant_lookup (position, "Position", "x", &value));
+    g_assert_cmpint (value, ==, 5000);
+    g_assert (g_variant_lookup (position, "Duration", "x", &value));
+    g_assert_cmpint (value, ==, 90500);
+
+    /* No polling while paused */
+    mock_dmr_set_transport_state (data->dmr, "PLAYING", NULL);
+    g_timeout_add (200, on_test_upnp_device_share_position_timeout, data->loop);
+    g_main_loop_run (data->loop);
+    mock_dmr_set_transport_state (data->dmr, "PAUSED_PLAYBACK", NULL);
+    g_timeout_add (200, on_test_upnp_device_share_position_timeout, data->loop);
+    g_main_loop_run (data->loop);
+
+    polls = mock_dmr_get_position_count (data->dmr);
+    g_timeout_add (2500, on_test_upnp_device_share_position_timeout, data->loop);
+    g_main_loop_run (data->loop);
+    g_assert_cmpuint (mock_dmr_get_position_count (data->dmr), ==, polls);
+}
+
+#define STORM_MAX_INTROSPECTIONS 8
+
+typedef struct {
+    UPnPDeviceData              *data;
+    KorvaUPnPIntrospectionQueue *queue;
+    KorvaUPnPDevice             *prioritized;
+    guint                        devices;
+    guint                        ready;
+    guint                        peak;
+    guint                        prioritized_rank;
+} StormData;
+
+static void
+on_test_upnp_introspection_storm_ready (GObject      *source,
+                                        GAsyncResult *res,
+                                        gpointer      user_data)
+{
+    StormData *storm = (StormData *) user_data;
+    GError *error = NULL;
+
+    g_assert (g_async_initable_init_finish (G_ASYNC_INITABLE (source), res, &error));
+    g_assert_no_error (error);
+
+    storm->ready++;
+    storm->peak = MAX (storm->peak, korva_upnp_introspection_queue_get_running (storm->queue));
+    if (source == G_OBJECT (storm->prioritized)) {
+        storm->prioritized_rank = storm->ready;
+    }
+
+    if (storm->ready == storm->devices) {
+        g_main_loop_quit (storm->data->loop);
+    }
+}
+
+/* A memory figure in kB from /proc/self/status or 0 if unknown */
+static guint64
+test_get_memory (const char *field)
+{
+    g_autofree char *status = NULL;
+    const char *line;
+
+    if (!g_file_get_contents ("/proc/self/status", &status, NULL, NULL)) {
+        return 0;
+    }
+
+    line = strstr (status, field);
+    if (line == NULL) {
+        return 0;
+    }
+
+    return g_ascii_strtoull (line + strlen (field), NULL, 10);
+}
+
+/* Peak resident set size in kB or 0 if unknown */
+static guint64
+test_get_peak_memory (void)
+{
+    return test_get_memory ("VmHWM:");
+}
+
+/*
+ * A few hundred renderers showing up at once are introspected a few at a
+ * time, and one a client is waiting for goes first.
+ */
+static void
+test_upnp_introspection_storm (UPnPDeviceData *data, gconstpointer user_data)
+{
+    g_autoptr (KorvaUPnPIntrospectionQueue) queue = NULL;
+    g_autoptr (GPtrArray) devices = NULL;
+    g_autofree char *last = NULL;
+    StormData storm;
+    guint i;
+
+    g_assert (data->init_result);
+
+    memset (&storm, 0, sizeof (StormData));
+    storm.data = data;
+    storm.devices = g_test_perf () ? 500 : 200;
+    queue = korva_upnp_introspection_queue_new (STORM_MAX_INTROSPECTIONS);
+    storm.queue = queue;
+    devices = g_ptr_array_new_with_free_func (g_object_unref);
+
+    mock_dmr_set_latency (data->dmr, 5);
+
+    g_test_timer_start ();
+    for (i = 0; i < storm.devices; i++) {
+        g_autofree char *uid = g_strdup_printf ("storm-%u", i);
+        KorvaUPnPDevice *device;
+
+        device = g_object_new (KORVA_TYPE_UPNP_DEVICE,
+                               "proxy", g_object_ref (data->proxy),
+                               NULL);
+        g_ptr_array_add (devices, device);
+        korva_upnp_introspection_queue_push (queue,
+                                             uid,
+                                             device,
+                                             on_test_upnp_introspection_storm_ready,
+                                             &storm);
+        g_assert_cmpuint (korva_upnp_introspection_queue_get_running (queue), <=, STORM_MAX_INTROSPECTIONS);
+    }
+
+    g_assert_cmpuint (korva_upnp_introspection_queue_get_running (queue), ==, STORM_MAX_INTROSPECTIONS);
+    g_assert_cmpuint (korva_upnp_introspection_queue_get_waiting (queue), ==,
+                      storm.devices - STORM_MAX_INTROSPECTIONS);
+
+    /* A push to the device discovered last; the first one is running already */
+    last = g_strdup_printf ("storm-%u", storm.devices - 1);
+    storm.prioritized = g_ptr_array_index (devices, storm.devices - 1);
+    g_assert (korva_upnp_introspection_queue_prioritize (queue, last));
+    g_assert (!korva_upnp_introspection_queue_prioritize (queue, "storm-0"));
+
+    g_main_loop_run (data->loop);
+
+    g_assert_cmpuint (storm.peak, <=, STORM_MAX_INTROSPECTIONS);
+    g_assert_cmpuint (storm.prioritized_rank, <=, 2 * STORM_MAX_INTROSPECTIONS);
+    g_assert_cmpuint (korva_upnp_introspection_queue_get_running (queue), ==, 0);
+    g_assert_cmpuint (korva_upnp_introspection_queue_get_waiting (queue), ==, 0);
+
+    g_test_message ("%u devices available after %.3f s, peak memory %" G_GUINT64_FORMAT " kB",
+                    storm.devices,
+                    g_test_timer_elapsed (),
+                    test_get_peak_memory ());
+}
+
+typedef struct {
+    GMainLoop                   *loop;
+    KorvaUPnPIntrospectionQueue *queue;
+    guint                        pending;
+    guint                        peak;
+} MemoryBenchmarkData;
+
+static void
+on_test_upnp_device_memory_ready (GObject      *source,
+                                  GAsyncResult *res,
+                                  gpointer      user_data)
+{
+    MemoryBenchmarkData *benchmark = (MemoryBenchmarkData *) user_data;
+    GError *error = NULL;
+
+    g_assert (g_async_initable_init_finish (G_ASYNC_INITABLE (source), res, &error));
+    g_assert_no_error (error);
+
+    benchmark->peak = MAX (benchmark->peak, korva_upnp_introspection_queue_get_running (benchmark->queue));
+    if (--benchmark->pending == 0) {
+        g_main_loop_quit (benchmark->loop);
+    }
+}
+
+/*
+ * Memory taken by the state of a renderer that was introspected, measured
+ * as the growth of the heap while a large venue's worth of them is alive.
+ */
+static void
+test_upnp_device_memory (UPnPDeviceData *data, gconstpointer user_data)
+{
+    g_autoptr (KorvaUPnPIntrospectionQueue) queue = NULL;
+    g_autoptr (GPtrArray) devices = NULL;
+    MemoryBenchmarkData benchmark;
+    guint64 before, after;
+    guint count, i;
+
+    g_assert (data->init_result);
+
+    /* The normal run only checks that the compact state still holds what
+     * introspection found */
+    count = g_test_perf () ? 1000 : 50;
+    queue = korva_upnp_introspection_queue_new (STORM_MAX_INTROSPECTIONS);
+    devices = g_ptr_array_new_full (count, g_object_unref);
+    memset (&benchmark, 0, sizeof (MemoryBenchmarkData));
+    benchmark.loop = data->loop;
+    benchmark.queue = queue;
+    benchmark.pending = count;
+
+    before = test_get_memory ("VmRSS:");
+    for (i = 0; i < count; i++) {
+        g_autofree char *uid = g_strdup_printf ("memory-%u", i);
+        KorvaUPnPDevice *device;
+
+        device = g_object_new (KORVA_TYPE_UPNP_DEVICE,
+                               "proxy", g_object_ref (data->proxy),
+                               NULL);
+        g_ptr_array_add (devices, device);
+        korva_upnp_introspection_queue_push (queue,
+                                             uid,
+                                             device,
+                                             on_test_upnp_device_memory_ready,
+                                             &benchmark);
+    }
+    g_main_loop_run (data->loop);
+    after = test_get_memory ("VmRSS:");
+
+    g_assert_cmpuint (benchmark.peak, <=, STORM_MAX_INTROSPECTIONS);
+    g_assert_cmpuint (korva_upnp_introspection_queue_get_running (queue), ==, 0);
+    for (i = 0; i < count; i++) {
+        KorvaDevice *device = KORVA_DEVICE (g_ptr_array_index (devices, i));
+        g_autoptr (GVariant) serialized = NULL;
+        gboolean responsive = FALSE;
+
+        g_assert_cmpstr (korva_device_get_uid (device), ==, MOCK_DMR_UDN);
+        g_assert_cmpstr (korva_device_get_display_name (device), ==,
+                         korva_device_get_display_name (KORVA_DEVICE (data->device)));
+        g_assert_cmpint (korva_device_get_device_type (device), ==, DEVICE_TYPE_PLAYER);
+
+        serialized = korva_device_serialize (device);
+        g_assert (g_variant_lookup (serialized, "Responsive", "b", &responsive));
+        g_assert (responsive);
+    }
+
+    if (!g_test_perf ()) {
+        return;
+    }
+
+    if (before == 0 || after == 0) {
+        g_test_skip ("Memory usage is not available");
+
+        return;
+    }
+
+    g_test_message ("%u devices took %" G_GUINT64_FORMAT " kB, %" G_GUINT64_FORMAT " bytes per device",
+                    count,
+                    after - before,
+                    (after - before) * 1024 / count);
+    g_test_minimized_result ((after - before) * 1024.0 / count,
+                             "Each device took %.0f bytes",
+                             (after - before) * 1024.0 / count);
+}
+
+#define RAPID_PUSHES 50
+
+typedef struct {
+    UPnPDeviceData *data;
+    guint           pending;
+    char           *tags[RAPID_PUSHES];
+    GError         *errors[RAPID_PUSHES];
+    GError         *unshare_error;
+} RapidPushData;
+
+typedef struct {
+    RapidPushData *rapid;
+    guint          index;
+} RapidPushTarget;
+
+static void
+on_test_upnp_device_share_rapid_push_async (GObject      *source,
+                                            GAsyncResult *res,
+                                            gpointer      user_data)
+{
+    RapidPushTarget *target = (RapidPushTarget *) user_data;
+    RapidPushData *rapid = target->rapid;
+
+    rapid->tags[target->index] = korva_device_push_finish (KORVA_DEVICE (source),
+                                                           res,
+                                                           &rapid->errors[target->index]);
+    if (--rapid->pending == 0) {
+        g_main_loop_quit (rapid->data->loop);
+    }
+}
+
+static void
+on_test_upnp_device_share_rapid_unshare_async (GObject      *source,
+                                               GAsyncResult *res,
+                                               gpointer      user_data)
+{
+    RapidPushData *rapid = (RapidPushData *) user_data;
+
+    korva_device_unshare_finish (KORVA_DEVICE (source), res, &rapid->unshare_error);
+}
+
+static void
+test_upnp_device_share_rapid (UPnPDeviceData *data, gconstpointer user_data)
+{
+    RapidPushData rapid;
+    RapidPushTarget targets[RAPID_PUSHES];
+    g_autoptr (GFile) image = NULL;
+    g_autoptr (KorvaUPnPFileServer) server = NULL;
+    g_autofree char *dir = NULL;
+    g_autofree char *title = NULL;
+    GFile *files[RAPID_PUSHES];
+    guint i;
+
+    server = korva_upnp_file_server_get_default ();
+    g_assert (korva_upnp_file_server_idle (server));
+
+    dir = g_dir_make_tmp ("korva-rapid-push-XXXXXX", NULL);
+    g_assert (dir != NULL);
+    image = g_file_new_for_commandline_arg (TEST_DATA_DIR "/test-upnp-image.jpg");
+
+    memset (&rapid, 0, sizeof (RapidPushData));
+    rapid.data = data;
+    rapid.pending = RAPID_PUSHES;
+
+    /* Every push has its own file so the meta-data tells them apart */
+    for (i = 0; i < RAPID_PUSHES; i++) {
+        g_autofree char *name = g_strdup_printf ("push-%02u.jpg", i);
+        g_autofree char *path = g_build_filename (dir, name, NULL);
+        g_autofree char *uri = NULL;
+        g_autofree char *push_title = g_strdup_printf ("Push %u", i);
+        GVariantBuilder *source;
+
+        files[i] = g_file_new_for_path (path);
+        g_assert (g_file_copy (image, files[i], G_FILE_COPY_NONE, NULL, NULL, NULL, NULL));
+        uri = g_file_get_uri (files[i]);
+
+        source = g_variant_builder_new (G_VARIANT_TYPE_VARDICT);
+        g_variant_builder_add (source, "{sv}", "URI", g_variant_new_string (uri));
+        g_variant_builder_add (source, "{sv}", "Title", g_variant_new_string (push_title));
+
+        targets[i].rapid = &rapid;
+        targets[i].index = i;
+        korva_device_push_async (KORVA_DEVICE (data->device),
+                                 g_variant_builder_end (source),
+                                 NULL,
+                                 on_test_upnp_device_share_rapid_push_async,
+                                 &targets[i]);
+        g_variant_builder_unref (source);
+    }
+
+    /* Unsharing something that was never pushed leaves the waiting push
+     * alone */
+    korva_device_unshare_async (KORVA_DEVICE (data->device),
+                                "ThisIsAnInvalidTag",
+                                NULL,
+                                on_test_upnp_device_share_rapid_unshare_async,
+                                &rapid);
+
+    g_main_loop_run (data->loop);
+
+    g_assert_error (rapid.unshare_error, KORVA_CONTROLLER1_ERROR, KORVA_CONTROLLER1_ERROR_NO_SUCH_TRANSFER);
+    g_clear_error (&rapid.unshare_error);
+
+    /* The first push was already talking to the device, everything between it
+     * and the last one was superseded before it started */
+    g_assert_no_error (rapid.errors[0]);
+    g_assert_no_error (rapid.errors[RAPID_PUSHES - 1]);
+    for (i = 1; i < RAPID_PUSHES - 1; i++) {
+        g_assert_error (rapid.errors[i], KORVA_CONTROLLER1_ERROR, KORVA_CONTROLLER1_ERROR_CANCELLED);
+        g_assert (rapid.tags[i] == NULL);
+    }
+
+    g_assert_cmpuint (mock_dmr_get_play_count (data->dmr), ==, 2);
+    title = g_strdup_printf (">Push %u<", RAPID_PUSHES - 1);
+    g_assert (strstr (mock_dmr_get_current_meta_data (data->dmr), title) != NULL);
+
+    korva_device_unshare_async (KORVA_DEVICE (data->device),
+                                rapid.tags[RAPID_PUSHES - 1],
+                                NULL,
+                                on_test_upnp_device_share_unshare_async,
+                                data);
+    g_main_loop_run (data->loop);
+
+    g_assert_no_error (data->result_error);
+    g_assert (korva_upnp_file_server_idle (server));
+
+    for (i = 0; i < RAPID_PUSHES; i++) {
+        g_file_delete (files[i], NULL, NULL);
+        g_object_unref (files[i]);
+        g_free (rapid.tags[i]);
+        g_clear_error (&rapid.errors[i]);
+    }
+    g_rmdir (dir);
+}
+
+static void
+test_upnp_device_share_trace (UPnPDeviceData *data, gconstpointer user_data)
+{
+    GVariantBuilder *source;
+    g_autoptr (GFile) file = NULL;
+    g_autofree char *uri = NULL;
+    g_autoptr (KorvaUPnPFileServer) server = NULL;
+    g_autoptr (GVariant) trace = NULL;
+    g_autoptr (GVariant) phases = NULL;
+    g_autoptr (SoupSession) session = NULL;
+    g_autoptr (SoupMessage) message = NULL;
+    g_auto (WaitForMessageData) wait_data = WAIT_FOR_MESSAGE_DATA_INIT (data->loop);
+    TraceHostFileData host_data = { data->loop, NULL };
+    GVariantIter iter;
+    const char *name;
+    gint64 offset, duration, total;
+    guint found = 0;
+
+    server = korva_upnp_file_server_get_default ();
+    g_assert (korva_upnp_file_server_idle (server));
+
+    file = g_file_new_for_commandline_arg (TEST_DATA_DIR "/test-upnp-image.jpg");
+    uri = g_file_get_uri (file);
+
+    source = g_variant_builder_new (G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add (source, "{sv}", "URI", g_variant_new_string (uri));
+    korva_device_push_async (KORVA_DEVICE (data->device),
+                             g_variant_builder_end (source),
+                             NULL,
+                             on_test_upnp_device_share_push_async,
+                             data);
+
+    g_main_loop_run (data->loop);
+
+    g_assert (data->result_error == NULL);
+    g_assert (data->result_tag != NULL);
+    g_assert (korva_push_trace_lookup ("ThisIsAnInvalidTag") == NULL);
+    g_assert (korva_push_trace_lookup (data->result_tag) != NULL);
+
+    /* Fetch the file like the renderer would to record the first byte */
+    korva_upnp_file_server_host_file_async (server,
+                                            file,
+                                            NULL,
+                                            "127.0.0.1",
+                                            "127.0.0.1",
+                                            NULL,
+                                            NULL,
+                                            on_test_upnp_device_share_trace_host_file,
+                                            &host_data);
+    g_main_loop_run (data->loop);
+    g_assert (host_data.uri != NULL);
+
+    session = soup_session_new ();
+    message = soup_message_new (SOUP_METHOD_GET, host_data.uri);
+    schedule_request_and_wait (session, message, &wait_data);
+    g_assert_no_error (wait_data.error);
+    g_assert_cmpint (soup_message_get_status (message), ==, SOUP_STATUS_OK);
+    g_free (host_data.uri);
+
+    trace = korva_push_trace_serialize (korva_push_trace_lookup (data->result_tag));
+    g_variant_ref_sink (trace);
+    g_assert (g_variant_lookup (trace, "Total", "x", &total));
+    g_assert_cmpint (total, >, 0);
+    phases = g_variant_lookup_value (trace, "Phases", G_VARIANT_TYPE ("a(sxx)"));
+    g_assert (phases != NULL);
+
+    g_variant_iter_init (&iter, phases);
+    while (g_variant_iter_next (&iter, "(&sxx)", &name, &offset, &duration)) {
+        g_assert_cmpint (offset, >=, 0);
+        g_assert_cmpint (duration, >=, 0);
+        g_assert_cmpint (offset + duration, <=, total);
+
+        if (g_strcmp0 (name, "MetadataQuery") == 0) {
+            found |= 1 << KORVA_PUSH_TRACE_PHASE_METADATA_QUERY;
+        } else if (g_strcmp0 (name, "DIDLLite") == 0) {
+            found |= 1 << KORVA_PUSH_TRACE_PHASE_DIDL_LITE;
+        } else if (g_strcmp0 (name, "SetAVTransportURI") == 0) {
+            found |= 1 << KORVA_PUSH_TRACE_PHASE_SET_AV_TRANSPORT_URI;
+        } else if (g_strcmp0 (name, "Stop") == 0) {
+            found |= 1 << KORVA_PUSH_TRACE_PHASE_STOP;
+        } else if (g_strcmp0 (name, "Play") == 0) {
+            found |= 1 << KORVA_PUSH_TRACE_PHASE_PLAY;
+        } else if (g_strcmp0 (name, "FirstByte") == 0) {
+            found |= 1 << KORVA_PUSH_TRACE_PHASE_FIRST_BYTE;
+        }
+    }
+
+    /* The mock is in transport-locked-once mode, so all phases were hit */
+    g_assert_cmpint (found, ==, (1 << KORVA_PUSH_TRACE_PHASE_COUNT) - 1);
+}
+
+/* Mirrors KORVA_UPNP_DEVICE_BREAKER_THRESHOLD */
+#define TEST_BREAKER_THRESHOLD 3
+#define TEST_BREAKER_DEADLINE 200
+#define TEST_BREAKER_TIMEOUT 500
+
+static void
+test_upnp_device_push_image (UPnPDeviceData *data)
+{
+    GVariantBuilder source;
+    g_autoptr (GFile) file = g_file_new_for_commandline_arg (TEST_DATA_DIR "/test-upnp-image.jpg");
+    g_autofree char *uri = g_file_get_uri (file);
+
+    g_clear_error (&data->result_error);
+    g_clear_pointer (&data->result_tag, g_free);
+
+    g_variant_builder_init (&source, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add (&source, "{sv}", "URI", g_variant_new_string (uri));
+    korva_device_push_async (KORVA_DEVICE (data->device),
+                             g_variant_builder_end (&source),
+                             NULL,
+                             on_test_upnp_device_share_push_async,
+                             data);
+
+    g_main_loop_run (data->loop);
+}
+
+static gboolean
+test_upnp_device_is_responsive (KorvaDevice *device)
+{
+    g_autoptr (GVariant) info = korva_device_serialize (device);
+    gboolean responsive;
+
+    g_assert (g_variant_lookup (info, "Responsive", "b", &responsive));
+
+    return responsive;
+}
+
+typedef struct {
+    gboolean responsive;
+    guint    flips;
+} BreakerData;
+
+static void
+on_test_upnp_device_breaker_changed (KorvaDevice *device, gpointer user_data)
+{
+    BreakerData *breaker = (BreakerData *) user_data;
+    gboolean responsive = test_upnp_device_is_responsive (device);
+
+    if (responsive != breaker->responsive) {
+        breaker->responsive = responsive;
+        breaker->flips++;
+    }
+}
+
+/*
+ * Calls to a renderer that stalls are cancelled at their deadline. After
+ * TEST_BREAKER_THRESHOLD of them, further calls fail right away until the
+ * breaker timeout is over; a call that succeeds then closes the breaker.
+ */
+static void
+test_upnp_device_breaker (UPnPDeviceData *data, gconstpointer user_data)
+{
+    BreakerData breaker = { TRUE, 0 };
+    g_autoptr (GVariant) info = NULL;
+    g_autoptr (GVariant) statistics = NULL;
+    g_autoptr (GVariant) rtt = NULL;
+    guint32 timeouts;
+    gint64 start;
+    gulong id;
+    guint i;
+
+    g_assert (data->init_result);
+    g_assert_no_error (data->init_error);
+    g_assert (test_upnp_device_is_responsive (KORVA_DEVICE (data->device)));
+
+    id = g_signal_connect (data->device,
+                           "changed",
+                           G_CALLBACK (on_test_upnp_device_breaker_changed),
+                           &breaker);
+
+    korva_upnp_device_set_timing (TEST_BREAKER_DEADLINE, TEST_BREAKER_TIMEOUT);
+    mock_dmr_set_latency (data->dmr, 3 * TEST_BREAKER_DEADLINE);
+
+    for (i = 1; i < TEST_BREAKER_THRESHOLD; i++) {
+        start = g_get_monotonic_time ();
+        test_upnp_device_push_image (data);
+        g_assert_error (data->result_error, KORVA_CONTROLLER1_ERROR, KORVA_CONTROLLER1_ERROR_TIMEOUT);
+        g_assert_cmpint (g_get_monotonic_time () - start, >=, TEST_BREAKER_DEADLINE * 1000);
+
+        /* A single slow call does not make the device unresponsive */
+        g_assert (test_upnp_device_is_responsive (KORVA_DEVICE (data->device)));
+        g_assert_cmpuint (breaker.flips, ==, 0);
+    }
+
+    g_test_expect_message ("Korva-UPnP-Device", G_LOG_LEVEL_WARNING, "*stopped responding*");
+    test_upnp_device_push_image (data);
+    g_test_assert_expected_messages ();
+    g_assert_error (data->result_error, KORVA_CONTROLLER1_ERROR, KORVA_CONTROLLER1_ERROR_TIMEOUT);
+    g_assert (!test_upnp_device_is_responsive (KORVA_DEVICE (data->device)));
+    g_assert_cmpuint (breaker.flips, ==, 1);
+
+    /* The breaker is open, so the renderer is not even asked */
+    start = g_get_monotonic_time ();
+    test_upnp_device_push_image (data);
+    g_assert_error (data->result_error, KORVA_CONTROLLER1_ERROR, KORVA_CONTROLLER1_ERROR_TIMEOUT);
+    g_assert_cmpint (g_get_monotonic_time () - start, <, TEST_BREAKER_DEADLINE * 1000);
+
+    /* Once the breaker timeout is over, the next call goes through again */
+    g_usleep (TEST_BREAKER_TIMEOUT * 1000);
+    mock_dmr_set_latency (data->dmr, 0);
+    test_upnp_device_push_image (data);
+    g_assert_no_error (data->result_error);
+    g_assert (data->result_tag != NULL);
+    g_assert (test_upnp_device_is_responsive (KORVA_DEVICE (data->device)));
+    g_assert_cmpuint (breaker.flips, ==, 2);
+
+    /* The round-trip times are not part of the serialized device */
+    info = korva_device_serialize (KORVA_DEVICE (data->device));
+    g_assert (g_variant_lookup_value (info, "SoapRTT", NULL) == NULL);
+    statistics = korva_device_get_statistics (KORVA_DEVICE (data->device));
+    g_assert (statistics != NULL);
+    rtt = g_variant_lookup_value (statistics, "SoapRTT", G_VARIANT_TYPE_VARDICT);
+    g_assert (rtt != NULL);
+    g_assert (g_variant_lookup (rtt, "Timeouts", "u", &timeouts));
+    g_assert_cmpuint (timeouts, ==, TEST_BREAKER_THRESHOLD);
+
+    korva_device_unshare_async (KORVA_DEVICE (data->device),
+                                data->result_tag,
+                                NULL,
+                                on_test_upnp_device_share_unshare_async,
+                                data);
+    g_main_loop_run (data->loop);
+    g_assert_no_error (data->result_error);
+
+    g_signal_handler_disconnect (data->device, id);
+    g_clear_pointer (&data->result_tag, g_free);
+    korva_upnp_device_set_timing (0, 0);
+}
+
+typedef struct {
+    MockDeviceLister *lister;
+    KorvaServer      *server;
+    KorvaController1 *proxy;
+} TestServer;
+
+/*
+ * Run a server on the test bus that offers the devices of a mock lister. The
+ * server lives in the same thread as the test, so all calls to it are async
+ * and the test iterates the main context until they are done.
+ */
+static void
+test_server_setup (TestServer *data, gconstpointer user_data)
+{
+    GError *error = NULL;
+    char *owner = NULL;
+
+    data->lister = mock_device_lister_new ();
+    data->server = korva_server_new_for_lister (KORVA_DEVICE_LISTER (data->lister));
+    data->proxy = korva_controller1_proxy_new_for_bus_sync (G_BUS_TYPE_SESSION,
+                                                            G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START |
+                                                            G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES,
+                                                            "org.jensge.Korva",
+                                                            "/org/jensge/Korva",
+                                                            NULL,
+                                                            &error);
+    g_assert_no_error (error);
+
+    while ((owner = g_dbus_proxy_get_name_owner (G_DBUS_PROXY (data->proxy))) == NULL) {
+        g_main_context_iteration (NULL, TRUE);
+    }
+    g_free (owner);
+}
+
+static void
+test_server_teardown (TestServer *data, gconstpointer user_data)
+{
+    g_clear_object (&data->proxy);
+    g_clear_object (&data->server);
+    g_clear_object (&data->lister);
+
+    while (g_main_context_iteration (NULL, FALSE));
+}
+
+static void
+on_test_server_call_done (GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    *((GAsyncResult **) user_data) = g_object_ref (res);
+}
+
+static GAsyncResult *
+test_server_wait (GAsyncResult **res)
+{
+    while (*res == NULL) {
+        g_main_context_iteration (NULL, TRUE);
+    }
+
+    return *res;
+}
+
+static GVariant *
+test_server_get_device_info (TestServer *data, const char *uid)
+{
+    GAsyncResult *res = NULL;
+    GVariant *info = NULL;
+    GError *error = NULL;
+
+    korva_controller1_call_get_device_info (data->proxy, uid, NULL, on_test_server_call_done, &res);
+    korva_controller1_call_get_device_info_finish (data->proxy, &info, test_server_wait (&res), &error);
+    g_assert_no_error (error);
+    g_object_unref (res);
+
+    return info;
+}
 
-    g_main_loop_run (data->loop);
+static GVariant *
+test_server_get_devices (TestServer *data)
+{
+    GAsyncResult *res = NULL;
+    GVariant *devices = NULL;
+    GError *error = NULL;
 
-    g_assert (data->result_error == NULL);
-    g_assert (korva_upnp_file_server_idle (server));
+    korva_controller1_call_get_devices (data->proxy, NULL, on_test_server_call_done, &res);
+    korva_controller1_call_get_devices_finish (data->proxy, &devices, test_server_wait (&res), &error);
+    g_assert_no_error (error);
+    g_object_unref (res);
 
-    /* Check that we don't get stuck in an endless loop when the transport
-     * doesn't get unlocked
-     */
-    mock_dmr_set_fault (data->dmr, MOCK_DMR_FAULT_TRANSPORT_LOCKED);
+    return devices;
+}
 
-    source = g_variant_builder_new (G_VARIANT_TYPE_VARDICT);
-    g_variant_builder_add (source, "{sv}", "URI", g_variant_new_string (uri));
-    korva_device_push_async (KORVA_DEVICE (data->device),
-                             g_variant_builder_end (source),
-                             NULL,
-                             on_test_upnp_device_share_push_async,
-                             data);
+static char *
+test_server_push (TestServer *data, const char *path, const char *uid, GError **error)
+{
+    GAsyncResult *res = NULL;
+    GVariantBuilder source;
+    char *tag = NULL;
+    g_autoptr (GFile) file = g_file_new_for_commandline_arg (path);
+    g_autofree char *uri = g_file_get_uri (file);
+
+    g_variant_builder_init (&source, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add (&source, "{sv}", "URI", g_variant_new_string (uri));
+    korva_controller1_call_push (data->proxy,
+                                 g_variant_builder_end (&source),
+                                 uid,
+                                 NULL,
+                                 on_test_server_call_done,
+                                 &res);
+    korva_controller1_call_push_finish (data->proxy, &tag, test_server_wait (&res), error);
+    g_object_unref (res);
 
-    g_main_loop_run (data->loop);
+    return tag;
+}
 
-    g_assert (data->result_error != NULL);
-    g_print ("%s\n", data->result_error->message);
-    g_assert (data->result_tag == NULL);
-    g_object_unref (server);
+/* Look up the device @uid in the result of GetDevices */
+static GVariant *
+test_server_find_device (GVariant *devices, const char *uid)
+{
+    GVariantIter iter;
+    GVariant *device;
+    const char *device_uid;
+
+    g_variant_iter_init (&iter, devices);
+    while ((device = g_variant_iter_next_value (&iter)) != NULL) {
+        if (g_variant_lookup (device, "UID", "&s", &device_uid) &&
+            g_strcmp0 (device_uid, uid) == 0) {
+            return device;
+        }
+        g_variant_unref (device);
+    }
+
+    return NULL;
 }
 
+/*
+ * Clients see over D-Bus when a renderer stopped responding. GetDevices only
+ * has the flag, GetDeviceInfo also has the round-trip times.
+ */
 static void
-test_upnp_device_share_ops_fail (UPnPDeviceData *data, gconstpointer user_data)
+test_server_device_responsive (UPnPDeviceData *data, gconstpointer user_data)
 {
-    GVariantBuilder *source;
-    GFile *file;
-    char *uri;
-    KorvaUPnPFileServer *server;
-    int fault = GPOINTER_TO_INT (user_data);
+    TestServer server;
+    g_autoptr (GVariant) info = NULL;
+    g_autoptr (GVariant) devices = NULL;
+    g_autoptr (GVariant) device = NULL;
+    g_autoptr (GVariant) rtt = NULL;
+    GError *error = NULL;
+    gboolean responsive;
+    guint32 timeouts;
+    guint i;
 
-    /* create server instance here to make sure the device uses the same server */
-    server = korva_upnp_file_server_get_default ();
-    g_assert (korva_upnp_file_server_idle (server));
+    g_assert (data->init_result);
+    g_assert_no_error (data->init_error);
+
+    test_server_setup (&server, NULL);
+    mock_device_lister_add (server.lister, KORVA_DEVICE (data->device));
+
+    info = test_server_get_device_info (&server, MOCK_DMR_UDN);
+    g_assert (g_variant_lookup (info, "Responsive", "b", &responsive));
+    g_assert (responsive);
+    rtt = g_variant_lookup_value (info, "SoapRTT", G_VARIANT_TYPE_VARDICT);
+    g_assert (rtt != NULL);
+    g_clear_pointer (&rtt, g_variant_unref);
+    g_clear_pointer (&info, g_variant_unref);
+
+    korva_upnp_device_set_timing (TEST_BREAKER_DEADLINE, TEST_BREAKER_TIMEOUT);
+    mock_dmr_set_latency (data->dmr, 3 * TEST_BREAKER_DEADLINE);
+
+    g_test_expect_message ("Korva-UPnP-Device", G_LOG_LEVEL_WARNING, "*stopped responding*");
+    for (i = 0; i < TEST_BREAKER_THRESHOLD; i++) {
+        g_assert (test_server_push (&server, TEST_DATA_DIR "/test-upnp-image.jpg", MOCK_DMR_UDN, &error) == NULL);
+        g_assert_error (error, KORVA_CONTROLLER1_ERROR, KORVA_CONTROLLER1_ERROR_TIMEOUT);
+        g_clear_error (&error);
+    }
+    g_test_assert_expected_messages ();
+
+    info = test_server_get_device_info (&server, MOCK_DMR_UDN);
+    g_assert (g_variant_lookup (info, "Responsive", "b", &responsive));
+    g_assert (!responsive);
+    rtt = g_variant_lookup_value (info, "SoapRTT", G_VARIANT_TYPE_VARDICT);
+    g_assert (rtt != NULL);
+    g_assert (g_variant_lookup (rtt, "Timeouts", "u", &timeouts));
+    g_assert_cmpuint (timeouts, ==, TEST_BREAKER_THRESHOLD);
+
+    devices = test_server_get_devices (&server);
+    device = test_server_find_device (devices, MOCK_DMR_UDN);
+    g_assert (device != NULL);
+    g_assert (g_variant_lookup (device, "Responsive", "b", &responsive));
+    g_assert (!responsive);
+    g_assert (g_variant_lookup_value (device, "SoapRTT", NULL) == NULL);
+
+    korva_upnp_device_set_timing (0, 0);
+    mock_dmr_set_latency (data->dmr, 0);
+    test_server_teardown (&server, NULL);
+}
 
-    file = g_file_new_for_commandline_arg (TEST_DATA_DIR "/test-upnp-image.jpg");
-    uri = g_file_get_uri (file);
+/* PushMany the test image to all of @uids */
+static GVariant *
+test_server_push_many (TestServer *data, const char * const *uids, const char *content_type)
+{
+    GAsyncResult *res = NULL;
+    GVariantBuilder targets;
+    GVariantBuilder source;
+    GVariant *results = NULL;
+    GError *error = NULL;
+    g_autoptr (GFile) file = g_file_new_for_commandline_arg (TEST_DATA_DIR "/test-upnp-image.jpg");
+    g_autofree char *uri = g_file_get_uri (file);
+    guint i;
+
+    g_variant_builder_init (&targets, G_VARIANT_TYPE ("a(a{sv}s)"));
+    for (i = 0; uids[i] != NULL; i++) {
+        g_variant_builder_init (&source, G_VARIANT_TYPE_VARDICT);
+        g_variant_builder_add (&source, "{sv}", "URI", g_variant_new_string (uri));
+        if (content_type != NULL) {
+            g_variant_builder_add (&source, "{sv}", "ContentType", g_variant_new_string (content_type));
+        }
+        g_variant_builder_add (&targets, "(@a{sv}s)", g_variant_builder_end (&source), uids[i]);
+    }
 
-    source = g_variant_builder_new (G_VARIANT_TYPE_VARDICT);
-    g_variant_builder_add (source, "{sv}", "URI", g_variant_new_string (uri));
-    korva_device_push_async (KORVA_DEVICE (data->device),
-                             g_variant_builder_end (source),
-                             NULL,
-                             on_test_upnp_device_share_push_async,
-                             data);
+    korva_controller1_call_push_many (data->proxy,
+                                      g_variant_builder_end (&targets),
+                                      NULL,
+                                      on_test_server_call_done,
+                                      &res);
+    korva_controller1_call_push_many_finish (data->proxy, &results, test_server_wait (&res), &error);
+    g_assert_no_error (error);
+    g_object_unref (res);
 
-    g_main_loop_run (data->loop);
+    g_assert_cmpuint (g_variant_n_children (results), ==, g_strv_length ((char **) uids));
 
-    if (fault == MOCK_DMR_FAULT_PLAY_FAIL) {
-        g_assert (korva_upnp_file_server_idle (server));
-        g_assert (data->result_error != NULL);
-        g_assert (data->result_tag == NULL);
+    return results;
+}
+
+/*
+ * Check that result @index of a PushMany is for @uid and either has @tag or,
+ * if @tag is %NULL, the D-Bus error @error_name.
+ */
+static void
+test_server_assert_push_result (GVariant   *results,
+                                guint       index,
+                                const char *uid,
+                                const char *tag,
+                                const char *error_name)
+{
+    g_autoptr (GVariant) result = g_variant_get_child_value (results, index);
+    const char *value;
+
+    g_assert (g_variant_lookup (result, "UID", "&s", &value));
+    g_assert_cmpstr (value, ==, uid);
+
+    if (tag != NULL) {
+        g_assert (g_variant_lookup (result, "Tag", "&s", &value));
+        g_assert_cmpstr (value, ==, tag);
+        g_assert (g_variant_lookup_value (result, "Error", NULL) == NULL);
     } else {
-        g_assert (!korva_upnp_file_server_idle (server));
-        g_assert (data->result_error == NULL);
-        g_assert (data->result_tag != NULL);
+        g_assert (g_variant_lookup_value (result, "Tag", NULL) == NULL);
+        g_assert (g_variant_lookup (result, "Error", "&s", &value));
+        g_assert_cmpstr (value, ==, error_name);
+        g_assert (g_variant_lookup (result, "ErrorMessage", "&s", &value));
+        g_assert_cmpstr (value, !=, "");
     }
+}
 
-    if (fault == MOCK_DMR_FAULT_STOP_FAIL) {
-        korva_device_unshare_async (KORVA_DEVICE (data->device),
-                                    data->result_tag,
-                                    NULL,
-                                    on_test_upnp_device_share_unshare_async,
-                                    data);
+static void
+test_server_unshare (TestServer *data, const char *tag, GError **error)
+{
+    GAsyncResult *res = NULL;
 
-        g_main_loop_run (data->loop);
+    korva_controller1_call_unshare (data->proxy, tag, NULL, on_test_server_call_done, &res);
+    korva_controller1_call_unshare_finish (data->proxy, test_server_wait (&res), error);
+    g_object_unref (res);
+}
 
-        g_assert (korva_upnp_file_server_idle (server));
-        g_assert (data->result_error != NULL);
-    }
+/* A failing target does not fail the others, results keep the target order */
+static void
+test_server_push_many_mixed (TestServer *data, gconstpointer user_data)
+{
+    g_autoptr (MockDevice) good = mock_device_new ("uuid:good");
+    g_autoptr (MockDevice) bad = mock_device_new ("uuid:bad");
+    g_autoptr (MockDevice) other = mock_device_new ("uuid:other");
+    g_autoptr (GVariant) results = NULL;
+    g_autoptr (GError) timeout = NULL;
+    GError *error = NULL;
+    const char *uids[] = { "uuid:good", "uuid:bad", "uuid:other", NULL };
+
+    timeout = g_error_new_literal (KORVA_CONTROLLER1_ERROR, KORVA_CONTROLLER1_ERROR_TIMEOUT, "Stalled");
+    mock_device_set_push_error (bad, timeout);
+    mock_device_lister_add (data->lister, KORVA_DEVICE (good));
+    mock_device_lister_add (data->lister, KORVA_DEVICE (bad));
+    mock_device_lister_add (data->lister, KORVA_DEVICE (other));
+
+    results = test_server_push_many (data, uids, NULL);
+    test_server_assert_push_result (results, 0, "uuid:good", "uuid:good-1", NULL);
+    test_server_assert_push_result (results, 1, "uuid:bad", NULL, "org.jensge.Korva.Error.Timeout");
+    test_server_assert_push_result (results, 2, "uuid:other", "uuid:other-1", NULL);
+
+    g_assert_cmpuint (mock_device_get_push_count (good), ==, 1);
+    g_assert_cmpuint (mock_device_get_push_count (bad), ==, 1);
+    g_assert_cmpuint (mock_device_get_push_count (other), ==, 1);
+
+    /* The tags of the successful pushes can be unshared like any other */
+    test_server_unshare (data, "uuid:good-1", &error);
+    g_assert_no_error (error);
+    test_server_unshare (data, "uuid:other-1", &error);
+    g_assert_no_error (error);
+}
 
-    g_object_unref (server);
+/* Unknown devices are reported per target, even if there are only those */
+static void
+test_server_push_many_unknown (TestServer *data, gconstpointer user_data)
+{
+    g_autoptr (MockDevice) good = mock_device_new ("uuid:good");
+    g_autoptr (GVariant) results = NULL;
+    g_autoptr (GVariant) unknown = NULL;
+    g_autoptr (GVariant) empty = NULL;
+    const char *uids[] = { "uuid:unknown", "uuid:good", NULL };
+    const char *unknown_uids[] = { "uuid:unknown", "uuid:gone", NULL };
+    const char *no_uids[] = { NULL };
+
+    mock_device_lister_add (data->lister, KORVA_DEVICE (good));
+
+    results = test_server_push_many (data, uids, NULL);
+    test_server_assert_push_result (results, 0, "uuid:unknown", NULL, "org.jensge.Korva.Error.NoSuchDevice");
+    test_server_assert_push_result (results, 1, "uuid:good", "uuid:good-1", NULL);
+
+    unknown = test_server_push_many (data, unknown_uids, NULL);
+    test_server_assert_push_result (unknown, 0, "uuid:unknown", NULL, "org.jensge.Korva.Error.NoSuchDevice");
+    test_server_assert_push_result (unknown, 1, "uuid:gone", NULL, "org.jensge.Korva.Error.NoSuchDevice");
+
+    empty = test_server_push_many (data, no_uids, NULL);
+
+    g_assert_cmpuint (mock_device_get_push_count (good), ==, 1);
 }
 
+/* A renderer that cannot play the file does not keep the others from it */
 static void
-test_upnp_device_share_not_compatible (UPnPDeviceData *data, gconstpointer user_data)
+test_server_push_many_compatibility (TestServer *data, gconstpointer user_data)
 {
-    GVariantBuilder *source;
-    GFile *file;
-    char *uri;
-    KorvaUPnPFileServer *server;
+    g_autoptr (MockDevice) image = mock_device_new ("uuid:image");
+    g_autoptr (MockDevice) audio = mock_device_new ("uuid:audio");
+    g_autoptr (GVariant) results = NULL;
+    g_autoptr (GError) not_compatible = NULL;
+    const char *uids[] = { "uuid:audio", "uuid:image", NULL };
+
+    not_compatible = g_error_new_literal (KORVA_CONTROLLER1_ERROR,
+                                          KORVA_CONTROLLER1_ERROR_NOT_COMPATIBLE,
+                                          "The file is not compatible with the selected renderer");
+    mock_device_set_push_error (audio, not_compatible);
+    mock_device_lister_add (data->lister, KORVA_DEVICE (image));
+    mock_device_lister_add (data->lister, KORVA_DEVICE (audio));
+
+    results = test_server_push_many (data, uids, "image/jpeg");
+    test_server_assert_push_result (results, 0, "uuid:audio", NULL, "org.jensge.Korva.Error.NotCompatible");
+    test_server_assert_push_result (results, 1, "uuid:image", "uuid:image-1", NULL);
+}
 
-    /* create server instance here to make sure the device uses the same server */
-    mock_dmr_set_protocol_info (data->dmr, "", "");
-    server = korva_upnp_file_server_get_default ();
-    g_assert (korva_upnp_file_server_idle (server));
+/* The cached GetDevices reply follows changes and removals of devices */
+static void
+test_server_devices_cache (TestServer *data, gconstpointer user_data)
+{
+    g_autoptr (MockDevice) a = mock_device_new ("uuid:a");
+    g_autoptr (MockDevice) b = mock_device_new ("uuid:b");
+    GVariant *devices, *device;
+    const char *name;
+
+    mock_device_lister_add (data->lister, KORVA_DEVICE (a));
+    mock_device_lister_add (data->lister, KORVA_DEVICE (b));
+
+    devices = test_server_get_devices (data);
+    g_assert_cmpuint (g_variant_n_children (devices), ==, 2);
+    g_variant_unref (devices);
+
+    /* Asked twice, so the second reply comes from the cache */
+    devices = test_server_get_devices (data);
+    g_assert_cmpuint (g_variant_n_children (devices), ==, 2);
+    g_variant_unref (devices);
+
+    mock_device_set_display_name (a, "Renamed");
+    devices = test_server_get_devices (data);
+    g_assert_cmpuint (g_variant_n_children (devices), ==, 2);
+    device = test_server_find_device (devices, "uuid:a");
+    g_assert (device != NULL);
+    g_assert (g_variant_lookup (device, "DisplayName", "&s", &name));
+    g_assert_cmpstr (name, ==, "Renamed");
+    g_variant_unref (device);
+    g_variant_unref (devices);
+
+    mock_device_lister_remove (data->lister, "uuid:b");
+    devices = test_server_get_devices (data);
+    g_assert_cmpuint (g_variant_n_children (devices), ==, 1);
+    device = test_server_find_device (devices, "uuid:b");
+    g_assert (device == NULL);
+    g_variant_unref (devices);
+
+    mock_device_lister_add (data->lister, KORVA_DEVICE (b));
+    devices = test_server_get_devices (data);
+    g_assert_cmpuint (g_variant_n_children (devices), ==, 2);
+    device = test_server_find_device (devices, "uuid:b");
+    g_assert (device != NULL);
+    g_variant_unref (device);
+    g_variant_unref (devices);
+}
 
-    file = g_file_new_for_commandline_arg (TEST_DATA_DIR "/test-upnp-image.jpg");
-    uri = g_file_get_uri (file);
+/* Mirrors MAX_REMOVED_DEVICES of the server */
+#define TEST_MAX_REMOVED_DEVICES 128
 
-    source = g_variant_builder_new (G_VARIANT_TYPE_VARDICT);
-    g_variant_builder_add (source, "{sv}", "URI", g_variant_new_string (uri));
-    korva_device_push_async (KORVA_DEVICE (data->device),
-                             g_variant_builder_end (source),
-                             NULL,
-                             on_test_upnp_device_share_push_async,
-                             data);
+static gboolean
+test_server_get_devices_since (TestServer *data,
+                               guint64     since,
+                               guint64    *generation,
+                               GVariant  **devices,
+                               char     ***removed)
+{
+    GAsyncResult *res = NULL;
+    GError *error = NULL;
+    gboolean reset;
+
+    korva_controller1_call_get_devices_since (data->proxy, since, NULL, on_test_server_call_done, &res);
+    korva_controller1_call_get_devices_since_finish (data->proxy,
+                                                     generation,
+                                                     devices,
+                                                     removed,
+                                                     &reset,
+                                                     test_server_wait (&res),
+                                                     &error);
+    g_assert_no_error (error);
+    g_object_unref (res);
 
-    g_main_loop_run (data->loop);
+    return reset;
+}
 
-    g_assert (data->result_error != NULL);
-    g_assert (data->result_tag == NULL);
-    g_assert_cmpint (data->result_error->domain, ==, KORVA_CONTROLLER1_ERROR);
-    g_assert_cmpint (data->result_error->code, ==, KORVA_CONTROLLER1_ERROR_NOT_COMPATIBLE);
-    g_assert (korva_upnp_file_server_idle (server));
+/*
+ * GetDevicesSince returns what changed after a generation the client got
+ * earlier, and everything if the server cannot tell.
+ */
+static void
+test_server_devices_since (TestServer *data, gconstpointer user_data)
+{
+    g_autoptr (MockDevice) a = mock_device_new ("uuid:a");
+    g_autoptr (MockDevice) b = mock_device_new ("uuid:b");
+    g_autoptr (MockDevice) c = mock_device_new ("uuid:c");
+    GVariant *devices, *device;
+    char **removed;
+    guint64 first, second, generation;
+    const char *name;
+    guint i;
+
+    mock_device_lister_add (data->lister, KORVA_DEVICE (a));
+    mock_device_lister_add (data->lister, KORVA_DEVICE (b));
+
+    /* A client without a generation gets the full list */
+    g_assert (test_server_get_devices_since (data, 0, &first, &devices, &removed));
+    g_assert_cmpuint (g_variant_n_children (devices), ==, 2);
+    g_assert_cmpuint (g_strv_length (removed), ==, 0);
+    g_variant_unref (devices);
+    g_strfreev (removed);
+
+    /* Nothing happened since */
+    g_assert (!test_server_get_devices_since (data, first, &generation, &devices, &removed));
+    g_assert_cmpuint (generation, ==, first);
+    g_assert_cmpuint (g_variant_n_children (devices), ==, 0);
+    g_assert_cmpuint (g_strv_length (removed), ==, 0);
+    g_variant_unref (devices);
+    g_strfreev (removed);
+
+    mock_device_lister_add (data->lister, KORVA_DEVICE (c));
+    mock_device_set_display_name (a, "Renamed");
+    mock_device_lister_remove (data->lister, "uuid:b");
+
+    g_assert (!test_server_get_devices_since (data, first, &second, &devices, &removed));
+    g_assert_cmpuint (second, >, first);
+    g_assert_cmpuint (g_variant_n_children (devices), ==, 2);
+    device = test_server_find_device (devices, "uuid:a");
+    g_assert (device != NULL);
+    g_assert (g_variant_lookup (device, "DisplayName", "&s", &name));
+    g_assert_cmpstr (name, ==, "Renamed");
+    g_variant_unref (device);
+    device = test_server_find_device (devices, "uuid:c");
+    g_assert (device != NULL);
+    g_variant_unref (device);
+    g_assert_cmpuint (g_strv_length (removed), ==, 1);
+    g_assert_cmpstr (removed[0], ==, "uuid:b");
+    g_variant_unref (devices);
+    g_strfreev (removed);
+
+    g_assert (!test_server_get_devices_since (data, second, &generation, &devices, &removed));
+    g_assert_cmpuint (generation, ==, second);
+    g_assert_cmpuint (g_variant_n_children (devices), ==, 0);
+    g_assert_cmpuint (g_strv_length (removed), ==, 0);
+    g_variant_unref (devices);
+    g_strfreev (removed);
+
+    /* Devices that were never available or are gone already */
+    g_signal_emit_by_name (data->lister, "device-unavailable", "uuid:never-seen");
+    g_signal_emit_by_name (data->lister, "device-unavailable", "uuid:b");
+    g_assert (!test_server_get_devices_since (data, second, &generation, &devices, &removed));
+    g_assert_cmpuint (generation, ==, second);
+    g_assert_cmpuint (g_variant_n_children (devices), ==, 0);
+    g_assert_cmpuint (g_strv_length (removed), ==, 0);
+    g_variant_unref (devices);
+    g_strfreev (removed);
+
+    /* A generation we never handed out */
+    g_assert (test_server_get_devices_since (data, second + 1, &generation, &devices, &removed));
+    g_assert_cmpuint (generation, ==, second);
+    g_assert_cmpuint (g_variant_n_children (devices), ==, 2);
+    g_assert_cmpuint (g_strv_length (removed), ==, 0);
+    g_variant_unref (devices);
+    g_strfreev (removed);
+
+    /* Once removals the client did not see were forgotten, it has to start
+     * over */
+    for (i = 0; i <= TEST_MAX_REMOVED_DEVICES; i++) {
+        g_autofree char *uid = g_strdup_printf ("uuid:gone-%u", i);
+        g_autoptr (MockDevice) gone = mock_device_new (uid);
+
+        mock_device_lister_add (data->lister, KORVA_DEVICE (gone));
+        mock_device_lister_remove (data->lister, uid);
+    }
 
-    g_object_unref (server);
+    g_assert (test_server_get_devices_since (data, second, &generation, &devices, &removed));
+    g_assert_cmpuint (generation, >, second);
+    g_assert_cmpuint (g_variant_n_children (devices), ==, 2);
+    g_assert_cmpuint (g_strv_length (removed), ==, 0);
+    g_variant_unref (devices);
+    g_strfreev (removed);
+
+    /* The newer removals are still known */
+    g_assert (!test_server_get_devices_since (data, generation - 1, &generation, &devices, &removed));
+    g_assert_cmpuint (g_variant_n_children (devices), ==, 0);
+    g_assert_cmpuint (g_strv_length (removed), ==, 1);
+    g_assert_cmpstr (removed[0], ==, "uuid:gone-" G_STRINGIFY (TEST_MAX_REMOVED_DEVICES));
+    g_variant_unref (devices);
+    g_strfreev (removed);
 }
 
 int main (int argc, char *argv[])
 {
-    korva_icon_cache_init ();
+    GTestDBus *bus;
+    int result;
+
+    korva_icon_cache_init (NULL, 0);
     g_test_init (&argc, &argv, NULL);
 
     g_test_add_func ("/korva/server/upnp/fileserver/single-instance",
                      test_upnp_fileserver_single_instance);
 
+    g_test_add_func ("/korva/server/upnp/host-data/didl-lite",
+                     test_upnp_host_data_didl_lite);
+
+    g_test_add_func ("/korva/server/upnp/didl-lite",
+                     test_upnp_didl_lite);
+    g_test_add_func ("/korva/server/upnp/didl-lite/benchmark",
+                     test_upnp_didl_lite_benchmark);
+    g_test_add_func ("/korva/server/upnp/sink-caps",
+                     test_upnp_sink_caps);
+
+    g_test_add_func ("/korva/server/upnp/rtt-stats",
+                     test_upnp_rtt_stats);
+    g_test_add_func ("/korva/server/upnp/failure-cache",
+                     test_upnp_failure_cache);
+    g_test_add_func ("/korva/server/upnp/last-change",
+                     test_upnp_last_change);
+    g_test_add_func ("/korva/server/upnp/last-change/benchmark",
+                     test_upnp_last_change_benchmark);
+    g_test_add_func ("/korva/server/icon-cache/eviction",
+                     test_icon_cache_eviction);
+
+    g_test_add_func ("/korva/server/icon-cache/dedup",
+                     test_icon_cache_dedup);
+
+    g_test_add_func ("/korva/server/priority",
+                     test_priority);
+
+    g_test_add_func ("/korva/server/upnp/icon-fetcher",
+                     test_upnp_icon_fetcher);
+
     g_test_add ("/korva/server/upnp/fileserver/host-file",
                 HostFileTestData,
                 NULL,
@@ -1048,6 +4327,13 @@ int main (int argc, char *argv[])
                 test_upnp_fileserver_host_file,
                 test_host_file_teardown);
 
+    g_test_add ("/korva/server/upnp/fileserver/host-file/concurrent",
+                HostFileTestData,
+                NULL,
+                test_host_file_setup,
+                test_upnp_fileserver_host_file_concurrent,
+                test_host_file_teardown);
+
     g_test_add ("/korva/server/upnp/fileserver/host-file/dont-override-data",
                 HostFileTestData,
                 NULL,
@@ -1104,6 +4390,27 @@ int main (int argc, char *argv[])
                 test_upnp_fileserver_http_server_content_features,
                 test_host_file_teardown);
 
+    g_test_add ("/korva/server/upnp/fileserver/playlist",
+                HostFileTestData,
+                NULL,
+                test_host_file_setup,
+                test_upnp_fileserver_playlist,
+                test_host_file_teardown);
+
+    g_test_add ("/korva/server/upnp/fileserver/http-server/jitter",
+                HostFileTestData,
+                NULL,
+                test_host_file_setup,
+                test_upnp_fileserver_http_server_jitter,
+                test_host_file_teardown);
+
+    g_test_add ("/korva/server/upnp/fileserver/http-server/storm",
+                HostFileTestData,
+                NULL,
+                test_host_file_setup,
+                test_upnp_fileserver_http_server_storm,
+                test_host_file_teardown);
+
     g_test_add ("/korva/server/upnp/device",
                 UPnPDeviceData,
                 NULL,
@@ -1132,6 +4439,37 @@ int main (int argc, char *argv[])
                 test_upnp_device,
                 test_upnp_device_teardown);
 
+    g_test_add ("/korva/server/upnp/device/cache",
+                UPnPDeviceData,
+                NULL,
+                test_upnp_device_cache_setup,
+                test_upnp_device_cache,
+                test_upnp_device_cache_teardown);
+
+    g_test_add_func ("/korva/server/upnp/device/cache/expiry",
+                     test_upnp_device_cache_expiry);
+
+    g_test_add ("/korva/server/upnp/device-lister/retry",
+                UPnPDeviceData,
+                NULL,
+                test_upnp_device_setup,
+                test_upnp_device_lister_retry,
+                test_upnp_device_teardown);
+
+    g_test_add ("/korva/server/upnp/device-lister/probe-cached",
+                UPnPDeviceData,
+                NULL,
+                test_upnp_device_cache_setup,
+                test_upnp_device_lister_probe_cached,
+                test_upnp_device_cache_teardown);
+
+    g_test_add ("/korva/server/upnp/device/concurrent-introspection",
+                UPnPDeviceData,
+                NULL,
+                test_upnp_device_setup,
+                test_upnp_device_concurrent_introspection,
+                test_upnp_device_teardown);
+
     g_test_add ("/korva/server/upnp/device/multiple-proxies",
                 UPnPDeviceData,
                 NULL,
@@ -1139,6 +4477,27 @@ int main (int argc, char *argv[])
                 test_upnp_device_multiple_proxies,
                 test_upnp_device_teardown);
 
+    g_test_add ("/korva/server/upnp/device/introspection-timeout",
+                UPnPDeviceData,
+                NULL,
+                test_upnp_device_setup,
+                test_upnp_device_introspection_timeout,
+                test_upnp_device_teardown);
+
+    g_test_add ("/korva/server/upnp/device/introspection-storm",
+                UPnPDeviceData,
+                NULL,
+                test_upnp_device_setup,
+                test_upnp_introspection_storm,
+                test_upnp_device_teardown);
+
+    g_test_add ("/korva/server/upnp/device/memory",
+                UPnPDeviceData,
+                NULL,
+                test_upnp_device_setup,
+                test_upnp_device_memory,
+                test_upnp_device_teardown);
+
 /*    g_test_add ("/korva/server/upnp/device/no-avtransport",
                 UPnPDeviceData,
                 GINT_TO_POINTER (MOCK_DMR_FAULT_NO_AV_TRANSPORT),
@@ -1189,7 +4548,105 @@ int main (int argc, char *argv[])
                 test_upnp_device_share_not_compatible,
                 test_upnp_device_teardown);
 
-    g_test_run ();
+    g_test_add ("/korva/server/upnp/device/share/connections",
+                UPnPDeviceData,
+                NULL,
+                test_upnp_device_setup,
+                test_upnp_device_share_connections,
+                test_upnp_device_teardown);
+
+    g_test_add ("/korva/server/upnp/device/share/rapid",
+                UPnPDeviceData,
+                NULL,
+                test_upnp_device_setup,
+                test_upnp_device_share_rapid,
+                test_upnp_device_teardown);
+
+    g_test_add ("/korva/server/upnp/device/watch",
+                UPnPDeviceData,
+                NULL,
+                test_upnp_device_setup,
+                test_upnp_device_watch,
+                test_upnp_device_teardown);
+
+    g_test_add ("/korva/server/upnp/device/share/state",
+                UPnPDeviceData,
+                NULL,
+                test_upnp_device_setup,
+                test_upnp_device_share_state,
+                test_upnp_device_teardown);
+
+    g_test_add ("/korva/server/upnp/device/share/position",
+                UPnPDeviceData,
+                NULL,
+                test_upnp_device_setup,
+                test_upnp_device_share_position,
+                test_upnp_device_teardown);
+
+    g_test_add ("/korva/server/upnp/device/share/trace",
+                UPnPDeviceData,
+                GINT_TO_POINTER (MOCK_DMR_FAULT_TRANSPORT_LOCKED_ONCE),
+                test_upnp_device_setup,
+                test_upnp_device_share_trace,
+                test_upnp_device_teardown);
+
+    g_test_add ("/korva/server/upnp/device/breaker",
+                UPnPDeviceData,
+                NULL,
+                test_upnp_device_setup,
+                test_upnp_device_breaker,
+                test_upnp_device_teardown);
+
+    g_test_add ("/korva/server/dbus/responsive",
+                UPnPDeviceData,
+                NULL,
+                test_upnp_device_setup,
+                test_server_device_responsive,
+                test_upnp_device_teardown);
+
+    g_test_add ("/korva/server/dbus/push-many/mixed",
+                TestServer,
+                NULL,
+                test_server_setup,
+                test_server_push_many_mixed,
+                test_server_teardown);
+
+    g_test_add ("/korva/server/dbus/push-many/unknown",
+                TestServer,
+                NULL,
+                test_server_setup,
+                test_server_push_many_unknown,
+                test_server_teardown);
+
+    g_test_add ("/korva/server/dbus/push-many/compatibility",
+                TestServer,
+                NULL,
+                test_server_setup,
+                test_server_push_many_compatibility,
+                test_server_teardown);
+
+    g_test_add ("/korva/server/dbus/devices-cache",
+                TestServer,
+                NULL,
+                test_server_setup,
+                test_server_devices_cache,
+                test_server_teardown);
+
+    g_test_add ("/korva/server/dbus/devices-since",
+                TestServer,
+                NULL,
+                test_server_setup,
+                test_server_devices_since,
+                test_server_teardown);
+
+    /* The server tests need a bus to own their name on */
+    bus = g_test_dbus_new (G_TEST_DBUS_NONE);
+    g_test_dbus_up (bus);
+
+    result = g_test_run ();
+
+    g_test_dbus_down (bus);
+    g_object_unref (bus);
 
-    return 0;
+    return result;
 }